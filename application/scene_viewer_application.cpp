@@ -371,6 +371,7 @@ SceneViewerApplication::SceneViewerApplication(const std::string &path, const st
 				LOGE("Camera index is out of bounds, using normal camera.");
 		}
 	}
+	last_camera_position = selected_camera->get_position();
 
 	// Pick a directional light.
 	default_directional_light.color = vec3(6.0f, 5.5f, 4.5f);
@@ -1355,6 +1356,9 @@ void SceneViewerApplication::update_scene(TaskComposer &composer, double frame_t
 	constexpr unsigned NumTasks = 8;
 	Threaded::scene_update_cached_transforms(scene, composer, NumTasks);
 
+	// Roughly a quarter of a second at 60 FPS.
+	constexpr unsigned AssetPrefetchFrames = 16;
+
 	// Perform updates which depend on node transforms.
 	auto &updates = composer.begin_pipeline_stage();
 	updates.set_desc("scene-updates");
@@ -1362,6 +1366,17 @@ void SceneViewerApplication::update_scene(TaskComposer &composer, double frame_t
 		jitter.step(selected_camera->get_projection(), selected_camera->get_view());
 		context.set_camera(jitter.get_jittered_projection(), selected_camera->get_view());
 		context.set_motion_vector_projections(jitter);
+		scene_loader.get_scene().update_lod_selection(context.get_visibility_frustum());
+
+		// Start paging in what the camera is heading towards before it comes into view.
+		vec3 camera_position = selected_camera->get_position();
+		if (auto *manager = GRANITE_ASSET_MANAGER())
+		{
+			scene_loader.get_scene().hint_future_asset_use(
+					*manager, selected_camera->get_projection() * selected_camera->get_view(),
+					camera_position - last_camera_position, AssetPrefetchFrames);
+		}
+		last_camera_position = camera_position;
 
 		lighting.refraction.falloff = vec3(1.0f / 1.5f, 1.0f / 2.5f, 1.0f / 5.0f);
 
@@ -1454,9 +1469,66 @@ void SceneViewerApplication::render_ui(CommandBuffer &cmd)
 		                          size, color, alignment, 1.0f);
 	}
 
+	render_metrics(offset + vec3(0.0f, 160.0f + 15.0f * float(device.get_memory_properties().memoryHeapCount), 0.0f),
+	               size, color);
+
 	flat_renderer.flush(cmd, vec3(0.0f), vec3(cmd.get_viewport().width, cmd.get_viewport().height, 1.0f));
 }
 
+void SceneViewerApplication::render_metrics(const vec3 &offset, const vec2 &size, const vec4 &color)
+{
+	// Rates and percentiles are noisy per frame, so only resample once a second.
+	int64_t now = Util::get_current_time_nsecs();
+	if (now - last_metrics_sample_ns >= 1000000000)
+	{
+		metrics_sampler.sample(metric_samples);
+		last_metrics_sample_ns = now;
+	}
+
+	char lines[4][256];
+	unsigned num_lines = 0;
+
+	auto *tasks = Util::MetricsSampler::find(metric_samples, "thread-group.tasks-executed");
+	auto *latency = Util::MetricsSampler::find(metric_samples, "thread-group.task-latency-us");
+	if (tasks && latency)
+	{
+		snprintf(lines[num_lines++], sizeof(lines[0]), "Tasks: %.0f / s, latency p50 %llu us, p99 %llu us",
+		         tasks->rate, static_cast<unsigned long long>(latency->p50),
+		         static_cast<unsigned long long>(latency->p99));
+	}
+
+	auto *set_hit = Util::MetricsSampler::find(metric_samples, "vulkan.descriptor-set.hit");
+	auto *set_miss = Util::MetricsSampler::find(metric_samples, "vulkan.descriptor-set.miss");
+	if (set_hit && set_miss && set_hit->rate + set_miss->rate > 0.0)
+	{
+		snprintf(lines[num_lines++], sizeof(lines[0]), "Descriptor sets: %.1f %% hit, %.0f misses / s",
+		         100.0 * set_hit->rate / (set_hit->rate + set_miss->rate), set_miss->rate);
+	}
+
+	auto *queue_size = Util::MetricsSampler::find(metric_samples, "render-queue.size");
+	if (queue_size && queue_size->count)
+	{
+		snprintf(lines[num_lines++], sizeof(lines[0]), "Render queue: p50 %llu, max %llu",
+		         static_cast<unsigned long long>(queue_size->p50),
+		         static_cast<unsigned long long>(queue_size->max));
+	}
+
+	auto *recycled = Util::MetricsSampler::find(metric_samples, "vulkan.memory.recycled-bytes");
+	auto *allocs = Util::MetricsSampler::find(metric_samples, "vulkan.memory.allocate-calls");
+	if (recycled && allocs)
+	{
+		snprintf(lines[num_lines++], sizeof(lines[0]), "vkAllocateMemory: %.1f / s, recycled %.1f MiB",
+		         allocs->rate, recycled->value / double(1024 * 1024));
+	}
+
+	for (unsigned i = 0; i < num_lines; i++)
+	{
+		flat_renderer.render_text(GRANITE_UI_MANAGER()->get_font(UI::FontSize::Normal), lines[i],
+		                          offset + vec3(0.0f, 15.0f * float(i), 0.0f),
+		                          size, color, Font::Alignment::TopRight, 1.0f);
+	}
+}
+
 void SceneViewerApplication::render_scene(TaskComposer &composer)
 {
 	auto &wsi = get_wsi();
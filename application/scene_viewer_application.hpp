@@ -28,6 +28,7 @@
 #include "animation_system.hpp"
 #include "renderer.hpp"
 #include "timer.hpp"
+#include "metrics.hpp"
 #include "event.hpp"
 #include "font.hpp"
 #include "ui_manager.hpp"
@@ -82,6 +83,7 @@ protected:
 	std::unique_ptr<AnimationSystem> animation_system;
 
 	Camera *selected_camera = nullptr;
+	vec3 last_camera_position;
 	DirectionalLightComponent *selected_directional = nullptr;
 	DirectionalLightComponent default_directional_light;
 
@@ -168,6 +170,11 @@ private:
 	float last_frame_times[FrameWindowSize] = {};
 	unsigned last_frame_index = 0;
 
+	Util::MetricsSampler metrics_sampler;
+	std::vector<Util::MetricSample> metric_samples;
+	int64_t last_metrics_sample_ns = 0;
+	void render_metrics(const vec3 &offset, const vec2 &size, const vec4 &color);
+
 	TemporalJitter jitter;
 	void capture_environment_probe();
 
@@ -21,25 +21,306 @@
  */
 
 #include "ecs.hpp"
+#include "aligned_alloc.hpp"
+#include "bitops.hpp"
+#include <atomic>
 
 namespace Granite
 {
+unsigned allocate_component_type_index()
+{
+	static std::atomic_uint count;
+	return count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ComponentAllocatorBase::set_slot(uint32_t slot, ComponentBase *component)
+{
+	uint32_t page = slot >> SlotPageBits;
+	if (page >= slot_pages.size())
+		slot_pages.resize(page + 1);
+
+	if (!slot_pages[page])
+	{
+		if (!component)
+			return;
+		slot_pages[page].reset(new ComponentBase *[SlotPageSize]());
+	}
+
+	slot_pages[page][slot & (SlotPageSize - 1)] = component;
+}
+
+// Chunks are sized so that a chunk of small components stays within L1/L2 friendly sizes.
+static constexpr size_t ArchetypeChunkSize = 16 * 1024;
+static constexpr size_t ArchetypeChunkAlignment = 64;
+
+Archetype::Archetype(std::vector<ComponentType> types_, std::vector<ComponentAllocatorBase *> allocators,
+                     std::atomic<uint64_t> *change_version_)
+	: types(std::move(types_)), change_version(change_version_)
+{
+	assert(types.size() == allocators.size());
+	assert(std::is_sorted(types.begin(), types.end()));
+
+	size_t row_size = sizeof(Entity *);
+	for (auto *allocator : allocators)
+		row_size += allocator->component_size;
+
+	// Largest power-of-two row count which fits in a chunk, accounting for column alignment padding.
+	chunk_capacity = 1u << (31 - leading_zeroes(uint32_t(std::max<size_t>(ArchetypeChunkSize / row_size, 1))));
+	for (;;)
+	{
+		size_t offset = sizeof(Entity *) * chunk_capacity;
+		columns.clear();
+		for (size_t i = 0; i < allocators.size(); i++)
+		{
+			auto *allocator = allocators[i];
+			offset = (offset + allocator->component_alignment - 1) & ~(allocator->component_alignment - 1);
+			columns.push_back({ types[i], allocator, offset, allocator->component_size });
+			offset += allocator->component_size * chunk_capacity;
+		}
+
+		chunk_size = offset;
+		if (chunk_size <= ArchetypeChunkSize || chunk_capacity == 1)
+			break;
+		chunk_capacity >>= 1;
+	}
+
+	chunk_mask = chunk_capacity - 1;
+	chunk_shift = trailing_zeroes(chunk_capacity);
+
+	for (unsigned i = 0; i < allocators.size(); i++)
+	{
+		auto type_index = allocators[i]->type_index;
+		if (column_by_type_index.size() <= type_index)
+			column_by_type_index.resize(type_index + 1, -1);
+		column_by_type_index[type_index] = int(i);
+	}
+}
+
+Archetype::~Archetype()
+{
+	for (uint32_t row = 0; row < count; row++)
+		for (unsigned i = 0; i < columns.size(); i++)
+			columns[i].allocator->destroy_component(get_component(i, row));
+	for (auto *chunk : chunks)
+		Util::memalign_free(chunk);
+}
+
+uint32_t Archetype::allocate_row(Entity *entity)
+{
+	uint32_t row = count;
+	if ((row >> chunk_shift) >= chunks.size())
+	{
+		auto *chunk = static_cast<uint8_t *>(Util::memalign_alloc(ArchetypeChunkAlignment, chunk_size));
+		if (!chunk)
+			throw std::bad_alloc();
+		chunks.push_back(chunk);
+		column_versions.resize(chunks.size() * columns.size());
+	}
+
+	get_chunk_entities(row >> chunk_shift)[row & chunk_mask] = entity;
+	mark_chunk_changed(row >> chunk_shift);
+	count++;
+	version++;
+	return row;
+}
+
+void Archetype::mark_chunk_changed(size_t chunk)
+{
+	if (columns.empty())
+		return;
+
+	uint64_t change = change_version->fetch_add(1, std::memory_order_relaxed) + 1;
+	for (unsigned i = 0; i < columns.size(); i++)
+		set_column_version(chunk, i, change);
+}
+
+void Archetype::free_row(uint32_t row)
+{
+	assert(row < count);
+	uint32_t last = count - 1;
+	if (row != last)
+	{
+		for (unsigned i = 0; i < columns.size(); i++)
+			columns[i].allocator->relocate_component(get_component(i, row), get_component(i, last));
+
+		auto *moved = get_chunk_entities(last >> chunk_shift)[last & chunk_mask];
+		get_chunk_entities(row >> chunk_shift)[row & chunk_mask] = moved;
+		moved->archetype_row = row;
+		mark_chunk_changed(row >> chunk_shift);
+	}
+
+	count--;
+	version++;
+
+	// Keep one spare chunk around so entities moving back and forth over a chunk boundary
+	// do not hit the allocator every time.
+	size_t needed_chunks = get_chunk_count() + 1;
+	while (chunks.size() > needed_chunks)
+	{
+		Util::memalign_free(chunks.back());
+		chunks.pop_back();
+	}
+	column_versions.resize(chunks.size() * columns.size());
+}
+
+EntityPool::EntityPool(EntityStorage storage_)
+	: storage(storage_)
+{
+	change_version.store(0, std::memory_order_relaxed);
+	if (storage == EntityStorage::Archetypes)
+		empty_archetype = get_archetype({});
+}
+
 Entity *EntityPool::create_entity()
+{
+	return create_entity_in(empty_archetype);
+}
+
+Entity *EntityPool::create_entity_in(Archetype *archetype)
 {
 	Util::Hasher hasher;
 	hasher.u64(++cookie);
-	auto *entity = entity_pool.allocate(this, hasher.get());
+	auto id = entity_handles.emplace(this, hasher.get());
+	auto *entity = &entity_handles.get(id);
+	entity->entity_id = id;
 	entity->pool_offset = entities.size();
 	entities.push_back(entity);
+
+	if (archetype)
+	{
+		entity->archetype = archetype;
+		entity->archetype_row = archetype->allocate_row(entity);
+	}
+
 	return entity;
 }
 
-void EntityPool::free_component(Entity &entity, ComponentType id, ComponentNode *component)
+Archetype *EntityPool::get_archetype(std::vector<ComponentType> types)
+{
+	Util::Hasher hasher;
+	hasher.u32(uint32_t(types.size()));
+	for (auto type : types)
+		hasher.u64(type);
+
+	auto *archetype = archetypes.find(hasher.get());
+	if (archetype)
+		return archetype;
+
+	std::vector<ComponentAllocatorBase *> allocators;
+	allocators.reserve(types.size());
+	for (auto type : types)
+	{
+		auto *allocator = component_types.find(type);
+		assert(allocator);
+		allocators.push_back(allocator);
+	}
+
+	archetype = new Archetype(std::move(types), std::move(allocators), &change_version);
+	archetype->set_hash(hasher.get());
+	archetypes.insert_yield(archetype);
+
+	for (auto &group : groups)
+		group.add_archetype(*archetype);
+
+	return archetype;
+}
+
+Archetype *EntityPool::get_archetype_with(Archetype &archetype, ComponentType id)
+{
+	Util::IntrusivePODWrapper<Archetype *> *edge = archetype.add_edges.find(id);
+	if (edge)
+		return edge->get();
+
+	auto types = archetype.get_types();
+	types.insert(std::upper_bound(types.begin(), types.end(), id), id);
+	auto *target = get_archetype(std::move(types));
+	archetype.add_edges.emplace_replace(id, target);
+	return target;
+}
+
+Archetype *EntityPool::get_archetype_without(Archetype &archetype, ComponentType id)
+{
+	Util::IntrusivePODWrapper<Archetype *> *edge = archetype.remove_edges.find(id);
+	if (edge)
+		return edge->get();
+
+	auto types = archetype.get_types();
+	types.erase(std::find(types.begin(), types.end(), id));
+	auto *target = get_archetype(std::move(types));
+	archetype.remove_edges.emplace_replace(id, target);
+	return target;
+}
+
+void EntityPool::move_to_archetype(Entity &entity, Archetype *target)
 {
+	auto &source = *entity.archetype;
+	uint32_t source_row = entity.archetype_row;
+	uint32_t target_row = target->allocate_row(&entity);
+
+	auto &columns = source.get_columns();
+	for (unsigned i = 0; i < columns.size(); i++)
+	{
+		void *src = source.get_component(i, source_row);
+		int target_column = target->find_column(columns[i].type);
+		if (target_column >= 0)
+			columns[i].allocator->relocate_component(target->get_component(unsigned(target_column), target_row), src);
+		else
+			columns[i].allocator->destroy_component(src);
+	}
+
+	source.free_row(source_row);
+	entity.archetype = target;
+	entity.archetype_row = target_row;
+}
+
+bool EntityPool::has_component(const Entity &entity, ComponentType id) const
+{
+	if (entity.archetype)
+		return entity.archetype->find_column(id) >= 0;
+
+	auto *allocator = component_types.find(id);
+	return allocator && allocator->get_slot(entity.get_slot()) != nullptr;
+}
+
+void EntityPool::free_archetypes()
+{
+	auto &list = archetypes.inner_list();
+	auto itr = list.begin();
+	while (itr != list.end())
+	{
+		auto *to_free = itr.get();
+		itr = list.erase(itr);
+		delete to_free;
+	}
+	archetypes.clear();
+	empty_archetype = nullptr;
+}
+
+void EntityPool::free_component(Entity &entity, ComponentType id)
+{
+	if (entity.archetype)
+	{
+		if (entity.archetype->find_column(id) >= 0)
+			move_to_archetype(entity, get_archetype_without(*entity.archetype, id));
+		return;
+	}
+
 	auto *c = component_types.find(id);
-	assert(c);
-	c->free_component(component->get());
-	component_nodes.free(component);
+	if (!c)
+		return;
+
+	auto *component = c->get_slot(entity.get_slot());
+	if (!component)
+		return;
+
+	c->set_slot(entity.get_slot(), nullptr);
+	c->free_component(component);
+
+	if (defer_group_updates)
+	{
+		c->pending_group_update = true;
+		return;
+	}
 
 	auto *component_groups = component_to_groups.find(id);
 	if (component_groups)
@@ -55,29 +336,295 @@ void EntityPool::free_component(Entity &entity, ComponentType id, ComponentNode
 
 void EntityPool::delete_entity(Entity *entity)
 {
+	release_components(*entity);
+	release_entity(*entity);
+}
+
+void EntityPool::release_components(Entity &entity)
+{
+	if (entity.archetype)
 	{
-		auto &components = entity->get_components();
-		auto &list = components.inner_list();
-		auto itr = list.begin();
-		while (itr != list.end())
-		{
-			auto *component = itr.get();
-			itr = list.erase(itr);
-			free_component(*entity, component->get_hash(), component);
-		}
+		auto &archetype = *entity.archetype;
+		auto &columns = archetype.get_columns();
+		for (unsigned i = 0; i < columns.size(); i++)
+			columns[i].allocator->destroy_component(archetype.get_component(i, entity.archetype_row));
+		archetype.free_row(entity.archetype_row);
+		entity.archetype = nullptr;
+	}
+	else
+	{
+		for (auto &allocator : component_types)
+			if (allocator.get_slot(entity.get_slot()))
+				free_component(entity, allocator.get_hash());
 	}
+}
 
-	auto offset = entity->pool_offset;
+void EntityPool::release_entity(Entity &entity)
+{
+	auto offset = entity.pool_offset;
 	assert(offset < entities.size());
 
 	entities[offset] = entities.back();
 	entities[offset]->pool_offset = offset;
 	entities.pop_back();
-	entity_pool.free(entity);
+	entity_handles.remove(entity.entity_id);
+}
+
+void EntityPool::take_pending_groups(std::vector<EntityGroupBase *> &pending)
+{
+	pending.clear();
+	for (auto &allocator : component_types)
+	{
+		if (!allocator.pending_group_update)
+			continue;
+		allocator.pending_group_update = false;
+
+		auto *component_groups = component_to_groups.find(allocator.get_hash());
+		if (!component_groups)
+			continue;
+
+		for (auto &group : *component_groups)
+		{
+			auto *g = groups.find(group.get_hash());
+			if (g && std::find(pending.begin(), pending.end(), g) == pending.end())
+				pending.push_back(g);
+		}
+	}
+}
+
+Entity *EntityPool::create_from_commands(EntityCommandBuffer::ComponentCommand * const *commands, size_t count,
+                                         std::vector<ComponentType> &types, Archetype *&archetype)
+{
+	if (storage == EntityStorage::Archetypes && count != 0)
+	{
+		// Place the entity directly in its final archetype rather than moving it once per component.
+		// Spawned entities tend to come in runs of the same shape, so remember the last archetype.
+		bool same_types = archetype && types.size() == count;
+		for (size_t i = 0; i < count && same_types; i++)
+			same_types = types[i] == commands[i]->type;
+
+		if (!same_types)
+		{
+			types.clear();
+			for (size_t i = 0; i < count; i++)
+			{
+				commands[i]->ops->get_allocator(*this);
+				types.push_back(commands[i]->type);
+			}
+
+			auto sorted_types = types;
+			std::sort(sorted_types.begin(), sorted_types.end());
+			if (std::adjacent_find(sorted_types.begin(), sorted_types.end()) != sorted_types.end())
+			{
+				// The same component was recorded twice, let the regular path replace it.
+				archetype = nullptr;
+				types.clear();
+			}
+			else
+				archetype = get_archetype(std::move(sorted_types));
+		}
+
+		if (archetype)
+		{
+			auto *entity = create_entity_in(archetype);
+			for (size_t i = 0; i < count; i++)
+			{
+				unsigned column = unsigned(archetype->find_column(commands[i]->type));
+				archetype->get_columns()[column].allocator->relocate_component(
+						archetype->get_component(column, entity->archetype_row), commands[i]->value);
+			}
+			return entity;
+		}
+	}
+
+	auto *entity = create_entity();
+	for (size_t i = 0; i < count; i++)
+		commands[i]->ops->allocate(*this, *entity, commands[i]->value);
+	return entity;
+}
+
+void EntityPool::commit(EntityCommandBuffer &buffer)
+{
+	EntityCommandBuffer *buffers[] = { &buffer };
+	commit(buffers, 1);
+}
+
+void EntityPool::commit(EntityCommandBuffer * const *buffers, size_t count)
+{
+	std::vector<Entity *> batch;
+	std::vector<EntityGroupBase *> pending_groups;
+
+	// Deletions go first, so creations can recycle entities and components right away.
+	// Archetype groups need no updates, and a deleted ID no longer resolves, so delete directly.
+	for (size_t i = 0; i < count; i++)
+	{
+		for (auto id : buffers[i]->deletes)
+		{
+			if (auto *entity = get_entity(id))
+			{
+				if (storage == EntityStorage::Archetypes)
+					delete_entity(entity);
+				else
+					batch.push_back(entity);
+			}
+		}
+	}
+
+	if (!batch.empty())
+	{
+		std::sort(batch.begin(), batch.end());
+		batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+
+		defer_group_updates = true;
+		for (auto *entity : batch)
+			release_components(*entity);
+		defer_group_updates = false;
+
+		take_pending_groups(pending_groups);
+		for (auto *group : pending_groups)
+			group->remove_entities(batch.data(), batch.size());
+
+		for (auto *entity : batch)
+			release_entity(*entity);
+	}
+
+	size_t total_creates = 0;
+	for (size_t i = 0; i < count; i++)
+		total_creates += buffers[i]->num_creates;
+
+	batch.clear();
+	batch.reserve(total_creates);
+	entities.reserve(entities.size() + total_creates);
+
+	std::vector<Entity *> modified;
+	std::vector<uint32_t> offsets;
+	std::vector<EntityCommandBuffer::ComponentCommand *> sorted_commands;
+	std::vector<ComponentType> types;
+	Archetype *archetype = nullptr;
+
+	defer_group_updates = true;
+	for (size_t i = 0; i < count; i++)
+	{
+		auto &buffer = *buffers[i];
+		uint32_t num_creates = buffer.num_creates;
+		buffer.created_entities.resize(num_creates);
+
+		// Bucket component commands by the entity they create, keeping the recorded order.
+		offsets.assign(num_creates + 1, 0);
+		for (auto &command : buffer.components)
+			if (command.created_index != EntityCommandBuffer::ExistingEntity)
+				offsets[command.created_index + 1]++;
+		for (uint32_t j = 0; j < num_creates; j++)
+			offsets[j + 1] += offsets[j];
+
+		sorted_commands.resize(offsets[num_creates]);
+		for (auto &command : buffer.components)
+			if (command.created_index != EntityCommandBuffer::ExistingEntity)
+				sorted_commands[offsets[command.created_index]++] = &command;
+
+		for (uint32_t j = 0; j < num_creates; j++)
+		{
+			uint32_t begin = j ? offsets[j - 1] : 0;
+			auto *entity = create_from_commands(sorted_commands.data() + begin, offsets[j] - begin, types, archetype);
+			buffer.created_entities[j] = entity;
+			batch.push_back(entity);
+		}
+
+		for (auto &command : buffer.components)
+		{
+			if (command.created_index != EntityCommandBuffer::ExistingEntity)
+				continue;
+
+			if (auto *entity = get_entity(command.id))
+			{
+				command.ops->allocate(*this, *entity, command.value);
+				modified.push_back(entity);
+			}
+			else
+				command.ops->destroy(command.value);
+		}
+
+		// Every value has been moved out or destroyed.
+		buffer.components.clear();
+		buffer.clear_commands();
+	}
+	defer_group_updates = false;
+
+	std::sort(modified.begin(), modified.end());
+	modified.erase(std::unique(modified.begin(), modified.end()), modified.end());
+
+	take_pending_groups(pending_groups);
+	for (auto *group : pending_groups)
+	{
+		group->add_entities(batch.data(), batch.size(), false);
+		group->add_entities(modified.data(), modified.size(), true);
+	}
+}
+
+EntityCommandBuffer::~EntityCommandBuffer()
+{
+	reset();
+	for (auto &block : blocks)
+		Util::memalign_free(block.data);
+}
+
+EntityCommandBuffer::PendingEntity EntityCommandBuffer::create_entity()
+{
+	return { num_creates++ };
+}
+
+void EntityCommandBuffer::delete_entity(EntityID id)
+{
+	deletes.push_back(id);
+}
+
+void EntityCommandBuffer::reset()
+{
+	for (auto &command : components)
+		command.ops->destroy(command.value);
+	components.clear();
+	created_entities.clear();
+	clear_commands();
+}
+
+void EntityCommandBuffer::clear_commands()
+{
+	assert(components.empty());
+	deletes.clear();
+	num_creates = 0;
+	current_block = 0;
+	block_offset = 0;
+}
+
+void *EntityCommandBuffer::allocate_value(size_t size, size_t alignment)
+{
+	while (current_block < blocks.size())
+	{
+		auto &block = blocks[current_block];
+		size_t offset = (block_offset + alignment - 1) & ~(alignment - 1);
+		if (offset + size <= block.size)
+		{
+			block_offset = offset + size;
+			return block.data + offset;
+		}
+
+		current_block++;
+		block_offset = 0;
+	}
+
+	ValueBlock block;
+	block.size = std::max<size_t>(ValueBlockSize, size);
+	block.data = static_cast<uint8_t *>(Util::memalign_alloc(std::max<size_t>(alignment, 64), block.size));
+	blocks.push_back(block);
+	block_offset = size;
+	return block.data;
 }
 
 EntityPool::~EntityPool()
 {
+	// Archetypes destroy their components through the allocators.
+	free_archetypes();
+
 	{
 		auto &list = component_types.inner_list();
 		auto itr = list.begin();
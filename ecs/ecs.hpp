@@ -26,11 +26,17 @@
 #include <vector>
 #include <memory>
 #include <algorithm>
+#include <utility>
+#include <type_traits>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
 #include "object_pool.hpp"
 #include "intrusive.hpp"
 #include "intrusive_hash_map.hpp"
 #include "compile_time_hash.hpp"
 #include "enum_cast.hpp"
+#include "generational_handle.hpp"
 #include <assert.h>
 
 namespace Granite
@@ -90,10 +96,25 @@ private:
 	Util::IntrusiveHashMap<ComponentSetKey> set;
 };
 
-using ComponentNode = Util::IntrusivePODWrapper<ComponentBase *>;
-using ComponentHashMap = Util::IntrusiveHashMapHolder<ComponentNode>;
 using ComponentGroupHashMap = Util::IntrusiveHashMap<ComponentSet>;
 
+// Small dense index assigned to every component type on first use, shared by all pools.
+// Used to look up per-type tables directly instead of hashing the component type.
+unsigned allocate_component_type_index();
+
+template <typename T>
+struct ComponentTypeIndex
+{
+	static unsigned get()
+	{
+		static const unsigned index = allocate_component_type_index();
+		return index;
+	}
+};
+
+// Stale handles are detected until an entity slot has been reused 255 times.
+using EntityID = Util::GenerationalHandleID;
+
 struct ComponentIDMapping
 {
 	template <typename T>
@@ -111,12 +132,215 @@ struct ComponentIDMapping
 	}
 };
 
+enum class EntityStorage
+{
+	// Every component type lives in its own object pool,
+	// and component pointers are stable for the lifetime of the component.
+	ComponentPools,
+	// Entities with the same set of components share chunks where each component type is stored contiguously.
+	// Adding or removing a component moves the entity to another archetype,
+	// which invalidates pointers to all its components.
+	Archetypes
+};
+
+class ComponentAllocatorBase;
+
+// All entities which have exactly the same set of component types.
+// Rows are kept dense, row i lives in chunk i >> chunk_shift.
+class Archetype : public Util::IntrusiveHashMapEnabled<Archetype>
+{
+public:
+	// Types must be sorted. Structural changes stamp chunks with new versions from change_version.
+	Archetype(std::vector<ComponentType> types, std::vector<ComponentAllocatorBase *> allocators,
+	          std::atomic<uint64_t> *change_version);
+	~Archetype();
+
+	Archetype(const Archetype &) = delete;
+	void operator=(const Archetype &) = delete;
+
+	struct Column
+	{
+		ComponentType type;
+		ComponentAllocatorBase *allocator;
+		size_t offset;
+		size_t stride;
+	};
+
+	int find_column(ComponentType type) const
+	{
+		auto itr = std::lower_bound(types.begin(), types.end(), type);
+		if (itr != types.end() && *itr == type)
+			return int(itr - types.begin());
+		else
+			return -1;
+	}
+
+	void *get_component(unsigned column, uint32_t row) const
+	{
+		auto &col = columns[column];
+		return chunks[row >> chunk_shift] + col.offset + (row & chunk_mask) * col.stride;
+	}
+
+	void *find_component(ComponentType type, uint32_t row) const
+	{
+		int column = find_column(type);
+		return column >= 0 ? get_component(unsigned(column), row) : nullptr;
+	}
+
+	int find_column_by_type_index(unsigned type_index) const
+	{
+		return type_index < column_by_type_index.size() ? column_by_type_index[type_index] : -1;
+	}
+
+	Entity **get_chunk_entities(size_t chunk) const
+	{
+		return reinterpret_cast<Entity **>(chunks[chunk]);
+	}
+
+	void *get_chunk_column(size_t chunk, unsigned column) const
+	{
+		return chunks[chunk] + columns[column].offset;
+	}
+
+	size_t get_chunk_count() const
+	{
+		return (count + chunk_capacity - 1) >> chunk_shift;
+	}
+
+	uint32_t get_chunk_entity_count(size_t chunk) const
+	{
+		uint32_t first = uint32_t(chunk) << chunk_shift;
+		return std::min<uint32_t>(count - first, chunk_capacity);
+	}
+
+	uint32_t get_entity_count() const
+	{
+		return count;
+	}
+
+	unsigned get_chunk_shift() const
+	{
+		return chunk_shift;
+	}
+
+	const std::vector<ComponentType> &get_types() const
+	{
+		return types;
+	}
+
+	const std::vector<Column> &get_columns() const
+	{
+		return columns;
+	}
+
+	// Bumped on every row allocation or removal.
+	uint64_t get_version() const
+	{
+		return version;
+	}
+
+	// Change version of a column within a chunk, i.e. the last time it was written through a query,
+	// marked as changed, or rows in the chunk were added or moved.
+	uint64_t get_column_version(size_t chunk, unsigned column) const
+	{
+		return column_versions[chunk * columns.size() + column];
+	}
+
+	void set_column_version(size_t chunk, unsigned column, uint64_t change)
+	{
+		column_versions[chunk * columns.size() + column] = change;
+	}
+
+	// Returns a new row with uninitialized components, the entity pointer is written.
+	uint32_t allocate_row(Entity *entity);
+
+	// All components of the row must have been destroyed or relocated.
+	// The last row is relocated into the hole.
+	void free_row(uint32_t row);
+
+	// Cached transitions to the archetype with one more or one less component type.
+	Util::IntrusiveHashMap<Util::IntrusivePODWrapper<Archetype *>> add_edges;
+	Util::IntrusiveHashMap<Util::IntrusivePODWrapper<Archetype *>> remove_edges;
+
+private:
+	std::vector<ComponentType> types;
+	std::vector<Column> columns;
+	std::vector<int> column_by_type_index;
+	std::vector<uint8_t *> chunks;
+	std::vector<uint64_t> column_versions;
+	std::atomic<uint64_t> *change_version;
+	uint32_t count = 0;
+	uint32_t chunk_capacity = 0;
+	uint32_t chunk_mask = 0;
+	unsigned chunk_shift = 0;
+	size_t chunk_size = 0;
+	uint64_t version = 0;
+
+	void mark_chunk_changed(size_t chunk);
+};
+
+// One contiguous run of entities in a group. Each column is an array of count components.
+template <typename... Ts>
+struct EntityChunk
+{
+	size_t count;
+	Entity * const *entities;
+	std::tuple<Ts *...> columns;
+
+	template <typename T>
+	T *get() const
+	{
+		return std::get<T *>(columns);
+	}
+};
+
+// Access modes for queries.
+template <typename T>
+struct Read
+{
+	using Component = T;
+	using Pointer = const T *;
+	static constexpr bool writes = false;
+};
+
+template <typename T>
+struct Write
+{
+	using Component = T;
+	using Pointer = T *;
+	static constexpr bool writes = true;
+};
+
+template <typename... Accessors>
+struct QueryChunk
+{
+	size_t count;
+	Entity * const *entities;
+	std::tuple<typename Accessors::Pointer...> columns;
+
+	template <typename T>
+	const T *read() const
+	{
+		return std::get<const T *>(columns);
+	}
+
+	template <typename T>
+	T *write() const
+	{
+		return std::get<T *>(columns);
+	}
+};
+
 class EntityGroupBase : public Util::IntrusiveHashMapEnabled<EntityGroupBase>
 {
 public:
 	virtual ~EntityGroupBase() = default;
 	virtual void add_entity(Entity &entity) = 0;
 	virtual void remove_entity(const Entity &entity) = 0;
+	// Bulk variants used by EntityPool::commit(). With skip_members, entities already in the group are ignored.
+	virtual void add_entities(Entity * const *list, size_t count, bool skip_members) = 0;
+	virtual void remove_entities(Entity * const *list, size_t count) = 0;
+	virtual void add_archetype(Archetype &archetype) = 0;
 	virtual void reset() = 0;
 };
 
@@ -131,43 +355,26 @@ class Entity : public Util::IntrusiveListEnabled<Entity>
 {
 public:
 	friend class EntityPool;
+	friend class Archetype;
 
 	Entity(EntityPool *pool_, Util::Hash hash_)
 		: pool(pool_), hash(hash_)
 	{
 	}
 
-	bool has_component(ComponentType id) const
-	{
-		auto itr = components.find(id);
-		return itr != nullptr;
-	}
+	bool has_component(ComponentType id) const;
 
 	template <typename T>
 	bool has_component() const
 	{
-		return has_component(ComponentIDMapping::get_id<T>());
+		return get_component<T>() != nullptr;
 	}
 
 	template <typename T>
-	T *get_component()
-	{
-		auto *t = components.find(ComponentIDMapping::get_id<T>());
-		if (t)
-			return static_cast<T *>(t->get());
-		else
-			return nullptr;
-	}
+	T *get_component();
 
 	template <typename T>
-	const T *get_component() const
-	{
-		auto *t = components.find(ComponentIDMapping::get_id<T>());
-		if (t)
-			return static_cast<const T *>(t->get());
-		else
-			return nullptr;
-	}
+	const T *get_component() const;
 
 	template <typename T, typename... Ts>
 	T *allocate_component(Ts&&... ts);
@@ -175,9 +382,10 @@ public:
 	template <typename T>
 	void free_component();
 
-	ComponentHashMap &get_components()
+	// Only set with EntityStorage::Archetypes.
+	Archetype *get_archetype() const
 	{
-		return components;
+		return archetype;
 	}
 
 	EntityPool *get_pool()
@@ -190,6 +398,17 @@ public:
 		return hash;
 	}
 
+	EntityID get_id() const
+	{
+		return entity_id;
+	}
+
+	// Index into per-type component tables. Reused after the entity is deleted.
+	uint32_t get_slot() const
+	{
+		return entity_id & 0xffffffu;
+	}
+
 	bool mark_for_destruction()
 	{
 		bool ret = !marked;
@@ -201,26 +420,52 @@ private:
 	EntityPool *pool;
 	Util::Hash hash;
 	size_t pool_offset = 0;
-	ComponentHashMap components;
+	EntityID entity_id = 0;
+	Archetype *archetype = nullptr;
+	uint32_t archetype_row = 0;
 	bool marked = false;
 };
 
+// Notified as entities join and leave a group. Only supported with EntityStorage::ComponentPools.
+class EntityGroupListener
+{
+public:
+	virtual ~EntityGroupListener() = default;
+	virtual void on_entity_added(Entity &entity) = 0;
+	virtual void on_entity_removed(const Entity &entity) = 0;
+	virtual void on_reset() = 0;
+};
+
 template <typename... Ts>
 class EntityGroup : public EntityGroupBase
 {
 public:
+	explicit EntityGroup(EntityStorage storage_)
+		: storage(storage_)
+	{
+	}
+
 	void add_entity(Entity &entity) override final
 	{
+		// With archetypes, membership follows from the matching archetypes.
+		if (storage == EntityStorage::Archetypes)
+			return;
+
 		if (has_all_components<Ts...>(entity))
 		{
 			entity_to_index[entity.get_hash()].get() = entities.size();
 			groups.push_back(std::make_tuple(entity.get_component<Ts>()...));
 			entities.push_back(&entity);
+			if (listener)
+				listener->on_entity_added(entity);
 		}
 	}
 
 	void remove_entity(const Entity &entity) override final
 	{
+		if (storage == EntityStorage::Archetypes)
+			return;
+
 		size_t offset;
 		if (entity_to_index.find_and_consume_pod(entity.get_hash(), offset))
 		{
@@ -231,30 +476,184 @@ public:
 			entity_to_index.erase(entity.get_hash());
 			entities.pop_back();
 			groups.pop_back();
+			if (listener)
+				listener->on_entity_removed(entity);
+		}
+	}
+
+	void add_entities(Entity * const *list, size_t count, bool skip_members) override final
+	{
+		if (storage == EntityStorage::Archetypes)
+			return;
+
+		reserve_for(groups, count);
+		reserve_for(entities, count);
+		for (size_t i = 0; i < count; i++)
+		{
+			auto &entity = *list[i];
+			if (!skip_members || !entity_to_index.find(entity.get_hash()))
+				add_entity(entity);
 		}
 	}
 
+	void remove_entities(Entity * const *list, size_t count) override final
+	{
+		if (storage == EntityStorage::Archetypes)
+			return;
+
+		for (size_t i = 0; i < count; i++)
+			remove_entity(*list[i]);
+	}
+
+	void add_archetype(Archetype &archetype) override final
+	{
+		const ComponentType ids[] = { ComponentIDMapping::get_id<Ts>()... };
+		ArchetypeColumns match = {};
+		match.archetype = &archetype;
+		for (size_t i = 0; i < sizeof...(Ts); i++)
+		{
+			int column = archetype.find_column(ids[i]);
+			if (column < 0)
+				return;
+			match.columns[i] = unsigned(column);
+		}
+		archetypes.push_back(match);
+		cached_version.store(~uint64_t(0), std::memory_order_relaxed);
+	}
+
+	// With EntityStorage::Archetypes, the flat vectors are rebuilt lazily here after structural changes,
+	// so references to them must not be held across entity or component creation and deletion.
+	// The rebuild is serialized, so any number of threads may call these at the same time.
 	const ComponentGroupVector<Ts...> &get_groups() const
 	{
+		refresh_archetype_cache();
 		return groups;
 	}
 
 	const std::vector<Entity *> &get_entities() const
 	{
+		refresh_archetype_cache();
 		return entities;
 	}
 
+	// Calls func(const EntityChunk<Ts...> &) for every contiguous run of entities in the group.
+	// With archetypes, a run is the part of an archetype chunk which is in use,
+	// with component pools every entity is its own run.
+	template <typename Func>
+	void for_each_chunk(const Func &func) const
+	{
+		if (storage == EntityStorage::Archetypes)
+		{
+			for (auto &match : archetypes)
+			{
+				size_t num_chunks = match.archetype->get_chunk_count();
+				for (size_t i = 0; i < num_chunks; i++)
+					func(make_chunk(match, i, std::index_sequence_for<Ts...>()));
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < groups.size(); i++)
+				func(EntityChunk<Ts...>{ 1, &entities[i], groups[i] });
+		}
+	}
+
 	void reset() override final
 	{
 		groups.clear();
 		entities.clear();
 		entity_to_index.clear();
+		cached_version.store(~uint64_t(0), std::memory_order_relaxed);
+		if (listener)
+			listener->on_reset();
+	}
+
+	// Current members are reported to the new listener right away.
+	void set_listener(EntityGroupListener *listener_)
+	{
+		assert(storage == EntityStorage::ComponentPools);
+		listener = listener_;
+		if (listener)
+			for (auto *entity : entities)
+				listener->on_entity_added(*entity);
+	}
+
+	struct ArchetypeColumns
+	{
+		Archetype *archetype;
+		unsigned columns[sizeof...(Ts)];
+	};
+
+	const std::vector<ArchetypeColumns> &get_archetypes() const
+	{
+		return archetypes;
+	}
+
+	EntityStorage get_storage() const
+	{
+		return storage;
 	}
 
 private:
-	ComponentGroupVector<Ts...> groups;
-	std::vector<Entity *> entities;
+	EntityStorage storage;
+	mutable ComponentGroupVector<Ts...> groups;
+	mutable std::vector<Entity *> entities;
 	Util::IntrusiveHashMap<Util::IntrusivePODWrapper<size_t>> entity_to_index;
+	std::vector<ArchetypeColumns> archetypes;
+	mutable std::mutex cache_lock;
+	mutable std::atomic<uint64_t> cached_version{~uint64_t(0)};
+	EntityGroupListener *listener = nullptr;
+
+	template <typename T>
+	static void reserve_for(std::vector<T> &vec, size_t count)
+	{
+		// Keep geometric growth so that many small commits stay linear.
+		if (vec.size() + count > vec.capacity())
+			vec.reserve(std::max(vec.size() + count, vec.capacity() * 2));
+	}
+
+	template <size_t... Indices>
+	static EntityChunk<Ts...> make_chunk(const ArchetypeColumns &match, size_t chunk, std::index_sequence<Indices...>)
+	{
+		return { match.archetype->get_chunk_entity_count(chunk),
+		         match.archetype->get_chunk_entities(chunk),
+		         std::make_tuple(static_cast<Ts *>(match.archetype->get_chunk_column(chunk, match.columns[Indices]))...) };
+	}
+
+	void refresh_archetype_cache() const
+	{
+		if (storage != EntityStorage::Archetypes)
+			return;
+
+		// Versions only ever increase, so the sum changes whenever any archetype changed.
+		uint64_t version = archetypes.size();
+		for (auto &match : archetypes)
+			version += match.archetype->get_version();
+		if (version == cached_version.load(std::memory_order_acquire))
+			return;
+
+		// Concurrent readers may all find the cache stale. One of them rebuilds it while the others wait.
+		std::lock_guard<std::mutex> holder{cache_lock};
+		if (version == cached_version.load(std::memory_order_relaxed))
+			return;
+
+		groups.clear();
+		entities.clear();
+		for_each_chunk([this](const EntityChunk<Ts...> &chunk) {
+			append_chunk(chunk, std::index_sequence_for<Ts...>());
+		});
+		cached_version.store(version, std::memory_order_release);
+	}
+
+	template <size_t... Indices>
+	void append_chunk(const EntityChunk<Ts...> &chunk, std::index_sequence<Indices...>) const
+	{
+		for (size_t i = 0; i < chunk.count; i++)
+		{
+			groups.push_back(std::make_tuple((std::get<Indices>(chunk.columns) + i)...));
+			entities.push_back(chunk.entities[i]);
+		}
+	}
 
 	template <typename... Us>
 	struct HasAllComponents;
@@ -264,8 +663,7 @@ private:
 	{
 		static bool has_component(const Entity &entity)
 		{
-			return entity.has_component(ComponentIDMapping::get_id<U>()) &&
-		           HasAllComponents<Us...>::has_component(entity);
+			return entity.has_component<U>() && HasAllComponents<Us...>::has_component(entity);
 		}
 	};
 
@@ -274,7 +672,7 @@ private:
 	{
 		static bool has_component(const Entity &entity)
 		{
-			return entity.has_component(ComponentIDMapping::get_id<U>());
+			return entity.has_component<U>();
 		}
 	};
 
@@ -285,11 +683,164 @@ private:
 	}
 };
 
+// Iterates all entities which have the accessed components.
+// Chunks can be filtered on whether any read component changed after a given version,
+// and components accessed with Write<T> are stamped as changed in every visited chunk.
+// With component pools, every entity is its own chunk and change filtering is not available,
+// so every entity counts as changed.
+// Entities and components must not be created or destroyed while a query is being iterated.
+template <typename... Accessors>
+class EntityQuery
+{
+public:
+	using Group = EntityGroup<typename Accessors::Component...>;
+	using Chunk = QueryChunk<Accessors...>;
+
+	EntityQuery(Group *group_, std::atomic<uint64_t> *change_version_)
+		: group(group_), change_version(change_version_)
+	{
+	}
+
+	// Upper bound for visit_chunk() indices.
+	size_t get_chunk_count() const
+	{
+		if (group->get_storage() != EntityStorage::Archetypes)
+			return group->get_groups().size();
+
+		size_t count = 0;
+		for (auto &match : group->get_archetypes())
+			count += match.archetype->get_chunk_count();
+		return count;
+	}
+
+	// Allocates a version to stamp writes with, which is newer than any existing change.
+	uint64_t begin_change_version() const
+	{
+		return change_version->fetch_add(1, std::memory_order_relaxed) + 1;
+	}
+
+	// Visits one chunk if it passes the change filter. Safe to call concurrently for different indices.
+	// changed_since of 0 visits everything.
+	template <typename Func>
+	void visit_chunk(size_t index, uint64_t version, uint64_t changed_since, const Func &func) const
+	{
+		if (group->get_storage() != EntityStorage::Archetypes)
+		{
+			auto &tuples = group->get_groups();
+			if (index < tuples.size())
+				func(make_pool_chunk(tuples[index], &group->get_entities()[index], std::index_sequence_for<Accessors...>()));
+			return;
+		}
+
+		for (auto &match : group->get_archetypes())
+		{
+			size_t num_chunks = match.archetype->get_chunk_count();
+			if (index >= num_chunks)
+			{
+				index -= num_chunks;
+				continue;
+			}
+
+			if (changed_since && !chunk_changed(match, index, changed_since))
+				return;
+
+			func(make_chunk(match, index, std::index_sequence_for<Accessors...>()));
+			stamp_writes(match, index, version);
+			return;
+		}
+	}
+
+	// Visits every chunk on the calling thread. Returns the version writes were stamped with,
+	// which can be passed as changed_since next time to only see changes made after this call.
+	template <typename Func>
+	uint64_t for_each_chunk(const Func &func, uint64_t changed_since = 0) const
+	{
+		uint64_t version = begin_change_version();
+		size_t count = get_chunk_count();
+		for (size_t i = 0; i < count; i++)
+			visit_chunk(i, version, changed_since, func);
+		return version;
+	}
+
+private:
+	Group *group;
+	std::atomic<uint64_t> *change_version;
+
+	static bool chunk_changed(const typename Group::ArchetypeColumns &match, size_t chunk, uint64_t changed_since)
+	{
+		const bool writes[] = { Accessors::writes... };
+		bool has_reads = false;
+		for (size_t i = 0; i < sizeof...(Accessors); i++)
+		{
+			if (writes[i])
+				continue;
+			has_reads = true;
+			if (match.archetype->get_column_version(chunk, match.columns[i]) > changed_since)
+				return true;
+		}
+
+		// A query which only writes has nothing to filter on.
+		return !has_reads;
+	}
+
+	static void stamp_writes(const typename Group::ArchetypeColumns &match, size_t chunk, uint64_t version)
+	{
+		const bool writes[] = { Accessors::writes... };
+		for (size_t i = 0; i < sizeof...(Accessors); i++)
+			if (writes[i])
+				match.archetype->set_column_version(chunk, match.columns[i], version);
+	}
+
+	template <size_t... Indices>
+	static Chunk make_chunk(const typename Group::ArchetypeColumns &match, size_t chunk, std::index_sequence<Indices...>)
+	{
+		return { match.archetype->get_chunk_entity_count(chunk),
+		         match.archetype->get_chunk_entities(chunk),
+		         std::make_tuple(static_cast<typename Accessors::Pointer>(
+				         match.archetype->get_chunk_column(chunk, match.columns[Indices]))...) };
+	}
+
+	template <typename Tuple, size_t... Indices>
+	static Chunk make_pool_chunk(const Tuple &tuple, Entity * const *entity, std::index_sequence<Indices...>)
+	{
+		return { 1, entity, std::make_tuple(static_cast<typename Accessors::Pointer>(std::get<Indices>(tuple))...) };
+	}
+};
+
 class ComponentAllocatorBase : public Util::IntrusiveHashMapEnabled<ComponentAllocatorBase>
 {
 public:
 	virtual ~ComponentAllocatorBase() = default;
 	virtual void free_component(ComponentBase *component) = 0;
+
+	// Archetype storage manages component memory itself.
+	// Relocation move-constructs into dst and destroys src.
+	virtual void relocate_component(void *dst, void *src) = 0;
+	virtual void destroy_component(void *component) = 0;
+
+	size_t component_size = 0;
+	size_t component_alignment = 0;
+	unsigned type_index = 0;
+	// Set when components were allocated or freed while EntityPool defers group updates.
+	bool pending_group_update = false;
+
+	// With component pools, the component owned by each entity slot.
+	// Paged so that sparsely used component types stay small.
+	enum { SlotPageBits = 10, SlotPageSize = 1u << SlotPageBits };
+
+	ComponentBase *get_slot(uint32_t slot) const
+	{
+		uint32_t page = slot >> SlotPageBits;
+		if (page < slot_pages.size() && slot_pages[page])
+			return slot_pages[page][slot & (SlotPageSize - 1)];
+		else
+			return nullptr;
+	}
+
+	void set_slot(uint32_t slot, ComponentBase *component);
+
+private:
+	std::vector<std::unique_ptr<ComponentBase *[]>> slot_pages;
 };
 
 template <typename T>
@@ -297,24 +848,190 @@ struct ComponentAllocator : public ComponentAllocatorBase
 {
 	Util::ObjectPool<T> pool;
 
+	ComponentAllocator()
+	{
+		component_size = sizeof(T);
+		component_alignment = alignof(T);
+		type_index = ComponentTypeIndex<T>::get();
+	}
+
 	void free_component(ComponentBase *component) override final
 	{
 		pool.free(static_cast<T *>(component));
 	}
+
+	void relocate_component(void *dst, void *src) override final
+	{
+		relocate(dst, src, std::is_move_constructible<T>());
+	}
+
+	void destroy_component(void *component) override final
+	{
+		static_cast<T *>(component)->~T();
+	}
+
+private:
+	static void relocate(void *dst, void *src, std::true_type)
+	{
+		auto *t = static_cast<T *>(src);
+		new (dst) T(std::move(*t));
+		t->~T();
+	}
+
+	static void relocate(void *, void *, std::false_type)
+	{
+		// Rejected in EntityPool::allocate_component().
+		std::terminate();
+	}
+};
+
+// Records entity creation, component allocation and entity deletion to be applied by EntityPool::commit().
+// Recording does not touch the pool, so buffers can be filled on worker threads, one buffer per thread,
+// and committed together on the thread which owns the pool.
+// Components are constructed when recorded and moved into the entity on commit.
+class EntityCommandBuffer
+{
+public:
+	EntityCommandBuffer() = default;
+	~EntityCommandBuffer();
+	EntityCommandBuffer(const EntityCommandBuffer &) = delete;
+	void operator=(const EntityCommandBuffer &) = delete;
+
+	struct PendingEntity
+	{
+		uint32_t index;
+	};
+
+	PendingEntity create_entity();
+
+	template <typename T, typename... Ts>
+	void allocate_component(PendingEntity entity, Ts&&... ts);
+
+	// Stale IDs are ignored on commit.
+	template <typename T, typename... Ts>
+	void allocate_component(EntityID id, Ts&&... ts);
+
+	void delete_entity(EntityID id);
+
+	// Filled in by commit, indexed by PendingEntity::index.
+	const std::vector<Entity *> &get_created_entities() const
+	{
+		return created_entities;
+	}
+
+	Entity *get_created_entity(PendingEntity entity) const
+	{
+		return entity.index < created_entities.size() ? created_entities[entity.index] : nullptr;
+	}
+
+	// Drops anything which has not been committed.
+	void reset();
+
+private:
+	friend class EntityPool;
+
+	enum { ValueBlockSize = 64 * 1024 };
+	enum : uint32_t { ExistingEntity = ~0u };
+
+	struct ComponentOps
+	{
+		ComponentAllocatorBase *(*get_allocator)(EntityPool &pool);
+		// Moves the value into the entity and destroys it.
+		void (*allocate)(EntityPool &pool, Entity &entity, void *value);
+		void (*destroy)(void *value);
+	};
+
+	template <typename T>
+	struct ComponentOpsFor
+	{
+		static ComponentAllocatorBase *get_allocator(EntityPool &pool);
+		static void allocate(EntityPool &pool, Entity &entity, void *value);
+		static void destroy(void *value);
+		static const ComponentOps ops;
+	};
+
+	struct ComponentCommand
+	{
+		ComponentType type;
+		uint32_t created_index;
+		EntityID id;
+		void *value;
+		const ComponentOps *ops;
+	};
+
+	struct ValueBlock
+	{
+		uint8_t *data;
+		size_t size;
+	};
+
+	std::vector<ComponentCommand> components;
+	std::vector<EntityID> deletes;
+	std::vector<Entity *> created_entities;
+	uint32_t num_creates = 0;
+
+	std::vector<ValueBlock> blocks;
+	size_t current_block = 0;
+	size_t block_offset = 0;
+
+	void *allocate_value(size_t size, size_t alignment);
+
+	template <typename T, typename... Ts>
+	void record_component(uint32_t created_index, EntityID id, Ts&&... ts);
+
+	void clear_commands();
 };
 
 class EntityPool
 {
 public:
+	friend class EntityCommandBuffer;
 	~EntityPool();
 
-	EntityPool() = default;
+	explicit EntityPool(EntityStorage storage = EntityStorage::ComponentPools);
 	void operator=(const EntityPool &) = delete;
 	EntityPool(const EntityPool &) = delete;
 
+	EntityStorage get_storage() const
+	{
+		return storage;
+	}
+
 	Entity *create_entity();
 	void delete_entity(Entity *entity);
 
+	// Applies deletions, then creations, then components added to existing entities.
+	// Groups are updated once per commit instead of once per component.
+	// Must not be called while iterating groups or queries.
+	void commit(EntityCommandBuffer &buffer);
+	void commit(EntityCommandBuffer * const *buffers, size_t count);
+
+	// Returns nullptr if the entity has been deleted.
+	Entity *get_entity(EntityID id) const
+	{
+		return entity_handles.maybe_get(id);
+	}
+
+	template <typename T>
+	T *get_component(const Entity &entity) const
+	{
+		auto *allocator = get_allocator(ComponentTypeIndex<T>::get());
+		if (!allocator)
+			return nullptr;
+
+		if (entity.archetype)
+		{
+			int column = entity.archetype->find_column_by_type_index(allocator->type_index);
+			if (column < 0)
+				return nullptr;
+			return static_cast<T *>(entity.archetype->get_component(unsigned(column), entity.archetype_row));
+		}
+		else
+			return static_cast<T *>(allocator->get_slot(entity.get_slot()));
+	}
+
+	bool has_component(const Entity &entity, ComponentType id) const;
+
 	template <typename... Ts>
 	EntityGroup<Ts...> *get_component_group_holder()
 	{
@@ -324,18 +1041,48 @@ public:
 		{
 			register_group<Ts...>(group_id);
 
-			t = new EntityGroup<Ts...>();
+			t = new EntityGroup<Ts...>(storage);
 			t->set_hash(group_id);
 			groups.insert_yield(t);
 
 			auto *group = static_cast<EntityGroup<Ts...> *>(t);
-			for (auto &entity : entities)
-				group->add_entity(*entity);
+			if (storage == EntityStorage::Archetypes)
+			{
+				for (auto &archetype : archetypes)
+					group->add_archetype(archetype);
+			}
+			else
+			{
+				for (auto &entity : entities)
+					group->add_entity(*entity);
+			}
 		}
 
 		return static_cast<EntityGroup<Ts...> *>(t);
 	}
 
+	template <typename... Accessors>
+	EntityQuery<Accessors...> query()
+	{
+		return { get_component_group_holder<typename Accessors::Component...>(), &change_version };
+	}
+
+	// Bumps the change version of a component as if it was written through a query.
+	// Only tracked with archetype storage.
+	template <typename T>
+	void mark_component_changed(const Entity &entity)
+	{
+		if (!entity.archetype)
+			return;
+		int column = entity.archetype->find_column_by_type_index(ComponentTypeIndex<T>::get());
+		if (column >= 0)
+		{
+			entity.archetype->set_column_version(entity.archetype_row >> entity.archetype->get_chunk_shift(),
+			                                     unsigned(column),
+			                                     change_version.fetch_add(1, std::memory_order_relaxed) + 1);
+		}
+	}
+
 	template <typename... Ts>
 	const ComponentGroupVector<Ts...> &get_component_group()
 	{
@@ -354,54 +1101,109 @@ public:
 	T *allocate_component(Entity &entity, Ts&&... ts)
 	{
 		constexpr ComponentType id = ComponentIDMapping::get_id<T>();
-		auto *t = component_types.find(id);
-		if (!t)
+		auto *allocator = get_or_create_allocator<T>();
+
+		if (entity.archetype)
 		{
-			t = new ComponentAllocator<T>();
-			t->set_hash(id);
-			component_types.insert_yield(t);
+			if (!std::is_move_constructible<T>::value)
+				throw std::logic_error("Archetype storage requires move constructible components.");
+
+			int column = entity.archetype->find_column_by_type_index(allocator->type_index);
+			if (column >= 0)
+			{
+				auto *comp = static_cast<T *>(entity.archetype->get_component(unsigned(column), entity.archetype_row));
+				comp->~T();
+				return new (comp) T(std::forward<Ts>(ts)...);
+			}
+
+			move_to_archetype(entity, get_archetype_with(*entity.archetype, id));
+			column = entity.archetype->find_column_by_type_index(allocator->type_index);
+			void *storage_ptr = entity.archetype->get_component(unsigned(column), entity.archetype_row);
+			return new (storage_ptr) T(std::forward<Ts>(ts)...);
 		}
 
-		auto *allocator = static_cast<ComponentAllocator<T> *>(t);
-		auto *existing = entity.components.find(id);
+		auto *existing = static_cast<T *>(allocator->get_slot(entity.get_slot()));
 
 		if (existing)
 		{
-			auto *comp = static_cast<T *>(existing->get());
 			// In-place modify. Destroy old data, and in-place construct.
 			// Do not need to fiddle with data structures internally.
-			comp->~T();
-			return new (comp) T(std::forward<Ts>(ts)...);
+			existing->~T();
+			return new (existing) T(std::forward<Ts>(ts)...);
 		}
 		else
 		{
 			auto *comp = allocator->pool.allocate(std::forward<Ts>(ts)...);
-			auto *node = component_nodes.allocate(comp);
-			node->set_hash(id);
-			entity.components.insert_replace(node);
-
-			auto *component_groups = component_to_groups.find(id);
-			if (component_groups)
-				for (auto &group : *component_groups)
-					groups.find(group.get_hash())->add_entity(entity);
+			allocator->set_slot(entity.get_slot(), comp);
+
+			if (defer_group_updates)
+				allocator->pending_group_update = true;
+			else
+			{
+				auto *component_groups = component_to_groups.find(id);
+				if (component_groups)
+					for (auto &group : *component_groups)
+						groups.find(group.get_hash())->add_entity(entity);
+			}
 
 			return comp;
 		}
 	}
 
-	void free_component(Entity &entity, ComponentType id, ComponentNode *component);
+	void free_component(Entity &entity, ComponentType id);
 	void reset_groups();
 	void reset_groups_for_component_type(ComponentType id);
 
 private:
-	Util::ObjectPool<Entity> entity_pool;
+	EntityStorage storage;
+	Util::GenerationalHandlePool<Entity> entity_handles;
 	Util::IntrusiveHashMapHolder<EntityGroupBase> groups;
 	Util::IntrusiveHashMapHolder<ComponentAllocatorBase> component_types;
-	Util::ObjectPool<ComponentNode> component_nodes;
+	std::vector<ComponentAllocatorBase *> allocators_by_type_index;
 	ComponentGroupHashMap component_to_groups;
 	std::vector<Entity *> entities;
 	uint64_t cookie = 0;
 
+	Util::IntrusiveHashMapHolder<Archetype> archetypes;
+	Archetype *empty_archetype = nullptr;
+	std::atomic<uint64_t> change_version;
+	bool defer_group_updates = false;
+
+	Entity *create_entity_in(Archetype *archetype);
+	void release_components(Entity &entity);
+	void release_entity(Entity &entity);
+	void take_pending_groups(std::vector<EntityGroupBase *> &pending);
+	Entity *create_from_commands(EntityCommandBuffer::ComponentCommand * const *commands, size_t count,
+	                             std::vector<ComponentType> &types, Archetype *&archetype);
+
+	template <typename T>
+	ComponentAllocator<T> *get_or_create_allocator()
+	{
+		auto *allocator = static_cast<ComponentAllocator<T> *>(get_allocator(ComponentTypeIndex<T>::get()));
+		if (!allocator)
+		{
+			ComponentAllocatorBase *t = new ComponentAllocator<T>();
+			t->set_hash(ComponentIDMapping::get_id<T>());
+			component_types.insert_yield(t);
+			allocator = static_cast<ComponentAllocator<T> *>(t);
+			if (allocators_by_type_index.size() <= allocator->type_index)
+				allocators_by_type_index.resize(allocator->type_index + 1);
+			allocators_by_type_index[allocator->type_index] = allocator;
+		}
+		return allocator;
+	}
+
+	Archetype *get_archetype(std::vector<ComponentType> types);
+	Archetype *get_archetype_with(Archetype &archetype, ComponentType id);
+	Archetype *get_archetype_without(Archetype &archetype, ComponentType id);
+	void move_to_archetype(Entity &entity, Archetype *target);
+	void free_archetypes();
+
+	ComponentAllocatorBase *get_allocator(unsigned type_index) const
+	{
+		return type_index < allocators_by_type_index.size() ? allocators_by_type_index[type_index] : nullptr;
+	}
+
 	template <typename... Us>
 	struct GroupRegisters;
 
@@ -444,13 +1246,74 @@ T *Entity::allocate_component(Ts&&... ts)
 template <typename T>
 void Entity::free_component()
 {
-	auto id = ComponentIDMapping::get_id<T>();
-	auto *t = components.find(id);
-	if (t)
-	{
-		components.erase(t);
-		pool->free_component(*this, t->get_hash(), t);
-	}
+	pool->free_component(*this, ComponentIDMapping::get_id<T>());
+}
+
+template <typename T>
+T *Entity::get_component()
+{
+	return pool->get_component<T>(*this);
+}
+
+template <typename T>
+const T *Entity::get_component() const
+{
+	return pool->get_component<T>(*this);
+}
+
+inline bool Entity::has_component(ComponentType id) const
+{
+	return pool->has_component(*this, id);
+}
+
+template <typename T, typename... Ts>
+void EntityCommandBuffer::allocate_component(PendingEntity entity, Ts&&... ts)
+{
+	record_component<T>(entity.index, 0, std::forward<Ts>(ts)...);
 }
 
-}
\ No newline at end of file
+template <typename T, typename... Ts>
+void EntityCommandBuffer::allocate_component(EntityID id, Ts&&... ts)
+{
+	record_component<T>(ExistingEntity, id, std::forward<Ts>(ts)...);
+}
+
+template <typename T, typename... Ts>
+void EntityCommandBuffer::record_component(uint32_t created_index, EntityID id, Ts&&... ts)
+{
+	static_assert(std::is_move_constructible<T>::value, "Deferred components must be move constructible.");
+
+	ComponentCommand command;
+	command.type = ComponentIDMapping::get_id<T>();
+	command.created_index = created_index;
+	command.id = id;
+	command.value = new (allocate_value(sizeof(T), alignof(T))) T(std::forward<Ts>(ts)...);
+	command.ops = &ComponentOpsFor<T>::ops;
+	components.push_back(command);
+}
+
+template <typename T>
+ComponentAllocatorBase *EntityCommandBuffer::ComponentOpsFor<T>::get_allocator(EntityPool &pool)
+{
+	return pool.get_or_create_allocator<T>();
+}
+
+template <typename T>
+void EntityCommandBuffer::ComponentOpsFor<T>::allocate(EntityPool &pool, Entity &entity, void *value)
+{
+	auto *t = static_cast<T *>(value);
+	pool.allocate_component<T>(entity, std::move(*t));
+	t->~T();
+}
+
+template <typename T>
+void EntityCommandBuffer::ComponentOpsFor<T>::destroy(void *value)
+{
+	static_cast<T *>(value)->~T();
+}
+
+template <typename T>
+const EntityCommandBuffer::ComponentOps EntityCommandBuffer::ComponentOpsFor<T>::ops = {
+	get_allocator, allocate, destroy,
+};
+}
@@ -0,0 +1,90 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "system_scheduler.hpp"
+#include <algorithm>
+
+namespace Granite
+{
+SystemScheduler::SystemScheduler(EntityPool &pool_, Granite::ThreadGroup &group_)
+	: pool(pool_), group(group_)
+{
+}
+
+bool SystemScheduler::conflicts(const SystemBase &a, const SystemBase &b)
+{
+	for (auto &access_a : a.accesses)
+		for (auto &access_b : b.accesses)
+			if (access_a.type_index == access_b.type_index && (access_a.writes || access_b.writes))
+				return true;
+	return false;
+}
+
+void SystemScheduler::run_chunks(SystemBase &system)
+{
+	uint64_t changed_since = system.changed_only ? system.last_run_version : 0;
+	size_t index;
+	while ((index = system.next_chunk.fetch_add(1, std::memory_order_relaxed)) < system.chunk_count)
+		system.run_chunk(index, system.version, changed_since);
+}
+
+void SystemScheduler::run()
+{
+	if (systems.empty())
+		return;
+
+	unsigned num_threads = std::max(group.get_num_threads(), 1u);
+	std::vector<TaskGroupHandle> tasks;
+	tasks.reserve(systems.size());
+
+	// Versions are allocated in submission order, so a system sees writes from every system which ran
+	// after its own previous run, regardless of how tasks end up being scheduled.
+	for (auto &system : systems)
+	{
+		system->chunk_count = system->get_chunk_count();
+		system->version = system->begin_change_version();
+		system->next_chunk.store(0, std::memory_order_relaxed);
+
+		auto task = group.create_task();
+		task->set_desc(system->name);
+
+		size_t num_tasks = std::max<size_t>(std::min<size_t>(num_threads, system->chunk_count), 1);
+		auto *sys = system.get();
+		for (size_t i = 0; i < num_tasks; i++)
+			task->enqueue_task([sys]() { run_chunks(*sys); });
+
+		for (size_t i = 0; i < tasks.size(); i++)
+			if (conflicts(*systems[i], *system))
+				group.add_dependency(*task, *tasks[i]);
+
+		tasks.push_back(std::move(task));
+	}
+
+	for (auto &task : tasks)
+		task->flush();
+	for (auto &task : tasks)
+		task->wait();
+
+	for (auto &system : systems)
+		system->last_run_version = system->version;
+}
+}
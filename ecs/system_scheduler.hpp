@@ -0,0 +1,119 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "ecs.hpp"
+#include "thread_group.hpp"
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <type_traits>
+
+namespace Granite
+{
+// Runs systems over EntityPool queries as ThreadGroup tasks.
+// Each system declares its component accesses with Read<T>/Write<T>, and two systems only run concurrently
+// if neither writes a component the other accesses. Otherwise they run in the order they were added.
+// Chunks within a system are processed in parallel, so a system must only touch the chunk it is given.
+// Entities and components must not be created or destroyed while run() is executing.
+class SystemScheduler
+{
+public:
+	SystemScheduler(EntityPool &pool, Granite::ThreadGroup &group);
+
+	// func is called as func(const QueryChunk<Accessors...> &).
+	// With changed_only, chunks are skipped unless one of the read components changed since the last run.
+	template <typename... Accessors, typename Func>
+	void add_system(const char *name, Func &&func, bool changed_only = false)
+	{
+		auto system = std::make_unique<System<typename std::decay<Func>::type, Accessors...>>(
+				pool.query<Accessors...>(), std::forward<Func>(func));
+		system->name = name;
+		system->changed_only = changed_only;
+		system->accesses = {
+			{ ComponentTypeIndex<typename Accessors::Component>::get(), Accessors::writes }...
+		};
+		systems.push_back(std::move(system));
+	}
+
+	void run();
+
+private:
+	struct Access
+	{
+		unsigned type_index;
+		bool writes;
+	};
+
+	struct SystemBase
+	{
+		virtual ~SystemBase() = default;
+		virtual size_t get_chunk_count() const = 0;
+		virtual uint64_t begin_change_version() const = 0;
+		virtual void run_chunk(size_t index, uint64_t version, uint64_t changed_since) const = 0;
+
+		const char *name = nullptr;
+		bool changed_only = false;
+		std::vector<Access> accesses;
+		uint64_t last_run_version = 0;
+
+		size_t chunk_count = 0;
+		uint64_t version = 0;
+		std::atomic<size_t> next_chunk;
+	};
+
+	template <typename Func, typename... Accessors>
+	struct System : SystemBase
+	{
+		System(EntityQuery<Accessors...> query_, Func func_)
+			: query(query_), func(std::move(func_))
+		{
+		}
+
+		size_t get_chunk_count() const override
+		{
+			return query.get_chunk_count();
+		}
+
+		uint64_t begin_change_version() const override
+		{
+			return query.begin_change_version();
+		}
+
+		void run_chunk(size_t index, uint64_t version_, uint64_t changed_since) const override
+		{
+			query.visit_chunk(index, version_, changed_since, func);
+		}
+
+		EntityQuery<Accessors...> query;
+		Func func;
+	};
+
+	EntityPool &pool;
+	Granite::ThreadGroup &group;
+	std::vector<std::unique_ptr<SystemBase>> systems;
+
+	static bool conflicts(const SystemBase &a, const SystemBase &b);
+	static void run_chunks(SystemBase &system);
+};
+}
@@ -22,18 +22,148 @@
 
 #include "asset_manager.hpp"
 #include "thread_group.hpp"
+#include "timer.hpp"
+#include "bitops.hpp"
 #include <utility>
 #include <algorithm>
 
 namespace Granite
 {
+AssetManager::AssetHeap::AssetHeap(Compare before_, uint32_t AssetInfo::*index_)
+	: before(before_), index(index_)
+{
+}
+
+void AssetManager::AssetHeap::place(AssetInfo *info, size_t i)
+{
+	heap[i] = info;
+	info->*index = uint32_t(i);
+}
+
+void AssetManager::AssetHeap::sift_up(size_t i)
+{
+	auto *info = heap[i];
+	while (i > 0)
+	{
+		size_t parent = (i - 1) / 2;
+		if (!before(info, heap[parent]))
+			break;
+		place(heap[parent], i);
+		i = parent;
+	}
+	place(info, i);
+}
+
+void AssetManager::AssetHeap::sift_down(size_t i)
+{
+	auto *info = heap[i];
+	size_t count = heap.size();
+	for (;;)
+	{
+		size_t child = 2 * i + 1;
+		if (child >= count)
+			break;
+		if (child + 1 < count && before(heap[child + 1], heap[child]))
+			child++;
+		if (!before(heap[child], info))
+			break;
+		place(heap[child], i);
+		i = child;
+	}
+	place(info, i);
+}
+
+void AssetManager::AssetHeap::update(AssetInfo *info, bool member)
+{
+	uint32_t i = info->*index;
+	if (!member)
+	{
+		if (i != UINT32_MAX)
+			erase(info);
+	}
+	else if (i == UINT32_MAX)
+	{
+		heap.push_back(info);
+		sift_up(heap.size() - 1);
+	}
+	else
+	{
+		sift_up(i);
+		sift_down(info->*index);
+	}
+}
+
+void AssetManager::AssetHeap::erase(AssetInfo *info)
+{
+	uint32_t i = info->*index;
+	auto *last = heap.back();
+	heap.pop_back();
+	info->*index = UINT32_MAX;
+
+	if (last != info)
+	{
+		place(last, i);
+		sift_up(i);
+		sift_down(last->*index);
+	}
+}
+
+bool AssetManager::sorts_before(const AssetInfo *a, const AssetInfo *b)
+{
+	// High prios come first since they will be activated.
+	// Then we sort by LRU.
+	// High consumption should be moved last, so they are candidates to be paged out if we're over budget.
+	// High pending consumption should be moved early since we don't want to page out resources that
+	// are in the middle of being loaded anyway.
+	// Finally, the ID is used as a tie breaker.
+
+	if (a->prio != b->prio)
+		return a->prio > b->prio;
+	else if (a->last_used != b->last_used)
+		return a->last_used > b->last_used;
+	else if (a->consumed != b->consumed)
+		return a->consumed < b->consumed;
+	else if (a->pending_consumed != b->pending_consumed)
+		return a->pending_consumed > b->pending_consumed;
+	else
+		return a->id.id < b->id.id;
+}
+
+bool AssetManager::sorts_after(const AssetInfo *a, const AssetInfo *b)
+{
+	return sorts_before(b, a);
+}
+
+void AssetManager::update_candidates(AssetInfo *info)
+{
+	bool inactive = info->consumed == 0 && info->pending_consumed == 0;
+	activation_candidates.update(info, inactive && info->prio > 0);
+	eviction_candidates.update(info, info->consumed != 0);
+}
+
 AssetManager::AssetManager()
+	: activation_candidates(sorts_before, &AssetInfo::activation_index)
+	, eviction_candidates(sorts_after, &AssetInfo::eviction_index)
 {
 	asset_bank.reserve(AssetID::MaxIDs);
-	sorted_assets.reserve(AssetID::MaxIDs);
+	used_assets.reset(new std::atomic<uint64_t>[NumIDWords]());
+	hinted_assets.reset(new std::atomic<uint64_t>[NumIDWords]());
+	hinted_etas.reset(new std::atomic<uint32_t>[AssetID::MaxIDs]);
+	for (uint32_t i = 0; i < AssetID::MaxIDs; i++)
+		hinted_etas[i].store(UINT32_MAX, std::memory_order_relaxed);
+	cost_updated_assets.reset(new std::atomic<uint64_t>[NumIDWords]());
+	// Only read back once flagged in cost_updated_assets, no need to touch every page up front.
+	cost_updates.reset(new std::atomic<uint64_t>[AssetID::MaxIDs]);
 	signal = std::make_unique<TaskSignal>();
 	for (uint64_t i = 0; i < timestamp; i++)
 		signal->signal_increment();
+
+	auto &metrics = Util::MetricsRegistry::get();
+	activations_metric = metrics.counter("asset-manager.activations");
+	releases_metric = metrics.counter("asset-manager.releases");
+	skipped_iterations_metric = metrics.counter("asset-manager.iterations-skipped");
+	consumed_metric = metrics.gauge("asset-manager.consumed-bytes");
+	iterate_time_metric = metrics.histogram("asset-manager.iterate-us");
 }
 
 AssetManager::~AssetManager()
@@ -53,6 +183,7 @@ AssetID AssetManager::register_asset_nolock(FileHandle file, AssetClass asset_cl
 	info->asset_class = asset_class;
 	AssetID ret = info->id;
 	asset_bank[id_count++] = info;
+	update_candidates(info);
 	if (iface)
 	{
 		iface->set_id_bounds(id_count);
@@ -92,8 +223,12 @@ AssetID AssetManager::register_asset(Filesystem &fs, const std::string &path, As
 
 void AssetManager::update_cost(AssetID id, uint64_t cost)
 {
-	std::lock_guard<std::mutex> holder{cost_update_lock};
-	thread_cost_updates.push_back({ id, cost });
+	if (id.id >= AssetID::MaxIDs)
+		return;
+
+	cost_updates[id.id].store(cost, std::memory_order_relaxed);
+	// Pairs with the acquire in update_costs_locked_assets(), so the cost is visible once the bit is.
+	cost_updated_assets[id.id / 64].fetch_or(uint64_t(1) << (id.id & 63), std::memory_order_release);
 }
 
 void AssetManager::set_asset_instantiator_interface(AssetInstantiatorInterface *iface_)
@@ -111,6 +246,7 @@ void AssetManager::set_asset_instantiator_interface(AssetInstantiatorInterface *
 		a->consumed = 0;
 		a->pending_consumed = 0;
 		a->last_used = 0;
+		update_candidates(a);
 	}
 	total_consumed = 0;
 
@@ -125,7 +261,33 @@ void AssetManager::set_asset_instantiator_interface(AssetInstantiatorInterface *
 
 void AssetManager::mark_used_asset(AssetID id)
 {
-	lru_append.push(id);
+	if (id.id >= AssetID::MaxIDs)
+		return;
+
+	auto &word = used_assets[id.id / 64];
+	uint64_t mask = uint64_t(1) << (id.id & 63);
+	if ((word.load(std::memory_order_relaxed) & mask) == 0)
+		word.fetch_or(mask, std::memory_order_relaxed);
+}
+
+void AssetManager::hint_future_use(AssetID id, uint32_t eta)
+{
+	if (id.id >= AssetID::MaxIDs || eta == UINT32_MAX)
+		return;
+
+	auto &slot = hinted_etas[id.id];
+	uint32_t current = slot.load(std::memory_order_relaxed);
+	do
+	{
+		// Many producers hint the same assets every frame, only the nearest one matters.
+		if (eta >= current)
+			return;
+	} while (!slot.compare_exchange_weak(current, eta, std::memory_order_relaxed));
+
+	auto &word = hinted_assets[id.id / 64];
+	uint64_t mask = uint64_t(1) << (id.id & 63);
+	if ((word.load(std::memory_order_relaxed) & mask) == 0)
+		word.fetch_or(mask, std::memory_order_relaxed);
 }
 
 void AssetManager::set_asset_budget(uint64_t cost)
@@ -144,22 +306,20 @@ bool AssetManager::set_asset_residency_priority(AssetID id, int prio)
 	if (id.id >= id_count)
 		return false;
 	asset_bank[id.id]->prio = prio;
+	update_candidates(asset_bank[id.id]);
 	return true;
 }
 
-void AssetManager::adjust_update(const CostUpdate &update)
+void AssetManager::adjust_update(AssetInfo *a, uint64_t cost)
 {
-	if (update.id.id < id_count)
-	{
-		auto *a = asset_bank[update.id.id];
-		total_consumed += update.cost - (a->consumed + a->pending_consumed);
-		a->consumed = update.cost;
-		a->pending_consumed = 0;
-
-		// A recently paged in image shouldn't be paged out right away in a situation where we're thrashing,
-		// that'd be very dumb.
-		a->last_used = timestamp;
-	}
+	total_consumed += cost - (a->consumed + a->pending_consumed);
+	a->consumed = cost;
+	a->pending_consumed = 0;
+
+	// A recently paged in image shouldn't be paged out right away in a situation where we're thrashing,
+	// that'd be very dumb.
+	a->last_used = timestamp;
+	update_candidates(a);
 }
 
 uint64_t AssetManager::get_current_total_consumed() const
@@ -169,24 +329,90 @@ uint64_t AssetManager::get_current_total_consumed() const
 
 void AssetManager::update_costs_locked_assets()
 {
+	uint32_t num_words = (id_count + 63) / 64;
+	for (uint32_t i = 0; i < num_words; i++)
 	{
-		std::lock_guard<std::mutex> holder_cost{cost_update_lock};
-		std::swap(cost_updates, thread_cost_updates);
-	}
+		// Cost updates may race with this, in which case they are either observed now or in the next iteration.
+		if (!cost_updated_assets[i].load(std::memory_order_relaxed))
+			continue;
 
-	for (auto &update : cost_updates)
-		adjust_update(update);
-	cost_updates.clear();
+		uint64_t updated = cost_updated_assets[i].exchange(0, std::memory_order_acquire);
+		Util::for_each_bit64(updated, [&](uint32_t bit) {
+			uint32_t id = i * 64 + bit;
+			if (id < id_count)
+				adjust_update(asset_bank[id], cost_updates[id].load(std::memory_order_relaxed));
+		});
+	}
 }
 
 void AssetManager::update_lru_locked_assets()
 {
-	lru_append.for_each_ranged([this](const AssetID *id, size_t count) {
-		for (size_t i = 0; i < count; i++)
-			if (id[i].id < id_count)
-				asset_bank[id[i].id]->last_used = timestamp;
-	});
-	lru_append.clear();
+	uint32_t num_words = (id_count + 63) / 64;
+	for (uint32_t i = 0; i < num_words; i++)
+	{
+		if (!used_assets[i].load(std::memory_order_relaxed))
+			continue;
+
+		uint64_t used = used_assets[i].exchange(0, std::memory_order_relaxed);
+		Util::for_each_bit64(used, [&](uint32_t bit) {
+			uint32_t id = i * 64 + bit;
+			if (id < id_count && asset_bank[id]->last_used != timestamp)
+			{
+				asset_bank[id]->last_used = timestamp;
+				update_candidates(asset_bank[id]);
+			}
+		});
+	}
+
+	for (uint32_t i = 0; i < num_words; i++)
+	{
+		if (!hinted_assets[i].load(std::memory_order_relaxed))
+			continue;
+
+		uint64_t hinted = hinted_assets[i].exchange(0, std::memory_order_relaxed);
+		Util::for_each_bit64(hinted, [&](uint32_t bit) {
+			uint32_t id = i * 64 + bit;
+			uint32_t eta = hinted_etas[id].exchange(UINT32_MAX, std::memory_order_relaxed);
+			if (id >= id_count || eta == UINT32_MAX)
+				return;
+
+			// Timestamps start at 1, and 0 is reserved for assets which were never used.
+			uint64_t last_used = timestamp - std::min<uint64_t>(eta, timestamp - 1);
+			if (asset_bank[id]->last_used < last_used)
+			{
+				asset_bank[id]->last_used = last_used;
+				update_candidates(asset_bank[id]);
+			}
+		});
+	}
+}
+
+void AssetManager::instantiate_asset(TaskGroup *task, AssetInfo &info)
+{
+	// Start background reads right away, so that the reads of all assets activated in an iteration overlap.
+	// The instantiator only blocks on the read once it starts parsing.
+	// Other files are read by the instantiator itself, which keeps the work off this thread when there is a task.
+	FileHandle file = info.handle;
+	if (file->has_async_read())
+		file = PrefetchedFile::read(*file);
+
+	if (task)
+	{
+		task->enqueue_task([this, instantiator = iface, id = info.id, file]() mutable {
+			instantiator->instantiate_asset(*this, nullptr, id, *file);
+		});
+	}
+	else
+		iface->instantiate_asset(*this, nullptr, info.id, *file);
+}
+
+void AssetManager::release_asset(AssetInfo *info)
+{
+	iface->release_asset(info->id);
+	releases_metric->add();
+	total_consumed -= info->consumed;
+	eviction_candidates.erase(info);
+	released_assets.push_back(info);
 }
 
 bool AssetManager::iterate_blocking(ThreadGroup &group, AssetID id)
@@ -208,11 +434,13 @@ bool AssetManager::iterate_blocking(ThreadGroup &group, AssetID id)
 	uint64_t estimate = iface->estimate_cost_asset(candidate->id, *candidate->handle);
 	auto task = group.create_task();
 	task->set_task_class(TaskClass::Background);
+	task->set_task_priority(TaskPriority::LatencySensitive);
 	task->set_fence_counter_signal(signal.get());
 	task->set_desc("asset-manager-instantiate-single");
-	iface->instantiate_asset(*this, task.get(), candidate->id, *candidate->handle);
+	instantiate_asset(task.get(), *candidate);
 	candidate->pending_consumed = estimate;
 	candidate->last_used = timestamp;
+	update_candidates(candidate);
 	total_consumed += estimate;
 
 	// We cannot increment the timestamp here, remember this for later.
@@ -235,10 +463,13 @@ void AssetManager::iterate(ThreadGroup *group)
 	if (current_count + 3 < timestamp)
 	{
 		iface->latch_handles();
+		skipped_iterations_metric->add();
 		LOGI("Asset manager skipping iteration due to too much pending work.\n");
 		return;
 	}
 
+	auto start_time = Util::get_current_time_nsecs();
+
 	TaskGroupHandle task;
 	if (group)
 	{
@@ -246,6 +477,7 @@ void AssetManager::iterate(ThreadGroup *group)
 		task->set_desc("asset-manager-instantiate");
 		task->set_fence_counter_signal(signal.get());
 		task->set_task_class(TaskClass::Background);
+		task->set_task_priority(TaskPriority::Bulk);
 	}
 	else
 		signal->signal_increment();
@@ -254,71 +486,49 @@ void AssetManager::iterate(ThreadGroup *group)
 	update_costs_locked_assets();
 	update_lru_locked_assets();
 
-	memcpy(sorted_assets.data(), asset_bank.data(), id_count * sizeof(sorted_assets[0]));
-	std::sort(sorted_assets.data(), sorted_assets.data() + id_count, [](const AssetInfo *a, const AssetInfo *b) -> bool {
-		// High prios come first since they will be activated.
-		// Then we sort by LRU.
-		// High consumption should be moved last, so they are candidates to be paged out if we're over budget.
-		// High pending consumption should be moved early since we don't want to page out resources that
-		// are in the middle of being loaded anyway.
-		// Finally, the ID is used as a tie breaker.
-
-		if (a->prio != b->prio)
-			return a->prio > b->prio;
-		else if (a->last_used != b->last_used)
-			return a->last_used > b->last_used;
-		else if (a->consumed != b->consumed)
-			return a->consumed < b->consumed;
-		else if (a->pending_consumed != b->pending_consumed)
-			return a->pending_consumed > b->pending_consumed;
-		else
-			return a->id.id < b->id.id;
-	});
-
-	size_t release_index = id_count;
 	uint64_t activated_cost_this_iteration = 0;
 	unsigned activation_count = 0;
-	size_t activate_index = 0;
+
+	// Activation walks candidates from the most important end, and releases walk resident assets
+	// from the least important end. Neither may cross where the other stopped.
+	const AssetInfo *last_released = nullptr;
+	const AssetInfo *activation_end = nullptr;
+	bool activation_exhausted = false;
 
 	// Aim to activate resources as long as we're in budget.
 	// Activate in order from highest priority to lowest.
 	bool can_activate = true;
 	while (can_activate &&
 	       total_consumed < transfer_budget &&
-	       activated_cost_this_iteration < transfer_budget_per_iteration &&
-	       activate_index != release_index)
+	       activated_cost_this_iteration < transfer_budget_per_iteration)
 	{
-		auto *candidate = sorted_assets[activate_index];
-		if (candidate->prio <= 0)
-			break;
-
-		// This resource is already active.
-		if (candidate->consumed != 0 || candidate->pending_consumed != 0)
+		auto *candidate = activation_candidates.top();
+		if (!candidate || (last_released && !sorts_before(candidate, last_released)))
 		{
-			activate_index++;
-			continue;
+			activation_exhausted = true;
+			break;
 		}
 
+		activation_end = candidate;
 		uint64_t estimate = iface->estimate_cost_asset(candidate->id, *candidate->handle);
 
 		can_activate = (total_consumed + estimate <= transfer_budget) || (candidate->prio >= persistent_prio());
-		while (!can_activate && activate_index + 1 != release_index)
+		while (!can_activate)
 		{
-			auto *release_candidate = sorted_assets[--release_index];
-			if (release_candidate->consumed)
-			{
-				LOGI("Releasing ID %u due to page-in pressure.\n", release_candidate->id.id);
-				iface->release_asset(release_candidate->id);
-				total_consumed -= release_candidate->consumed;
-				release_candidate->consumed = 0;
-			}
+			auto *release_candidate = eviction_candidates.top();
+			if (!release_candidate || !sorts_before(candidate, release_candidate))
+				break;
+
+			LOGI("Releasing ID %u due to page-in pressure.\n", release_candidate->id.id);
+			last_released = release_candidate;
+			release_asset(release_candidate);
 			can_activate = total_consumed + estimate <= transfer_budget;
 		}
 
 		if (can_activate)
 		{
 			// We're trivially in budget.
-			iface->instantiate_asset(*this, task.get(), candidate->id, *candidate->handle);
+			instantiate_asset(task.get(), *candidate);
 			activation_count++;
 
 			candidate->pending_consumed = estimate;
@@ -326,40 +536,53 @@ void AssetManager::iterate(ThreadGroup *group)
 			// Let this run over budget once.
 			// Ensures we can make forward progress no matter what the limit is.
 			activated_cost_this_iteration += estimate;
-			activate_index++;
+
+			// Assets with an estimate of 0 are still inactive, but must not be picked again in this iteration.
+			activation_candidates.erase(candidate);
 		}
 	}
 
 	// If we're 75% of budget, start garbage collecting non-resident resources ahead of time.
 	const uint64_t low_image_budget = (transfer_budget * 3) / 4;
 
-	const auto should_release = [&]() -> bool {
-		if (release_index == activate_index)
+	const auto should_release = [&](const AssetInfo *candidate) -> bool {
+		if (!candidate)
+			return false;
+
+		// When every prioritized asset was considered for activation, only unprioritized ones can go.
+		if (activation_exhausted && (last_released || candidate->prio > 0))
+			return false;
+		if (activation_end && !sorts_before(activation_end, candidate))
 			return false;
-		if (sorted_assets[release_index - 1]->prio == persistent_prio())
+		if (candidate->prio == persistent_prio())
 			return false;
 
 		if (total_consumed > transfer_budget)
 			return true;
-		else if (total_consumed > low_image_budget && sorted_assets[release_index - 1]->prio == 0)
+		else if (total_consumed > low_image_budget && candidate->prio == 0)
 			return true;
 
 		return false;
 	};
 
 	// If we're over budget, deactivate resources.
-	while (should_release())
+	while (should_release(eviction_candidates.top()))
 	{
-		auto *candidate = sorted_assets[--release_index];
-		if (candidate->consumed)
-		{
-			LOGI("Releasing 0-prio ID %u due to page-in pressure.\n", candidate->id.id);
-			iface->release_asset(candidate->id);
-			total_consumed -= candidate->consumed;
-			candidate->consumed = 0;
-			candidate->last_used = 0;
-		}
+		auto *candidate = eviction_candidates.top();
+		LOGI("Releasing 0-prio ID %u due to page-in pressure.\n", candidate->id.id);
+		candidate->last_used = 0;
+		release_asset(candidate);
+	}
+
+	for (auto *info : released_assets)
+	{
+		info->consumed = 0;
+		update_candidates(info);
 	}
+	released_assets.clear();
+
+	activations_metric->add(activation_count);
+	consumed_metric->set(int64_t(total_consumed));
 
 	if (activated_cost_this_iteration)
 	{
@@ -369,5 +592,6 @@ void AssetManager::iterate(ThreadGroup *group)
 
 	iface->latch_handles();
 	timestamp++;
+	iterate_time_metric->record((Util::get_current_time_nsecs() - start_time) / 1000);
 }
 }
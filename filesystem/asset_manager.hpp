@@ -21,15 +21,16 @@
  */
 
 #pragma once
-#include "atomic_append_buffer.hpp"
 #include "global_managers.hpp"
 #include "filesystem.hpp"
 #include "object_pool.hpp"
 #include "intrusive_hash_map.hpp"
 #include "dynamic_array.hpp"
+#include "metrics.hpp"
 #include <vector>
 #include <mutex>
 #include <memory>
+#include <atomic>
 
 namespace Granite
 {
@@ -129,6 +130,13 @@ public:
 	// When a resource is actually accessed, this is called.
 	void mark_used_asset(AssetID id);
 
+	// May be called concurrently, except when calling iterate().
+	// Hints that a resource is likely to be accessed eta iterations from now, e.g. when it is about to come into view.
+	// Until it is used, the asset ranks as if it was last used eta iterations ago,
+	// so it is activated ahead of assets which have not been used for longer, within the same budgets.
+	// A hint with eta 0 is equivalent to mark_used_asset(). The nearest hint given in an iteration wins.
+	void hint_future_use(AssetID id, uint32_t eta);
+
 private:
 	struct AssetInfo : Util::IntrusiveHashMapEnabled<AssetInfo>
 	{
@@ -139,13 +147,54 @@ private:
 		AssetID id = {};
 		AssetClass asset_class = AssetClass::ImageZeroable;
 		int prio = 0;
+		uint32_t activation_index = UINT32_MAX;
+		uint32_t eviction_index = UINT32_MAX;
+	};
+
+	// Binary heap which stores the position of each asset in the asset itself,
+	// so an asset can be moved or removed in place when its priority or LRU timestamp changes.
+	class AssetHeap
+	{
+	public:
+		using Compare = bool (*)(const AssetInfo *, const AssetInfo *);
+		AssetHeap(Compare before, uint32_t AssetInfo::*index);
+
+		// Inserts, repositions or removes info.
+		void update(AssetInfo *info, bool member);
+		void erase(AssetInfo *info);
+
+		AssetInfo *top() const
+		{
+			return heap.empty() ? nullptr : heap.front();
+		}
+
+	private:
+		std::vector<AssetInfo *> heap;
+		Compare before;
+		uint32_t AssetInfo::*index;
+
+		void place(AssetInfo *info, size_t i);
+		void sift_up(size_t i);
+		void sift_down(size_t i);
 	};
 
-	Util::DynamicArray<AssetInfo *> sorted_assets;
+	// Importance order, most important first.
+	static bool sorts_before(const AssetInfo *a, const AssetInfo *b);
+	static bool sorts_after(const AssetInfo *a, const AssetInfo *b);
+
+	// Inactive assets with a positive priority, most important first.
+	AssetHeap activation_candidates;
+	// Resident assets, least important first.
+	AssetHeap eviction_candidates;
+	void update_candidates(AssetInfo *info);
+
+	// Released assets keep their sort key until the end of iterate() so they are not reconsidered for activation.
+	std::vector<AssetInfo *> released_assets;
+	void release_asset(AssetInfo *info);
+
 	Util::DynamicArray<AssetInfo *> asset_bank;
 	std::mutex asset_bank_lock;
 	Util::ObjectPool<AssetInfo> pool;
-	Util::AtomicAppendBuffer<AssetID> lru_append;
 	Util::IntrusiveHashMapHolder<AssetInfo> file_to_assets;
 
 	AssetInstantiatorInterface *iface = nullptr;
@@ -156,16 +205,26 @@ private:
 	uint64_t timestamp = 1;
 	uint32_t blocking_signals = 0;
 
-	struct CostUpdate
-	{
-		AssetID id;
-		uint64_t cost = 0;
-	};
-	std::mutex cost_update_lock;
-	std::vector<CostUpdate> thread_cost_updates;
-	std::vector<CostUpdate> cost_updates;
-
-	void adjust_update(const CostUpdate &update);
+	Util::MetricCounter *activations_metric;
+	Util::MetricCounter *releases_metric;
+	Util::MetricCounter *skipped_iterations_metric;
+	Util::MetricGauge *consumed_metric;
+	Util::MetricHistogram *iterate_time_metric;
+
+	// One bit per asset ID, merged into the assets in iterate().
+	// Marking an asset which is already marked is a plain load, so render threads can mark
+	// the same assets over and over without contending on cache lines.
+	enum { NumIDWords = AssetID::MaxIDs / 64 };
+	std::unique_ptr<std::atomic<uint64_t>[]> used_assets;
+	// Nearest ETA hinted for every asset ID, UINT32_MAX if none, and which of them were hinted since the last merge.
+	std::unique_ptr<std::atomic<uint32_t>[]> hinted_etas;
+	std::unique_ptr<std::atomic<uint64_t>[]> hinted_assets;
+	// Latest cost reported for every asset ID, and which of them have been updated since the last merge.
+	std::unique_ptr<std::atomic<uint64_t>[]> cost_updates;
+	std::unique_ptr<std::atomic<uint64_t>[]> cost_updated_assets;
+
+	void adjust_update(AssetInfo *a, uint64_t cost);
+	void instantiate_asset(TaskGroup *task, AssetInfo &info);
 	std::unique_ptr<TaskSignal> signal;
 	AssetID register_asset_nolock(FileHandle file, AssetClass asset_class, int prio);
 
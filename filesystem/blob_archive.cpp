@@ -0,0 +1,288 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "blob_archive.hpp"
+#include "path_utils.hpp"
+#include "lz4_block.hpp"
+#include "logging.hpp"
+#include <algorithm>
+#include <unordered_map>
+#include <string.h>
+#include <stdio.h>
+
+namespace Granite
+{
+namespace BlobArchive
+{
+Util::Hash hash_path(const std::string &path)
+{
+	Util::Hasher h;
+	h.string(path);
+	return h.get();
+}
+
+void Packer::set_alignment(uint32_t alignment_)
+{
+	alignment = alignment_;
+}
+
+void Packer::set_chunk_size(uint32_t chunk_size_)
+{
+	chunk_size = chunk_size_;
+}
+
+void Packer::set_compression(Compression compression_)
+{
+	compression = compression_;
+}
+
+bool Packer::add_file(const std::string &path, FileHandle file)
+{
+	auto canon_path = Path::canonicalize_path(path);
+	if (canon_path.empty() || !file)
+		return false;
+
+	inputs.push_back({ std::move(canon_path), std::move(file), EntryType::File });
+	return true;
+}
+
+// Empty for the root directory.
+static std::string get_parent_path(const std::string &path)
+{
+	return Path::canonicalize_path(Path::split(path).first);
+}
+
+static uint64_t align_offset(uint64_t offset, uint64_t alignment)
+{
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+bool Packer::write(const std::string &output_path)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0 || chunk_size == 0)
+	{
+		LOGE("Invalid alignment or chunk size.\n");
+		return false;
+	}
+
+	// Every directory leading up to a file gets an entry of its own.
+	std::vector<Input> all_inputs = inputs;
+	std::unordered_map<std::string, EntryType> types;
+	for (auto &input : inputs)
+	{
+		if (!types.emplace(input.path, EntryType::File).second)
+		{
+			LOGE("%s was added more than once.\n", input.path.c_str());
+			return false;
+		}
+	}
+
+	for (auto &input : inputs)
+	{
+		auto dir = get_parent_path(input.path);
+		while (!dir.empty())
+		{
+			auto itr = types.find(dir);
+			if (itr != types.end())
+			{
+				if (itr->second == EntryType::File)
+				{
+					LOGE("%s is both a file and a directory.\n", dir.c_str());
+					return false;
+				}
+				break;
+			}
+
+			types.emplace(dir, EntryType::Directory);
+			all_inputs.push_back({ dir, {}, EntryType::Directory });
+			dir = get_parent_path(dir);
+		}
+	}
+
+	struct SortedInput
+	{
+		Util::Hash hash;
+		Input *input;
+	};
+
+	std::vector<SortedInput> sorted;
+	sorted.reserve(all_inputs.size());
+	for (auto &input : all_inputs)
+		sorted.push_back({ hash_path(input.path), &input });
+	std::sort(sorted.begin(), sorted.end(), [](const SortedInput &a, const SortedInput &b) {
+		if (a.hash != b.hash)
+			return a.hash < b.hash;
+		else
+			return a.input->path < b.input->path;
+	});
+
+	std::unordered_map<std::string, uint32_t> indices;
+	std::string strings;
+	uint64_t max_chunks = 0;
+	for (auto &s : sorted)
+	{
+		indices[s.input->path] = uint32_t(&s - sorted.data());
+		strings += s.input->path;
+		if (compression != Compression::None && s.input->file)
+			max_chunks += (s.input->file->get_size() + chunk_size - 1) / chunk_size;
+	}
+
+	Header header = {};
+	memcpy(header.magic, "BLOBBY02", sizeof(header.magic));
+	header.entry_count = uint32_t(sorted.size());
+	header.chunk_size = chunk_size;
+	header.alignment = alignment;
+	header.entries_offset = sizeof(Header);
+	header.strings_offset = header.entries_offset + sorted.size() * sizeof(Entry);
+	header.strings_size = strings.size();
+	// Room for the worst case, the chunk count is only known once everything has been compressed.
+	header.chunks_offset = align_offset(header.strings_offset + header.strings_size, alignof(Chunk));
+	header.data_offset = align_offset(header.chunks_offset + max_chunks * sizeof(Chunk), alignment);
+
+	FILE *file = fopen(output_path.c_str(), "wb");
+	if (!file)
+	{
+		LOGE("Failed to open %s for writing.\n", output_path.c_str());
+		return false;
+	}
+
+	bool success = true;
+	const auto write_data = [&](const void *data, size_t size) {
+		if (success && size && fwrite(data, 1, size, file) != size)
+		{
+			LOGE("Failed to write to %s.\n", output_path.c_str());
+			success = false;
+		}
+	};
+
+	std::vector<uint8_t> padding(std::max<uint64_t>(header.data_offset, alignment));
+	write_data(padding.data(), header.data_offset);
+
+	std::vector<Entry> entries(sorted.size());
+	std::vector<Chunk> chunks;
+	std::vector<uint8_t> compressed;
+	std::vector<Chunk> file_chunks;
+	uint32_t path_offset = 0;
+
+	for (size_t i = 0; i < sorted.size() && success; i++)
+	{
+		auto &input = *sorted[i].input;
+		auto &entry = entries[i];
+		entry.path_hash = sorted[i].hash;
+		entry.path_offset = path_offset;
+		entry.path_length = uint32_t(input.path.size());
+		path_offset += entry.path_length;
+		entry.type = input.type;
+
+		auto parent = get_parent_path(input.path);
+		entry.parent = parent.empty() ? RootParent : indices[parent];
+
+		if (input.type == EntryType::Directory)
+			continue;
+
+		entry.size = input.file->get_size();
+		FileMappingHandle mapping;
+		if (entry.size)
+		{
+			mapping = input.file->map();
+			if (!mapping)
+			{
+				LOGE("Failed to map %s.\n", input.path.c_str());
+				success = false;
+				break;
+			}
+		}
+
+		auto *src = mapping ? mapping->data<uint8_t>() : nullptr;
+
+		if (compression == Compression::LZ4 && entry.size)
+		{
+			compressed.clear();
+			file_chunks.clear();
+
+			for (uint64_t offset = 0; offset < entry.size; offset += chunk_size)
+			{
+				size_t len = size_t(std::min<uint64_t>(chunk_size, entry.size - offset));
+				size_t bound = Util::lz4_compress_bound(len);
+				size_t chunk_offset = compressed.size();
+				compressed.resize(chunk_offset + bound);
+
+				size_t compressed_size = Util::lz4_compress(compressed.data() + chunk_offset, bound, src + offset, len);
+				if (compressed_size == 0 || compressed_size >= len)
+				{
+					memcpy(compressed.data() + chunk_offset, src + offset, len);
+					compressed_size = len;
+				}
+
+				compressed.resize(chunk_offset + compressed_size);
+				file_chunks.push_back({ chunk_offset, uint32_t(compressed_size), 0 });
+			}
+
+			// Uncompressed files can be used without a copy, so only compress if it's worth it.
+			if (compressed.size() < entry.size - entry.size / 16)
+			{
+				entry.offset = header.data_size;
+				entry.compression = Compression::LZ4;
+				entry.first_chunk = uint32_t(chunks.size());
+				for (auto &chunk : file_chunks)
+				{
+					chunk.offset += header.data_size;
+					chunks.push_back(chunk);
+				}
+
+				write_data(compressed.data(), compressed.size());
+				header.data_size += compressed.size();
+				continue;
+			}
+		}
+
+		uint64_t aligned_offset = align_offset(header.data_size, alignment);
+		write_data(padding.data(), size_t(aligned_offset - header.data_size));
+		entry.offset = aligned_offset;
+		entry.compression = Compression::None;
+		write_data(src, size_t(entry.size));
+		header.data_size = aligned_offset + entry.size;
+	}
+
+	header.chunk_count = uint32_t(chunks.size());
+
+	if (success && fseek(file, 0, SEEK_SET) != 0)
+	{
+		LOGE("Failed to seek in %s.\n", output_path.c_str());
+		success = false;
+	}
+
+	write_data(&header, sizeof(header));
+	write_data(entries.data(), entries.size() * sizeof(Entry));
+	write_data(strings.data(), strings.size());
+	write_data(padding.data(), size_t(header.chunks_offset - header.strings_offset - header.strings_size));
+	write_data(chunks.data(), chunks.size() * sizeof(Chunk));
+
+	if (fclose(file) != 0)
+		success = false;
+
+	if (!success)
+		remove(output_path.c_str());
+	return success;
+}
+}
+}
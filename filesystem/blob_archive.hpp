@@ -0,0 +1,134 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "filesystem.hpp"
+#include "hash.hpp"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace Granite
+{
+// Layout of BLOBBY02 archives, which BlobFilesystem reads and BlobArchive::Packer writes.
+// Everything is little endian. The header, entries, strings and chunk table come first, so that
+// BlobFilesystem can use them straight from a single mapping of the archive without parsing them.
+namespace BlobArchive
+{
+enum class EntryType : uint32_t
+{
+	File = 0,
+	Directory = 1
+};
+
+enum class Compression : uint32_t
+{
+	None = 0,
+	// Util::lz4_compress() in independent chunks of Header::chunk_size bytes.
+	LZ4 = 1
+};
+
+// Parent of entries in the root directory.
+static constexpr uint32_t RootParent = UINT32_MAX;
+static constexpr uint32_t DefaultAlignment = 256;
+static constexpr uint32_t DefaultChunkSize = 64 * 1024;
+
+struct Header
+{
+	char magic[8];
+	uint32_t entry_count;
+	uint32_t chunk_count;
+	uint32_t chunk_size;
+	// Alignment of the data of uncompressed files within the archive.
+	uint32_t alignment;
+	uint64_t entries_offset;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+	uint64_t chunks_offset;
+	uint64_t data_offset;
+	uint64_t data_size;
+};
+
+// Sorted by path_hash, then path, so lookups are a binary search.
+struct Entry
+{
+	uint64_t path_hash;
+	// Relative to Header::data_offset.
+	uint64_t offset;
+	// Uncompressed size.
+	uint64_t size;
+	// Canonical path in the string table, not null terminated.
+	uint32_t path_offset;
+	uint32_t path_length;
+	// Index of the directory entry this entry lives in.
+	uint32_t parent;
+	EntryType type;
+	Compression compression;
+	// Compressed files own chunks [first_chunk, first_chunk + ceil(size / chunk_size)).
+	uint32_t first_chunk;
+};
+
+// A chunk decompresses to Header::chunk_size bytes, except the last chunk of a file.
+// Chunks which did not compress are stored as-is, with size equal to the decompressed size.
+struct Chunk
+{
+	// Relative to Header::data_offset.
+	uint64_t offset;
+	uint32_t size;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(Header) == 72, "Unexpected BlobArchive::Header size.");
+static_assert(sizeof(Entry) == 48, "Unexpected BlobArchive::Entry size.");
+static_assert(sizeof(Chunk) == 16, "Unexpected BlobArchive::Chunk size.");
+
+// Hash of a path canonicalized with Path::canonicalize_path().
+Util::Hash hash_path(const std::string &path);
+
+class Packer
+{
+public:
+	// Must be a power of two.
+	void set_alignment(uint32_t alignment);
+	void set_chunk_size(uint32_t chunk_size);
+	// Files are only stored compressed if it saves a meaningful amount of space.
+	void set_compression(Compression compression);
+
+	// Files are read in write().
+	bool add_file(const std::string &path, FileHandle file);
+	bool write(const std::string &output_path);
+
+private:
+	struct Input
+	{
+		std::string path;
+		FileHandle file;
+		EntryType type;
+	};
+	std::vector<Input> inputs;
+	uint32_t alignment = DefaultAlignment;
+	uint32_t chunk_size = DefaultChunkSize;
+	Compression compression = Compression::None;
+};
+}
+}
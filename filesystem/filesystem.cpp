@@ -22,6 +22,8 @@
 
 #define NOMINMAX
 #include "filesystem.hpp"
+#include "blob_archive.hpp"
+#include "lz4_block.hpp"
 #include "path_utils.hpp"
 #include "logging.hpp"
 #include "os_filesystem.hpp"
@@ -452,6 +454,18 @@ void BlobFilesystem::parse()
 	if (mapped_size < 16)
 		throw std::runtime_error("Blob archive too small.");
 
+	{
+		auto magic = file->map_subset(0, 8);
+		if (!magic)
+			throw std::runtime_error("Failed to map blob archive.");
+
+		if (memcmp(magic->data(), "BLOBBY02", 8) == 0)
+		{
+			parse_v2();
+			return;
+		}
+	}
+
 	auto mapped_handle = file->map();
 	if (!mapped_handle)
 		throw std::runtime_error("Failed to map blob archive.");
@@ -495,6 +509,327 @@ void BlobFilesystem::parse()
 	}
 }
 
+void BlobFilesystem::parse_v2()
+{
+	uint64_t file_size = file->get_size();
+	if (file_size < sizeof(BlobArchive::Header))
+		throw std::runtime_error("Blob archive too small.");
+
+	uint64_t data_offset;
+	{
+		auto header_mapping = file->map_subset(0, sizeof(BlobArchive::Header));
+		if (!header_mapping)
+			throw std::runtime_error("Failed to map blob archive.");
+		data_offset = header_mapping->data<BlobArchive::Header>()->data_offset;
+	}
+
+	if (data_offset < sizeof(BlobArchive::Header) || data_offset > file_size || data_offset > SIZE_MAX)
+		throw std::range_error("Blob table of contents out of range.");
+
+	toc = file->map_subset(0, size_t(data_offset));
+	if (!toc)
+		throw std::runtime_error("Failed to map blob archive.");
+
+	// Only the tables as a whole are validated here, individual entries are validated when they are used.
+	auto *toc_header = toc->data<BlobArchive::Header>();
+	auto *base = toc->data<uint8_t>();
+
+	if (toc_header->chunk_size == 0 || toc_header->alignment == 0 ||
+	    (toc_header->alignment & (toc_header->alignment - 1)) != 0)
+		throw std::runtime_error("Invalid blob chunk size or alignment.");
+
+	if (toc_header->entries_offset % alignof(BlobArchive::Entry) != 0 ||
+	    toc_header->chunks_offset % alignof(BlobArchive::Chunk) != 0)
+		throw std::runtime_error("Misaligned blob tables.");
+
+	if (toc_header->entries_offset > data_offset ||
+	    (data_offset - toc_header->entries_offset) / sizeof(BlobArchive::Entry) < toc_header->entry_count ||
+	    toc_header->chunks_offset > data_offset ||
+	    (data_offset - toc_header->chunks_offset) / sizeof(BlobArchive::Chunk) < toc_header->chunk_count ||
+	    toc_header->strings_offset > data_offset ||
+	    data_offset - toc_header->strings_offset < toc_header->strings_size)
+		throw std::range_error("Blob tables out of range.");
+
+	if (toc_header->data_size > file_size - data_offset)
+		throw std::range_error("Blob is not large enough for all files.");
+
+	header = toc_header;
+	blob_entries = reinterpret_cast<const BlobArchive::Entry *>(base + header->entries_offset);
+	blob_chunks = reinterpret_cast<const BlobArchive::Chunk *>(base + header->chunks_offset);
+	blob_strings = reinterpret_cast<const char *>(base + header->strings_offset);
+}
+
+std::string BlobFilesystem::get_entry_path(const BlobArchive::Entry &entry) const
+{
+	if (entry.path_offset > header->strings_size || entry.path_length > header->strings_size - entry.path_offset)
+		return {};
+	return std::string(blob_strings + entry.path_offset, blob_strings + entry.path_offset + entry.path_length);
+}
+
+const BlobArchive::Entry *BlobFilesystem::find_entry(const std::string &path) const
+{
+	auto hash = BlobArchive::hash_path(path);
+	auto *end = blob_entries + header->entry_count;
+	auto *itr = std::lower_bound(blob_entries, end, hash, [](const BlobArchive::Entry &entry, Util::Hash h) {
+		return entry.path_hash < h;
+	});
+
+	for (; itr != end && itr->path_hash == hash; ++itr)
+		if (get_entry_path(*itr) == path)
+			return itr;
+
+	return nullptr;
+}
+
+// A file stored as LZ4 chunks in a BLOBBY02 archive. Mappings only decompress the chunks they overlap.
+class BlobCompressedFile final : public File
+{
+public:
+	BlobCompressedFile(FileHandle archive_, FileMappingHandle toc_, const BlobArchive::Chunk *chunks_,
+	                   const BlobArchive::Header &header, uint64_t size_)
+		: archive(std::move(archive_)), toc(std::move(toc_)), chunks(chunks_),
+		  chunk_size(header.chunk_size), data_offset(header.data_offset), data_size(header.data_size), size(size_)
+	{
+	}
+
+	FileMappingHandle map_subset(uint64_t offset, size_t range) override
+	{
+		if (offset > size || range > size - offset)
+			return {};
+
+		auto *mapped = static_cast<uint8_t *>(malloc(std::max<size_t>(range, 1)));
+		if (!mapped)
+			return {};
+
+		if (range && !map_and_decompress(mapped, offset, range))
+		{
+			LOGE("Failed to decompress blob file.\n");
+			free(mapped);
+			return {};
+		}
+
+		return Util::make_handle<FileMapping>(reference_from_this(), offset, mapped, range, 0, range);
+	}
+
+	// Reads the stored chunks with the archive's read_async(), and decompresses them on the thread completing it.
+	void read_async(void *buffer, uint64_t offset, size_t range, FileReadCompletion completion) override
+	{
+		if (offset > size)
+		{
+			completion(-1);
+			return;
+		}
+
+		range = size_t(std::min<uint64_t>(range, size - offset));
+		if (range == 0)
+		{
+			completion(0);
+			return;
+		}
+
+		uint64_t stored_begin, stored_end;
+		if (!get_stored_range(offset, range, stored_begin, stored_end))
+		{
+			completion(-1);
+			return;
+		}
+
+		auto stored_size = size_t(stored_end - stored_begin);
+		auto *stored = static_cast<uint8_t *>(malloc(std::max<size_t>(stored_size, 1)));
+		if (!stored)
+		{
+			completion(-1);
+			return;
+		}
+
+		archive->read_async(stored, data_offset + stored_begin, stored_size,
+		                    [this, holder = reference_from_this(), dst = static_cast<uint8_t *>(buffer),
+		                     offset, range, stored, stored_begin, stored_size,
+		                     completion = std::move(completion)](int64_t result) {
+			bool ok = result == int64_t(stored_size) && decompress(dst, offset, range, stored, stored_begin);
+			free(stored);
+			if (!ok)
+				LOGE("Failed to decompress blob file.\n");
+			completion(ok ? int64_t(range) : -1);
+		});
+	}
+
+	bool has_async_read() override
+	{
+		return archive->has_async_read();
+	}
+
+	FileMappingHandle map_write(size_t) override
+	{
+		return {};
+	}
+
+	void unmap(void *mapped, size_t) override
+	{
+		free(mapped);
+	}
+
+	uint64_t get_size() override
+	{
+		return size;
+	}
+
+private:
+	FileHandle archive;
+	FileMappingHandle toc;
+	const BlobArchive::Chunk *chunks;
+	uint64_t chunk_size;
+	uint64_t data_offset;
+	uint64_t data_size;
+	uint64_t size;
+
+	// The chunks of a file are stored back to back, so everything we need can be read at once.
+	bool get_stored_range(uint64_t offset, size_t range, uint64_t &stored_begin, uint64_t &stored_end) const
+	{
+		uint64_t first_chunk = offset / chunk_size;
+		uint64_t last_chunk = (offset + range - 1) / chunk_size;
+
+		stored_begin = UINT64_MAX;
+		stored_end = 0;
+		for (uint64_t i = first_chunk; i <= last_chunk; i++)
+		{
+			auto &chunk = chunks[i];
+			if (chunk.offset > data_size || chunk.size > data_size - chunk.offset)
+				return false;
+			stored_begin = std::min(stored_begin, chunk.offset);
+			stored_end = std::max(stored_end, chunk.offset + chunk.size);
+		}
+
+		return true;
+	}
+
+	bool map_and_decompress(uint8_t *dst, uint64_t offset, size_t range)
+	{
+		uint64_t stored_begin, stored_end;
+		if (!get_stored_range(offset, range, stored_begin, stored_end))
+			return false;
+
+		auto stored = archive->map_subset(data_offset + stored_begin, size_t(stored_end - stored_begin));
+		if (!stored)
+			return false;
+
+		return decompress(dst, offset, range, stored->data<uint8_t>(), stored_begin);
+	}
+
+	// stored holds the archive data from stored_begin, as returned by get_stored_range().
+	bool decompress(uint8_t *dst, uint64_t offset, size_t range, const uint8_t *stored, uint64_t stored_begin) const
+	{
+		uint64_t first_chunk = offset / chunk_size;
+		uint64_t last_chunk = (offset + range - 1) / chunk_size;
+
+		std::vector<uint8_t> scratch;
+		for (uint64_t i = first_chunk; i <= last_chunk; i++)
+		{
+			uint64_t chunk_begin = i * chunk_size;
+			size_t chunk_len = size_t(std::min(chunk_size, size - chunk_begin));
+			uint64_t copy_begin = std::max(offset, chunk_begin);
+			uint64_t copy_end = std::min(offset + range, chunk_begin + chunk_len);
+			auto *src = stored + (chunks[i].offset - stored_begin);
+			auto *out = dst + (copy_begin - offset);
+
+			if (chunks[i].size == chunk_len)
+			{
+				memcpy(out, src + (copy_begin - chunk_begin), size_t(copy_end - copy_begin));
+			}
+			else if (copy_begin == chunk_begin && copy_end == chunk_begin + chunk_len)
+			{
+				if (!Util::lz4_decompress(out, chunk_len, src, chunks[i].size))
+					return false;
+			}
+			else
+			{
+				scratch.resize(chunk_len);
+				if (!Util::lz4_decompress(scratch.data(), chunk_len, src, chunks[i].size))
+					return false;
+				memcpy(out, scratch.data() + (copy_begin - chunk_begin), size_t(copy_end - copy_begin));
+			}
+		}
+
+		return true;
+	}
+};
+
+FileHandle BlobFilesystem::open_entry(const BlobArchive::Entry &entry)
+{
+	if (entry.type != BlobArchive::EntryType::File)
+		return {};
+
+	if (entry.compression == BlobArchive::Compression::None)
+	{
+		if (entry.offset > header->data_size || entry.size > header->data_size - entry.offset)
+		{
+			LOGE("Blob file out of range.\n");
+			return {};
+		}
+
+		return Util::make_handle<FileSlice>(file, header->data_offset + entry.offset, entry.size);
+	}
+	else if (entry.compression == BlobArchive::Compression::LZ4)
+	{
+		uint64_t chunk_count = (entry.size + header->chunk_size - 1) / header->chunk_size;
+		if (entry.first_chunk > header->chunk_count || chunk_count > header->chunk_count - entry.first_chunk)
+		{
+			LOGE("Blob chunks out of range.\n");
+			return {};
+		}
+
+		return Util::make_handle<BlobCompressedFile>(file, toc, blob_chunks + entry.first_chunk, *header, entry.size);
+	}
+	else
+	{
+		LOGE("Unknown blob compression.\n");
+		return {};
+	}
+}
+
+std::vector<ListEntry> BlobFilesystem::list_v2(const std::string &path)
+{
+	uint32_t parent = BlobArchive::RootParent;
+	if (!path.empty())
+	{
+		auto *dir = find_entry(path);
+		if (!dir || dir->type != BlobArchive::EntryType::Directory)
+			return {};
+		parent = uint32_t(dir - blob_entries);
+	}
+
+	std::vector<ListEntry> list_entries;
+	for (uint32_t i = 0; i < header->entry_count; i++)
+	{
+		auto &entry = blob_entries[i];
+		if (entry.parent == parent)
+		{
+			list_entries.push_back({ Path::join(path, Path::basename(get_entry_path(entry))),
+			                         entry.type == BlobArchive::EntryType::Directory ? PathType::Directory : PathType::File });
+		}
+	}
+	return list_entries;
+}
+
+bool BlobFilesystem::stat_v2(const std::string &path, FileStat &stat)
+{
+	stat.last_modified = 0;
+	if (path.empty())
+	{
+		stat.size = 0;
+		stat.type = PathType::Directory;
+		return true;
+	}
+
+	auto *entry = find_entry(path);
+	if (!entry)
+		return false;
+
+	stat.size = entry->size;
+	stat.type = entry->type == BlobArchive::EntryType::Directory ? PathType::Directory : PathType::File;
+	return true;
+}
+
 BlobFilesystem::Directory *BlobFilesystem::make_directory(const std::string &path)
 {
 	auto split = Util::split_no_empty(path, "/");
@@ -559,6 +894,8 @@ BlobFilesystem::BlobFile *BlobFilesystem::find_file(const std::string &path)
 std::vector<ListEntry> BlobFilesystem::list(const std::string &path)
 {
 	auto canon_path = Path::canonicalize_path(path);
+	if (header)
+		return list_v2(canon_path);
 
 	std::vector<ListEntry> entries;
 	if (const auto *zip_dir = find_directory(canon_path))
@@ -575,6 +912,8 @@ std::vector<ListEntry> BlobFilesystem::list(const std::string &path)
 bool BlobFilesystem::stat(const std::string &path, FileStat &stat)
 {
 	auto p = Path::canonicalize_path(path);
+	if (header)
+		return stat_v2(p, stat);
 
 	if (const auto *zip_file = find_file(p))
 	{
@@ -600,6 +939,12 @@ FileHandle BlobFilesystem::open(const std::string &path, FileMode mode)
 		return {};
 
 	auto p = Path::canonicalize_path(path);
+	if (header)
+	{
+		auto *entry = find_entry(p);
+		return entry ? open_entry(*entry) : FileHandle{};
+	}
+
 	auto *blob_file = find_file(p);
 	if (!blob_file)
 		return {};
@@ -658,6 +1003,95 @@ Util::IntrusivePtr<FileMapping> File::map()
 	return map_subset(0, get_size());
 }
 
+void File::read_async(void *buffer, uint64_t offset, size_t range, FileReadCompletion completion)
+{
+	uint64_t size = get_size();
+	if (offset > size)
+	{
+		completion(-1);
+		return;
+	}
+
+	range = size_t(std::min<uint64_t>(range, size - offset));
+	if (range == 0)
+	{
+		completion(0);
+		return;
+	}
+
+	auto mapping = map_subset(offset, range);
+	if (!mapping)
+	{
+		completion(-1);
+		return;
+	}
+
+	memcpy(buffer, mapping->data(), range);
+	completion(int64_t(range));
+}
+
+bool File::has_async_read()
+{
+	return false;
+}
+
+Util::IntrusivePtr<PrefetchedFile> PrefetchedFile::read(File &file)
+{
+	auto prefetched = Util::make_handle<PrefetchedFile>();
+	prefetched->size = file.get_size();
+	prefetched->data.reset(new uint8_t[std::max<size_t>(prefetched->size, 1)]);
+
+	// The completion holds a reference, so the buffer outlives the read even if the caller lets go.
+	file.read_async(prefetched->data.get(), 0, prefetched->size, [prefetched](int64_t result) mutable {
+		std::lock_guard<std::mutex> holder{prefetched->lock};
+		if (result < 0)
+		{
+			prefetched->failed = true;
+			prefetched->size = 0;
+		}
+		else
+			prefetched->size = size_t(result);
+		prefetched->done = true;
+		prefetched->cond.notify_all();
+	});
+
+	return prefetched;
+}
+
+bool PrefetchedFile::wait()
+{
+	std::unique_lock<std::mutex> holder{lock};
+	cond.wait(holder, [this]() { return done; });
+	return !failed;
+}
+
+FileMappingHandle PrefetchedFile::map_subset(uint64_t offset, size_t range)
+{
+	wait();
+	if (offset > size || range > size - offset)
+		return {};
+
+	return Util::make_handle<FileMapping>(
+		reference_from_this(), offset,
+		data.get() + offset, range,
+		0, range);
+}
+
+uint64_t PrefetchedFile::get_size()
+{
+	wait();
+	return size;
+}
+
+FileMappingHandle PrefetchedFile::map_write(size_t)
+{
+	return {};
+}
+
+void PrefetchedFile::unmap(void *, size_t)
+{
+}
+
 FileSlice::FileSlice(FileHandle handle_, uint64_t offset_, uint64_t range_)
 	: handle(std::move(handle_)), offset(offset_), range(range_)
 {
@@ -670,6 +1104,23 @@ FileMappingHandle FileSlice::map_subset(uint64_t offset_, size_t range_)
 	return handle->map_subset(offset + offset_, range_);
 }
 
+void FileSlice::read_async(void *buffer, uint64_t offset_, size_t range_, FileReadCompletion completion)
+{
+	if (offset_ > range)
+	{
+		completion(-1);
+		return;
+	}
+
+	range_ = size_t(std::min<uint64_t>(range_, range - offset_));
+	handle->read_async(buffer, offset + offset_, range_, std::move(completion));
+}
+
+bool FileSlice::has_async_read()
+{
+	return handle->has_async_read();
+}
+
 FileMappingHandle FileSlice::map_write(size_t)
 {
 	return {};
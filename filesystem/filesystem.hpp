@@ -26,6 +26,8 @@
 #include <memory>
 #include <unordered_map>
 #include <functional>
+#include <mutex>
+#include <condition_variable>
 #include <stdio.h>
 #include "global_managers.hpp"
 #include "intrusive.hpp"
@@ -34,6 +36,10 @@ namespace Granite
 {
 class FileMapping;
 
+// Receives the number of bytes read, which is only short of the request at the end of the file,
+// or a negative value on failure.
+using FileReadCompletion = std::function<void (int64_t)>;
+
 class File : public Util::ThreadSafeIntrusivePtrEnabled<File>
 {
 public:
@@ -42,6 +48,13 @@ public:
 	virtual Util::IntrusivePtr<FileMapping> map_write(size_t size) = 0;
 	virtual uint64_t get_size() = 0;
 
+	// Reads range bytes at offset into buffer, which must remain valid until completion is called.
+	// completion is called exactly once, possibly from another thread, and must not block.
+	// The default implementation copies from map_subset() and completes before returning.
+	virtual void read_async(void *buffer, uint64_t offset, size_t range, FileReadCompletion completion);
+	// Whether read_async() does its work in the background, rather than before returning.
+	virtual bool has_async_read();
+
 	// Only called by FileMapping.
 	virtual void unmap(void *mapped, size_t range) = 0;
 
@@ -272,6 +285,8 @@ class FileSlice final : public File
 public:
 	FileSlice(FileHandle handle, uint64_t offset, uint64_t range);
 	FileMappingHandle map_subset(uint64_t offset, size_t range) override;
+	void read_async(void *buffer, uint64_t offset, size_t range, FileReadCompletion completion) override;
+	bool has_async_read() override;
 	FileMappingHandle map_write(size_t) override;
 	void unmap(void *, size_t) override;
 	uint64_t get_size() override;
@@ -282,6 +297,41 @@ private:
 	uint64_t range;
 };
 
+// Contents of a file read into memory with File::read_async().
+// Starting many of these before using any of them lets the reads overlap.
+class PrefetchedFile final : public File
+{
+public:
+	static Util::IntrusivePtr<PrefetchedFile> read(File &file);
+
+	// Blocks until the read has completed. On failure, the file is empty.
+	bool wait();
+
+	// These block until the read has completed.
+	FileMappingHandle map_subset(uint64_t offset, size_t range) override;
+	uint64_t get_size() override;
+
+	FileMappingHandle map_write(size_t) override;
+	void unmap(void *, size_t) override;
+
+private:
+	// Left uninitialized, the read fills it.
+	std::unique_ptr<uint8_t[]> data;
+	size_t size = 0;
+	std::mutex lock;
+	std::condition_variable cond;
+	bool done = false;
+	bool failed = false;
+};
+
+namespace BlobArchive
+{
+struct Header;
+struct Entry;
+struct Chunk;
+}
+
+// Reads BLOBBY01 archives from tools/blobify.py and BLOBBY02 archives from tools/blob_packer.cpp.
 class BlobFilesystem final : public FilesystemBackend
 {
 public:
@@ -319,6 +369,14 @@ private:
 		std::vector<BlobFile> files;
 	};
 	std::unique_ptr<Directory> root;
+
+	// BLOBBY02 is used straight from a mapping of its table of contents.
+	FileMappingHandle toc;
+	const BlobArchive::Header *header = nullptr;
+	const BlobArchive::Entry *blob_entries = nullptr;
+	const BlobArchive::Chunk *blob_chunks = nullptr;
+	const char *blob_strings = nullptr;
+
 	BlobFile *find_file(const std::string &path);
 	Directory *find_directory(const std::string &path);
 	Directory *make_directory(const std::string &path);
@@ -328,6 +386,13 @@ private:
 	static uint64_t read_u64(const uint8_t *&buf, size_t &size);
 	static std::string read_string(const uint8_t *&buf, size_t &size, size_t len);
 	void add_entry(const std::string &path, size_t offset, size_t size);
+
+	void parse_v2();
+	const BlobArchive::Entry *find_entry(const std::string &path) const;
+	std::string get_entry_path(const BlobArchive::Entry &entry) const;
+	FileHandle open_entry(const BlobArchive::Entry &entry);
+	std::vector<ListEntry> list_v2(const std::string &path);
+	bool stat_v2(const std::string &path, FileStat &stat);
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,402 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "async_reader.hpp"
+#include "environment.hpp"
+#include "thread_name.hpp"
+#include "logging.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(__ANDROID__)
+#define GRANITE_ASYNC_READER_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace Granite
+{
+// Enough to keep a disk busy, while not tying up too many threads on page cache hits.
+static constexpr unsigned NumThreadPoolWorkers = 4;
+static constexpr unsigned IOUringEntries = 256;
+
+AsyncReader &AsyncReader::get()
+{
+	static AsyncReader reader(Util::get_environment_bool("GRANITE_IO_URING", true) ? Backend::IOUring : Backend::ThreadPool);
+	return reader;
+}
+
+AsyncReader::AsyncReader(Backend backend_)
+	: backend(backend_)
+{
+	if (backend == Backend::IOUring && !init_io_uring())
+	{
+		LOGI("io_uring is not available, reading files with pread().\n");
+		backend = Backend::ThreadPool;
+	}
+
+	if (backend == Backend::IOUring)
+		threads.emplace_back(&AsyncReader::io_uring_completion_worker, this);
+	else
+		for (unsigned i = 0; i < NumThreadPoolWorkers; i++)
+			threads.emplace_back(&AsyncReader::thread_pool_worker, this);
+}
+
+AsyncReader::~AsyncReader()
+{
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		shutting_down = true;
+		if (backend == Backend::IOUring)
+			submit_nop_locked();
+		else
+			cond.notify_all();
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	deinit_io_uring();
+}
+
+void AsyncReader::complete(Request *req, int64_t result)
+{
+	req->completion(result);
+	delete req;
+}
+
+void AsyncReader::read(FileHandle file, int fd, void *buffer, uint64_t offset, size_t range,
+                       FileReadCompletion completion)
+{
+	if (range == 0)
+	{
+		completion(0);
+		return;
+	}
+
+	auto *req = new Request;
+	req->file = std::move(file);
+	req->fd = fd;
+	req->buffer = static_cast<uint8_t *>(buffer);
+	req->offset = offset;
+	req->range = range;
+	req->completed = 0;
+	req->completion = std::move(completion);
+	req->iov = {};
+
+	std::lock_guard<std::mutex> holder{lock};
+	if (backend == Backend::IOUring)
+	{
+		submit_locked(req);
+	}
+	else
+	{
+		queue.push_back(req);
+		cond.notify_one();
+	}
+}
+
+void AsyncReader::thread_pool_worker()
+{
+	Util::set_current_thread_name("async-reader");
+
+	for (;;)
+	{
+		Request *req;
+		{
+			std::unique_lock<std::mutex> holder{lock};
+			cond.wait(holder, [this]() { return shutting_down || !queue.empty(); });
+			if (queue.empty())
+				return;
+			req = queue.front();
+			queue.pop_front();
+		}
+
+		bool failed = false;
+		while (req->completed < req->range)
+		{
+			ssize_t ret = pread64(req->fd, req->buffer + req->completed, req->range - req->completed,
+			                      off64_t(req->offset + req->completed));
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			if (ret < 0)
+			{
+				LOGE("pread() failed (%s).\n", strerror(errno));
+				failed = true;
+				break;
+			}
+
+			// End of file.
+			if (ret == 0)
+				break;
+
+			req->completed += size_t(ret);
+		}
+
+		complete(req, failed ? -1 : int64_t(req->completed));
+	}
+}
+
+#ifdef GRANITE_ASYNC_READER_IO_URING
+bool AsyncReader::init_io_uring()
+{
+	io_uring_params params = {};
+	ring.fd = int(syscall(__NR_io_uring_setup, IOUringEntries, &params));
+	if (ring.fd < 0)
+		return false;
+
+	ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+		ring.sq_ring_size = ring.cq_ring_size = std::max(ring.sq_ring_size, ring.cq_ring_size);
+
+	void *mapped = mmap(nullptr, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    ring.fd, IORING_OFF_SQ_RING);
+	if (mapped == MAP_FAILED)
+	{
+		deinit_io_uring();
+		return false;
+	}
+	ring.sq_ring = mapped;
+
+	if (single_mmap)
+	{
+		ring.cq_ring = ring.sq_ring;
+	}
+	else
+	{
+		mapped = mmap(nullptr, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		              ring.fd, IORING_OFF_CQ_RING);
+		if (mapped == MAP_FAILED)
+		{
+			deinit_io_uring();
+			return false;
+		}
+		ring.cq_ring = mapped;
+	}
+
+	ring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	mapped = mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	              ring.fd, IORING_OFF_SQES);
+	if (mapped == MAP_FAILED)
+	{
+		deinit_io_uring();
+		return false;
+	}
+	ring.sqes = static_cast<io_uring_sqe *>(mapped);
+
+	auto *sq = static_cast<uint8_t *>(ring.sq_ring);
+	ring.sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	ring.sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	ring.sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	ring.sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	ring.sq_entries = params.sq_entries;
+
+	auto *cq = static_cast<uint8_t *>(ring.cq_ring);
+	ring.cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	ring.cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	ring.cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	ring.cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+	ring.cq_entries = params.cq_entries;
+
+	return true;
+}
+
+void AsyncReader::deinit_io_uring()
+{
+	if (ring.sqes)
+		munmap(ring.sqes, ring.sqes_size);
+	if (ring.cq_ring && ring.cq_ring != ring.sq_ring)
+		munmap(ring.cq_ring, ring.cq_ring_size);
+	if (ring.sq_ring)
+		munmap(ring.sq_ring, ring.sq_ring_size);
+	if (ring.fd >= 0)
+		close(ring.fd);
+	ring = {};
+}
+
+void AsyncReader::io_uring_enter_locked()
+{
+	// Without SQPOLL, the kernel consumes all submitted entries before returning,
+	// so the submission queue is always empty between calls.
+	int ret;
+	do
+	{
+		ret = int(syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, nullptr, 0));
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		LOGE("io_uring_enter() failed (%s).\n", strerror(errno));
+}
+
+void AsyncReader::submit_locked(Request *req)
+{
+	// Leave room for the shutdown NOP, the completion queue must never overflow.
+	// in_flight is bounded by the CQ size (2 * IOUringEntries) rather than the SQ size.
+	// This is only safe because io_uring_enter_locked() makes the kernel consume every
+	// SQE before we write the next one, so at most one SQ slot is ever in use.
+	if (in_flight + 1 >= ring.cq_entries)
+	{
+		queue.push_back(req);
+		return;
+	}
+
+	unsigned tail = *ring.sq_tail;
+	unsigned index = tail & *ring.sq_mask;
+	auto &sqe = ring.sqes[index];
+	memset(&sqe, 0, sizeof(sqe));
+
+	// READV rather than READ, so this works on any kernel which has io_uring.
+	req->iov.iov_base = req->buffer + req->completed;
+	req->iov.iov_len = req->range - req->completed;
+	sqe.opcode = IORING_OP_READV;
+	sqe.fd = req->fd;
+	sqe.addr = uint64_t(reinterpret_cast<uintptr_t>(&req->iov));
+	sqe.len = 1;
+	sqe.off = req->offset + req->completed;
+	sqe.user_data = uint64_t(reinterpret_cast<uintptr_t>(req));
+
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	in_flight++;
+	io_uring_enter_locked();
+}
+
+void AsyncReader::submit_nop_locked()
+{
+	unsigned tail = *ring.sq_tail;
+	unsigned index = tail & *ring.sq_mask;
+	auto &sqe = ring.sqes[index];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_NOP;
+	sqe.user_data = 0;
+
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	in_flight++;
+	io_uring_enter_locked();
+}
+
+void AsyncReader::io_uring_completion_worker()
+{
+	Util::set_current_thread_name("async-reader");
+
+	std::vector<std::pair<Request *, int64_t>> completed;
+
+	for (;;)
+	{
+		int ret = int(syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+		if (ret < 0 && errno != EINTR)
+		{
+			LOGE("io_uring_enter() failed (%s).\n", strerror(errno));
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		bool done;
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			unsigned head = *ring.cq_head;
+			unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+			for (; head != tail; head++)
+			{
+				auto &cqe = ring.cqes[head & *ring.cq_mask];
+				auto *req = reinterpret_cast<Request *>(uintptr_t(cqe.user_data));
+				int res = cqe.res;
+				in_flight--;
+
+				if (!req)
+					continue;
+
+				if (res == -EINTR || res == -EAGAIN)
+				{
+					queue.push_back(req);
+				}
+				else if (res < 0)
+				{
+					LOGE("io_uring read failed (%s).\n", strerror(-res));
+					completed.emplace_back(req, -1);
+				}
+				else
+				{
+					req->completed += size_t(res);
+					// Short reads which did not hit the end of the file continue where they left off.
+					if (res != 0 && req->completed < req->range)
+						queue.push_back(req);
+					else
+						completed.emplace_back(req, int64_t(req->completed));
+				}
+			}
+
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+			while (!queue.empty() && in_flight + 1 < ring.cq_entries)
+			{
+				auto *req = queue.front();
+				queue.pop_front();
+				submit_locked(req);
+			}
+
+			done = shutting_down && in_flight == 0 && queue.empty();
+		}
+
+		for (auto &c : completed)
+			complete(c.first, c.second);
+		completed.clear();
+
+		if (done)
+			break;
+	}
+}
+#else
+bool AsyncReader::init_io_uring()
+{
+	return false;
+}
+
+void AsyncReader::deinit_io_uring()
+{
+}
+
+void AsyncReader::io_uring_enter_locked()
+{
+}
+
+void AsyncReader::submit_locked(Request *)
+{
+}
+
+void AsyncReader::submit_nop_locked()
+{
+}
+
+void AsyncReader::io_uring_completion_worker()
+{
+}
+#endif
+}
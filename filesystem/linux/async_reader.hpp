@@ -0,0 +1,124 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "../filesystem.hpp"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace Granite
+{
+// Backs File::read_async() for MMapFile.
+// Uses io_uring where the kernel allows it, and a small pool of threads doing pread() otherwise.
+class AsyncReader
+{
+public:
+	enum class Backend
+	{
+		IOUring,
+		ThreadPool
+	};
+
+	// Shared by all files. Set GRANITE_IO_URING=0 to force the thread pool.
+	static AsyncReader &get();
+
+	// Falls back to the thread pool if io_uring is not available.
+	explicit AsyncReader(Backend backend);
+	~AsyncReader();
+
+	AsyncReader(const AsyncReader &) = delete;
+	void operator=(const AsyncReader &) = delete;
+
+	// file keeps fd alive until completion.
+	void read(FileHandle file, int fd, void *buffer, uint64_t offset, size_t range, FileReadCompletion completion);
+
+	Backend get_backend() const
+	{
+		return backend;
+	}
+
+private:
+	struct Request
+	{
+		FileHandle file;
+		int fd;
+		uint8_t *buffer;
+		uint64_t offset;
+		size_t range;
+		size_t completed;
+		FileReadCompletion completion;
+		struct iovec iov;
+	};
+
+	Backend backend;
+	std::mutex lock;
+	std::condition_variable cond;
+	std::vector<std::thread> threads;
+	bool shutting_down = false;
+
+	// Thread pool.
+	std::deque<Request *> queue;
+	void thread_pool_worker();
+
+	// io_uring.
+	struct Ring
+	{
+		int fd = -1;
+		void *sq_ring = nullptr;
+		void *cq_ring = nullptr;
+		size_t sq_ring_size = 0;
+		size_t cq_ring_size = 0;
+		io_uring_sqe *sqes = nullptr;
+		size_t sqes_size = 0;
+
+		unsigned *sq_head = nullptr;
+		unsigned *sq_tail = nullptr;
+		unsigned *sq_mask = nullptr;
+		unsigned *sq_array = nullptr;
+		unsigned sq_entries = 0;
+
+		unsigned *cq_head = nullptr;
+		unsigned *cq_tail = nullptr;
+		unsigned *cq_mask = nullptr;
+		io_uring_cqe *cqes = nullptr;
+		unsigned cq_entries = 0;
+	} ring;
+
+	// With io_uring, requests beyond what the completion queue can hold wait in queue.
+	unsigned in_flight = 0;
+	bool init_io_uring();
+	void deinit_io_uring();
+	void submit_locked(Request *req);
+	void submit_nop_locked();
+	void io_uring_enter_locked();
+	void io_uring_completion_worker();
+
+	static void complete(Request *req, int64_t result);
+};
+}
@@ -21,6 +21,7 @@
  */
 
 #include "os_filesystem.hpp"
+#include "async_reader.hpp"
 #include "path_utils.hpp"
 #include "logging.hpp"
 #include <algorithm>
@@ -225,6 +226,23 @@ void MMapFile::unmap(void *mapped, size_t mapped_size)
 	munmap(mapped, mapped_size);
 }
 
+void MMapFile::read_async(void *buffer, uint64_t offset, size_t range, FileReadCompletion completion)
+{
+	if (offset > size)
+	{
+		completion(-1);
+		return;
+	}
+
+	range = size_t(std::min<uint64_t>(range, size - offset));
+	AsyncReader::get().read(reference_from_this(), fd, buffer, offset, range, std::move(completion));
+}
+
+bool MMapFile::has_async_read()
+{
+	return true;
+}
+
 MMapFile::~MMapFile()
 {
 	if (fd >= 0)
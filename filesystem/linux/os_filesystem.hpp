@@ -35,6 +35,8 @@ public:
 	FileMappingHandle map_write(size_t map_size) override;
 	void unmap(void *mapped, size_t size) override;
 	uint64_t get_size() override;
+	void read_async(void *buffer, uint64_t offset, size_t range, FileReadCompletion completion) override;
+	bool has_async_read() override;
 
 private:
 	bool init(const std::string &path, FileMode mode);
@@ -0,0 +1,244 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "aabb_batch.hpp"
+#include "frustum.hpp"
+#include "simd.hpp"
+#include "simd_headers.hpp"
+#include <float.h>
+
+namespace Granite
+{
+#if defined(__SSE3__) || defined(__aarch64__)
+#if defined(__SSE3__)
+struct LanesSSE
+{
+	using V = __m128;
+	enum { Width = 4 };
+
+	static inline V load(const float *p) { return _mm_loadu_ps(p); }
+	static inline void store(float *p, V v) { _mm_storeu_ps(p, v); }
+	static inline V set1(float v) { return _mm_set1_ps(v); }
+	static inline V add(V a, V b) { return _mm_add_ps(a, b); }
+	static inline V sub(V a, V b) { return _mm_sub_ps(a, b); }
+	static inline V mul(V a, V b) { return _mm_mul_ps(a, b); }
+	static inline V div(V a, V b) { return _mm_div_ps(a, b); }
+	static inline V sqrt(V a) { return _mm_sqrt_ps(a); }
+
+	static inline V select_positive(V w, V a, V b)
+	{
+		V mask = _mm_cmpgt_ps(w, _mm_setzero_ps());
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	}
+
+	// Same test as SIMD::frustum_cull(), any sign bit set means culled.
+	static inline V merge_distances(V a, V b) { return _mm_or_ps(a, b); }
+	static inline unsigned visible_mask(V merged) { return ~unsigned(_mm_movemask_ps(merged)) & 0xfu; }
+};
+
+#if defined(__AVX__)
+struct LanesAVX
+{
+	using V = __m256;
+	enum { Width = 8 };
+
+	static inline V load(const float *p) { return _mm256_loadu_ps(p); }
+	static inline void store(float *p, V v) { _mm256_storeu_ps(p, v); }
+	static inline V set1(float v) { return _mm256_set1_ps(v); }
+	static inline V add(V a, V b) { return _mm256_add_ps(a, b); }
+	static inline V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+	static inline V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+	static inline V div(V a, V b) { return _mm256_div_ps(a, b); }
+	static inline V sqrt(V a) { return _mm256_sqrt_ps(a); }
+
+	static inline V select_positive(V w, V a, V b)
+	{
+		return _mm256_blendv_ps(b, a, _mm256_cmp_ps(w, _mm256_setzero_ps(), _CMP_GT_OQ));
+	}
+
+	static inline V merge_distances(V a, V b) { return _mm256_or_ps(a, b); }
+	static inline unsigned visible_mask(V merged) { return ~unsigned(_mm256_movemask_ps(merged)) & 0xffu; }
+};
+using Lanes = LanesAVX;
+#else
+using Lanes = LanesSSE;
+#endif
+#else
+struct LanesNEON
+{
+	using V = float32x4_t;
+	enum { Width = 4 };
+
+	static inline V load(const float *p) { return vld1q_f32(p); }
+	static inline void store(float *p, V v) { vst1q_f32(p, v); }
+	static inline V set1(float v) { return vdupq_n_f32(v); }
+	static inline V add(V a, V b) { return vaddq_f32(a, b); }
+	static inline V sub(V a, V b) { return vsubq_f32(a, b); }
+	static inline V mul(V a, V b) { return vmulq_f32(a, b); }
+	static inline V div(V a, V b) { return vdivq_f32(a, b); }
+	static inline V sqrt(V a) { return vsqrtq_f32(a); }
+
+	static inline V select_positive(V w, V a, V b)
+	{
+		return vbslq_f32(vcgtq_f32(w, vdupq_n_f32(0.0f)), a, b);
+	}
+
+	// Same test as SIMD::frustum_cull(), the smallest plane distance must be >= 0.
+	static inline V merge_distances(V a, V b) { return vminq_f32(a, b); }
+	static inline unsigned visible_mask(V merged)
+	{
+		static const uint32_t bits[4] = { 1, 2, 4, 8 };
+		return vaddvq_u32(vandq_u32(vcgeq_f32(merged, vdupq_n_f32(0.0f)), vld1q_u32(bits)));
+	}
+};
+using Lanes = LanesNEON;
+#endif
+
+// For every 4-bit visibility mask, the set lanes in order, then padding.
+static const uint8_t compact_lanes[16][4] = {
+	{ 0, 0, 0, 0 }, { 0, 0, 0, 0 }, { 1, 0, 0, 0 }, { 0, 1, 0, 0 },
+	{ 2, 0, 0, 0 }, { 0, 2, 0, 0 }, { 1, 2, 0, 0 }, { 0, 1, 2, 0 },
+	{ 3, 0, 0, 0 }, { 0, 3, 0, 0 }, { 1, 3, 0, 0 }, { 0, 1, 3, 0 },
+	{ 2, 3, 0, 0 }, { 0, 2, 3, 0 }, { 1, 2, 3, 0 }, { 0, 1, 2, 3 },
+};
+
+static const uint8_t compact_counts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+template <typename L>
+static inline typename L::V plane_distance(const typename L::V (&plane)[4], const float *const (&major)[3], unsigned base)
+{
+	// Same summation order as the horizontal adds in SIMD::frustum_cull().
+	auto xy = L::add(L::mul(plane[0], L::load(major[0] + base)), L::mul(plane[1], L::load(major[1] + base)));
+	auto zw = L::add(L::mul(plane[2], L::load(major[2] + base)), plane[3]);
+	return L::add(xy, zw);
+}
+
+template <typename L>
+static unsigned cull_lanes(const AABBBatch &batch, const Frustum &frustum,
+                           uint32_t *visible_indices, float *screen_sizes)
+{
+	using V = typename L::V;
+
+	// For each plane, only the AABB corner furthest along the plane normal needs testing.
+	// Which corner that is only depends on the plane, so pick the streams up front.
+	const float *major[6][3];
+	V planes[6][4];
+	for (unsigned p = 0; p < 6; p++)
+	{
+		auto &plane = frustum.get_planes()[p];
+		for (unsigned c = 0; c < 3; c++)
+			major[p][c] = plane[c] > 0.0f ? batch.hi[c] : batch.lo[c];
+		for (unsigned c = 0; c < 4; c++)
+			planes[p][c] = L::set1(plane[c]);
+	}
+
+	V lod_w[4];
+	for (unsigned c = 0; c < 4; c++)
+		lod_w[c] = L::set1(frustum.get_lod_w_plane()[c]);
+	V lod_scale = L::set1(frustum.get_lod_scale());
+	V half = L::set1(0.5f);
+	V no_size = L::set1(FLT_MAX);
+
+	unsigned num_visible = 0;
+	for (unsigned base = 0; base + L::Width <= batch.count; base += L::Width)
+	{
+		V merged = plane_distance<L>(planes[0], major[0], base);
+		merged = L::merge_distances(merged, plane_distance<L>(planes[1], major[1], base));
+		merged = L::merge_distances(merged, plane_distance<L>(planes[2], major[2], base));
+		merged = L::merge_distances(merged, plane_distance<L>(planes[3], major[3], base));
+		merged = L::merge_distances(merged, plane_distance<L>(planes[4], major[4], base));
+		merged = L::merge_distances(merged, plane_distance<L>(planes[5], major[5], base));
+		unsigned mask = L::visible_mask(merged);
+
+		float sizes[L::Width];
+		if (screen_sizes)
+		{
+			V lo_x = L::load(batch.lo[0] + base);
+			V lo_y = L::load(batch.lo[1] + base);
+			V lo_z = L::load(batch.lo[2] + base);
+			V dx = L::sub(L::load(batch.hi[0] + base), lo_x);
+			V dy = L::sub(L::load(batch.hi[1] + base), lo_y);
+			V dz = L::sub(L::load(batch.hi[2] + base), lo_z);
+
+			V cx = L::add(lo_x, L::mul(dx, half));
+			V cy = L::add(lo_y, L::mul(dy, half));
+			V cz = L::add(lo_z, L::mul(dz, half));
+			V w = L::add(L::add(L::mul(lod_w[0], cx), L::mul(lod_w[1], cy)),
+			             L::add(L::mul(lod_w[2], cz), lod_w[3]));
+
+			V radius = L::mul(half, L::sqrt(L::add(L::add(L::mul(dx, dx), L::mul(dy, dy)), L::mul(dz, dz))));
+			V size = L::div(L::mul(radius, lod_scale), w);
+			L::store(sizes, L::select_positive(w, size, no_size));
+		}
+
+		// Visibility is close to random from the branch predictor's point of view, so compact without branching,
+		// four lanes at a time. Writing past the last visible entry is fine, since there is room for count entries.
+		for (unsigned quad = 0; quad < L::Width; quad += 4)
+		{
+			unsigned quad_mask = (mask >> quad) & 0xfu;
+			const uint8_t *lanes = compact_lanes[quad_mask];
+			uint32_t *indices = visible_indices + num_visible;
+			indices[0] = base + quad + lanes[0];
+			indices[1] = base + quad + lanes[1];
+			indices[2] = base + quad + lanes[2];
+			indices[3] = base + quad + lanes[3];
+			if (screen_sizes)
+			{
+				float *out = screen_sizes + num_visible;
+				out[0] = sizes[quad + lanes[0]];
+				out[1] = sizes[quad + lanes[1]];
+				out[2] = sizes[quad + lanes[2]];
+				out[3] = sizes[quad + lanes[3]];
+			}
+			num_visible += compact_counts[quad_mask];
+		}
+	}
+
+	return num_visible;
+}
+#endif
+
+unsigned AABBBatch::cull(const Frustum &frustum, uint32_t *visible_indices, float *screen_sizes) const
+{
+	unsigned num_visible = 0;
+	unsigned i = 0;
+
+#if defined(__SSE3__) || defined(__aarch64__)
+	num_visible = cull_lanes<Lanes>(*this, frustum, visible_indices, screen_sizes);
+	i = count - count % Lanes::Width;
+#endif
+
+	// Tails, and NEON on 32-bit ARM.
+	for (; i < count; i++)
+	{
+		AABB aabb(vec3(lo[0][i], lo[1][i], lo[2][i]), vec3(hi[0][i], hi[1][i], hi[2][i]));
+		if (SIMD::frustum_cull(aabb, frustum.get_planes()))
+		{
+			if (screen_sizes)
+				screen_sizes[num_visible] = frustum.estimate_screen_size(aabb);
+			visible_indices[num_visible++] = i;
+		}
+	}
+
+	return num_visible;
+}
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "aabb.hpp"
+#include <stdint.h>
+
+namespace Granite
+{
+class Frustum;
+
+// Structure-of-arrays batch of world-space AABBs, tested against a frustum in one go.
+// The W component of the AABB corners is assumed to be 1, as it is for any AABB built from vec3 corners.
+struct AABBBatch
+{
+	enum { MaxCount = 64 };
+
+	float lo[3][MaxCount];
+	float hi[3][MaxCount];
+	unsigned count = 0;
+
+	inline void push(const AABB &aabb)
+	{
+		unsigned i = count++;
+		auto &minimum = aabb.get_minimum();
+		auto &maximum = aabb.get_maximum();
+		lo[0][i] = minimum.x;
+		lo[1][i] = minimum.y;
+		lo[2][i] = minimum.z;
+		hi[0][i] = maximum.x;
+		hi[1][i] = maximum.y;
+		hi[2][i] = maximum.z;
+	}
+
+	inline bool full() const
+	{
+		return count == MaxCount;
+	}
+
+	inline void clear()
+	{
+		count = 0;
+	}
+
+	// Writes the indices of all AABBs which pass the frustum test to visible_indices in ascending order
+	// and returns how many there were.
+	// Decisions are identical to SIMD::frustum_cull().
+	// If screen_sizes is not nullptr, screen_sizes[i] receives Frustum::estimate_screen_size()
+	// for the AABB at visible_indices[i].
+	unsigned cull(const Frustum &frustum, uint32_t *visible_indices, float *screen_sizes) const;
+};
+}
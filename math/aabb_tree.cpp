@@ -0,0 +1,415 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "aabb_tree.hpp"
+#include <algorithm>
+
+namespace Granite
+{
+// Loose AABBs grow by this fraction of their size on every side.
+static constexpr float LooseFactor = 0.25f;
+
+static float surface_area(const AABB &aabb)
+{
+	vec3 d = aabb.get_maximum() - aabb.get_minimum();
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static AABB merge(const AABB &a, const AABB &b)
+{
+	return AABB(min(a.get_minimum(), b.get_minimum()), max(a.get_maximum(), b.get_maximum()));
+}
+
+static bool contains(const AABB &outer, const AABB &inner)
+{
+	return all(lessThanEqual(outer.get_minimum(), inner.get_minimum())) &&
+	       all(greaterThanEqual(outer.get_maximum(), inner.get_maximum()));
+}
+
+AABBTree::CullPlanes::CullPlanes(const vec4 *planes)
+{
+	for (unsigned i = 0; i < 8; i++)
+	{
+		vec4 p = i < 6 ? planes[i] : vec4(0.0f, 0.0f, 0.0f, 1.0f);
+		float tolerance = 1e-5f * (muglm::abs(p.w) + 1.0f);
+		x[i] = p.x;
+		y[i] = p.y;
+		z[i] = p.z;
+		w_outside[i] = p.w + tolerance;
+		w_inside[i] = p.w - tolerance;
+	}
+}
+
+AABB AABBTree::make_loose(const AABB &aabb)
+{
+	vec3 lo = aabb.get_minimum();
+	vec3 hi = aabb.get_maximum();
+	// The magnitude dependent part keeps parents strictly larger than their children even after rounding,
+	// so culling a parent never disagrees with culling a child.
+	vec3 margin = (hi - lo) * vec3(LooseFactor) + max(abs(lo), abs(hi)) * vec3(1e-5f) + vec3(1e-5f);
+	return AABB(lo - margin, hi + margin);
+}
+
+uint32_t AABBTree::allocate_node()
+{
+	uint32_t index;
+	if (free_list != InvalidNode)
+	{
+		index = free_list;
+		free_list = cold[index].parent;
+	}
+	else
+	{
+		index = uint32_t(hot.size());
+		hot.emplace_back();
+		cold.emplace_back();
+	}
+
+	hot[index].child0 = InvalidNode;
+	hot[index].child1 = InvalidNode;
+	cold[index].parent = InvalidNode;
+	cold[index].handle = InvalidNode;
+	cold[index].height = 0;
+	return index;
+}
+
+void AABBTree::free_node(uint32_t index)
+{
+	cold[index].parent = free_list;
+	cold[index].height = -1;
+	free_list = index;
+}
+
+uint32_t AABBTree::insert(const AABB &aabb, uint32_t user_data)
+{
+	uint32_t handle;
+	if (!free_handles.empty())
+	{
+		handle = free_handles.back();
+		free_handles.pop_back();
+	}
+	else
+	{
+		handle = uint32_t(leaf_nodes.size());
+		leaf_nodes.push_back(InvalidNode);
+	}
+
+	uint32_t leaf = allocate_node();
+	set_aabb(leaf, make_loose(aabb));
+	hot[leaf].child1 = user_data;
+	cold[leaf].handle = handle;
+	leaf_nodes[handle] = leaf;
+
+	insert_leaf(leaf);
+	leaf_count++;
+	modifications_since_optimize++;
+	return handle;
+}
+
+void AABBTree::remove(uint32_t handle)
+{
+	uint32_t leaf = leaf_nodes[handle];
+	remove_leaf(leaf);
+	free_node(leaf);
+	leaf_nodes[handle] = InvalidNode;
+	free_handles.push_back(handle);
+	leaf_count--;
+	modifications_since_optimize++;
+}
+
+bool AABBTree::update(uint32_t handle, const AABB &aabb)
+{
+	uint32_t leaf = leaf_nodes[handle];
+	AABB current = get_aabb(leaf);
+	AABB loose = make_loose(aabb);
+
+	// Also reinsert if the object shrunk a lot, a stale loose AABB only costs culling efficiency.
+	vec3 extent = current.get_maximum() - current.get_minimum();
+	vec3 loose_extent = loose.get_maximum() - loose.get_minimum();
+	if (contains(current, aabb) && all(lessThanEqual(extent, loose_extent * vec3(4.0f))))
+		return false;
+
+	remove_leaf(leaf);
+	set_aabb(leaf, loose);
+	insert_leaf(leaf);
+	modifications_since_optimize++;
+	return true;
+}
+
+void AABBTree::optimize()
+{
+	// Relayout is linear in the node count, so only do it once a good chunk of the tree has moved around.
+	if (root == InvalidNode || modifications_since_optimize * 8 < leaf_count)
+		return;
+	modifications_since_optimize = 0;
+
+	std::vector<HotNode> new_hot;
+	std::vector<ColdNode> new_cold;
+	size_t node_count = 2 * leaf_count - 1;
+	new_hot.reserve(node_count);
+	new_cold.reserve(node_count);
+
+	// Pre-order, so the first child always directly follows its parent and every subtree is contiguous.
+	struct Entry
+	{
+		uint32_t index;
+		uint32_t new_parent;
+		bool second_child;
+	};
+	std::vector<Entry> stack;
+	stack.push_back({ root, InvalidNode, false });
+
+	while (!stack.empty())
+	{
+		auto entry = stack.back();
+		stack.pop_back();
+
+		auto new_index = uint32_t(new_hot.size());
+		new_hot.push_back(hot[entry.index]);
+		new_cold.push_back(cold[entry.index]);
+		new_cold.back().parent = entry.new_parent;
+
+		if (entry.new_parent != InvalidNode)
+		{
+			if (entry.second_child)
+				new_hot[entry.new_parent].child1 = new_index;
+			else
+				new_hot[entry.new_parent].child0 = new_index;
+		}
+
+		auto &node = hot[entry.index];
+		if (node.is_leaf())
+			leaf_nodes[cold[entry.index].handle] = new_index;
+		else
+		{
+			stack.push_back({ node.child1, new_index, true });
+			stack.push_back({ node.child0, new_index, false });
+		}
+	}
+
+	hot = std::move(new_hot);
+	cold = std::move(new_cold);
+	root = 0;
+	free_list = InvalidNode;
+}
+
+void AABBTree::partition_query(const vec4 *planes, size_t target_count, std::vector<QueryRoot> &roots) const
+{
+	roots.clear();
+	if (root == InvalidNode)
+		return;
+
+	CullPlanes cull_planes(planes);
+	auto result = cull_planes.classify(hot[root]);
+	if (result == Classification::Outside)
+		return;
+	roots.push_back({ root, result == Classification::Inside });
+
+	// Replace each splittable root with its children which survive culling, one level at a time,
+	// so the roots end up as subtrees of similar size.
+	bool did_split = true;
+	while (did_split && roots.size() < target_count)
+	{
+		did_split = false;
+		size_t count = roots.size();
+		for (size_t i = 0; i < count && roots.size() < target_count; i++)
+		{
+			auto &node = hot[roots[i].node];
+			if (roots[i].fully_inside || node.is_leaf())
+				continue;
+
+			did_split = true;
+			roots[i].node = InvalidNode;
+			for (uint32_t child : { node.child0, node.child1 })
+			{
+				result = cull_planes.classify(hot[child]);
+				if (result == Classification::Outside)
+					continue;
+
+				QueryRoot child_root = { child, result == Classification::Inside };
+				if (roots[i].node == InvalidNode)
+					roots[i] = child_root;
+				else
+					roots.push_back(child_root);
+			}
+		}
+
+		roots.erase(std::remove_if(roots.begin(), roots.end(), [](const QueryRoot &r) {
+			return r.node == InvalidNode;
+		}), roots.end());
+	}
+}
+
+void AABBTree::clear()
+{
+	hot.clear();
+	cold.clear();
+	leaf_nodes.clear();
+	free_handles.clear();
+	root = InvalidNode;
+	free_list = InvalidNode;
+	leaf_count = 0;
+	modifications_since_optimize = 0;
+}
+
+void AABBTree::set_child(uint32_t parent, uint32_t from, uint32_t to)
+{
+	if (parent == InvalidNode)
+		root = to;
+	else if (hot[parent].child0 == from)
+		hot[parent].child0 = to;
+	else
+		hot[parent].child1 = to;
+}
+
+void AABBTree::insert_leaf(uint32_t leaf)
+{
+	if (root == InvalidNode)
+	{
+		root = leaf;
+		cold[leaf].parent = InvalidNode;
+		return;
+	}
+
+	// Walk down towards the sibling which minimizes the surface area heuristic.
+	AABB leaf_aabb = get_aabb(leaf);
+	uint32_t index = root;
+	while (!hot[index].is_leaf())
+	{
+		AABB node_aabb = get_aabb(index);
+		float area = surface_area(node_aabb);
+		float combined_area = surface_area(merge(node_aabb, leaf_aabb));
+
+		// Cost of making a new parent for this node and the leaf,
+		// and the cost every level below pays for the leaf being pushed further down.
+		float cost = 2.0f * combined_area;
+		float inheritance_cost = 2.0f * (combined_area - area);
+
+		const auto child_cost = [&](uint32_t child) -> float {
+			AABB child_aabb = get_aabb(child);
+			float merged = surface_area(merge(leaf_aabb, child_aabb));
+			return (hot[child].is_leaf() ? merged : merged - surface_area(child_aabb)) + inheritance_cost;
+		};
+
+		uint32_t child0 = hot[index].child0;
+		uint32_t child1 = hot[index].child1;
+		float cost0 = child_cost(child0);
+		float cost1 = child_cost(child1);
+
+		if (cost < cost0 && cost < cost1)
+			break;
+
+		index = cost0 < cost1 ? child0 : child1;
+	}
+
+	uint32_t sibling = index;
+	uint32_t new_parent = allocate_node();
+	uint32_t old_parent = cold[sibling].parent;
+
+	set_aabb(new_parent, merge(leaf_aabb, get_aabb(sibling)));
+	hot[new_parent].child0 = sibling;
+	hot[new_parent].child1 = leaf;
+	cold[new_parent].parent = old_parent;
+	cold[new_parent].height = cold[sibling].height + 1;
+
+	set_child(old_parent, sibling, new_parent);
+	cold[sibling].parent = new_parent;
+	cold[leaf].parent = new_parent;
+	refit_upwards(new_parent);
+}
+
+void AABBTree::remove_leaf(uint32_t leaf)
+{
+	if (leaf == root)
+	{
+		root = InvalidNode;
+		return;
+	}
+
+	uint32_t parent = cold[leaf].parent;
+	uint32_t grand_parent = cold[parent].parent;
+	uint32_t sibling = hot[parent].child0 == leaf ? hot[parent].child1 : hot[parent].child0;
+
+	set_child(grand_parent, parent, sibling);
+	cold[sibling].parent = grand_parent;
+	free_node(parent);
+	if (grand_parent != InvalidNode)
+		refit_upwards(grand_parent);
+}
+
+void AABBTree::refit_upwards(uint32_t index)
+{
+	while (index != InvalidNode)
+	{
+		index = balance(index);
+		uint32_t child0 = hot[index].child0;
+		uint32_t child1 = hot[index].child1;
+		cold[index].height = 1 + std::max(cold[child0].height, cold[child1].height);
+		set_aabb(index, merge(get_aabb(child0), get_aabb(child1)));
+		index = cold[index].parent;
+	}
+}
+
+// Rotates the taller child up if the subtree at index is imbalanced. Returns the new subtree root.
+uint32_t AABBTree::balance(uint32_t a)
+{
+	if (hot[a].is_leaf() || cold[a].height < 2)
+		return a;
+
+	uint32_t b = hot[a].child0;
+	uint32_t c = hot[a].child1;
+	int imbalance = cold[c].height - cold[b].height;
+
+	// Rotates child up and hands one of its children over to a, keeping the taller one.
+	const auto rotate = [this, a](uint32_t up, uint32_t other, bool up_is_child0) -> uint32_t {
+		uint32_t f = hot[up].child0;
+		uint32_t g = hot[up].child1;
+		uint32_t keep = cold[f].height > cold[g].height ? f : g;
+		uint32_t give = keep == f ? g : f;
+
+		hot[up].child0 = a;
+		hot[up].child1 = keep;
+		cold[up].parent = cold[a].parent;
+		cold[a].parent = up;
+		set_child(cold[up].parent, a, up);
+
+		if (up_is_child0)
+			hot[a].child0 = give;
+		else
+			hot[a].child1 = give;
+		cold[give].parent = a;
+
+		set_aabb(a, merge(get_aabb(other), get_aabb(give)));
+		set_aabb(up, merge(get_aabb(a), get_aabb(keep)));
+		cold[a].height = 1 + std::max(cold[other].height, cold[give].height);
+		cold[up].height = 1 + std::max(cold[a].height, cold[keep].height);
+		return up;
+	};
+
+	if (imbalance > 1)
+		return rotate(c, b, false);
+	else if (imbalance < -1)
+		return rotate(b, c, true);
+	else
+		return a;
+}
+}
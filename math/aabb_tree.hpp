@@ -0,0 +1,320 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "aabb.hpp"
+#include "simd.hpp"
+#include <vector>
+#include <stdint.h>
+
+namespace Granite
+{
+// Dynamic bounding volume hierarchy, kept balanced with tree rotations as leaves come and go.
+// Leaves store a loose AABB which is somewhat larger than what was inserted,
+// so objects which only move a little do not have to be reinserted.
+class AABBTree
+{
+public:
+	enum : uint32_t { InvalidNode = ~0u };
+
+	// Returns a leaf handle which stays valid until the leaf is removed.
+	uint32_t insert(const AABB &aabb, uint32_t user_data);
+	void remove(uint32_t leaf);
+
+	// Returns true if the leaf had to be reinserted.
+	bool update(uint32_t leaf, const AABB &aabb);
+
+	// Lays out nodes in depth-first order once enough of the tree has changed since the last time,
+	// which keeps queries walking forward through memory. Call after a batch of updates.
+	void optimize();
+
+	void clear();
+
+	uint32_t get_user_data(uint32_t leaf) const
+	{
+		return hot[leaf_nodes[leaf]].child1;
+	}
+
+	AABB get_loose_aabb(uint32_t leaf) const
+	{
+		return get_aabb(leaf_nodes[leaf]);
+	}
+
+	size_t get_leaf_count() const
+	{
+		return leaf_count;
+	}
+
+	unsigned get_height() const
+	{
+		return root != InvalidNode ? unsigned(cold[root].height) : 0;
+	}
+
+	// Calls func(user_data, fully_inside) for leaves whose loose AABB may intersect the six frustum planes.
+	// Every AABB which passes SIMD::frustum_cull() and is contained in a leaf's loose AABB gets reported,
+	// so callers test their exact AABB to get the same result as a linear scan.
+	// fully_inside is set when the loose AABB is inside every plane, and the exact test can be skipped.
+	template <typename Func>
+	void query(const vec4 *planes, const Func &func) const
+	{
+		if (root == InvalidNode)
+			return;
+
+		CullPlanes cull_planes(planes);
+		StackAllocation stack(get_height());
+		walk_subtree(cull_planes, root, func, stack.stack);
+	}
+
+	// A subtree which partition_query() left for a later query_roots().
+	struct QueryRoot
+	{
+		uint32_t node;
+		bool fully_inside;
+	};
+
+	// Splits a query into independent subtrees so it can be spread over several threads.
+	// Culls the top of the tree breadth-first until there are at least target_count roots, or nothing left to split.
+	// Calling query_roots() for every root reports the same leaves as query() does.
+	void partition_query(const vec4 *planes, size_t target_count, std::vector<QueryRoot> &roots) const;
+
+	template <typename Func>
+	void query_roots(const vec4 *planes, const QueryRoot *roots, size_t count, const Func &func) const
+	{
+		if (!count)
+			return;
+
+		CullPlanes cull_planes(planes);
+		StackAllocation stack(get_height());
+		for (size_t i = 0; i < count; i++)
+		{
+			if (roots[i].fully_inside)
+				emit_subtree(roots[i].node, func, stack.stack);
+			else
+				walk_subtree(cull_planes, roots[i].node, func, stack.stack);
+		}
+	}
+
+private:
+	enum { MaxLocalStackDepth = 64 };
+
+	// What traversal touches, two nodes per cache line.
+	// Leaves have no child0 and keep their user data in child1.
+	struct HotNode
+	{
+		float lo[3];
+		uint32_t child0;
+		float hi[3];
+		uint32_t child1;
+
+		bool is_leaf() const
+		{
+			return child0 == InvalidNode;
+		}
+	};
+
+	struct ColdNode
+	{
+		// Doubles as the free list link.
+		uint32_t parent;
+		// Leaf handle, or InvalidNode for internal nodes.
+		uint32_t handle;
+		int height;
+	};
+
+	std::vector<HotNode> hot;
+	std::vector<ColdNode> cold;
+	std::vector<uint32_t> leaf_nodes;
+	std::vector<uint32_t> free_handles;
+	uint32_t root = InvalidNode;
+	uint32_t free_list = InvalidNode;
+	size_t leaf_count = 0;
+	size_t modifications_since_optimize = 0;
+
+	uint32_t allocate_node();
+	void free_node(uint32_t index);
+	void insert_leaf(uint32_t index);
+	void remove_leaf(uint32_t index);
+	uint32_t balance(uint32_t index);
+	void refit_upwards(uint32_t index);
+	void set_child(uint32_t parent, uint32_t from, uint32_t to);
+
+	AABB get_aabb(uint32_t index) const
+	{
+		auto &node = hot[index];
+		return AABB(vec3(node.lo[0], node.lo[1], node.lo[2]), vec3(node.hi[0], node.hi[1], node.hi[2]));
+	}
+
+	void set_aabb(uint32_t index, const AABB &aabb)
+	{
+		auto &node = hot[index];
+		for (unsigned i = 0; i < 3; i++)
+		{
+			node.lo[i] = aabb.get_minimum()[i];
+			node.hi[i] = aabb.get_maximum()[i];
+		}
+	}
+
+	static AABB make_loose(const AABB &aabb);
+
+	enum class Classification { Outside, Intersects, Inside };
+
+	// Planes transposed into two groups of four. The two padding planes accept everything.
+	// Plane distances are nudged by a tolerance, loosening the outside test and tightening the inside test,
+	// so that rounding never makes the tree stricter than SIMD::frustum_cull().
+	struct CullPlanes
+	{
+		explicit CullPlanes(const vec4 *planes);
+		alignas(16) float x[8], y[8], z[8], w_outside[8], w_inside[8];
+
+		Classification classify(const HotNode &node) const
+		{
+#if defined(__SSE__)
+			__m128 lo = _mm_loadu_ps(node.lo);
+			__m128 hi = _mm_loadu_ps(node.hi);
+			__m128 lo_x = _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(0, 0, 0, 0));
+			__m128 lo_y = _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(1, 1, 1, 1));
+			__m128 lo_z = _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(2, 2, 2, 2));
+			__m128 hi_x = _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(0, 0, 0, 0));
+			__m128 hi_y = _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(1, 1, 1, 1));
+			__m128 hi_z = _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(2, 2, 2, 2));
+
+			__m128 zero = _mm_setzero_ps();
+			__m128 outside = zero;
+			__m128 inside = zero;
+			for (unsigned i = 0; i < 8; i += 4)
+			{
+				__m128 px = _mm_load_ps(x + i);
+				__m128 py = _mm_load_ps(y + i);
+				__m128 pz = _mm_load_ps(z + i);
+				__m128 mx = _mm_cmpgt_ps(px, zero);
+				__m128 my = _mm_cmpgt_ps(py, zero);
+				__m128 mz = _mm_cmpgt_ps(pz, zero);
+
+				// Corner furthest along the plane normal, and the one furthest against it.
+				__m128 far_dist = _mm_add_ps(
+						_mm_add_ps(_mm_mul_ps(px, _mm_or_ps(_mm_and_ps(mx, hi_x), _mm_andnot_ps(mx, lo_x))),
+						           _mm_mul_ps(py, _mm_or_ps(_mm_and_ps(my, hi_y), _mm_andnot_ps(my, lo_y)))),
+						_mm_add_ps(_mm_mul_ps(pz, _mm_or_ps(_mm_and_ps(mz, hi_z), _mm_andnot_ps(mz, lo_z))),
+						           _mm_load_ps(w_outside + i)));
+				__m128 near_dist = _mm_add_ps(
+						_mm_add_ps(_mm_mul_ps(px, _mm_or_ps(_mm_and_ps(mx, lo_x), _mm_andnot_ps(mx, hi_x))),
+						           _mm_mul_ps(py, _mm_or_ps(_mm_and_ps(my, lo_y), _mm_andnot_ps(my, hi_y)))),
+						_mm_add_ps(_mm_mul_ps(pz, _mm_or_ps(_mm_and_ps(mz, lo_z), _mm_andnot_ps(mz, hi_z))),
+						           _mm_load_ps(w_inside + i)));
+
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(far_dist, zero));
+				inside = _mm_or_ps(inside, _mm_cmple_ps(near_dist, zero));
+			}
+
+			if (_mm_movemask_ps(outside))
+				return Classification::Outside;
+			return _mm_movemask_ps(inside) ? Classification::Intersects : Classification::Inside;
+#else
+			bool inside = true;
+			for (unsigned i = 0; i < 6; i++)
+			{
+				float far_dist = x[i] * (x[i] > 0.0f ? node.hi[0] : node.lo[0]) +
+				                 y[i] * (y[i] > 0.0f ? node.hi[1] : node.lo[1]) +
+				                 z[i] * (z[i] > 0.0f ? node.hi[2] : node.lo[2]) + w_outside[i];
+				if (far_dist < 0.0f)
+					return Classification::Outside;
+
+				float near_dist = x[i] * (x[i] > 0.0f ? node.lo[0] : node.hi[0]) +
+				                  y[i] * (y[i] > 0.0f ? node.lo[1] : node.hi[1]) +
+				                  z[i] * (z[i] > 0.0f ? node.lo[2] : node.hi[2]) + w_inside[i];
+				if (near_dist <= 0.0f)
+					inside = false;
+			}
+			return inside ? Classification::Inside : Classification::Intersects;
+#endif
+		}
+	};
+
+	// A depth-first walk holds at most height + 1 nodes.
+	struct StackAllocation
+	{
+		explicit StackAllocation(unsigned height)
+		{
+			if (height + 1 > MaxLocalStackDepth)
+			{
+				heap_stack.resize(height + 1);
+				stack = heap_stack.data();
+			}
+		}
+
+		uint32_t local_stack[MaxLocalStackDepth];
+		std::vector<uint32_t> heap_stack;
+		uint32_t *stack = local_stack;
+	};
+
+	template <typename Func>
+	void walk_subtree(const CullPlanes &cull_planes, uint32_t index, const Func &func, uint32_t *stack) const
+	{
+		unsigned stack_size = 0;
+		stack[stack_size++] = index;
+
+		while (stack_size)
+		{
+			index = stack[--stack_size];
+			auto &node = hot[index];
+
+			auto result = cull_planes.classify(node);
+			if (result == Classification::Outside)
+				continue;
+
+			if (result == Classification::Inside)
+			{
+				emit_subtree(index, func, stack + stack_size);
+				continue;
+			}
+
+			if (node.is_leaf())
+				func(node.child1, false);
+			else
+			{
+				stack[stack_size++] = node.child1;
+				stack[stack_size++] = node.child0;
+			}
+		}
+	}
+
+	template <typename Func>
+	void emit_subtree(uint32_t index, const Func &func, uint32_t *stack) const
+	{
+		unsigned stack_size = 0;
+		stack[stack_size++] = index;
+
+		while (stack_size)
+		{
+			auto &node = hot[stack[--stack_size]];
+			if (node.is_leaf())
+				func(node.child1, true);
+			else
+			{
+				stack[stack_size++] = node.child1;
+				stack[stack_size++] = node.child0;
+			}
+		}
+	}
+};
+}
@@ -21,6 +21,8 @@
  */
 
 #include "frustum.hpp"
+#include "muglm/matrix_helper.hpp"
+#include <float.h>
 
 namespace Granite
 {
@@ -59,6 +61,12 @@ bool Frustum::intersects_sphere(const AABB &aabb) const
 	return true;
 }
 
+float Frustum::estimate_screen_size(const AABB &aabb) const
+{
+	float w = dot(lod_w_plane, vec4(aabb.get_center(), 1.0f));
+	return w > 0.0f ? aabb.get_radius() * lod_scale / w : FLT_MAX;
+}
+
 vec3 Frustum::get_coord(float dx, float dy, float dz) const
 {
 	vec4 clip = vec4(2.0f * dx - 1.0f, 2.0f * dy - 1.0f, dz, 1.0f);
@@ -142,5 +150,12 @@ void Frustum::build_planes(const mat4 &inv_view_projection_)
 	for (auto &p : planes)
 		if (dot(center, p) < 0.0f)
 			p = -p;
+
+	// A sphere of radius r at clip W spans at most r * |row.xyz| / W in NDC X and Y.
+	mat4 view_projection = inverse(inv_view_projection);
+	vec4 row_x(view_projection[0].x, view_projection[1].x, view_projection[2].x, view_projection[3].x);
+	vec4 row_y(view_projection[0].y, view_projection[1].y, view_projection[2].y, view_projection[3].y);
+	lod_w_plane = vec4(view_projection[0].w, view_projection[1].w, view_projection[2].w, view_projection[3].w);
+	lod_scale = muglm::max(length(row_x.xyz()), length(row_y.xyz()));
 }
 }
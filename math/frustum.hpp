@@ -43,8 +43,25 @@ public:
 		return planes;
 	}
 
+	// Projected radius of the AABB's bounding sphere in NDC units, i.e. 1.0 covers half the viewport.
+	// Meant for LOD selection. AABBs with their center behind the camera get FLT_MAX.
+	float estimate_screen_size(const AABB &aabb) const;
+
+	// Row of the view-projection which computes clip W.
+	const vec4 &get_lod_w_plane() const
+	{
+		return lod_w_plane;
+	}
+
+	float get_lod_scale() const
+	{
+		return lod_scale;
+	}
+
 private:
 	vec4 planes[6];
 	mat4 inv_view_projection;
+	vec4 lod_w_plane;
+	float lod_scale;
 };
 }
\ No newline at end of file
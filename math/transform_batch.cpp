@@ -0,0 +1,227 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "transform_batch.hpp"
+#include "transforms.hpp"
+#include "simd_headers.hpp"
+
+namespace Granite
+{
+static const mat4 identity_transform(1.0f);
+
+static inline const mat4 &get_parent(const mat4 *transforms, uint32_t parent)
+{
+	return parent == TransformBatch::NoParent ? identity_transform : transforms[parent];
+}
+
+#if defined(__SSE3__)
+// The lane operations below must match SIMD::convert_quaternion_with_scale() and SIMD::mul() operation
+// for operation, down to adding zero, otherwise results drift by an ULP or in the sign of zero.
+static inline void load_transposed(__m128 *rows, const mat4 *const *m, unsigned col)
+{
+	rows[0] = _mm_loadu_ps((*m[0])[col].data);
+	rows[1] = _mm_loadu_ps((*m[1])[col].data);
+	rows[2] = _mm_loadu_ps((*m[2])[col].data);
+	rows[3] = _mm_loadu_ps((*m[3])[col].data);
+	_MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+}
+
+static inline void store_transposed(mat4 *const *m, unsigned col, __m128 r0, __m128 r1, __m128 r2, __m128 r3)
+{
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	_mm_storeu_ps((*m[0])[col].data, r0);
+	_mm_storeu_ps((*m[1])[col].data, r1);
+	_mm_storeu_ps((*m[2])[col].data, r2);
+	_mm_storeu_ps((*m[3])[col].data, r3);
+}
+
+struct LanesSSE
+{
+	using V = __m128;
+	enum { Width = 4 };
+
+	static inline V load(const float *p) { return _mm_loadu_ps(p); }
+	static inline V set1(float v) { return _mm_set1_ps(v); }
+	static inline V add(V a, V b) { return _mm_add_ps(a, b); }
+	static inline V sub(V a, V b) { return _mm_sub_ps(a, b); }
+	static inline V mul(V a, V b) { return _mm_mul_ps(a, b); }
+
+	static inline void load_columns(V (&cols)[4][4], const mat4 *const *m)
+	{
+		for (unsigned c = 0; c < 4; c++)
+			load_transposed(cols[c], m, c);
+	}
+
+	static inline void store_columns(mat4 *const *m, const V (&cols)[4][4])
+	{
+		for (unsigned c = 0; c < 4; c++)
+			store_transposed(m, c, cols[c][0], cols[c][1], cols[c][2], cols[c][3]);
+	}
+};
+
+#if defined(__AVX__)
+struct LanesAVX
+{
+	using V = __m256;
+	enum { Width = 8 };
+
+	static inline V load(const float *p) { return _mm256_loadu_ps(p); }
+	static inline V set1(float v) { return _mm256_set1_ps(v); }
+	static inline V add(V a, V b) { return _mm256_add_ps(a, b); }
+	static inline V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+	static inline V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+
+	static inline void load_columns(V (&cols)[4][4], const mat4 *const *m)
+	{
+		for (unsigned c = 0; c < 4; c++)
+		{
+			__m128 lo[4], hi[4];
+			load_transposed(lo, m, c);
+			load_transposed(hi, m + 4, c);
+			for (unsigned r = 0; r < 4; r++)
+				cols[c][r] = _mm256_insertf128_ps(_mm256_castps128_ps256(lo[r]), hi[r], 1);
+		}
+	}
+
+	static inline void store_columns(mat4 *const *m, const V (&cols)[4][4])
+	{
+		for (unsigned c = 0; c < 4; c++)
+		{
+			store_transposed(m, c,
+			                 _mm256_castps256_ps128(cols[c][0]), _mm256_castps256_ps128(cols[c][1]),
+			                 _mm256_castps256_ps128(cols[c][2]), _mm256_castps256_ps128(cols[c][3]));
+			store_transposed(m + 4, c,
+			                 _mm256_extractf128_ps(cols[c][0], 1), _mm256_extractf128_ps(cols[c][1], 1),
+			                 _mm256_extractf128_ps(cols[c][2], 1), _mm256_extractf128_ps(cols[c][3], 1));
+		}
+	}
+};
+using Lanes = LanesAVX;
+#else
+using Lanes = LanesSSE;
+#endif
+
+template <typename L>
+static inline void compose_lanes(const TransformBatch &batch, unsigned base, mat4 *transforms, mat4 *prev_transforms)
+{
+	using V = typename L::V;
+
+	const mat4 *parents[L::Width];
+	mat4 *outputs[L::Width];
+	for (unsigned i = 0; i < L::Width; i++)
+	{
+		parents[i] = &get_parent(transforms, batch.parents[base + i]);
+		outputs[i] = &transforms[batch.outputs[base + i]];
+	}
+
+	V x = L::load(batch.rotation[0] + base);
+	V y = L::load(batch.rotation[1] + base);
+	V z = L::load(batch.rotation[2] + base);
+	V w = L::load(batch.rotation[3] + base);
+
+	V zero = L::set1(0.0f);
+	V one = L::set1(1.0f);
+	V two = L::set1(2.0f);
+	V neg_two = L::set1(-2.0f);
+
+	V xx = L::mul(x, x);
+	V yy = L::mul(y, y);
+	V zz = L::mul(z, z);
+	V ww = L::mul(w, w);
+	V xy = L::mul(x, y);
+	V xz = L::mul(x, z);
+	V yz = L::mul(y, z);
+	V wx = L::mul(w, x);
+	V wy = L::mul(w, y);
+	V wz = L::mul(w, z);
+	V pad = L::add(L::mul(zero, L::sub(ww, ww)), zero);
+
+	V model[4][4];
+	V s = L::load(batch.scale[0] + base);
+	model[0][0] = L::mul(L::add(L::mul(neg_two, L::add(yy, zz)), one), s);
+	model[0][1] = L::mul(L::add(L::mul(two, L::add(xy, wz)), zero), s);
+	model[0][2] = L::mul(L::add(L::mul(two, L::sub(xz, wy)), zero), s);
+	model[0][3] = L::mul(pad, s);
+
+	s = L::load(batch.scale[1] + base);
+	model[1][0] = L::mul(L::add(L::mul(two, L::sub(xy, wz)), zero), s);
+	model[1][1] = L::mul(L::add(L::mul(neg_two, L::add(xx, zz)), one), s);
+	model[1][2] = L::mul(L::add(L::mul(two, L::add(yz, wx)), zero), s);
+	model[1][3] = L::mul(pad, s);
+
+	s = L::load(batch.scale[2] + base);
+	model[2][0] = L::mul(L::add(L::mul(two, L::add(xz, wy)), zero), s);
+	model[2][1] = L::mul(L::add(L::mul(two, L::sub(yz, wx)), zero), s);
+	model[2][2] = L::mul(L::add(L::mul(neg_two, L::add(xx, yy)), one), s);
+	model[2][3] = L::mul(pad, s);
+
+	model[3][0] = L::load(batch.translation[0] + base);
+	model[3][1] = L::load(batch.translation[1] + base);
+	model[3][2] = L::load(batch.translation[2] + base);
+	model[3][3] = one;
+
+	V parent[4][4];
+	L::load_columns(parent, parents);
+
+	V world[4][4];
+	for (unsigned c = 0; c < 4; c++)
+	{
+		for (unsigned r = 0; r < 4; r++)
+		{
+			V v = L::mul(parent[0][r], model[c][0]);
+			v = L::add(v, L::mul(parent[1][r], model[c][1]));
+			v = L::add(v, L::mul(parent[2][r], model[c][2]));
+			v = L::add(v, L::mul(parent[3][r], model[c][3]));
+			world[c][r] = v;
+		}
+	}
+
+	// Copying out the previous transform right before overwriting it avoids a separate pass over memory.
+	if (prev_transforms)
+		for (unsigned i = 0; i < L::Width; i++)
+			prev_transforms[batch.outputs[base + i]] = *outputs[i];
+	L::store_columns(outputs, world);
+}
+#endif
+
+void TransformBatch::compose(mat4 *transforms, mat4 *prev_transforms) const
+{
+	unsigned i = 0;
+#if defined(__SSE3__)
+	for (; i + Lanes::Width <= count; i += Lanes::Width)
+		compose_lanes<Lanes>(*this, i, transforms, prev_transforms);
+#endif
+
+	// Tails, and everything on targets where compute_model_transform() is not built on the SSE3 paths.
+	// Matching the scalar mat3_cast() path lane by lane is at the mercy of FP contraction, so don't try.
+	for (; i < count; i++)
+	{
+		if (prev_transforms)
+			prev_transforms[outputs[i]] = transforms[outputs[i]];
+		compute_model_transform(transforms[outputs[i]],
+		                        vec3(scale[0][i], scale[1][i], scale[2][i]),
+		                        quat(rotation[3][i], rotation[0][i], rotation[1][i], rotation[2][i]),
+		                        vec3(translation[0][i], translation[1][i], translation[2][i]),
+		                        get_parent(transforms, parents[i]));
+	}
+}
+}
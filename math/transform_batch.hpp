@@ -0,0 +1,77 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "math.hpp"
+#include <stdint.h>
+
+namespace Granite
+{
+// Structure-of-arrays batch of local node transforms, composed with their parents' world transforms in one go.
+// Parents and outputs index into the same array of world transforms.
+// No entry may use another entry of the same batch as its parent, so batches are built per hierarchy level.
+struct TransformBatch
+{
+	enum { MaxCount = 64 };
+	static constexpr uint32_t NoParent = UINT32_MAX;
+
+	float translation[3][MaxCount];
+	float rotation[4][MaxCount];
+	float scale[3][MaxCount];
+	uint32_t parents[MaxCount];
+	uint32_t outputs[MaxCount];
+	unsigned count = 0;
+
+	inline void push(const vec3 &s, const quat &r, const vec3 &t, uint32_t parent, uint32_t output)
+	{
+		unsigned i = count++;
+		translation[0][i] = t.x;
+		translation[1][i] = t.y;
+		translation[2][i] = t.z;
+		rotation[0][i] = r.x;
+		rotation[1][i] = r.y;
+		rotation[2][i] = r.z;
+		rotation[3][i] = r.w;
+		scale[0][i] = s.x;
+		scale[1][i] = s.y;
+		scale[2][i] = s.z;
+		parents[i] = parent;
+		outputs[i] = output;
+	}
+
+	inline bool full() const
+	{
+		return count == MaxCount;
+	}
+
+	inline void clear()
+	{
+		count = 0;
+	}
+
+	// Moves transforms[output] to prev_transforms[output] (if not nullptr), then writes
+	// transforms[parent] * T * R * S to transforms[output].
+	// Results are bit-exact with compute_model_transform().
+	void compose(mat4 *transforms, mat4 *prev_transforms) const;
+};
+}
@@ -24,6 +24,8 @@
 
 #include "aabb.hpp"
 #include "intrusive.hpp"
+#include "array_view.hpp"
+#include "asset_manager.hpp"
 
 namespace Granite
 {
@@ -89,6 +91,12 @@ public:
 		return DrawPipeline::Opaque;
 	}
 
+	// Assets read when rendering, e.g. textures. Used to prefetch them before the renderable comes into view.
+	virtual Util::ArrayView<const AssetID> get_asset_dependencies() const
+	{
+		return {};
+	}
+
 	RenderableFlags flags = 0;
 };
 using AbstractRenderableHandle = Util::IntrusivePtr<AbstractRenderable>;
@@ -1036,6 +1036,20 @@ void Parser::parse(const std::string &original_path, const std::string &json)
 					json_lights[index].attached_to_node = true;
 				}
 			}
+
+			if (ext.HasMember("MSFT_lod"))
+			{
+				auto &ids = ext["MSFT_lod"]["ids"];
+				for (auto itr = ids.Begin(); itr != ids.End(); ++itr)
+					node.lod_nodes.push_back(itr->GetUint());
+			}
+		}
+
+		if (!node.lod_nodes.empty() && value.HasMember("extras") && value["extras"].HasMember("MSFT_screencoverage"))
+		{
+			auto &coverage = value["extras"]["MSFT_screencoverage"];
+			for (auto itr = coverage.Begin(); itr != coverage.End(); ++itr)
+				node.lod_screen_sizes.push_back(SceneFormats::lod_coverage_to_screen_size(itr->GetFloat()));
 		}
 
 		if (value.HasMember("skin"))
@@ -424,6 +424,55 @@ bool mesh_optimize_index_buffer(Mesh &mesh, const IndexBufferOptimizeOptions &op
 	return true;
 }
 
+bool mesh_simplify(Mesh &lod, const Mesh &mesh, float target_ratio, float target_error, float &error)
+{
+	auto &layout = mesh.attribute_layout[ecast(MeshAttribute::Position)];
+	if (layout.format != VK_FORMAT_R32G32B32_SFLOAT && layout.format != VK_FORMAT_R32G32B32A32_SFLOAT)
+	{
+		LOGE("Unsupported format for position.\n");
+		return false;
+	}
+
+	lod = mesh;
+	mesh_deduplicate_vertices(lod);
+	if (lod.topology != VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST || lod.count < 3)
+		return false;
+
+	auto *indices = reinterpret_cast<const uint32_t *>(lod.indices.data());
+	auto *positions = reinterpret_cast<const float *>(lod.positions.data() + layout.offset);
+	size_t vertex_count = lod.positions.size() / lod.position_stride;
+
+	size_t target_count = size_t(float(lod.count / 3) * target_ratio) * 3;
+	std::vector<uint32_t> index_buffer(lod.count);
+	float relative_error = 0.0f;
+	// Attribute seams are preserved, since vertices which are split on attributes are locked together.
+	index_buffer.resize(meshopt_simplify(index_buffer.data(), indices, lod.count,
+	                                     positions, vertex_count, lod.position_stride,
+	                                     target_count, target_error, 0, &relative_error));
+
+	if (index_buffer.empty() || index_buffer.size() >= lod.count)
+		return false;
+
+	error = relative_error * meshopt_simplifyScale(positions, vertex_count, lod.position_stride);
+
+	// Unreferenced vertices are dropped by the vertex fetch remap.
+	lod.count = uint32_t(index_buffer.size());
+	lod.indices.resize(index_buffer.size() * sizeof(uint32_t));
+	memcpy(lod.indices.data(), index_buffer.data(), lod.indices.size());
+	return mesh_optimize_index_buffer(lod, { false, false });
+}
+
+// The screen size is the radius of a disc in NDC, and the viewport spans 2x2 NDC units.
+float lod_screen_size_to_coverage(float screen_size)
+{
+	return muglm::min(0.25f * pi<float>() * screen_size * screen_size, 1.0f);
+}
+
+float lod_coverage_to_screen_size(float coverage)
+{
+	return muglm::sqrt(4.0f * coverage / pi<float>());
+}
+
 bool mesh_recompute_tangents(Mesh &mesh)
 {
 	if (mesh.attribute_layout[ecast(MeshAttribute::Tangent)].format != VK_FORMAT_R32G32B32A32_SFLOAT)
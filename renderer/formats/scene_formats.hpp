@@ -141,6 +141,11 @@ struct Node
 	std::vector<uint32_t> children;
 	NodeTransform transform;
 
+	// MSFT_lod. Nodes holding coarser versions of meshes, primitive for primitive, in order of decreasing detail.
+	// lod_screen_sizes holds the smallest Frustum::estimate_screen_size() each level, starting with this node, is used at.
+	std::vector<uint32_t> lod_nodes;
+	std::vector<float> lod_screen_sizes;
+
 	Util::Hash skin = 0;
 	bool has_skin = false;
 	bool joint = false;
@@ -264,6 +269,16 @@ struct IndexBufferOptimizeOptions
 	bool stripify;
 };
 bool mesh_optimize_index_buffer(Mesh &mesh, const IndexBufferOptimizeOptions &options);
+
+// Builds a level of detail for mesh with roughly target_ratio of its triangles,
+// stopping early if the deviation would exceed target_error relative to the mesh extents.
+// On success, error receives the deviation in the mesh's object space.
+bool mesh_simplify(Mesh &lod, const Mesh &mesh, float target_ratio, float target_error, float &error);
+
+// Conversions between Node::lod_screen_sizes and the viewport fractions of MSFT_screencoverage.
+float lod_screen_size_to_coverage(float screen_size);
+float lod_coverage_to_screen_size(float coverage);
+
 std::unordered_set<uint32_t> build_used_nodes_in_scene(const SceneNodes &scene, const std::vector<Node> &nodes);
 }
 }
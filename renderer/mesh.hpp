@@ -178,6 +178,11 @@ struct StaticMesh : AbstractRenderable
 		return material.get_info().pipeline;
 	}
 
+	Util::ArrayView<const AssetID> get_asset_dependencies() const override
+	{
+		return { material.textures, Util::ecast(TextureKind::Count) };
+	}
+
 	void bake();
 
 protected:
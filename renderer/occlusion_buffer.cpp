@@ -0,0 +1,354 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "occlusion_buffer.hpp"
+#include "render_components.hpp"
+#include "simd_headers.hpp"
+#include "muglm/muglm_impl.hpp"
+#include <algorithm>
+#include <math.h>
+
+namespace Granite
+{
+void OcclusionBuffer::init(unsigned width_, unsigned height_)
+{
+	tiles_x = (width_ + TileWidth - 1) / TileWidth;
+	tiles_y = (height_ + TileHeight - 1) / TileHeight;
+	width = tiles_x * TileWidth;
+	height = tiles_y * TileHeight;
+	depth.resize(size_t(tiles_x) * tiles_y * TileSize);
+	tile_max_depth.resize(size_t(tiles_x) * tiles_y);
+	std::fill(depth.begin(), depth.end(), 1.0f);
+	std::fill(tile_max_depth.begin(), tile_max_depth.end(), 1.0f);
+}
+
+void OcclusionBuffer::begin(const mat4 &view_projection_)
+{
+	view_projection = view_projection_;
+	triangles.clear();
+	tested_count.store(0, std::memory_order_relaxed);
+	occluded_count.store(0, std::memory_order_relaxed);
+}
+
+void OcclusionBuffer::add_occluders(const OccluderList &occluders)
+{
+	static const mat4 identity(1.0f);
+	for (auto &info : occluders)
+	{
+		auto &occluder = *info.occluder;
+		add_occluder(info.transform ? info.transform->get_world_transform() : identity,
+		             occluder.positions.data(), occluder.indices.data(), occluder.indices.size());
+	}
+}
+
+void OcclusionBuffer::add_occluder(const mat4 &model, const vec3 *positions, const uint32_t *indices, size_t num_indices)
+{
+	mat4 mvp = view_projection * model;
+	for (size_t i = 0; i + 3 <= num_indices; i += 3)
+	{
+		vec4 clip[3];
+		for (unsigned j = 0; j < 3; j++)
+			clip[j] = mvp * vec4(positions[indices[i + j]], 1.0f);
+		setup_clipped_triangle(clip);
+	}
+}
+
+void OcclusionBuffer::setup_clipped_triangle(const vec4 *clip)
+{
+	bool inside[3];
+	for (unsigned i = 0; i < 3; i++)
+		inside[i] = clip[i].z >= 0.0f;
+
+	if (inside[0] && inside[1] && inside[2])
+	{
+		setup_triangle(clip[0], clip[1], clip[2]);
+		return;
+	}
+
+	// Clip against the near plane. Everything else is handled by the bounding box in screen space.
+	vec4 poly[4];
+	unsigned count = 0;
+	for (unsigned i = 0; i < 3; i++)
+	{
+		unsigned next = (i + 1) % 3;
+		if (inside[i])
+			poly[count++] = clip[i];
+		if (inside[i] != inside[next])
+		{
+			float t = clip[i].z / (clip[i].z - clip[next].z);
+			poly[count++] = mix(clip[i], clip[next], vec4(t));
+		}
+	}
+
+	for (unsigned i = 2; i < count; i++)
+		setup_triangle(poly[0], poly[i - 1], poly[i]);
+}
+
+void OcclusionBuffer::setup_triangle(const vec4 &c0, const vec4 &c1, const vec4 &c2)
+{
+	if (c0.w <= 0.0f || c1.w <= 0.0f || c2.w <= 0.0f)
+		return;
+
+	const auto to_screen = [this](const vec4 &c) -> vec3 {
+		vec3 ndc = c.xyz() / vec3(c.w);
+		return vec3((ndc.x * 0.5f + 0.5f) * float(width), (ndc.y * 0.5f + 0.5f) * float(height), ndc.z);
+	};
+
+	vec3 v[3] = { to_screen(c0), to_screen(c1), to_screen(c2) };
+
+	float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+	if (muglm::abs(area) < 1e-6f)
+		return;
+
+	// Only pixels fully inside the triangle are written.
+	float lo_x = muglm::min(muglm::min(v[0].x, v[1].x), v[2].x);
+	float lo_y = muglm::min(muglm::min(v[0].y, v[1].y), v[2].y);
+	float hi_x = muglm::max(muglm::max(v[0].x, v[1].x), v[2].x);
+	float hi_y = muglm::max(muglm::max(v[0].y, v[1].y), v[2].y);
+
+	Triangle tri;
+	tri.min_x = int(ceilf(muglm::clamp(lo_x, 0.0f, float(width))));
+	tri.min_y = int(ceilf(muglm::clamp(lo_y, 0.0f, float(height))));
+	tri.max_x = int(floorf(muglm::clamp(hi_x, 0.0f, float(width)))) - 1;
+	tri.max_y = int(floorf(muglm::clamp(hi_y, 0.0f, float(height)))) - 1;
+	if (tri.min_x > tri.max_x || tri.min_y > tri.max_y)
+		return;
+
+	float sign = area > 0.0f ? 1.0f : -1.0f;
+	for (unsigned i = 0; i < 3; i++)
+	{
+		auto &p = v[i];
+		auto &q = v[(i + 1) % 3];
+		float a = sign * (p.y - q.y);
+		float b = sign * (q.x - p.x);
+		float c = sign * (p.x * q.y - q.x * p.y);
+
+		// Evaluate at pixel centers, and move the edge inwards by the pixel's extent along the edge normal.
+		tri.a[i] = a;
+		tri.b[i] = b;
+		tri.c[i] = c + 0.5f * (a + b) - 0.5f * (muglm::abs(a) + muglm::abs(b));
+	}
+
+	float z_dx = ((v[1].z - v[0].z) * (v[2].y - v[0].y) - (v[2].z - v[0].z) * (v[1].y - v[0].y)) / area;
+	float z_dy = ((v[2].z - v[0].z) * (v[1].x - v[0].x) - (v[1].z - v[0].z) * (v[2].x - v[0].x)) / area;
+	tri.z_dx = z_dx;
+	tri.z_dy = z_dy;
+	// Furthest depth within the pixel.
+	tri.z_c = v[0].z - z_dx * v[0].x - z_dy * v[0].y +
+	          0.5f * (z_dx + z_dy) + 0.5f * (muglm::abs(z_dx) + muglm::abs(z_dy));
+
+	triangles.push_back(tri);
+}
+
+void OcclusionBuffer::rasterize_triangle(const Triangle &tri, int row_min_y, int row_max_y)
+{
+	int min_y = std::max(tri.min_y, row_min_y);
+	int max_y = std::min(tri.max_y, row_max_y);
+	if (min_y > max_y)
+		return;
+
+	for (int tile_y = min_y / TileHeight; tile_y <= max_y / TileHeight; tile_y++)
+	{
+		int y_begin = std::max(min_y, tile_y * int(TileHeight));
+		int y_end = std::min(max_y, tile_y * int(TileHeight) + int(TileHeight) - 1);
+
+		for (int tile_x = tri.min_x / TileWidth; tile_x <= tri.max_x / TileWidth; tile_x++)
+		{
+			float *tile = depth.data() + (size_t(tile_y) * tiles_x + tile_x) * TileSize;
+			int base_x = tile_x * TileWidth;
+
+			for (int y = y_begin; y <= y_end; y++)
+			{
+				float *row = tile + (y - tile_y * TileHeight) * TileWidth;
+				float fy = float(y);
+
+#if defined(__SSE__)
+				for (int lane = 0; lane < int(TileWidth); lane += 4)
+				{
+					int x = base_x + lane;
+					__m128 fx = _mm_add_ps(_mm_set1_ps(float(x)), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+					__m128 mask = _mm_and_ps(_mm_cmpge_ps(fx, _mm_set1_ps(float(tri.min_x))),
+					                         _mm_cmple_ps(fx, _mm_set1_ps(float(tri.max_x))));
+
+					for (unsigned e = 0; e < 3; e++)
+					{
+						__m128 edge = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.a[e]), fx),
+						                         _mm_set1_ps(tri.b[e] * fy + tri.c[e]));
+						mask = _mm_and_ps(mask, _mm_cmpge_ps(edge, _mm_setzero_ps()));
+					}
+
+					if (_mm_movemask_ps(mask) == 0)
+						continue;
+
+					__m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.z_dx), fx),
+					                      _mm_set1_ps(tri.z_dy * fy + tri.z_c));
+					__m128 old_z = _mm_loadu_ps(row + lane);
+					__m128 new_z = _mm_min_ps(old_z, z);
+					_mm_storeu_ps(row + lane, _mm_or_ps(_mm_and_ps(mask, new_z), _mm_andnot_ps(mask, old_z)));
+				}
+#else
+				for (int lane = 0; lane < int(TileWidth); lane++)
+				{
+					int x = base_x + lane;
+					if (x < tri.min_x || x > tri.max_x)
+						continue;
+
+					float fx = float(x);
+					bool inside = true;
+					for (unsigned e = 0; e < 3; e++)
+						inside = inside && tri.a[e] * fx + (tri.b[e] * fy + tri.c[e]) >= 0.0f;
+
+					if (inside)
+						row[lane] = muglm::min(row[lane], tri.z_dx * fx + (tri.z_dy * fy + tri.z_c));
+				}
+#endif
+			}
+		}
+	}
+}
+
+void OcclusionBuffer::update_tile_max_depth(unsigned tile)
+{
+	const float *d = depth.data() + size_t(tile) * TileSize;
+	float max_depth = d[0];
+	for (unsigned i = 1; i < TileSize; i++)
+		max_depth = muglm::max(max_depth, d[i]);
+	tile_max_depth[tile] = max_depth;
+}
+
+void OcclusionBuffer::rasterize_tile_rows(unsigned first_row, unsigned num_rows)
+{
+	unsigned end_row = std::min(first_row + num_rows, tiles_y);
+	if (first_row >= end_row)
+		return;
+
+	std::fill(depth.begin() + size_t(first_row) * tiles_x * TileSize,
+	          depth.begin() + size_t(end_row) * tiles_x * TileSize, 1.0f);
+
+	int row_min_y = int(first_row * TileHeight);
+	int row_max_y = int(end_row * TileHeight) - 1;
+	for (auto &tri : triangles)
+		rasterize_triangle(tri, row_min_y, row_max_y);
+
+	for (unsigned tile = first_row * tiles_x; tile < end_row * tiles_x; tile++)
+		update_tile_max_depth(tile);
+}
+
+void OcclusionBuffer::rasterize_band(unsigned index, unsigned num_bands)
+{
+	unsigned first_row = (index * tiles_y) / num_bands;
+	unsigned end_row = ((index + 1) * tiles_y) / num_bands;
+	rasterize_tile_rows(first_row, end_row - first_row);
+}
+
+void OcclusionBuffer::rasterize()
+{
+	rasterize_tile_rows(0, tiles_y);
+}
+
+bool OcclusionBuffer::test_aabb(const AABB &aabb) const
+{
+	tested_count.fetch_add(1, std::memory_order_relaxed);
+
+	float lo_x = float(width), lo_y = float(height), hi_x = 0.0f, hi_y = 0.0f;
+	float min_z = 1.0f;
+	for (unsigned i = 0; i < 8; i++)
+	{
+		vec4 clip = view_projection * vec4(aabb.get_corner(i), 1.0f);
+
+		// Crossing the near plane, consider it visible.
+		if (clip.z < 0.0f || clip.w <= 0.0f)
+			return true;
+
+		vec3 ndc = clip.xyz() / vec3(clip.w);
+		float x = (ndc.x * 0.5f + 0.5f) * float(width);
+		float y = (ndc.y * 0.5f + 0.5f) * float(height);
+		lo_x = muglm::min(lo_x, x);
+		lo_y = muglm::min(lo_y, y);
+		hi_x = muglm::max(hi_x, x);
+		hi_y = muglm::max(hi_y, y);
+		min_z = muglm::min(min_z, ndc.z);
+	}
+
+	// Every pixel the AABB touches, even partially.
+	int min_x = int(floorf(muglm::clamp(lo_x, 0.0f, float(width))));
+	int min_y = int(floorf(muglm::clamp(lo_y, 0.0f, float(height))));
+	int max_x = int(ceilf(muglm::clamp(hi_x, 0.0f, float(width)))) - 1;
+	int max_y = int(ceilf(muglm::clamp(hi_y, 0.0f, float(height)))) - 1;
+
+	// Off-screen, leave it to frustum culling.
+	if (min_x > max_x || min_y > max_y)
+		return true;
+
+	for (int tile_y = min_y / TileHeight; tile_y <= max_y / TileHeight; tile_y++)
+	{
+		int y_begin = std::max(min_y, tile_y * int(TileHeight));
+		int y_end = std::min(max_y, tile_y * int(TileHeight) + int(TileHeight) - 1);
+
+		for (int tile_x = min_x / TileWidth; tile_x <= max_x / TileWidth; tile_x++)
+		{
+			unsigned tile_index = unsigned(tile_y) * tiles_x + unsigned(tile_x);
+			// Everything in the tile is in front of the AABB.
+			if (tile_max_depth[tile_index] < min_z)
+				continue;
+
+			const float *tile = depth.data() + size_t(tile_index) * TileSize;
+			int x_begin = std::max(min_x, tile_x * int(TileWidth)) - tile_x * int(TileWidth);
+			int x_end = std::min(max_x, tile_x * int(TileWidth) + int(TileWidth) - 1) - tile_x * int(TileWidth);
+
+			for (int y = y_begin; y <= y_end; y++)
+			{
+				const float *row = tile + (y - tile_y * TileHeight) * TileWidth;
+				for (int x = x_begin; x <= x_end; x++)
+					if (row[x] >= min_z)
+						return true;
+			}
+		}
+	}
+
+	occluded_count.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+void OcclusionBuffer::cull(VisibilityList &list) const
+{
+	auto itr = std::remove_if(list.begin(), list.end(), [this](const RenderableInfo &info) {
+		return info.transform && !test_aabb(info.transform->get_aabb());
+	});
+	list.erase(itr, list.end());
+}
+
+OcclusionBuffer::Statistics OcclusionBuffer::get_statistics() const
+{
+	Statistics stats = {};
+	stats.occluder_triangles = uint32_t(triangles.size());
+	stats.tested = tested_count.load(std::memory_order_relaxed);
+	stats.occluded = occluded_count.load(std::memory_order_relaxed);
+	return stats;
+}
+
+float OcclusionBuffer::get_depth(unsigned x, unsigned y) const
+{
+	unsigned tile = (y / TileHeight) * tiles_x + x / TileWidth;
+	return depth[size_t(tile) * TileSize + (y % TileHeight) * TileWidth + x % TileWidth];
+}
+}
@@ -0,0 +1,124 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "math.hpp"
+#include "aabb.hpp"
+#include "render_queue.hpp"
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+namespace Granite
+{
+// Low resolution depth buffer which occluder meshes are rasterized into on the CPU,
+// so that renderables hidden behind them can be dropped before they reach a RenderQueue.
+// Rasterization is conservative: only pixels fully covered by an occluder triangle are written,
+// with the furthest depth found within the pixel, so nothing visible is ever culled.
+// Depth follows the [0, 1] NDC convention of perspective(), smaller is closer.
+class OcclusionBuffer
+{
+public:
+	enum { TileWidth = 8, TileHeight = 8, TileSize = TileWidth * TileHeight };
+
+	struct Statistics
+	{
+		uint32_t occluder_triangles;
+		uint32_t tested;
+		uint32_t occluded;
+	};
+
+	// Size is rounded up to whole tiles.
+	void init(unsigned width, unsigned height);
+
+	// Clears the buffer and all queued occluders.
+	void begin(const mat4 &view_projection);
+
+	// Transforms and clips triangles against the near plane, and queues them for rasterization.
+	void add_occluder(const mat4 &model, const vec3 *positions, const uint32_t *indices, size_t num_indices);
+	void add_occluders(const OccluderList &occluders);
+
+	// Rasterizes every queued triangle into rows of tiles [first_row, first_row + num_rows).
+	// Disjoint row ranges can be rasterized concurrently.
+	void rasterize_tile_rows(unsigned first_row, unsigned num_rows);
+	// Splits the tile rows evenly into num_bands, rasterizing band index.
+	void rasterize_band(unsigned index, unsigned num_bands);
+	void rasterize();
+
+	// Returns false only if the AABB is certainly hidden behind rasterized occluders.
+	// Thread-safe once rasterization has completed.
+	bool test_aabb(const AABB &aabb) const;
+
+	// Removes occluded renderables from the list, keeping the order of the rest.
+	// Entries without a transform are unbounded and are always kept.
+	void cull(VisibilityList &list) const;
+
+	Statistics get_statistics() const;
+
+	unsigned get_width() const
+	{
+		return width;
+	}
+
+	unsigned get_height() const
+	{
+		return height;
+	}
+
+	unsigned get_tile_rows() const
+	{
+		return tiles_y;
+	}
+
+	// Depth of pixel (x, y), mostly useful for debugging and testing.
+	float get_depth(unsigned x, unsigned y) const;
+
+private:
+	struct Triangle
+	{
+		// Edge functions are a * x + b * y + c, inside when all are >= 0.
+		// c is already biased so that the test passes only for fully covered pixels.
+		float a[3], b[3], c[3];
+		// Depth plane, already biased towards the furthest depth within a pixel.
+		float z_dx, z_dy, z_c;
+		int min_x, min_y, max_x, max_y;
+	};
+
+	std::vector<float> depth;
+	std::vector<float> tile_max_depth;
+	std::vector<Triangle> triangles;
+	mat4 view_projection;
+	unsigned width = 0;
+	unsigned height = 0;
+	unsigned tiles_x = 0;
+	unsigned tiles_y = 0;
+
+	mutable std::atomic<uint32_t> tested_count{0};
+	mutable std::atomic<uint32_t> occluded_count{0};
+
+	void setup_triangle(const vec4 &a, const vec4 &b, const vec4 &c);
+	void setup_clipped_triangle(const vec4 *clip);
+	void rasterize_triangle(const Triangle &tri, int row_min_y, int row_max_y);
+	void update_tile_max_depth(unsigned tile);
+};
+}
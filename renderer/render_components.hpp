@@ -76,6 +76,25 @@ struct RenderableComponent : ComponentBase
 	AbstractRenderableHandle renderable;
 };
 
+// Alternatives for RenderableComponent::renderable, most detailed first.
+// Scene::update_lod_selection() points the RenderableComponent to the level matching the projected size.
+struct LODComponent : ComponentBase
+{
+	GRANITE_COMPONENT_TYPE_DECL(LODComponent)
+
+	struct Level
+	{
+		AbstractRenderableHandle renderable;
+		// Smallest Frustum::estimate_screen_size() the level is used at.
+		float min_screen_size;
+	};
+	std::vector<Level> levels;
+
+	// Relative margin around every threshold which must be crossed before switching, to avoid flickering.
+	float hysteresis = 0.1f;
+	unsigned current_level = 0;
+};
+
 struct CameraComponent : ComponentBase
 {
 	GRANITE_COMPONENT_TYPE_DECL(CameraComponent)
@@ -266,6 +285,16 @@ struct VolumetricDecalComponent : ComponentBase
 	uint32_t timestamp = 0;
 };
 
+// Low-poly stand-in geometry which is rasterized into an OcclusionBuffer to hide renderables behind it.
+// Positions are in the local space of the entity's RenderInfoComponent, and should lie within its AABB.
+// Only opaque, closed or wall-like geometry should be tagged, as the occluder must not be see-through.
+struct OccluderComponent : ComponentBase
+{
+	GRANITE_COMPONENT_TYPE_DECL(OccluderComponent)
+	std::vector<vec3> positions;
+	std::vector<uint32_t> indices;
+};
+
 struct CastsStaticShadowComponent : ComponentBase
 {
 	GRANITE_COMPONENT_TYPE_DECL(CastsStaticShadowComponent)
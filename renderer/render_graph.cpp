@@ -2918,28 +2918,313 @@ bool RenderGraph::depends_on_pass(unsigned dst_pass, unsigned src_pass)
 	return false;
 }
 
-void RenderGraph::bake()
+void RenderGraph::build_swapchain_alias()
 {
+	// Check if the swapchain needs to be blitted to in case the geometry does not match the backbuffer,
+	// or the usage of the image makes that impossible.
+	swapchain_physical_index = resources[resource_to_index[backbuffer_source]]->get_physical_index();
+
+	auto &backbuffer_dim = physical_dimensions[swapchain_physical_index];
+
+	// If resource is touched in async-compute, we cannot alias with swapchain.
+	// If resource is not transient, it's being used in multiple physical passes,
+	// we can't use the implicit subpass dependencies for dealing with swapchain.
+	bool can_alias_backbuffer = (backbuffer_dim.queues & compute_queues) == 0 &&
+	                            (backbuffer_dim.flags & ATTACHMENT_INFO_INTERNAL_TRANSIENT_BIT) != 0;
+
+	// Resources which do not alias with the backbuffer should not be pre-rotated.
+	for (auto &dim : physical_dimensions)
+		if (&dim != &backbuffer_dim)
+			dim.transform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
+
+	LOGI("Backbuffer transform: %u\n", backbuffer_dim.transform);
+	if (Vulkan::surface_transform_swaps_xy(backbuffer_dim.transform))
+		std::swap(backbuffer_dim.width, backbuffer_dim.height);
+
+	backbuffer_dim.flags &= ~(ATTACHMENT_INFO_INTERNAL_TRANSIENT_BIT | ATTACHMENT_INFO_SUPPORTS_PREROTATE_BIT);
+	backbuffer_dim.flags |= swapchain_dimensions.flags & ATTACHMENT_INFO_PERSISTENT_BIT;
+
+	if (!can_alias_backbuffer || backbuffer_dim != swapchain_dimensions)
+	{
+		LOGW("Cannot alias with backbuffer, requires extra blit pass!\n");
+		LOGW("  Backbuffer: %u x %u, fmt: %u, transform: %u\n",
+		     backbuffer_dim.width, backbuffer_dim.height,
+		     backbuffer_dim.format, backbuffer_dim.transform);
+		LOGW("  Swapchain: %u x %u, fmt: %u, transform: %u\n",
+		     swapchain_dimensions.width, swapchain_dimensions.height,
+		     swapchain_dimensions.format, swapchain_dimensions.transform);
+
+		swapchain_physical_index = RenderResource::Unused;
+		backbuffer_dim.queues |= RENDER_GRAPH_QUEUE_GRAPHICS_BIT;
+
+		// We will need to sample from the image to blit to backbuffer.
+		backbuffer_dim.image_usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+
+		// Don't use pre-transform if we can't alias anyways.
+		if (Vulkan::surface_transform_swaps_xy(backbuffer_dim.transform))
+			std::swap(backbuffer_dim.width, backbuffer_dim.height);
+		backbuffer_dim.transform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
+	}
+	else
+		physical_dimensions[swapchain_physical_index].flags |= ATTACHMENT_INFO_INTERNAL_TRANSIENT_BIT;
+}
+
+Util::Hash RenderGraph::hash_graph_description() const
+{
+	Util::Hasher h;
+
+	auto &quirks = Vulkan::ImplementationQuirks::get();
+	h.u32(quirks.merge_subpasses);
+	h.u32(quirks.use_transient_color);
+	h.u32(quirks.use_transient_depth_stencil);
+
+	h.string(backbuffer_source);
+	h.u32(swapchain_dimensions.format);
+
+	// Sizes are left out on purpose, restore_baked_graph() refreshes them.
+	h.u32(uint32_t(resources.size()));
+	for (auto &resource : resources)
+	{
+		h.u32(uint32_t(resource->get_type()));
+		h.string(resource->get_name());
+		h.u32(resource->get_used_queues());
+
+		if (resource->get_type() == RenderResource::Type::Buffer)
+		{
+			auto &buffer = static_cast<const RenderBufferResource &>(*resource);
+			auto &info = buffer.get_buffer_info();
+			h.u64(info.size);
+			h.u32(info.usage);
+			h.u32(info.flags);
+			h.u32(buffer.get_buffer_usage());
+		}
+		else if (resource->get_type() == RenderResource::Type::Texture)
+		{
+			auto &texture = static_cast<const RenderTextureResource &>(*resource);
+			auto &info = texture.get_attachment_info();
+			h.u32(info.size_class);
+			h.string(info.size_relative_name);
+			h.u32(info.format);
+			h.u32(info.samples);
+			h.u32(info.levels);
+			h.u32(info.layers);
+			h.u32(info.aux_usage);
+			h.u32(info.flags);
+			h.u32(texture.get_image_usage());
+			h.u32(texture.get_transient_state());
+		}
+	}
+
+	const auto hash_resource = [&](const RenderResource *resource) {
+		h.u32(resource ? resource->get_index() : RenderResource::Unused);
+	};
+
+	const auto hash_texture_list = [&](const std::vector<RenderTextureResource *> &list) {
+		h.u32(uint32_t(list.size()));
+		for (auto *resource : list)
+			hash_resource(resource);
+	};
+
+	const auto hash_buffer_list = [&](const std::vector<RenderBufferResource *> &list) {
+		h.u32(uint32_t(list.size()));
+		for (auto *resource : list)
+			hash_resource(resource);
+	};
+
+	const auto hash_access = [&](const RenderPass::AccessedResource &access) {
+		h.u64(access.stages);
+		h.u64(access.access);
+		h.u32(access.layout);
+	};
+
+	h.u32(uint32_t(passes.size()));
 	for (auto &pass : passes)
-		pass->setup_dependencies();
+	{
+		h.string(pass->get_name());
+		h.u32(pass->get_queue());
+		h.u32(pass->may_not_need_render_pass());
 
-	// First, validate that the graph is sane.
-	validate_passes();
+		hash_texture_list(pass->get_color_outputs());
+		hash_texture_list(pass->get_resolve_outputs());
+		hash_texture_list(pass->get_color_inputs());
+		hash_texture_list(pass->get_color_scale_inputs());
+		hash_texture_list(pass->get_storage_texture_outputs());
+		hash_texture_list(pass->get_storage_texture_inputs());
+		hash_texture_list(pass->get_blit_texture_outputs());
+		hash_texture_list(pass->get_blit_texture_inputs());
+		hash_texture_list(pass->get_attachment_inputs());
+		hash_texture_list(pass->get_history_inputs());
+		hash_buffer_list(pass->get_storage_outputs());
+		hash_buffer_list(pass->get_storage_inputs());
+		hash_buffer_list(pass->get_transfer_outputs());
+		hash_resource(pass->get_depth_stencil_input());
+		hash_resource(pass->get_depth_stencil_output());
 
-	auto itr = resource_to_index.find(backbuffer_source);
-	if (itr == end(resource_to_index))
-		throw std::logic_error("Backbuffer source does not exist.");
+		h.u32(uint32_t(pass->get_generic_texture_inputs().size()));
+		for (auto &input : pass->get_generic_texture_inputs())
+		{
+			hash_resource(input.texture);
+			hash_access(input);
+		}
 
-	pass_stack.clear();
+		h.u32(uint32_t(pass->get_generic_buffer_inputs().size()));
+		for (auto &input : pass->get_generic_buffer_inputs())
+		{
+			hash_resource(input.buffer);
+			hash_access(input);
+		}
+
+		h.u32(uint32_t(pass->get_proxy_inputs().size()));
+		for (auto &input : pass->get_proxy_inputs())
+		{
+			hash_resource(input.proxy);
+			hash_access(input);
+		}
+
+		h.u32(uint32_t(pass->get_proxy_outputs().size()));
+		for (auto &output : pass->get_proxy_outputs())
+		{
+			hash_resource(output.proxy);
+			hash_access(output);
+		}
+
+		h.u32(uint32_t(pass->get_fake_resource_aliases().size()));
+		for (auto &alias : pass->get_fake_resource_aliases())
+		{
+			hash_resource(alias.first);
+			hash_resource(alias.second);
+		}
+
+		// Whether attachments are cleared or loaded is baked into the render pass.
+		for (unsigned i = 0; i < pass->get_color_outputs().size(); i++)
+			h.u32(pass->get_clear_color(i));
+		h.u32(pass->get_clear_depth_stencil());
+	}
+
+	return h.get();
+}
 
+void RenderGraph::store_baked_graph(Util::Hash hash)
+{
+	// Graphs are typically toggled between a handful of configurations, no need for anything fancier.
+	if (baked_graphs.size() >= 16)
+		baked_graphs.clear();
+
+	auto &baked = baked_graphs[hash];
+	baked.pass_stack = pass_stack;
+	baked.physical_passes = physical_passes;
+	baked.pass_barriers = pass_barriers;
+	baked.physical_dimensions = physical_dimensions;
+	baked.physical_image_has_history = physical_image_has_history;
+
+	baked.physical_image_mipgen.clear();
+	for (auto &dim : physical_dimensions)
+		baked.physical_image_mipgen.push_back(dim.levels > 1 && (dim.flags & ATTACHMENT_INFO_MIPGEN_BIT) != 0);
+
+	baked.resource_physical_indices.clear();
+	for (auto &resource : resources)
+		baked.resource_physical_indices.push_back(resource->get_physical_index());
+
+	baked.color_clear_passes.clear();
+	baked.depth_clear_passes.clear();
+	for (auto &physical_pass : physical_passes)
+	{
+		auto &rp = physical_pass.render_pass_info;
+		std::vector<std::pair<unsigned, unsigned>> color_clears;
+		for (auto &req : physical_pass.color_clear_requests)
+			color_clears.emplace_back(req.pass->get_index(), unsigned(req.target - rp.clear_color));
+		baked.color_clear_passes.push_back(std::move(color_clears));
+
+		auto &depth_req = physical_pass.depth_clear_request;
+		baked.depth_clear_passes.push_back(depth_req.pass ? depth_req.pass->get_index() : RenderPass::Unused);
+	}
+}
+
+bool RenderGraph::restore_baked_graph(const BakedGraph &baked)
+{
+	if (baked.resource_physical_indices.size() != resources.size())
+		return false;
+
+	for (auto &resource : resources)
+		resource->set_physical_index(baked.resource_physical_indices[resource->get_index()]);
+
+	// Sizes are the only thing which may have changed. Every resource sharing a physical resource has the same size.
+	physical_dimensions = baked.physical_dimensions;
+	std::vector<bool> refreshed(physical_dimensions.size());
+	for (auto &resource : resources)
+	{
+		unsigned physical_index = resource->get_physical_index();
+		if (resource->get_type() != RenderResource::Type::Texture ||
+		    physical_index == RenderResource::Unused || refreshed[physical_index])
+		{
+			continue;
+		}
+
+		refreshed[physical_index] = true;
+		auto dim = get_resource_dimensions(static_cast<const RenderTextureResource &>(*resource));
+		auto &physical_dim = physical_dimensions[physical_index];
+		physical_dim.width = dim.width;
+		physical_dim.height = dim.height;
+		physical_dim.depth = dim.depth;
+		physical_dim.levels = dim.levels;
+		physical_dim.transform = dim.transform;
+
+		// Passes writing to mipmapped images cannot be merged, so the pass structure would change.
+		bool mipgen = dim.levels > 1 && (physical_dim.flags & ATTACHMENT_INFO_MIPGEN_BIT) != 0;
+		if (mipgen != baked.physical_image_mipgen[physical_index])
+			return false;
+	}
+
+	pass_stack = baked.pass_stack;
+	pass_barriers = baked.pass_barriers;
+	physical_image_has_history = baked.physical_image_has_history;
+	physical_passes = baked.physical_passes;
+
+	for (auto &pass : passes)
+		pass->set_physical_pass_index(RenderPass::Unused);
+
+	for (auto &physical_pass : physical_passes)
+	{
+		unsigned index = unsigned(&physical_pass - physical_passes.data());
+		for (auto pass : physical_pass.passes)
+			passes[pass]->set_physical_pass_index(index);
+
+		auto &rp = physical_pass.render_pass_info;
+		rp.subpasses = physical_pass.subpasses.data();
+
+		for (auto &req : physical_pass.color_clear_requests)
+		{
+			auto &clear = baked.color_clear_passes[index][&req - physical_pass.color_clear_requests.data()];
+			req.pass = passes[clear.first].get();
+			req.target = &rp.clear_color[clear.second];
+		}
+
+		if (baked.depth_clear_passes[index] != RenderPass::Unused)
+		{
+			physical_pass.depth_clear_request.pass = passes[baked.depth_clear_passes[index]].get();
+			physical_pass.depth_clear_request.target = &rp.clear_depth_stencil;
+		}
+	}
+
+	return true;
+}
+
+void RenderGraph::bake_topology(const RenderResource &backbuffer_resource)
+{
+	// The graph might have been baked before.
+	for (auto &resource : resources)
+		resource->set_physical_index(RenderResource::Unused);
+	for (auto &pass : passes)
+		pass->set_physical_pass_index(RenderPass::Unused);
+	physical_dimensions.clear();
+
+	pass_stack.clear();
 	pass_dependencies.clear();
 	pass_merge_dependencies.clear();
 	pass_dependencies.resize(passes.size());
 	pass_merge_dependencies.resize(passes.size());
 
 	// Work our way back from the backbuffer, and sort out all the dependencies.
-	auto &backbuffer_resource = *resources[itr->second];
-
 	if (backbuffer_resource.get_write_passes().empty())
 		throw std::logic_error("No pass exists which writes to resource.");
 
@@ -2976,54 +3261,38 @@ void RenderGraph::bake()
 
 	// For each render pass in isolation, figure out the barriers required.
 	build_barriers();
+}
 
-	// Check if the swapchain needs to be blitted to in case the geometry does not match the backbuffer,
-	// or the usage of the image makes that impossible.
-	swapchain_physical_index = resources[resource_to_index[backbuffer_source]]->get_physical_index();
-
-	auto &backbuffer_dim = physical_dimensions[swapchain_physical_index];
-
-	// If resource is touched in async-compute, we cannot alias with swapchain.
-	// If resource is not transient, it's being used in multiple physical passes,
-	// we can't use the implicit subpass dependencies for dealing with swapchain.
-	bool can_alias_backbuffer = (backbuffer_dim.queues & compute_queues) == 0 &&
-	                            (backbuffer_dim.flags & ATTACHMENT_INFO_INTERNAL_TRANSIENT_BIT) != 0;
-
-	// Resources which do not alias with the backbuffer should not be pre-rotated.
-	for (auto &dim : physical_dimensions)
-		if (&dim != &backbuffer_dim)
-			dim.transform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
+void RenderGraph::bake()
+{
+	for (auto &pass : passes)
+		pass->setup_dependencies();
 
-	LOGI("Backbuffer transform: %u\n", backbuffer_dim.transform);
-	if (Vulkan::surface_transform_swaps_xy(backbuffer_dim.transform))
-		std::swap(backbuffer_dim.width, backbuffer_dim.height);
+	// First, validate that the graph is sane.
+	validate_passes();
 
-	backbuffer_dim.flags &= ~(ATTACHMENT_INFO_INTERNAL_TRANSIENT_BIT | ATTACHMENT_INFO_SUPPORTS_PREROTATE_BIT);
-	backbuffer_dim.flags |= swapchain_dimensions.flags & ATTACHMENT_INFO_PERSISTENT_BIT;
+	auto itr = resource_to_index.find(backbuffer_source);
+	if (itr == end(resource_to_index))
+		throw std::logic_error("Backbuffer source does not exist.");
 
-	if (!can_alias_backbuffer || backbuffer_dim != swapchain_dimensions)
+	// If we have seen this graph before, only the parts which depend on resource sizes need to be redone.
+	Util::Hash hash = 0;
+	bool restored = false;
+	if (enabled_bake_cache)
 	{
-		LOGW("Cannot alias with backbuffer, requires extra blit pass!\n");
-		LOGW("  Backbuffer: %u x %u, fmt: %u, transform: %u\n",
-		     backbuffer_dim.width, backbuffer_dim.height,
-		     backbuffer_dim.format, backbuffer_dim.transform);
-		LOGW("  Swapchain: %u x %u, fmt: %u, transform: %u\n",
-		     swapchain_dimensions.width, swapchain_dimensions.height,
-		     swapchain_dimensions.format, swapchain_dimensions.transform);
-
-		swapchain_physical_index = RenderResource::Unused;
-		backbuffer_dim.queues |= RENDER_GRAPH_QUEUE_GRAPHICS_BIT;
-
-		// We will need to sample from the image to blit to backbuffer.
-		backbuffer_dim.image_usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+		hash = hash_graph_description();
+		auto baked_itr = baked_graphs.find(hash);
+		restored = baked_itr != end(baked_graphs) && restore_baked_graph(baked_itr->second);
+	}
 
-		// Don't use pre-transform if we can't alias anyways.
-		if (Vulkan::surface_transform_swaps_xy(backbuffer_dim.transform))
-			std::swap(backbuffer_dim.width, backbuffer_dim.height);
-		backbuffer_dim.transform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
+	if (!restored)
+	{
+		bake_topology(*resources[itr->second]);
+		if (enabled_bake_cache)
+			store_baked_graph(hash);
 	}
-	else
-		physical_dimensions[swapchain_physical_index].flags |= ATTACHMENT_INFO_INTERNAL_TRANSIENT_BIT;
+
+	build_swapchain_alias();
 
 	// Based on our render graph, figure out the barriers we actually need.
 	// Some barriers are implicit (transients), and some are redundant, i.e. same texture read in multiple passes.
@@ -3697,6 +3966,13 @@ void RenderGraph::enable_timestamps(bool enable)
 	enabled_timestamps = enable;
 }
 
+void RenderGraph::enable_bake_cache(bool enable)
+{
+	enabled_bake_cache = enable;
+	if (!enable)
+		baked_graphs.clear();
+}
+
 void RenderGraph::add_external_lock_interface(const std::string &name, RenderPassExternalLockInterface *iface)
 {
 	external_lock_interfaces[name] = iface;
@@ -36,6 +36,7 @@
 #include "application_wsi_events.hpp"
 #include "quirks.hpp"
 #include "thread_group.hpp"
+#include "hash.hpp"
 
 namespace Granite
 {
@@ -782,6 +783,11 @@ public:
 
 	void enable_timestamps(bool enable);
 
+	// bake() remembers the result for recently seen graph descriptions, so rebuilding an identical graph,
+	// e.g. after toggling a pass back on, or one which only differs in resource sizes, e.g. after a resize,
+	// skips ordering passes, merging physical passes and deriving barriers.
+	void enable_bake_cache(bool enable);
+
 	void bake();
 	void reset();
 	void log();
@@ -957,6 +963,8 @@ private:
 	void build_physical_barriers();
 	void build_render_pass_info();
 	void build_aliases();
+	void build_swapchain_alias();
+	void bake_topology(const RenderResource &backbuffer_resource);
 
 	bool enabled_timestamps = false;
 
@@ -989,6 +997,29 @@ private:
 	Vulkan::ImageView *swapchain_attachment = nullptr;
 	unsigned swapchain_physical_index = RenderResource::Unused;
 
+	// Everything bake() derives before it considers the swapchain. None of it depends on resource sizes,
+	// except for merging of passes which write to mipmapped attachments.
+	struct BakedGraph
+	{
+		std::vector<unsigned> pass_stack;
+		std::vector<PhysicalPass> physical_passes;
+		std::vector<Barriers> pass_barriers;
+		std::vector<ResourceDimensions> physical_dimensions;
+		std::vector<bool> physical_image_has_history;
+		std::vector<bool> physical_image_mipgen;
+		std::vector<unsigned> resource_physical_indices;
+
+		// Clear requests refer to RenderPass objects, which do not survive reset(), so keep pass indices instead.
+		std::vector<std::vector<std::pair<unsigned, unsigned>>> color_clear_passes;
+		std::vector<unsigned> depth_clear_passes;
+	};
+	std::unordered_map<Util::Hash, BakedGraph> baked_graphs;
+	bool enabled_bake_cache = true;
+
+	Util::Hash hash_graph_description() const;
+	void store_baked_graph(Util::Hash hash);
+	bool restore_baked_graph(const BakedGraph &baked);
+
 	void enqueue_scaled_requests(Vulkan::CommandBuffer &cmd, const std::vector<ScaledClearRequests> &requests);
 	void enqueue_mipmap_requests(Vulkan::CommandBuffer &cmd, const std::vector<MipmapRequests> &requests);
 
@@ -23,8 +23,11 @@
 #define NOMINMAX
 #include "render_queue.hpp"
 #include "render_context.hpp"
+#include "task_composer.hpp"
+#include "metrics.hpp"
 #include <cstring>
 #include <iterator>
+#include <algorithm>
 #include <assert.h>
 
 using namespace Vulkan;
@@ -37,28 +40,239 @@ void RenderQueue::set_device(Vulkan::Device *device)
 	resource_manager = &device->get_resource_manager();
 }
 
+static void record_queue_size(size_t count)
+{
+	// Null if the name was already registered as another metric type.
+	static MetricHistogram *metric = MetricsRegistry::get().histogram("render-queue.size");
+	if (metric && count)
+		metric->record(count);
+}
+
+void RenderQueue::sort_queue(RenderQueueDataVector &queue)
+{
+	record_queue_size(queue.raw_input.size());
+	queue.sorter.resize(queue.raw_input.size());
+	queue.sorted_output.reserve(queue.raw_input.size());
+
+	size_t n = queue.raw_input.size();
+	uint64_t *codes = queue.sorter.code_data();
+
+	for (size_t i = 0; i < n; i++)
+		codes[i] = queue.raw_input[i].sorting_key;
+	queue.sorter.sort();
+
+	const uint32_t *indices = queue.sorter.indices_data();
+	for (size_t i = 0; i < n; i++)
+		queue.sorted_output[i] = queue.raw_input[indices[i]];
+	queue.sorted_count = n;
+}
+
 void RenderQueue::sort()
 {
 	for (auto &queue : queues)
-	{
-		queue.sorter.resize(queue.raw_input.size());
-		queue.sorted_output.reserve(queue.raw_input.size());
+		sort_queue(queue);
+}
 
+void RenderQueue::sort_indices()
+{
+	for (auto &queue : queues)
+	{
 		size_t n = queue.raw_input.size();
+		queue.sorter.resize(n);
 		uint64_t *codes = queue.sorter.code_data();
-		const uint32_t *indices = queue.sorter.indices_data();
-
 		for (size_t i = 0; i < n; i++)
 			codes[i] = queue.raw_input[i].sorting_key;
 		queue.sorter.sort();
-		for (size_t i = 0; i < n; i++)
-			queue.sorted_output[i] = queue.raw_input[indices[i]];
+		queue.sorted_count = 0;
+	}
+}
+
+static void merge_pair(const RenderQueue::MergeItem *a, const RenderQueue::MergeItem *a_end,
+                       const RenderQueue::MergeItem *b, const RenderQueue::MergeItem *b_end,
+                       RenderQueue::MergeItem *output)
+{
+	// Ties take from a, which keeps the merge stable.
+	while (a != a_end && b != b_end)
+	{
+		bool take_b = b->sorting_key < a->sorting_key;
+		*output++ = take_b ? *b : *a;
+		b += take_b;
+		a += !take_b;
+	}
+
+	output = std::copy(a, a_end, output);
+	std::copy(b, b_end, output);
+}
+
+void RenderQueue::merge_runs(const MergeRun *runs, unsigned count, MergeItem *scratch, RenderQueueData *output)
+{
+	if (count == 1)
+	{
+		auto &run = runs[0];
+		for (size_t i = run.begin; i < run.end; i++)
+			*output++ = run.data[run.indices[i]];
+		return;
+	}
+
+	// Merge key and pointer pairs of adjacent runs until one is left, then copy the data out once.
+	size_t offsets[MaxMergeRuns + 1];
+	MergeItem *items = scratch;
+	offsets[0] = 0;
+	for (unsigned i = 0; i < count; i++)
+	{
+		auto &run = runs[i];
+		for (size_t j = run.begin; j < run.end; j++)
+			*items++ = { run.codes[j], &run.data[run.indices[j]] };
+		offsets[i + 1] = offsets[i] + (run.end - run.begin);
+	}
+
+	size_t total = offsets[count];
+	MergeItem *src = scratch;
+	MergeItem *dst = scratch + total;
+
+	while (count > 1)
+	{
+		unsigned merged_count = 0;
+		for (unsigned i = 0; i < count; i += 2)
+		{
+			if (i + 1 < count)
+			{
+				merge_pair(src + offsets[i], src + offsets[i + 1],
+				           src + offsets[i + 1], src + offsets[i + 2],
+				           dst + offsets[i]);
+			}
+			else
+				std::copy(src + offsets[i], src + offsets[i + 1], dst + offsets[i]);
+
+			offsets[merged_count++] = offsets[i];
+		}
+
+		offsets[merged_count] = total;
+		count = merged_count;
+		std::swap(src, dst);
+	}
+
+	// Render callbacks take instanced draws as one contiguous array, so the data is copied out here
+	// rather than dispatching through the pointers. Dispatch would otherwise pay the same scattered reads,
+	// and still has to gather every instanced draw whose instances came from different runs.
+	for (size_t i = 0; i < total; i++)
+		output[i] = *src[i].data;
+}
+
+// Below this, spreading a merge over multiple tasks costs more than it saves.
+static constexpr size_t ParallelMergeThreshold = 32 * 1024;
+
+bool RenderQueue::merge_queue(Queue queue_type, TaskGroup *group, const RenderQueue *inputs, unsigned count,
+                              unsigned num_tasks)
+{
+	assert(count <= MaxMergeRuns);
+	auto &queue = queues[ecast(queue_type)];
+	MergeRun runs[MaxMergeRuns];
+	unsigned num_runs = 0;
+	unsigned largest_run = 0;
+	size_t total = 0;
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		auto &input = inputs[i].queues[ecast(queue_type)];
+		// Assert that we did in fact sort.
+		assert(input.sorter.size() == input.raw_input.size());
+
+		size_t n = input.raw_input.size();
+		if (!n)
+			continue;
+
+		if (!num_runs || n > runs[largest_run].end)
+			largest_run = num_runs;
+		runs[num_runs++] = { input.sorter.sorted_code_data(), input.sorter.indices_data(), input.raw_input.data(), 0, n };
+		total += n;
+	}
+
+	if (group && (num_tasks < 2 || total < ParallelMergeThreshold))
+		return false;
+
+	record_queue_size(total);
+
+	queue.sorted_output.reserve(total);
+	queue.merge_scratch.reserve(2 * total);
+	queue.sorted_count = total;
+
+	if (!group)
+	{
+		merge_runs(runs, num_runs, queue.merge_scratch.data(), queue.sorted_output.data());
+		return true;
+	}
+
+	// Split the output on keys sampled from the largest run. Every run is cut at the same key,
+	// so equal keys always end up in the same slice and the merge stays stable.
+	auto *slice_runs = allocate_many<MergeRun>(num_tasks * num_runs);
+	size_t offset = 0;
+	auto &largest = runs[largest_run];
+
+	for (unsigned slice = 0; slice < num_tasks; slice++)
+	{
+		auto *slice_run = slice_runs + slice * num_runs;
+		size_t slice_count = 0;
+		bool last = slice + 1 == num_tasks;
+		uint64_t split_key = last ? 0 : largest.codes[(largest.end * (slice + 1)) / num_tasks];
+
+		for (unsigned i = 0; i < num_runs; i++)
+		{
+			size_t begin = slice ? slice_runs[(slice - 1) * num_runs + i].end : 0;
+			size_t end = last ? runs[i].end :
+			             size_t(std::lower_bound(runs[i].codes + begin, runs[i].codes + runs[i].end, split_key) - runs[i].codes);
+			slice_run[i] = { runs[i].codes, runs[i].indices, runs[i].data, begin, end };
+			slice_count += end - begin;
+		}
+
+		if (slice_count)
+		{
+			RenderQueueData *output = queue.sorted_output.data() + offset;
+			MergeItem *scratch = queue.merge_scratch.data() + 2 * offset;
+			group->enqueue_task([slice_run, num_runs, scratch, output]() {
+				merge_runs(slice_run, num_runs, scratch, output);
+			});
+		}
+		offset += slice_count;
 	}
+
+	return true;
+}
+
+void RenderQueue::merge(const RenderQueue *inputs, unsigned count)
+{
+	for (unsigned i = 0; i < Util::ecast(Queue::Count); i++)
+		merge_queue(Queue(i), nullptr, inputs, count, 1);
+}
+
+void RenderQueue::merge(TaskComposer &composer, const RenderQueue *inputs, unsigned count, unsigned num_tasks)
+{
+	auto &thread_group = composer.get_thread_group();
+	auto &group = composer.begin_pipeline_stage();
+	group.set_desc("render-queue-merge");
+	group.enqueue_task([this, &thread_group, inputs, count, num_tasks, h = composer.get_deferred_enqueue_handle()]() mutable {
+		bool merged[Util::ecast(Queue::Count)];
+
+		{
+			TaskComposer merge_composer(thread_group);
+			auto &merge_group = merge_composer.begin_pipeline_stage();
+			merge_group.set_desc("render-queue-merge-slices");
+			for (unsigned i = 0; i < Util::ecast(Queue::Count); i++)
+				merged[i] = merge_queue(Queue(i), &merge_group, inputs, count, num_tasks);
+			merge_composer.add_outgoing_dependency(*h);
+		}
+
+		for (unsigned i = 0; i < Util::ecast(Queue::Count); i++)
+			if (!merged[i])
+				merge_queue(Queue(i), nullptr, inputs, count, 1);
+
+		h->flush();
+	});
 }
 
 void RenderQueue::combine_render_info(const RenderQueue &queue)
 {
-	for (unsigned i = 0; i < ecast(Queue::Count); i++)
+	for (unsigned i = 0; i < Util::ecast(Queue::Count); i++)
 	{
 		auto e = static_cast<Queue>(i);
 		auto &q = queue.get_queue_data(e).raw_input;
@@ -70,8 +284,9 @@ void RenderQueue::dispatch_range(Queue queue_type, CommandBuffer &cmd, const Com
 {
 	auto *queue = queues[ecast(queue_type)].sorted_data();
 
-	// Assert that we did in fact sort.
-	assert(queues[ecast(queue_type)].sorter.size() == queues[ecast(queue_type)].raw_input.size());
+	// Assert that we did in fact sort or merge.
+	assert(queues[ecast(queue_type)].sorted_count >= queues[ecast(queue_type)].raw_input.size());
+	assert(end <= queues[ecast(queue_type)].sorted_count);
 
 	while (begin < end)
 	{
@@ -92,12 +307,12 @@ void RenderQueue::dispatch_range(Queue queue_type, CommandBuffer &cmd, const Com
 
 size_t RenderQueue::get_dispatch_size(Queue queue) const
 {
-	return queues[ecast(queue)].size();
+	return queues[ecast(queue)].sorted_size();
 }
 
 void RenderQueue::dispatch(Queue queue, CommandBuffer &cmd, const CommandBufferSavedState *state) const
 {
-	dispatch_range(queue, cmd, state, 0, queues[ecast(queue)].size());
+	dispatch_range(queue, cmd, state, 0, get_dispatch_size(queue));
 }
 
 void RenderQueue::dispatch_subset(Queue queue, Vulkan::CommandBuffer &cmd, const Vulkan::CommandBufferSavedState *state,
@@ -41,6 +41,8 @@ class ResourceManager;
 
 namespace Granite
 {
+class TaskComposer;
+struct TaskGroup;
 class ShaderSuite;
 class RenderContext;
 class AbstractRenderable;
@@ -49,6 +51,7 @@ struct VolumetricDiffuseLightComponent;
 struct VolumetricFogRegionComponent;
 struct VolumetricDecalComponent;
 struct RenderInfoComponent;
+struct OccluderComponent;
 
 struct RenderableInfo
 {
@@ -63,8 +66,16 @@ struct PositionalLightInfo
 	const RenderInfoComponent *transform;
 	Util::Hash transform_hash;
 };
+
+struct OccluderInfo
+{
+	const OccluderComponent *occluder;
+	const RenderInfoComponent *transform;
+};
+
 using VisibilityList = std::vector<RenderableInfo>;
 using PositionalLightList = std::vector<PositionalLightInfo>;
+using OccluderList = std::vector<OccluderInfo>;
 
 struct VolumetricDiffuseLightInfo
 {
@@ -152,7 +163,7 @@ struct QueueDataWrapped : QueueDataWrappedErased
 class RenderQueue
 {
 public:
-	enum { BlockSize = 64 * 1024 };
+	enum { BlockSize = 64 * 1024, MaxMergeRuns = 64 };
 
 	RenderQueue() = default;
 	void operator=(const RenderQueue &) = delete;
@@ -220,14 +231,23 @@ public:
 	void combine_render_info(const RenderQueue &queue);
 	void reset();
 
+	struct MergeItem
+	{
+		uint64_t sorting_key;
+		const RenderQueueData *data;
+	};
+
 	struct RenderQueueDataVector
 	{
 		Util::SmallVector<RenderQueueData, 64> raw_input;
 		Util::DynamicArray<RenderQueueData> sorted_output;
-		Util::RadixSorter<uint64_t, 8, 8, 8, 8, 8, 8, 8, 8> sorter;
+		Util::DynamicArray<MergeItem> merge_scratch;
+		Util::RadixSorter<uint64_t, 11, 11, 11, 11, 10, 10> sorter;
+		size_t sorted_count = 0;
 		inline size_t size() const { return raw_input.size(); }
-		inline void clear() { raw_input.clear(); sorter.resize(0); }
+		inline void clear() { raw_input.clear(); sorter.resize(0); sorted_count = 0; }
 		inline const RenderQueueData *sorted_data() const { return sorted_output.data(); }
+		inline size_t sorted_size() const { return sorted_count; }
 	};
 
 	const RenderQueueDataVector &get_queue_data(Queue queue) const
@@ -236,6 +256,16 @@ public:
 	}
 
 	void sort();
+
+	// Alternative to combine_render_info() and sort() for per-thread queues.
+	// Each input sorts its own keys with sort_indices(), then merge() k-way merges them into this queue's
+	// sorted output, copying every RenderQueueData once. Equal keys keep the order of the inputs,
+	// so the result matches combining in order and sorting. Inputs may include this queue,
+	// and must not be reset before this queue is dispatched.
+	void sort_indices();
+	void merge(const RenderQueue *inputs, unsigned count);
+	// Merges in a new pipeline stage. Large queues are merged with up to num_tasks tasks each.
+	void merge(TaskComposer &composer, const RenderQueue *inputs, unsigned count, unsigned num_tasks);
 	void dispatch(Queue queue, Vulkan::CommandBuffer &cmd, const Vulkan::CommandBufferSavedState *state) const;
 	void dispatch_range(Queue queue, Vulkan::CommandBuffer &cmd, const Vulkan::CommandBufferSavedState *state, size_t begin, size_t end) const;
 	void dispatch_subset(Queue queue, Vulkan::CommandBuffer &cmd, const Vulkan::CommandBufferSavedState *state, unsigned index, unsigned num_indices) const;
@@ -302,6 +332,17 @@ private:
 	static Util::ThreadSafeObjectPool<Block> allocator_pool;
 
 	static void *allocate_from_block(Block &block, size_t size, size_t alignment);
+	static void sort_queue(RenderQueueDataVector &queue);
+
+	struct MergeRun
+	{
+		const uint64_t *codes;
+		const uint32_t *indices;
+		const RenderQueueData *data;
+		size_t begin, end;
+	};
+	static void merge_runs(const MergeRun *runs, unsigned count, MergeItem *scratch, RenderQueueData *output);
+	bool merge_queue(Queue queue, TaskGroup *group, const RenderQueue *inputs, unsigned count, unsigned num_tasks);
 	Block *insert_block();
 	Block *insert_large_block(size_t size, size_t alignment);
 
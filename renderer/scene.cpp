@@ -22,15 +22,21 @@
 
 #include "scene.hpp"
 #include "transforms.hpp"
+#include "transform_batch.hpp"
+#include "aabb_batch.hpp"
 #include "lights/lights.hpp"
 #include "simd.hpp"
 #include "task_composer.hpp"
+#include "asset_manager.hpp"
+#include <algorithm>
 #include <limits>
+#include <string.h>
 
 namespace Granite
 {
 Scene::Scene()
 	: spatials(pool.get_component_group<BoundedComponent, RenderInfoComponent, CachedSpatialTransformTimestampComponent>()),
+	  spatial_entities(pool.get_component_entities<BoundedComponent, RenderInfoComponent, CachedSpatialTransformTimestampComponent>()),
 	  opaque(pool.get_component_group<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, OpaqueComponent>()),
 	  transparent(pool.get_component_group<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, TransparentComponent>()),
 	  positional_lights(pool.get_component_group<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, PositionalLightComponent>()),
@@ -40,6 +46,9 @@ Scene::Scene()
 	  render_pass_shadowing(pool.get_component_group<RenderPassComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, CastsDynamicShadowComponent>()),
 	  backgrounds(pool.get_component_group<UnboundedComponent, RenderableComponent>()),
 	  opaque_floating(pool.get_component_group<OpaqueFloatingComponent, RenderableComponent>()),
+	  occluders(pool.get_component_group<OccluderComponent, RenderInfoComponent>()),
+	  lods(pool.get_component_group<LODComponent, RenderableComponent, RenderInfoComponent>()),
+	  lod_entities(pool.get_component_entities<LODComponent, RenderableComponent, RenderInfoComponent>()),
 	  cameras(pool.get_component_group<CameraComponent, CachedTransformComponent>()),
 	  directional_lights(pool.get_component_group<DirectionalLightComponent, CachedTransformComponent>()),
 	  volumetric_diffuse_lights(pool.get_component_group<VolumetricDiffuseLightComponent, CachedSpatialTransformTimestampComponent, RenderInfoComponent>()),
@@ -52,6 +61,12 @@ Scene::Scene()
 	  render_pass_creators(pool.get_component_group<RenderPassComponent>())
 {
 	pending_hierarchy_level_mask.store(0, std::memory_order_relaxed);
+
+	pool.get_component_group_holder<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, OpaqueComponent>()->set_listener(&opaque_index);
+	pool.get_component_group_holder<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, TransparentComponent>()->set_listener(&transparent_index);
+	pool.get_component_group_holder<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, CastsStaticShadowComponent>()->set_listener(&static_shadowing_index);
+	pool.get_component_group_holder<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, CastsDynamicShadowComponent>()->set_listener(&dynamic_shadowing_index);
+	pool.get_component_group_holder<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, PositionalLightComponent>()->set_listener(&positional_lights_index);
 }
 
 Scene::~Scene()
@@ -65,37 +80,299 @@ Scene::~Scene()
 	destroy_entities(queued_entities);
 }
 
-template <typename T, typename Func>
-static void gather_visible_renderables(const Frustum &frustum, VisibilityList &list, const T &objects,
-                                       size_t begin_index, size_t end_index, const Func &filter_func)
+static bool filter_true(const RenderInfoComponent *, RenderableFlags)
+{
+	return true;
+}
+
+static bool filter_motion_vectors(const RenderInfoComponent *info, RenderableFlags flags)
+{
+	return (flags & RENDERABLE_IMPLICIT_MOTION_BIT) == 0 && info->requires_motion_vectors;
+}
+
+template <typename Func>
+static void gather_visible_renderable(const Frustum &frustum, VisibilityList &list,
+                                      const RenderInfoComponent *transform, const RenderableComponent *renderable,
+                                      const CachedSpatialTransformTimestampComponent *timestamp,
+                                      bool fully_inside, const Func &filter_func)
 {
-	for (size_t i = begin_index; i < end_index; i++)
+	auto flags = renderable->renderable->flags;
+	if (!filter_func(transform, flags))
+		return;
+
+	// The renderable changes with LOD selection.
+	Util::Hasher h;
+	h.u64(timestamp->cookie);
+	h.u32(timestamp->last_timestamp);
+	h.pointer(renderable->renderable.get());
+
+	if (transform->has_scene_node())
 	{
-		auto &o = objects[i];
-		auto *transform = get_component<RenderInfoComponent>(o);
+		if (fully_inside || (flags & RENDERABLE_FORCE_VISIBLE_BIT) != 0 ||
+		    SIMD::frustum_cull(transform->get_aabb(), frustum.get_planes()))
+		{
+			list.push_back({ renderable->renderable.get(), transform, h.get() });
+		}
+	}
+	else
+		list.push_back({ renderable->renderable.get(), nullptr, h.get() });
+}
 
-		auto *renderable = get_component<RenderableComponent>(o);
-		auto flags = renderable->renderable->flags;
-		if (!filter_func(transform, flags))
-			continue;
+// Collects the members of a spatial index query which still need an exact frustum test,
+// and tests them AABBBatch::MaxCount at a time. emit(entity) is called for every member which passes.
+struct BatchedFrustumCull
+{
+	AABBBatch batch;
+	Entity *entities[AABBBatch::MaxCount];
+
+	template <typename Emit>
+	void test(const Frustum &frustum, Entity &entity, const AABB &aabb, const Emit &emit)
+	{
+		entities[batch.count] = &entity;
+		batch.push(aabb);
+		if (batch.full())
+			flush(frustum, emit);
+	}
+
+	template <typename Emit>
+	void flush(const Frustum &frustum, const Emit &emit)
+	{
+		uint32_t visible[AABBBatch::MaxCount];
+		unsigned num_visible = batch.count ? batch.cull(frustum, visible, nullptr) : 0;
+		for (unsigned i = 0; i < num_visible; i++)
+			emit(*entities[visible[i]]);
+		batch.clear();
+	}
+};
+
+// Queries the whole index, or only one part of it if partition is not nullptr.
+template <typename Func>
+static void query_index(const SceneSpatialIndex &index, const Frustum &frustum,
+                        const SceneQueryPartition *partition, unsigned part, const Func &func)
+{
+	if (partition)
+		index.query_part(frustum, *partition, part, func);
+	else
+		index.query(frustum, func);
+}
 
-		auto *timestamp = get_component<CachedSpatialTransformTimestampComponent>(o);
+template <typename Func>
+static void gather_visible_renderables(const Frustum &frustum, VisibilityList &list,
+                                       const SceneSpatialIndex &index, const SceneQueryPartition *partition,
+                                       unsigned part, const Func &filter_func)
+{
+	BatchedFrustumCull cull;
+	auto emit = [&](Entity &entity) {
+		auto *transform = entity.get_component<RenderInfoComponent>();
+		auto *timestamp = entity.get_component<CachedSpatialTransformTimestampComponent>();
+		auto *renderable = entity.get_component<RenderableComponent>()->renderable.get();
 
+		// The renderable changes with LOD selection.
 		Util::Hasher h;
 		h.u64(timestamp->cookie);
 		h.u32(timestamp->last_timestamp);
+		h.pointer(renderable);
+		list.push_back({ renderable, transform->has_scene_node() ? transform : nullptr, h.get() });
+	};
+
+	query_index(index, frustum, partition, part, [&](Entity &entity, bool fully_inside) {
+		auto *transform = entity.get_component<RenderInfoComponent>();
+		auto flags = entity.get_component<RenderableComponent>()->renderable->flags;
+		if (!filter_func(transform, flags))
+			return;
+
+		if (fully_inside || !transform->has_scene_node() || (flags & RENDERABLE_FORCE_VISIBLE_BIT) != 0)
+			emit(entity);
+		else
+			cull.test(frustum, entity, transform->get_aabb(), emit);
+	});
+	cull.flush(frustum, emit);
+}
+
+bool SceneSpatialIndex::can_index(Entity &entity)
+{
+	auto *transform = entity.get_component<RenderInfoComponent>();
+	auto *renderable = entity.get_component<RenderableComponent>();
+	auto *timestamp = entity.get_component<CachedSpatialTransformTimestampComponent>();
+
+	// Until the cached AABB has been computed, members are culled like before.
+	return transform->has_scene_node() &&
+	       (renderable->renderable->flags & RENDERABLE_FORCE_VISIBLE_BIT) == 0 &&
+	       timestamp->current_timestamp &&
+	       timestamp->last_timestamp == *timestamp->current_timestamp;
+}
+
+void SceneSpatialIndex::on_entity_added(Entity &entity)
+{
+	uint32_t slot = entity.get_slot();
+	if (slot >= proxies.size())
+		proxies.resize(slot + 1);
+
+	auto &proxy = proxies[slot];
+	proxy.entity = &entity;
+	proxy.leaf = AABBTree::InvalidNode;
+	proxy.unindexed_offset = uint32_t(unindexed.size());
+	unindexed.push_back(&entity);
+	pending_changes.push_back(slot);
+}
+
+void SceneSpatialIndex::on_entity_removed(const Entity &entity)
+{
+	auto &proxy = proxies[entity.get_slot()];
+	if (proxy.leaf != AABBTree::InvalidNode)
+		tree.remove(proxy.leaf);
+	else
+		remove_unindexed(proxy);
+	proxy = {};
+	pending_changes.push_back(entity.get_slot());
+}
+
+void SceneSpatialIndex::on_reset()
+{
+	tree.clear();
+	proxies.clear();
+	unindexed.clear();
+	pending_changes.clear();
+	changes.clear();
+	// Skip a generation, so every retained list does a full gather.
+	generation += 2;
+}
+
+void SceneSpatialIndex::remove_unindexed(Proxy &proxy)
+{
+	uint32_t offset = proxy.unindexed_offset;
+	unindexed[offset] = unindexed.back();
+	proxies[unindexed[offset]->get_slot()].unindexed_offset = offset;
+	unindexed.pop_back();
+	proxy.unindexed_offset = AABBTree::InvalidNode;
+}
+
+void SceneSpatialIndex::refit(const uint32_t *slots, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		uint32_t slot = slots[i];
+		if (slot >= proxies.size() || !proxies[slot].entity)
+			continue;
+
+		auto &proxy = proxies[slot];
+		if (proxy.leaf != AABBTree::InvalidNode)
+			tree.update(proxy.leaf, proxy.entity->get_component<RenderInfoComponent>()->get_aabb());
+		pending_changes.push_back(slot);
+	}
+}
+
+void SceneSpatialIndex::touch(const uint32_t *slots, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		if (slots[i] < proxies.size() && proxies[slots[i]].entity)
+			pending_changes.push_back(slots[i]);
+}
 
-		if (transform->has_scene_node())
+void SceneSpatialIndex::index_pending()
+{
+	for (size_t i = unindexed.size(); i; i--)
+	{
+		auto &entity = *unindexed[i - 1];
+		if (can_index(entity))
 		{
-			if ((flags & RENDERABLE_FORCE_VISIBLE_BIT) != 0 ||
-			    SIMD::frustum_cull(transform->get_aabb(), frustum.get_planes()))
-			{
-				list.push_back({ renderable->renderable.get(), transform, h.get() });
-			}
+			auto &proxy = proxies[entity.get_slot()];
+			remove_unindexed(proxy);
+			proxy.leaf = tree.insert(entity.get_component<RenderInfoComponent>()->get_aabb(), entity.get_slot());
 		}
-		else
-			list.push_back({ renderable->renderable.get(), nullptr, h.get() });
 	}
+
+	tree.optimize();
+
+	// The last published list stays valid until something new is published.
+	if (!pending_changes.empty())
+	{
+		changes.clear();
+		std::swap(changes, pending_changes);
+		generation++;
+	}
+}
+
+void SceneSpatialIndex::append_retained(Entity &entity, const Frustum &frustum, bool fully_inside,
+                                        RetainedVisibilityList &retained)
+{
+	size_t offset = retained.list.size();
+	gather_visible_renderable(frustum, retained.list,
+	                          entity.get_component<RenderInfoComponent>(),
+	                          entity.get_component<RenderableComponent>(),
+	                          entity.get_component<CachedSpatialTransformTimestampComponent>(),
+	                          fully_inside, filter_true);
+
+	if (retained.list.size() == offset)
+		return;
+
+	uint32_t slot = entity.get_slot();
+	if (slot >= retained.offsets.size())
+		retained.offsets.resize(slot + 1, AABBTree::InvalidNode);
+	retained.offsets[slot] = uint32_t(offset);
+	retained.slots.push_back(slot);
+	retained.transform_hash ^= retained.list.back().transform_hash;
+}
+
+void SceneSpatialIndex::retest_retained(uint32_t slot, const Frustum &frustum, RetainedVisibilityList &retained) const
+{
+	if (slot < retained.offsets.size() && retained.offsets[slot] != AABBTree::InvalidNode)
+	{
+		uint32_t offset = retained.offsets[slot];
+		retained.transform_hash ^= retained.list[offset].transform_hash;
+		retained.list[offset] = retained.list.back();
+		retained.slots[offset] = retained.slots.back();
+		retained.offsets[retained.slots[offset]] = offset;
+		retained.list.pop_back();
+		retained.slots.pop_back();
+		retained.offsets[slot] = AABBTree::InvalidNode;
+	}
+
+	if (slot < proxies.size() && proxies[slot].entity)
+		append_retained(*proxies[slot].entity, frustum, false, retained);
+}
+
+void SceneSpatialIndex::partition_query(const Frustum &frustum, unsigned num_parts,
+                                        SceneQueryPartition &partition) const
+{
+	// A few subtrees per part, since culling makes the visible work per subtree uneven.
+	partition.num_parts = num_parts;
+	tree.partition_query(frustum.get_planes(), 4 * num_parts, partition.roots);
+}
+
+bool SceneSpatialIndex::update_retained(const Frustum &frustum, RetainedVisibilityList &retained) const
+{
+	bool same_frustum = retained.index == this &&
+	                    memcmp(retained.planes, frustum.get_planes(), sizeof(retained.planes)) == 0;
+	bool first = retained.index == nullptr;
+	Util::Hash old_hash = retained.transform_hash;
+	size_t old_size = retained.list.size();
+
+	if (same_frustum && retained.generation + 1 == generation)
+	{
+		for (auto slot : changes)
+			retest_retained(slot, frustum, retained);
+	}
+	else if (!same_frustum || retained.generation != generation)
+	{
+		retained.list.clear();
+		retained.slots.clear();
+		retained.offsets.clear();
+		retained.transform_hash = 0;
+		query(frustum, [&](Entity &entity, bool fully_inside) {
+			append_retained(entity, frustum, fully_inside, retained);
+		});
+	}
+
+	// Structural changes made after the last index_pending() are not published yet. Re-testing is idempotent,
+	// so they are applied now, and again once published.
+	for (auto slot : pending_changes)
+		retest_retained(slot, frustum, retained);
+
+	retained.index = this;
+	retained.generation = generation;
+	memcpy(retained.planes, frustum.get_planes(), sizeof(retained.planes));
+	return first || retained.transform_hash != old_hash || retained.list.size() != old_size;
 }
 
 void Scene::add_render_passes(RenderGraph &graph)
@@ -228,6 +505,19 @@ void Scene::gather_opaque_floating_renderables(VisibilityList &list) const
 		list.push_back({ get_component<RenderableComponent>(background)->renderable.get(), nullptr });
 }
 
+void Scene::gather_visible_occluders(const Frustum &frustum, OccluderList &list) const
+{
+	for (auto &o : occluders)
+	{
+		auto *occluder = get_component<OccluderComponent>(o);
+		auto *transform = get_component<RenderInfoComponent>(o);
+		if (!transform->has_scene_node())
+			list.push_back({ occluder, nullptr });
+		else if (SIMD::frustum_cull(transform->get_aabb(), frustum.get_planes()))
+			list.push_back({ occluder, transform });
+	}
+}
+
 void Scene::gather_visible_render_pass_sinks(const vec3 &camera_pos, VisibilityList &list) const
 {
 	for (auto &sink : render_pass_sinks)
@@ -238,150 +528,196 @@ void Scene::gather_visible_render_pass_sinks(const vec3 &camera_pos, VisibilityL
 	}
 }
 
-static bool filter_true(const RenderInfoComponent *, RenderableFlags)
-{
-	return true;
-}
 
 void Scene::gather_visible_opaque_renderables(const Frustum &frustum, VisibilityList &list) const
 {
-	gather_visible_renderables(frustum, list, opaque, 0, opaque.size(), filter_true);
+	gather_visible_renderables(frustum, list, opaque_index, nullptr, 0, filter_true);
 }
 
 void Scene::gather_visible_motion_vector_renderables(const Frustum &frustum, VisibilityList &list) const
 {
-	gather_visible_renderables(frustum, list, opaque, 0, opaque.size(),
-	                           [](const RenderInfoComponent *info, RenderableFlags flags) {
-		                           return (flags & RENDERABLE_IMPLICIT_MOTION_BIT) == 0 &&
-		                                  info->requires_motion_vectors;
-	                           });
+	gather_visible_renderables(frustum, list, opaque_index, nullptr, 0, filter_motion_vectors);
+}
+
+void Scene::partition_opaque_renderables(const Frustum &frustum, unsigned num_parts,
+                                         SceneQueryPartition &partition) const
+{
+	opaque_index.partition_query(frustum, num_parts, partition);
+}
+
+void Scene::gather_visible_opaque_renderables_part(const Frustum &frustum, VisibilityList &list,
+                                                   const SceneQueryPartition &partition, unsigned part) const
+{
+	gather_visible_renderables(frustum, list, opaque_index, &partition, part, filter_true);
+}
+
+void Scene::gather_visible_motion_vector_renderables_part(const Frustum &frustum, VisibilityList &list,
+                                                          const SceneQueryPartition &partition, unsigned part) const
+{
+	gather_visible_renderables(frustum, list, opaque_index, &partition, part, filter_motion_vectors);
 }
 
 void Scene::gather_visible_opaque_renderables_subset(const Frustum &frustum, VisibilityList &list,
                                                      unsigned index, unsigned num_indices) const
 {
-	size_t start_index = (index * opaque.size()) / num_indices;
-	size_t end_index = ((index + 1) * opaque.size()) / num_indices;
-	gather_visible_renderables(frustum, list, opaque, start_index, end_index, filter_true);
+	SceneQueryPartition partition;
+	partition_opaque_renderables(frustum, num_indices, partition);
+	gather_visible_opaque_renderables_part(frustum, list, partition, index);
 }
 
 void Scene::gather_visible_motion_vector_renderables_subset(const Frustum &frustum, VisibilityList &list,
                                                             unsigned index, unsigned num_indices) const
 {
-	size_t start_index = (index * opaque.size()) / num_indices;
-	size_t end_index = ((index + 1) * opaque.size()) / num_indices;
-	gather_visible_renderables(frustum, list, opaque, start_index, end_index,
-	                           [](const RenderInfoComponent *info, RenderableFlags flags) {
-		                           return (flags & RENDERABLE_IMPLICIT_MOTION_BIT) == 0 &&
-		                                  info->requires_motion_vectors;
-	                           });
+	SceneQueryPartition partition;
+	partition_opaque_renderables(frustum, num_indices, partition);
+	gather_visible_motion_vector_renderables_part(frustum, list, partition, index);
+}
+
+bool Scene::gather_retained_opaque_renderables(const Frustum &frustum, RetainedVisibilityList &list) const
+{
+	return opaque_index.update_retained(frustum, list);
+}
+
+bool Scene::gather_retained_transparent_renderables(const Frustum &frustum, RetainedVisibilityList &list) const
+{
+	return transparent_index.update_retained(frustum, list);
+}
+
+bool Scene::gather_retained_static_shadow_renderables(const Frustum &frustum, RetainedVisibilityList &list) const
+{
+	return static_shadowing_index.update_retained(frustum, list);
 }
 
 void Scene::gather_visible_transparent_renderables(const Frustum &frustum, VisibilityList &list) const
 {
-	gather_visible_renderables(frustum, list, transparent, 0, transparent.size(), filter_true);
+	gather_visible_renderables(frustum, list, transparent_index, nullptr, 0, filter_true);
 }
 
 void Scene::gather_visible_static_shadow_renderables(const Frustum &frustum, VisibilityList &list) const
 {
-	gather_visible_renderables(frustum, list, static_shadowing, 0, static_shadowing.size(), filter_true);
+	gather_visible_renderables(frustum, list, static_shadowing_index, nullptr, 0, filter_true);
+}
+
+void Scene::gather_visible_dynamic_shadow_renderables(const Frustum &frustum, VisibilityList &list) const
+{
+	gather_visible_renderables(frustum, list, dynamic_shadowing_index, nullptr, 0, filter_true);
+	gather_render_pass_shadow_renderables(list);
+}
+
+void Scene::partition_transparent_renderables(const Frustum &frustum, unsigned num_parts,
+                                              SceneQueryPartition &partition) const
+{
+	transparent_index.partition_query(frustum, num_parts, partition);
+}
+
+void Scene::partition_static_shadow_renderables(const Frustum &frustum, unsigned num_parts,
+                                                SceneQueryPartition &partition) const
+{
+	static_shadowing_index.partition_query(frustum, num_parts, partition);
+}
+
+void Scene::partition_dynamic_shadow_renderables(const Frustum &frustum, unsigned num_parts,
+                                                 SceneQueryPartition &partition) const
+{
+	dynamic_shadowing_index.partition_query(frustum, num_parts, partition);
+}
+
+void Scene::gather_visible_transparent_renderables_part(const Frustum &frustum, VisibilityList &list,
+                                                        const SceneQueryPartition &partition, unsigned part) const
+{
+	gather_visible_renderables(frustum, list, transparent_index, &partition, part, filter_true);
+}
+
+void Scene::gather_visible_static_shadow_renderables_part(const Frustum &frustum, VisibilityList &list,
+                                                          const SceneQueryPartition &partition, unsigned part) const
+{
+	gather_visible_renderables(frustum, list, static_shadowing_index, &partition, part, filter_true);
+}
+
+void Scene::gather_visible_dynamic_shadow_renderables_part(const Frustum &frustum, VisibilityList &list,
+                                                           const SceneQueryPartition &partition, unsigned part) const
+{
+	gather_visible_renderables(frustum, list, dynamic_shadowing_index, &partition, part, filter_true);
 }
 
 void Scene::gather_visible_transparent_renderables_subset(const Frustum &frustum, VisibilityList &list,
                                                           unsigned index, unsigned num_indices) const
 {
-	size_t start_index = (index * transparent.size()) / num_indices;
-	size_t end_index = ((index + 1) * transparent.size()) / num_indices;
-	gather_visible_renderables(frustum, list, transparent, start_index, end_index, filter_true);
+	SceneQueryPartition partition;
+	partition_transparent_renderables(frustum, num_indices, partition);
+	gather_visible_transparent_renderables_part(frustum, list, partition, index);
 }
 
 void Scene::gather_visible_static_shadow_renderables_subset(const Frustum &frustum, VisibilityList &list,
                                                             unsigned index, unsigned num_indices) const
 {
-	size_t start_index = (index * static_shadowing.size()) / num_indices;
-	size_t end_index = ((index + 1) * static_shadowing.size()) / num_indices;
-	gather_visible_renderables(frustum, list, static_shadowing, start_index, end_index, filter_true);
-}
-
-void Scene::gather_visible_dynamic_shadow_renderables(const Frustum &frustum, VisibilityList &list) const
-{
-	gather_visible_renderables(frustum, list, dynamic_shadowing, 0, dynamic_shadowing.size(), filter_true);
-	for (auto &object : render_pass_shadowing)
-		list.push_back({ get_component<RenderableComponent>(object)->renderable.get(), nullptr });
+	SceneQueryPartition partition;
+	partition_static_shadow_renderables(frustum, num_indices, partition);
+	gather_visible_static_shadow_renderables_part(frustum, list, partition, index);
 }
 
 void Scene::gather_visible_dynamic_shadow_renderables_subset(const Frustum &frustum, VisibilityList &list,
                                                              unsigned index, unsigned num_indices) const
 {
-	size_t start_index = (index * dynamic_shadowing.size()) / num_indices;
-	size_t end_index = ((index + 1) * dynamic_shadowing.size()) / num_indices;
-	gather_visible_renderables(frustum, list, dynamic_shadowing, start_index, end_index, filter_true);
+	SceneQueryPartition partition;
+	partition_dynamic_shadow_renderables(frustum, num_indices, partition);
+	gather_visible_dynamic_shadow_renderables_part(frustum, list, partition, index);
 
 	if (index == 0)
-		for (auto &object : render_pass_shadowing)
-			list.push_back({ get_component<RenderableComponent>(object)->renderable.get(), nullptr });
+		gather_render_pass_shadow_renderables(list);
 }
 
-static void gather_positional_lights(const Frustum &frustum, VisibilityList &list,
-                                     const ComponentGroupVector<
-		                                     RenderInfoComponent,
-		                                     RenderableComponent,
-		                                     CachedSpatialTransformTimestampComponent,
-		                                     PositionalLightComponent> &positional,
-                                     size_t start_index, size_t end_index)
+void Scene::gather_render_pass_shadow_renderables(VisibilityList &list) const
 {
-	for (size_t i = start_index; i < end_index; i++)
-	{
-		auto &o = positional[i];
-		auto *transform = get_component<RenderInfoComponent>(o);
-		auto *renderable = get_component<RenderableComponent>(o);
-		auto *timestamp = get_component<CachedSpatialTransformTimestampComponent>(o);
+	for (auto &object : render_pass_shadowing)
+		list.push_back({ get_component<RenderableComponent>(object)->renderable.get(), nullptr });
+}
 
-		Util::Hasher h;
-		h.u64(timestamp->cookie);
-		h.u32(timestamp->last_timestamp);
+static void emit_positional_light(VisibilityList &list, Entity &entity)
+{
+	auto *transform = entity.get_component<RenderInfoComponent>();
+	auto *timestamp = entity.get_component<CachedSpatialTransformTimestampComponent>();
 
-		if (transform->has_scene_node())
-		{
-			if (SIMD::frustum_cull(transform->get_aabb(), frustum.get_planes()))
-				list.push_back({ renderable->renderable.get(), transform, h.get() });
-		}
-		else
-			list.push_back({ renderable->renderable.get(), nullptr, h.get() });
-	}
+	Util::Hasher h;
+	h.u64(timestamp->cookie);
+	h.u32(timestamp->last_timestamp);
+	list.push_back({ entity.get_component<RenderableComponent>()->renderable.get(),
+	                 transform->has_scene_node() ? transform : nullptr, h.get() });
 }
 
-static void gather_positional_lights(const Frustum &frustum, PositionalLightList &list,
-                                     const ComponentGroupVector<RenderInfoComponent,
-		                                     RenderableComponent,
-		                                     CachedSpatialTransformTimestampComponent,
-		                                     PositionalLightComponent> &positional,
-                                     size_t start_index, size_t end_index)
+static void emit_positional_light(PositionalLightList &list, Entity &entity)
 {
-	for (size_t i = start_index; i < end_index; i++)
-	{
-		auto &o = positional[i];
-		auto *transform = get_component<RenderInfoComponent>(o);
-		auto *light = get_component<PositionalLightComponent>(o)->light;
-		auto *timestamp = get_component<CachedSpatialTransformTimestampComponent>(o);
+	auto *transform = entity.get_component<RenderInfoComponent>();
+	auto *timestamp = entity.get_component<CachedSpatialTransformTimestampComponent>();
 
-		Util::Hasher h;
-		h.u64(timestamp->cookie);
-		h.u32(timestamp->last_timestamp);
+	Util::Hasher h;
+	h.u64(timestamp->cookie);
+	h.u32(timestamp->last_timestamp);
+	list.push_back({ entity.get_component<PositionalLightComponent>()->light, transform, h.get() });
+}
 
-		if (transform->has_scene_node())
-		{
-			if (SIMD::frustum_cull(transform->get_aabb(), frustum.get_planes()))
-				list.push_back({ light, transform, h.get() });
-		}
+template <typename List>
+static void gather_positional_lights(const Frustum &frustum, List &list, const SceneSpatialIndex &index,
+                                     const SceneQueryPartition *partition, unsigned part)
+{
+	BatchedFrustumCull cull;
+	auto emit = [&](Entity &entity) {
+		emit_positional_light(list, entity);
+	};
+
+	query_index(index, frustum, partition, part, [&](Entity &entity, bool fully_inside) {
+		auto *transform = entity.get_component<RenderInfoComponent>();
+		if (fully_inside || !transform->has_scene_node())
+			emit(entity);
 		else
-			list.push_back({ light, transform, h.get() });
-	}
+			cull.test(frustum, entity, transform->get_aabb(), emit);
+	});
+	cull.flush(frustum, emit);
 }
 
 void Scene::gather_visible_positional_lights(const Frustum &frustum, VisibilityList &list) const
 {
-	gather_positional_lights(frustum, list, positional_lights, 0, positional_lights.size());
+	gather_positional_lights(frustum, list, positional_lights_index, nullptr, 0);
 }
 
 void Scene::gather_irradiance_affecting_positional_lights(PositionalLightList &list) const
@@ -401,7 +737,7 @@ void Scene::gather_irradiance_affecting_positional_lights(PositionalLightList &l
 
 void Scene::gather_visible_positional_lights(const Frustum &frustum, PositionalLightList &list) const
 {
-	gather_positional_lights(frustum, list, positional_lights, 0, positional_lights.size());
+	gather_positional_lights(frustum, list, positional_lights_index, nullptr, 0);
 }
 
 void Scene::gather_visible_volumetric_diffuse_lights(const Frustum &frustum, VolumetricDiffuseLightList &list) const
@@ -464,20 +800,38 @@ void Scene::gather_visible_volumetric_fog_regions(const Frustum &frustum, Volume
 	}
 }
 
+void Scene::partition_positional_lights(const Frustum &frustum, unsigned num_parts,
+                                        SceneQueryPartition &partition) const
+{
+	positional_lights_index.partition_query(frustum, num_parts, partition);
+}
+
+void Scene::gather_visible_positional_lights_part(const Frustum &frustum, VisibilityList &list,
+                                                  const SceneQueryPartition &partition, unsigned part) const
+{
+	gather_positional_lights(frustum, list, positional_lights_index, &partition, part);
+}
+
+void Scene::gather_visible_positional_lights_part(const Frustum &frustum, PositionalLightList &list,
+                                                  const SceneQueryPartition &partition, unsigned part) const
+{
+	gather_positional_lights(frustum, list, positional_lights_index, &partition, part);
+}
+
 void Scene::gather_visible_positional_lights_subset(const Frustum &frustum, VisibilityList &list,
                                                     unsigned index, unsigned num_indices) const
 {
-	size_t start_index = (index * positional_lights.size()) / num_indices;
-	size_t end_index = ((index + 1) * positional_lights.size()) / num_indices;
-	gather_positional_lights(frustum, list, positional_lights, start_index, end_index);
+	SceneQueryPartition partition;
+	partition_positional_lights(frustum, num_indices, partition);
+	gather_visible_positional_lights_part(frustum, list, partition, index);
 }
 
 void Scene::gather_visible_positional_lights_subset(const Frustum &frustum, PositionalLightList &list,
                                                     unsigned index, unsigned num_indices) const
 {
-	size_t start_index = (index * positional_lights.size()) / num_indices;
-	size_t end_index = ((index + 1) * positional_lights.size()) / num_indices;
-	gather_positional_lights(frustum, list, positional_lights, start_index, end_index);
+	SceneQueryPartition partition;
+	partition_positional_lights(frustum, num_indices, partition);
+	gather_visible_positional_lights_part(frustum, list, partition, index);
 }
 
 size_t Scene::get_opaque_renderables_count() const
@@ -554,8 +908,6 @@ static void update_skinning(Node &node)
 	}
 }
 
-static const mat4 identity_transform(1.0f);
-
 size_t Scene::get_cached_transforms_count() const
 {
 	return spatials.size();
@@ -573,6 +925,120 @@ void Scene::update_all_transforms()
 	update_transform_tree();
 	update_transform_listener_components();
 	update_cached_transforms_range(0, spatials.size());
+	update_spatial_indices();
+}
+
+void Scene::update_spatial_indices()
+{
+	SceneSpatialIndex *indices[] = {
+		&opaque_index, &transparent_index, &static_shadowing_index,
+		&dynamic_shadowing_index, &positional_lights_index,
+	};
+
+	moved_spatials.for_each_ranged([&](const uint32_t *slots, size_t count) {
+		for (auto *index : indices)
+			index->refit(slots, count);
+	});
+	moved_spatials.clear();
+
+	for (auto *index : indices)
+		index->index_pending();
+}
+
+static unsigned select_lod_level(const LODComponent &lod, float screen_size)
+{
+	unsigned level = muglm::min(lod.current_level, unsigned(lod.levels.size() - 1));
+	float refine = 1.0f + lod.hysteresis;
+	float coarsen = 1.0f - lod.hysteresis;
+
+	while (level > 0 && screen_size >= lod.levels[level - 1].min_screen_size * refine)
+		level--;
+	while (level + 1 < lod.levels.size() && screen_size < lod.levels[level].min_screen_size * coarsen)
+		level++;
+	return level;
+}
+
+void Scene::update_lod_selection(const Frustum &frustum)
+{
+	AABBBatch batch;
+	uint32_t batch_indices[AABBBatch::MaxCount];
+	uint32_t visible[AABBBatch::MaxCount];
+	float screen_sizes[AABBBatch::MaxCount];
+
+	lod_changes.clear();
+
+	// Members which are not visible, or have no scene node to place them, keep their level.
+	for (size_t base = 0, count = lods.size(); base < count; base += AABBBatch::MaxCount)
+	{
+		size_t end = std::min<size_t>(count, base + AABBBatch::MaxCount);
+		batch.clear();
+		for (size_t i = base; i < end; i++)
+		{
+			auto *transform = get_component<RenderInfoComponent>(lods[i]);
+			if (transform->has_scene_node() && !get_component<LODComponent>(lods[i])->levels.empty())
+			{
+				batch_indices[batch.count] = uint32_t(i);
+				batch.push(transform->get_aabb());
+			}
+		}
+
+		unsigned num_visible = batch.count ? batch.cull(frustum, visible, screen_sizes) : 0;
+		for (unsigned i = 0; i < num_visible; i++)
+		{
+			uint32_t index = batch_indices[visible[i]];
+			auto *lod = get_component<LODComponent>(lods[index]);
+			unsigned level = select_lod_level(*lod, screen_sizes[i]);
+			if (level != lod->current_level)
+			{
+				lod->current_level = level;
+				get_component<RenderableComponent>(lods[index])->renderable = lod->levels[level].renderable;
+				lod_changes.push_back(lod_entities[index]->get_slot());
+			}
+		}
+	}
+
+	if (lod_changes.empty())
+		return;
+
+	SceneSpatialIndex *indices[] = {
+		&opaque_index, &transparent_index, &static_shadowing_index, &dynamic_shadowing_index,
+	};
+
+	for (auto *index : indices)
+		index->touch(lod_changes.data(), lod_changes.size());
+}
+
+void Scene::hint_future_asset_use(AssetManager &manager, const mat4 &view_projection,
+                                  const vec3 &velocity, unsigned num_frames) const
+{
+	const SceneSpatialIndex *indices[] = { &opaque_index, &transparent_index };
+
+	// Renderables in view show up again for every later sample, but the asset manager keeps the nearest ETA.
+	unsigned frame = 0;
+	for (;;)
+	{
+		Frustum frustum;
+		frustum.build_planes(inverse(view_projection * translate(-velocity * float(frame))));
+
+		for (auto *index : indices)
+		{
+			index->query(frustum, [&](Entity &entity, bool fully_inside) {
+				auto *transform = entity.get_component<RenderInfoComponent>();
+				if (transform->has_scene_node() && !fully_inside &&
+				    !SIMD::frustum_cull(transform->get_aabb(), frustum.get_planes()))
+				{
+					return;
+				}
+
+				for (auto &id : entity.get_component<RenderableComponent>()->renderable->get_asset_dependencies())
+					manager.hint_future_use(id, frame);
+			});
+		}
+
+		if (frame >= num_frames)
+			break;
+		frame = std::min(num_frames, frame ? 2 * frame : 1);
+	}
 }
 
 static void perform_update_skinning(Node * const *updates, size_t count)
@@ -814,6 +1280,8 @@ void Scene::update_cached_transforms_range(size_t begin_range, size_t end_range)
 				}
 			}
 
+			// Also for members without a scene node, since their transform_hash changes as well.
+			moved_spatials.push(spatial_entities[i]->get_slot());
 			timestamp->last_timestamp = new_timestamp;
 		}
 
@@ -875,24 +1343,39 @@ void Scene::distribute_per_level_updates(TaskGroup *group)
 	}
 }
 
-static void update_transform_tree_node(Node &node, const mat4 &transform)
+static void perform_updates(Node * const *updates, size_t count)
 {
-	node.get_cached_prev_transform() = node.get_cached_transform();
-	auto &t = node.get_transform();
-	compute_model_transform(node.get_cached_transform(), t.scale, t.rotation, t.translation, transform);
+	if (!count)
+		return;
 
-	node.update_timestamp();
-	node.clear_pending_update_no_atomic();
-}
+	// All updates come from the same hierarchy level, so parents are already up to date.
+	auto &transforms = updates[0]->parent_scene.get_transforms();
+	const Transform *locals = transforms.get_transforms();
+	mat4 *cached = transforms.get_cached_transforms();
+	mat4 *cached_prev = transforms.get_cached_prev_transforms();
 
-static void perform_updates(Node * const *updates, size_t count)
-{
-	for (size_t i = 0; i < count; i++)
+	TransformBatch batch;
+	for (size_t base = 0; base < count; base += TransformBatch::MaxCount)
 	{
-		auto *update = updates[i];
-		auto *parent = update->get_parent();
-		auto &transform = parent ? parent->get_cached_transform() : identity_transform;
-		update_transform_tree_node(*update, transform);
+		size_t end = std::min<size_t>(count, base + TransformBatch::MaxCount);
+		for (size_t i = base; i < end; i++)
+		{
+			auto *update = updates[i];
+			auto *parent = update->get_parent();
+			auto &t = locals[update->transform.offset];
+			batch.push(t.scale, t.rotation, t.translation,
+			           parent ? parent->transform.offset : TransformBatch::NoParent,
+			           update->transform.offset);
+		}
+
+		batch.compose(cached, cached_prev);
+		batch.clear();
+
+		for (size_t i = base; i < end; i++)
+		{
+			updates[i]->update_timestamp();
+			updates[i]->clear_pending_update_no_atomic();
+		}
 	}
 }
 
@@ -25,6 +25,7 @@
 #include "ecs.hpp"
 #include "render_components.hpp"
 #include "frustum.hpp"
+#include "aabb_tree.hpp"
 #include "scene_formats.hpp"
 #include "no_init_pod.hpp"
 #include "thread_group.hpp"
@@ -35,6 +36,7 @@
 namespace Granite
 {
 class RenderContext;
+class AssetManager;
 struct EnvironmentComponent;
 class Node;
 class Scene;
@@ -108,6 +110,126 @@ private:
 	uint32_t high_water_mark = 0;
 };
 
+class SceneSpatialIndex;
+
+// A visible set which is kept across frames by Scene::gather_retained_*_renderables().
+// While the frustum stays the same, only members which changed since the last update are culled again.
+class RetainedVisibilityList
+{
+public:
+	const VisibilityList &get_list() const
+	{
+		return list;
+	}
+
+	// Order independent combination of every visible transform_hash.
+	Util::Hash get_transform_hash() const
+	{
+		return transform_hash;
+	}
+
+	// Forces a full gather on the next update.
+	void invalidate()
+	{
+		index = nullptr;
+	}
+
+private:
+	friend class SceneSpatialIndex;
+	VisibilityList list;
+	std::vector<uint32_t> slots;
+	std::vector<uint32_t> offsets;
+	const SceneSpatialIndex *index = nullptr;
+	uint64_t generation = 0;
+	vec4 planes[6];
+	Util::Hash transform_hash = 0;
+};
+
+// A whole-scene gather split into parts which can be gathered concurrently, see Scene::partition_*_renderables().
+// Only valid for the frustum it was built with, until the spatial indices are updated again.
+struct SceneQueryPartition
+{
+	std::vector<AABBTree::QueryRoot> roots;
+	unsigned num_parts = 0;
+};
+
+// Keeps the members of a renderable group in an AABBTree, so whole-scene visibility queries
+// only touch objects near the frustum. Members without a scene node, force visible members
+// and members whose AABB has not been computed yet are kept in a plain list instead.
+// Members must have RenderInfoComponent, RenderableComponent and CachedSpatialTransformTimestampComponent.
+class SceneSpatialIndex final : public EntityGroupListener
+{
+public:
+	void on_entity_added(Entity &entity) override;
+	void on_entity_removed(const Entity &entity) override;
+	void on_reset() override;
+
+	// Refits members whose cached AABB was recomputed. Slots are entity slots, non-members are ignored.
+	void refit(const uint32_t *slots, size_t count);
+	// Marks members which changed in place, so retained gathers re-test them.
+	void touch(const uint32_t *slots, size_t count);
+	// Moves members from the plain list into the tree once their AABB is known.
+	// Also publishes the members which changed since the last call for retained gathers.
+	void index_pending();
+
+	// Returns true if the visible set or any visible transform changed.
+	bool update_retained(const Frustum &frustum, RetainedVisibilityList &retained) const;
+
+	// Calls func(entity, fully_inside) for a superset of the members visible in frustum.
+	// If fully_inside is set, the member's AABB is known to be inside the frustum.
+	template <typename Func>
+	void query(const Frustum &frustum, const Func &func) const
+	{
+		tree.query(frustum.get_planes(), [&](uint32_t slot, bool fully_inside) {
+			func(*proxies[slot].entity, fully_inside);
+		});
+
+		for (auto *entity : unindexed)
+			func(*entity, false);
+	}
+
+	// Splits query() into num_parts parts by subtree. Every part can then be queried on its own thread.
+	void partition_query(const Frustum &frustum, unsigned num_parts,
+	                     SceneQueryPartition &partition) const;
+
+	template <typename Func>
+	void query_part(const Frustum &frustum, const SceneQueryPartition &partition, unsigned part, const Func &func) const
+	{
+		size_t begin = part * partition.roots.size() / partition.num_parts;
+		size_t end = (part + 1) * partition.roots.size() / partition.num_parts;
+		tree.query_roots(frustum.get_planes(), partition.roots.data() + begin, end - begin,
+		                 [&](uint32_t slot, bool fully_inside) { func(*proxies[slot].entity, fully_inside); });
+
+		begin = part * unindexed.size() / partition.num_parts;
+		end = (part + 1) * unindexed.size() / partition.num_parts;
+		for (size_t i = begin; i < end; i++)
+			func(*unindexed[i], false);
+	}
+
+private:
+	struct Proxy
+	{
+		Entity *entity = nullptr;
+		uint32_t leaf = AABBTree::InvalidNode;
+		uint32_t unindexed_offset = AABBTree::InvalidNode;
+	};
+
+	AABBTree tree;
+	std::vector<Proxy> proxies;
+	std::vector<Entity *> unindexed;
+
+	// Slots which were added, removed or moved. Changes are published once per index_pending(),
+	// and generation counts the publishes which had any changes.
+	std::vector<uint32_t> pending_changes;
+	std::vector<uint32_t> changes;
+	uint64_t generation = 1;
+
+	void remove_unindexed(Proxy &proxy);
+	void retest_retained(uint32_t slot, const Frustum &frustum, RetainedVisibilityList &retained) const;
+	static void append_retained(Entity &entity, const Frustum &frustum, bool fully_inside, RetainedVisibilityList &retained);
+	static bool can_index(Entity &entity);
+};
+
 class Scene
 {
 public:
@@ -126,7 +248,21 @@ public:
 	void update_transform_tree(TaskComposer &composer);
 	void update_transform_listener_components();
 	void update_cached_transforms_subset(unsigned index, unsigned num_indices);
+	void update_cached_transforms_range(size_t start_index, size_t end_index);
 	size_t get_cached_transforms_count() const;
+	// Brings the spatial indices used by the whole-scene gather_visible_* calls up to date.
+	// Must run after update_cached_transforms_range() has covered the scene, update_all_transforms() does this.
+	void update_spatial_indices();
+	// Selects the level of every visible LODComponent from its projected size in frustum, usually the main camera's.
+	// All gathers use the selected levels, so this runs once per frame after update_spatial_indices(),
+	// and not concurrently with any gather.
+	void update_lod_selection(const Frustum &frustum);
+	// Hints the assets of opaque and transparent renderables which come into view within num_frames frames,
+	// assuming the camera at view_projection keeps moving by velocity world space units per frame.
+	// Predicted views are sampled 0, 1, 2, 4, ... frames ahead, and each renderable's ETA is the first sample it is visible in.
+	// Runs after update_lod_selection(), and must not run concurrently with AssetManager::iterate().
+	void hint_future_asset_use(AssetManager &manager, const mat4 &view_projection,
+	                           const vec3 &velocity, unsigned num_frames) const;
 
 	void gather_visible_opaque_renderables(const Frustum &frustum, VisibilityList &list) const;
 	void gather_visible_motion_vector_renderables(const Frustum &frustum, VisibilityList &list) const;
@@ -155,6 +291,43 @@ public:
 	void gather_visible_positional_lights_subset(const Frustum &frustum, PositionalLightList &list,
 	                                             unsigned index, unsigned num_indices) const;
 
+	// Splits the whole-scene gathers into num_parts parts by spatial index subtree, for the _part variants below.
+	// Parts of one partition can be gathered concurrently, and together they gather the same set as the whole-scene call.
+	// The opaque partition also serves motion vector gathers.
+	void partition_opaque_renderables(const Frustum &frustum, unsigned num_parts,
+	                                  SceneQueryPartition &partition) const;
+	void partition_transparent_renderables(const Frustum &frustum, unsigned num_parts,
+	                                       SceneQueryPartition &partition) const;
+	void partition_static_shadow_renderables(const Frustum &frustum, unsigned num_parts,
+	                                         SceneQueryPartition &partition) const;
+	void partition_dynamic_shadow_renderables(const Frustum &frustum, unsigned num_parts,
+	                                          SceneQueryPartition &partition) const;
+	void partition_positional_lights(const Frustum &frustum, unsigned num_parts,
+	                                 SceneQueryPartition &partition) const;
+
+	void gather_visible_opaque_renderables_part(const Frustum &frustum, VisibilityList &list,
+	                                            const SceneQueryPartition &partition, unsigned part) const;
+	void gather_visible_motion_vector_renderables_part(const Frustum &frustum, VisibilityList &list,
+	                                                   const SceneQueryPartition &partition, unsigned part) const;
+	void gather_visible_transparent_renderables_part(const Frustum &frustum, VisibilityList &list,
+	                                                 const SceneQueryPartition &partition, unsigned part) const;
+	void gather_visible_static_shadow_renderables_part(const Frustum &frustum, VisibilityList &list,
+	                                                   const SceneQueryPartition &partition, unsigned part) const;
+	// Does not include render pass shadow casters, see gather_render_pass_shadow_renderables().
+	void gather_visible_dynamic_shadow_renderables_part(const Frustum &frustum, VisibilityList &list,
+	                                                    const SceneQueryPartition &partition, unsigned part) const;
+	void gather_visible_positional_lights_part(const Frustum &frustum, VisibilityList &list,
+	                                           const SceneQueryPartition &partition, unsigned part) const;
+	void gather_visible_positional_lights_part(const Frustum &frustum, PositionalLightList &list,
+	                                           const SceneQueryPartition &partition, unsigned part) const;
+	void gather_render_pass_shadow_renderables(VisibilityList &list) const;
+
+	// Updates a visible set kept across frames. Returns true if it changed since the last update.
+	// Must not run concurrently with update_spatial_indices().
+	bool gather_retained_opaque_renderables(const Frustum &frustum, RetainedVisibilityList &list) const;
+	bool gather_retained_transparent_renderables(const Frustum &frustum, RetainedVisibilityList &list) const;
+	bool gather_retained_static_shadow_renderables(const Frustum &frustum, RetainedVisibilityList &list) const;
+
 	size_t get_opaque_renderables_count() const;
 	size_t get_motion_vector_renderables_count() const;
 	size_t get_transparent_renderables_count() const;
@@ -165,6 +338,7 @@ public:
 	void gather_visible_render_pass_sinks(const vec3 &camera_pos, VisibilityList &list) const;
 	void gather_unbounded_renderables(VisibilityList &list) const;
 	void gather_opaque_floating_renderables(VisibilityList &list) const;
+	void gather_visible_occluders(const Frustum &frustum, OccluderList &list) const;
 	EnvironmentComponent *get_environment() const;
 	EntityPool &get_entity_pool();
 
@@ -219,6 +393,14 @@ public:
 	inline const OccluderStateAllocator &get_occluder_states() const { return occluder_state_allocator; }
 
 private:
+	// Declared before the pool, so they outlive entity group teardown.
+	SceneSpatialIndex opaque_index;
+	SceneSpatialIndex transparent_index;
+	SceneSpatialIndex static_shadowing_index;
+	SceneSpatialIndex dynamic_shadowing_index;
+	SceneSpatialIndex positional_lights_index;
+	Util::AtomicAppendBuffer<uint32_t> moved_spatials;
+
 	TransformAllocator transform_allocator;
 	TransformAllocatorAABB transform_allocator_aabb;
 	OccluderStateAllocator occluder_state_allocator;
@@ -232,6 +414,7 @@ private:
 			BoundedComponent,
 			RenderInfoComponent,
 			CachedSpatialTransformTimestampComponent> &spatials;
+	const std::vector<Entity *> &spatial_entities;
 	const ComponentGroupVector<
 			RenderInfoComponent,
 			RenderableComponent,
@@ -273,6 +456,15 @@ private:
 	const ComponentGroupVector<
 			OpaqueFloatingComponent,
 			RenderableComponent> &opaque_floating;
+	const ComponentGroupVector<
+			OccluderComponent,
+			RenderInfoComponent> &occluders;
+	const ComponentGroupVector<
+			LODComponent,
+			RenderableComponent,
+			RenderInfoComponent> &lods;
+	const std::vector<Entity *> &lod_entities;
+	std::vector<uint32_t> lod_changes;
 	const ComponentGroupVector<
 			CameraComponent,
 			CachedTransformComponent> &cameras;
@@ -308,8 +500,6 @@ private:
 	Util::IntrusiveList<Entity> queued_entities;
 	void destroy_entities(Util::IntrusiveList<Entity> &entity_list);
 
-	void update_cached_transforms_range(size_t start_index, size_t end_index);
-
 	// New transform update system:
 	enum { MaxNodeHierarchyLevels = 32 };
 	void push_pending_node_update(Node *node);
@@ -73,6 +73,33 @@ void SceneLoader::load_scene(const std::string &path)
 	scene->set_root_node(node);
 }
 
+static void setup_lod_levels(Entity &entity, const std::vector<SceneFormats::Node> &nodes,
+                             const SceneFormats::Node &node, size_t primitive,
+                             const std::vector<AbstractRenderableHandle> &meshes)
+{
+	std::vector<LODComponent::Level> levels;
+	levels.push_back({ meshes[node.meshes[primitive]], 0.0f });
+	for (auto index : node.lod_nodes)
+	{
+		if (index >= nodes.size() || nodes[index].meshes.size() != node.meshes.size())
+		{
+			LOGW("LOD node %u does not match the primitives of its base node, ignoring it.\n", index);
+			break;
+		}
+		levels.push_back({ meshes[nodes[index].meshes[primitive]], 0.0f });
+	}
+
+	if (levels.size() < 2)
+		return;
+
+	// Without MSFT_screencoverage, every level takes over at half the size of the previous one.
+	bool has_sizes = node.lod_screen_sizes.size() == node.lod_nodes.size() + 1;
+	for (size_t i = 0; i + 1 < levels.size(); i++)
+		levels[i].min_screen_size = has_sizes ? node.lod_screen_sizes[i] : 0.5f / float(1u << i);
+
+	entity.allocate_component<LODComponent>()->levels = std::move(levels);
+}
+
 NodeHandle SceneLoader::build_tree_for_subscene(const SubsceneData &subscene)
 {
 	auto &parser = *subscene.parser;
@@ -139,8 +166,12 @@ NodeHandle SceneLoader::build_tree_for_subscene(const SubsceneData &subscene)
 				if (nodes[child])
 					nodes[i]->add_child(nodes[child]);
 
-			for (auto &mesh : node.meshes)
-				scene->create_renderable(subscene.meshes[mesh], nodes[i].get());
+			for (size_t j = 0; j < node.meshes.size(); j++)
+			{
+				auto *entity = scene->create_renderable(subscene.meshes[node.meshes[j]], nodes[i].get());
+				if (!node.lod_nodes.empty())
+					setup_lod_levels(*entity, parser.get_nodes(), node, j, subscene.meshes);
+			}
 		}
 		i++;
 	}
@@ -32,6 +32,78 @@ void RenderPassSceneRenderer::init(const Setup &setup)
 	setup_data = setup;
 	if (setup_data.flags & SCENE_RENDERER_DEBUG_PROBES_BIT)
 		setup_debug_probes();
+
+	retained_opaque_visible.invalidate();
+	retained_static_shadow_visible.invalidate();
+	for (auto *retained : { &retained_queue_depth, &retained_queue_opaque, &retained_queue_static_depth })
+	{
+		retained->key = 0;
+		retained->rebuild = false;
+	}
+
+	if (setup_data.flags & SCENE_RENDERER_OCCLUSION_CULL_BIT)
+		occlusion_buffer.init(OcclusionWidth, OcclusionHeight);
+}
+
+bool RenderPassSceneRenderer::use_occlusion_culling() const
+{
+	// Retained visible sets are not re-culled while the view stays the same, so occlusion can't be applied to them.
+	return (setup_data.flags & SCENE_RENDERER_OCCLUSION_CULL_BIT) != 0 && !use_retained_opaque() &&
+	       (setup_data.flags & (SCENE_RENDERER_FORWARD_OPAQUE_BIT |
+	                            SCENE_RENDERER_FORWARD_Z_PREPASS_BIT |
+	                            SCENE_RENDERER_DEFERRED_GBUFFER_BIT)) != 0;
+}
+
+void RenderPassSceneRenderer::setup_occluders()
+{
+	visible_occluders.clear();
+	setup_data.scene->gather_visible_occluders(setup_data.context->get_visibility_frustum(), visible_occluders);
+	occlusion_buffer.begin(setup_data.context->get_render_parameters().view_projection);
+	occlusion_buffer.add_occluders(visible_occluders);
+}
+
+void RenderPassSceneRenderer::enqueue_occlusion_rasterization(TaskComposer &composer)
+{
+	{
+		auto &group = composer.begin_pipeline_stage();
+		group.enqueue_task([this]() {
+			setup_occluders();
+		});
+	}
+
+	auto &group = composer.begin_pipeline_stage();
+	for (unsigned i = 0; i < MaxTasks; i++)
+	{
+		group.enqueue_task([this, i]() {
+			occlusion_buffer.rasterize_band(i, MaxTasks);
+		});
+	}
+}
+
+void RenderPassSceneRenderer::enqueue_occlusion_culling(TaskComposer &composer)
+{
+	auto &group = composer.begin_pipeline_stage();
+	for (unsigned i = 0; i < MaxTasks; i++)
+	{
+		group.enqueue_task([this, i]() {
+			occlusion_buffer.cull(visible_per_task[i]);
+		});
+	}
+}
+
+bool RenderPassSceneRenderer::use_retained_opaque() const
+{
+	return (setup_data.flags & SCENE_RENDERER_RETAINED_VISIBILITY_BIT) != 0 &&
+	       (setup_data.flags & (SCENE_RENDERER_FORWARD_OPAQUE_BIT |
+	                            SCENE_RENDERER_FORWARD_Z_PREPASS_BIT |
+	                            SCENE_RENDERER_DEFERRED_GBUFFER_BIT)) != 0;
+}
+
+bool RenderPassSceneRenderer::use_retained_static_depth() const
+{
+	return (setup_data.flags & SCENE_RENDERER_RETAINED_VISIBILITY_BIT) != 0 &&
+	       (setup_data.flags & SCENE_RENDERER_DEPTH_BIT) != 0 &&
+	       (setup_data.flags & SCENE_RENDERER_DEPTH_STATIC_BIT) != 0;
 }
 
 void RenderPassSceneRenderer::setup_debug_probes()
@@ -138,9 +210,151 @@ static RendererSuite::Type get_depth_renderer_type(SceneRendererFlags flags)
 	}
 }
 
+void RenderPassSceneRenderer::begin_retained_queue(RetainedQueue &retained, const Renderer &renderer, bool changed)
+{
+	// Sorting keys and render infos also depend on the camera, the renderer configuration,
+	// and the image views and draws the resource manager resolved them to.
+	auto &params = setup_data.context->get_render_parameters();
+	Util::Hasher h;
+	h.pointer(&renderer);
+	h.u32(renderer.get_mesh_renderer_options());
+	h.u64(setup_data.context->get_device().get_resource_manager().get_latch_version());
+	h.data(reinterpret_cast<const uint32_t *>(&params.view_projection), sizeof(params.view_projection));
+	h.data(reinterpret_cast<const uint32_t *>(&params.camera_position), sizeof(params.camera_position));
+
+	retained.rebuild = changed || retained.key != h.get();
+	if (!retained.rebuild)
+		return;
+
+	retained.key = h.get();
+	for (auto &queue : retained.queues)
+		renderer.begin(queue);
+}
+
+void RenderPassSceneRenderer::push_retained_queue(RetainedQueue &retained, const RetainedVisibilityList &visible,
+                                                  bool depth, unsigned index, unsigned count)
+{
+	auto &list = visible.get_list();
+	size_t begin = (list.size() * index) / count;
+	size_t end = (list.size() * (index + 1)) / count;
+	auto &queue = retained.queues[index];
+
+	if (depth)
+		queue.push_depth_renderables(*setup_data.context, list.data() + begin, end - begin);
+	else
+		queue.push_renderables(*setup_data.context, list.data() + begin, end - begin);
+}
+
+void RenderPassSceneRenderer::push_retained_motion_vectors(RenderQueue &queue, unsigned index, unsigned count)
+{
+	// Motion vectors depend on the previous frame's transforms, so they cannot be retained
+	// like the opaque queues, but the retained entries still need them every frame.
+	auto &list = retained_opaque_visible.get_list();
+	size_t begin = (list.size() * index) / count;
+	size_t end = (list.size() * (index + 1)) / count;
+	queue.push_motion_vector_renderables(*setup_data.context, list.data() + begin, end - begin);
+}
+
+void RenderPassSceneRenderer::update_retained_queues()
+{
+	auto *suite = setup_data.suite;
+	auto &frustum = setup_data.context->get_visibility_frustum();
+
+	if (use_retained_opaque())
+	{
+		bool changed = setup_data.scene->gather_retained_opaque_renderables(frustum, retained_opaque_visible);
+
+		if (setup_data.flags & SCENE_RENDERER_FORWARD_Z_PREPASS_BIT)
+			begin_retained_queue(retained_queue_depth, suite->get_renderer(RendererSuite::Type::PrepassDepth), changed);
+
+		if (setup_data.flags & SCENE_RENDERER_FORWARD_OPAQUE_BIT)
+			begin_retained_queue(retained_queue_opaque, suite->get_renderer(RendererSuite::Type::ForwardOpaque), changed);
+		else if (setup_data.flags & SCENE_RENDERER_DEFERRED_GBUFFER_BIT)
+			begin_retained_queue(retained_queue_opaque, suite->get_renderer(RendererSuite::Type::Deferred), changed);
+	}
+
+	if (use_retained_static_depth())
+	{
+		bool changed = setup_data.scene->gather_retained_static_shadow_renderables(frustum, retained_static_shadow_visible);
+		begin_retained_queue(retained_queue_static_depth,
+		                     suite->get_renderer(get_depth_renderer_type(setup_data.flags)), changed);
+	}
+}
+
+void RenderPassSceneRenderer::rebuild_retained_queues()
+{
+	if (retained_queue_depth.rebuild)
+	{
+		push_retained_queue(retained_queue_depth, retained_opaque_visible, true, 0, 1);
+		retained_queue_depth.queues[0].sort();
+	}
+
+	if (retained_queue_opaque.rebuild)
+	{
+		push_retained_queue(retained_queue_opaque, retained_opaque_visible, false, 0, 1);
+		retained_queue_opaque.queues[0].sort();
+	}
+
+	if (retained_queue_static_depth.rebuild)
+	{
+		push_retained_queue(retained_queue_static_depth, retained_static_shadow_visible, true, 0, 1);
+		retained_queue_static_depth.queues[0].sort();
+	}
+}
+
+void RenderPassSceneRenderer::enqueue_rebuild_retained_queues(TaskComposer &composer)
+{
+	// Whether a queue needs rebuilding is only known once the retained gathers have run,
+	// so every stage is composed up front and skips the queues which are still valid.
+	{
+		auto &group = composer.begin_pipeline_stage();
+		group.set_desc("retained-queue-push");
+		for (unsigned i = 0; i < MaxTasks; i++)
+		{
+			group.enqueue_task([this, i]() {
+				if (retained_queue_depth.rebuild)
+				{
+					push_retained_queue(retained_queue_depth, retained_opaque_visible, true, i, MaxTasks);
+					retained_queue_depth.queues[i].sort_indices();
+				}
+
+				if (retained_queue_opaque.rebuild)
+				{
+					push_retained_queue(retained_queue_opaque, retained_opaque_visible, false, i, MaxTasks);
+					retained_queue_opaque.queues[i].sort_indices();
+				}
+
+				if (retained_queue_static_depth.rebuild)
+				{
+					push_retained_queue(retained_queue_static_depth, retained_static_shadow_visible, true, i, MaxTasks);
+					retained_queue_static_depth.queues[i].sort_indices();
+				}
+			});
+		}
+	}
+
+	auto &thread_group = composer.get_thread_group();
+	auto &group = composer.begin_pipeline_stage();
+	group.set_desc("retained-queue-merge");
+	group.enqueue_task([this, &thread_group, h = composer.get_deferred_enqueue_handle()]() mutable {
+		for (auto *retained : { &retained_queue_depth, &retained_queue_opaque, &retained_queue_static_depth })
+		{
+			if (retained->rebuild)
+			{
+				TaskComposer merge_composer(thread_group);
+				retained->queues[0].merge(merge_composer, retained->queues, MaxTasks, MaxTasks);
+				merge_composer.add_outgoing_dependency(*h);
+			}
+		}
+		h->flush();
+	});
+}
+
 void RenderPassSceneRenderer::prepare_render_pass()
 {
 	prepare_setup_queues();
+	update_retained_queues();
+	rebuild_retained_queues();
 
 	auto &visible = visible_per_task[0];
 	auto &visible_transparent = visible_per_task_transparent[0];
@@ -152,10 +366,19 @@ void RenderPassSceneRenderer::prepare_render_pass()
 	auto &queue_opaque = queue_per_task_opaque[0];
 	auto &queue_depth = queue_per_task_depth[0];
 
+	if (use_occlusion_culling())
+	{
+		setup_occluders();
+		occlusion_buffer.rasterize();
+	}
+
 	if (setup_data.flags & (SCENE_RENDERER_FORWARD_OPAQUE_BIT | SCENE_RENDERER_FORWARD_Z_PREPASS_BIT))
 	{
 		scene->gather_visible_render_pass_sinks(context->get_render_parameters().camera_position, visible);
-		scene->gather_visible_opaque_renderables(frustum, visible);
+		if (!use_retained_opaque())
+			scene->gather_visible_opaque_renderables(frustum, visible);
+		if (use_occlusion_culling())
+			occlusion_buffer.cull(visible);
 		if ((setup_data.flags & SCENE_RENDERER_SKIP_OPAQUE_FLOATING_BIT) == 0)
 			scene->gather_opaque_floating_renderables(visible);
 
@@ -171,7 +394,14 @@ void RenderPassSceneRenderer::prepare_render_pass()
 	}
 
 	if (setup_data.flags & SCENE_RENDERER_MOTION_VECTOR_BIT)
+	{
 		queue_opaque.push_motion_vector_renderables(*context, visible.data(), visible.size());
+		if (use_retained_opaque() &&
+		    (setup_data.flags & (SCENE_RENDERER_FORWARD_OPAQUE_BIT | SCENE_RENDERER_FORWARD_Z_PREPASS_BIT)) != 0)
+		{
+			push_retained_motion_vectors(queue_opaque, 0, 1);
+		}
+	}
 
 	if (setup_data.flags & SCENE_RENDERER_DEFERRED_GBUFFER_BIT)
 	{
@@ -180,7 +410,10 @@ void RenderPassSceneRenderer::prepare_render_pass()
 			scene->gather_opaque_floating_renderables(visible);
 		if ((setup_data.flags & SCENE_RENDERER_SKIP_UNBOUNDED_BIT) == 0)
 			scene->gather_unbounded_renderables(visible);
-		scene->gather_visible_opaque_renderables(frustum, visible);
+		if (!use_retained_opaque())
+			scene->gather_visible_opaque_renderables(frustum, visible);
+		if (use_occlusion_culling())
+			occlusion_buffer.cull(visible);
 		queue_opaque.push_renderables(*context, visible.data(), visible.size());
 	}
 
@@ -194,7 +427,7 @@ void RenderPassSceneRenderer::prepare_render_pass()
 	{
 		if (setup_data.flags & SCENE_RENDERER_DEPTH_DYNAMIC_BIT)
 			scene->gather_visible_dynamic_shadow_renderables(frustum, visible);
-		if (setup_data.flags & SCENE_RENDERER_DEPTH_STATIC_BIT)
+		if ((setup_data.flags & SCENE_RENDERER_DEPTH_STATIC_BIT) && !use_retained_static_depth())
 			scene->gather_visible_static_shadow_renderables(frustum, visible);
 		queue_depth.push_depth_renderables(*context, visible.data(), visible.size());
 	}
@@ -251,6 +484,17 @@ void RenderPassSceneRenderer::enqueue_prepare_render_pass(RenderGraph &, TaskCom
 		prepare_setup_queues();
 	});
 
+	if (use_retained_opaque() || use_retained_static_depth())
+	{
+		setup_group.enqueue_task([this]() {
+			update_retained_queues();
+		});
+		enqueue_rebuild_retained_queues(composer);
+	}
+
+	if (use_occlusion_culling())
+		enqueue_occlusion_rasterization(composer);
+
 	if (setup_data.flags & (SCENE_RENDERER_FORWARD_OPAQUE_BIT |
 	                        SCENE_RENDERER_FORWARD_Z_PREPASS_BIT |
 	                        SCENE_RENDERER_MOTION_VECTOR_BIT))
@@ -267,7 +511,12 @@ void RenderPassSceneRenderer::enqueue_prepare_render_pass(RenderGraph &, TaskCom
 		}
 
 		if (setup_data.flags & (SCENE_RENDERER_FORWARD_OPAQUE_BIT | SCENE_RENDERER_FORWARD_Z_PREPASS_BIT))
-			Threaded::scene_gather_opaque_renderables(*setup_data.scene, composer, setup_data.context->get_visibility_frustum(), visible_per_task, MaxTasks);
+		{
+			if (!use_retained_opaque())
+				Threaded::scene_gather_opaque_renderables(*setup_data.scene, composer, setup_data.context->get_visibility_frustum(), visible_per_task, MaxTasks);
+			if (use_occlusion_culling())
+				enqueue_occlusion_culling(composer);
+		}
 		else if (setup_data.flags & SCENE_RENDERER_MOTION_VECTOR_BIT)
 			Threaded::scene_gather_motion_vector_renderables(*setup_data.scene, composer, setup_data.context->get_visibility_frustum(), visible_per_task, MaxTasks);
 
@@ -293,6 +542,17 @@ void RenderPassSceneRenderer::enqueue_prepare_render_pass(RenderGraph &, TaskCom
 		}
 		else if (setup_data.flags & SCENE_RENDERER_MOTION_VECTOR_BIT)
 		{
+			if (use_retained_opaque())
+			{
+				auto &group = composer.begin_pipeline_stage();
+				group.set_desc("retained-motion-vector-push");
+				for (unsigned i = 0; i < MaxTasks; i++)
+				{
+					group.enqueue_task([this, i]() {
+						push_retained_motion_vectors(queue_per_task_opaque[i], i, MaxTasks);
+					});
+				}
+			}
 			Threaded::compose_parallel_push_renderables(composer, *setup_data.context, queue_per_task_opaque,
 			                                            visible_per_task, MaxTasks,
 			                                            Threaded::PushType::MotionVector);
@@ -311,7 +571,10 @@ void RenderPassSceneRenderer::enqueue_prepare_render_pass(RenderGraph &, TaskCom
 					setup_data.scene->gather_unbounded_renderables(visible_per_task[0]);
 			});
 		}
-		Threaded::scene_gather_opaque_renderables(*setup_data.scene, composer, setup_data.context->get_visibility_frustum(), visible_per_task, MaxTasks);
+		if (!use_retained_opaque())
+			Threaded::scene_gather_opaque_renderables(*setup_data.scene, composer, setup_data.context->get_visibility_frustum(), visible_per_task, MaxTasks);
+		if (use_occlusion_culling())
+			enqueue_occlusion_culling(composer);
 		Threaded::compose_parallel_push_renderables(composer, *setup_data.context, queue_per_task_opaque,
 		                                            visible_per_task, MaxTasks,
 		                                            Threaded::PushType::Normal);
@@ -334,7 +597,7 @@ void RenderPassSceneRenderer::enqueue_prepare_render_pass(RenderGraph &, TaskCom
 			                                                  visible_per_task, nullptr, MaxTasks);
 		}
 
-		if (setup_data.flags & SCENE_RENDERER_DEPTH_STATIC_BIT)
+		if ((setup_data.flags & SCENE_RENDERER_DEPTH_STATIC_BIT) && !use_retained_static_depth())
 		{
 			Threaded::scene_gather_static_shadow_renderables(*setup_data.scene, composer,
 			                                                 setup_data.context->get_visibility_frustum(),
@@ -355,9 +618,11 @@ void RenderPassSceneRenderer::build_render_pass_inner(Vulkan::CommandBuffer &cmd
 	{
 		if (setup_data.flags & SCENE_RENDERER_FORWARD_Z_PREPASS_BIT)
 		{
-			suite->get_renderer(RendererSuite::Type::PrepassDepth).flush(cmd, queue_per_task_depth[0], *setup_data.context,
-			                                                             Renderer::NO_COLOR_BIT | Renderer::SKIP_SORTING_BIT |
-			                                                             flush_flags);
+			auto &renderer = suite->get_renderer(RendererSuite::Type::PrepassDepth);
+			Renderer::RendererOptionFlags opt = Renderer::NO_COLOR_BIT | Renderer::SKIP_SORTING_BIT | flush_flags;
+			renderer.flush(cmd, queue_per_task_depth[0], *setup_data.context, opt);
+			if (use_retained_opaque())
+				renderer.flush(cmd, retained_queue_depth.queues[0], *setup_data.context, opt);
 		}
 
 		if (setup_data.flags & SCENE_RENDERER_FORWARD_OPAQUE_BIT)
@@ -365,7 +630,10 @@ void RenderPassSceneRenderer::build_render_pass_inner(Vulkan::CommandBuffer &cmd
 			Renderer::RendererOptionFlags opt = Renderer::SKIP_SORTING_BIT | flush_flags;
 			if (setup_data.flags & (SCENE_RENDERER_FORWARD_Z_PREPASS_BIT | SCENE_RENDERER_FORWARD_Z_EXISTING_PREPASS_BIT))
 				opt |= Renderer::DEPTH_STENCIL_READ_ONLY_BIT | Renderer::DEPTH_TEST_EQUAL_BIT;
-			suite->get_renderer(RendererSuite::Type::ForwardOpaque).flush(cmd, queue_per_task_opaque[0], *setup_data.context, opt);
+			auto &renderer = suite->get_renderer(RendererSuite::Type::ForwardOpaque);
+			renderer.flush(cmd, queue_per_task_opaque[0], *setup_data.context, opt);
+			if (use_retained_opaque())
+				renderer.flush(cmd, retained_queue_opaque.queues[0], *setup_data.context, opt);
 
 			if (setup_data.flags & SCENE_RENDERER_DEBUG_PROBES_BIT)
 			{
@@ -390,8 +658,10 @@ void RenderPassSceneRenderer::build_render_pass_inner(Vulkan::CommandBuffer &cmd
 
 	if (setup_data.flags & SCENE_RENDERER_DEFERRED_GBUFFER_BIT)
 	{
-		suite->get_renderer(RendererSuite::Type::Deferred).flush(cmd, queue_per_task_opaque[0], *setup_data.context,
-		                                                         Renderer::SKIP_SORTING_BIT | flush_flags);
+		auto &renderer = suite->get_renderer(RendererSuite::Type::Deferred);
+		renderer.flush(cmd, queue_per_task_opaque[0], *setup_data.context, Renderer::SKIP_SORTING_BIT | flush_flags);
+		if (use_retained_opaque())
+			renderer.flush(cmd, retained_queue_opaque.queues[0], *setup_data.context, Renderer::SKIP_SORTING_BIT | flush_flags);
 
 		if (setup_data.flags & SCENE_RENDERER_DEBUG_PROBES_BIT)
 		{
@@ -420,9 +690,11 @@ void RenderPassSceneRenderer::build_render_pass_inner(Vulkan::CommandBuffer &cmd
 
 	if (setup_data.flags & SCENE_RENDERER_DEPTH_BIT)
 	{
-		auto type = get_depth_renderer_type(setup_data.flags);
-		suite->get_renderer(type).flush(cmd, queue_per_task_depth[0], *setup_data.context,
-		                                Renderer::DEPTH_BIAS_BIT | Renderer::SKIP_SORTING_BIT | flush_flags);
+		auto &renderer = suite->get_renderer(get_depth_renderer_type(setup_data.flags));
+		Renderer::RendererOptionFlags opt = Renderer::DEPTH_BIAS_BIT | Renderer::SKIP_SORTING_BIT | flush_flags;
+		renderer.flush(cmd, queue_per_task_depth[0], *setup_data.context, opt);
+		if (use_retained_static_depth())
+			renderer.flush(cmd, retained_queue_static_depth.queues[0], *setup_data.context, opt);
 	}
 }
 
@@ -27,6 +27,7 @@
 #include "render_queue.hpp"
 #include "render_context.hpp"
 #include "render_graph.hpp"
+#include "occlusion_buffer.hpp"
 #include "lights/deferred_lights.hpp"
 
 namespace Granite
@@ -52,6 +53,13 @@ enum SceneRendererFlagBits : uint32_t
 	SCENE_RENDERER_SKIP_UNBOUNDED_BIT = 1 << 16,
 	SCENE_RENDERER_SKIP_OPAQUE_FLOATING_BIT = 1 << 17,
 	SCENE_RENDERER_MOTION_VECTOR_FULL_BIT = 1 << 18, // Reconstruct MVs even for static objects.
+	// Keeps frustum culled opaque renderables and static shadow casters, and their sorted queues, across frames.
+	// Only entities which changed are culled again, and nothing is pushed while the view and its visible set are unchanged.
+	// Renderables must not change their render info unless their transform changes.
+	SCENE_RENDERER_RETAINED_VISIBILITY_BIT = 1 << 19,
+	// Rasterizes OccluderComponent meshes into a CPU depth buffer,
+	// and drops frustum culled opaque renderables which are hidden behind them.
+	SCENE_RENDERER_OCCLUSION_CULL_BIT = 1 << 20,
 };
 using SceneRendererFlags = uint32_t;
 
@@ -78,6 +86,12 @@ public:
 	// An immediate version of enqueue_prepare_render_pass.
 	void prepare_render_pass();
 
+	// Culling statistics of the last prepared frame, if SCENE_RENDERER_OCCLUSION_CULL_BIT is used.
+	const OcclusionBuffer &get_occlusion_buffer() const
+	{
+		return occlusion_buffer;
+	}
+
 protected:
 	Setup setup_data = {};
 	VkClearColorValue clear_color_value = {};
@@ -92,6 +106,29 @@ protected:
 	RenderQueue queue_per_task_transparent[MaxTasks];
 	mutable RenderQueue queue_non_tasked;
 
+	// Rebuilt like the per-task queues when the key changes, with the result merged into queues[0].
+	struct RetainedQueue
+	{
+		RenderQueue queues[MaxTasks];
+		Util::Hash key = 0;
+		bool rebuild = false;
+	};
+	RetainedVisibilityList retained_opaque_visible;
+	RetainedVisibilityList retained_static_shadow_visible;
+	RetainedQueue retained_queue_depth;
+	RetainedQueue retained_queue_opaque;
+	RetainedQueue retained_queue_static_depth;
+
+	bool use_retained_opaque() const;
+	bool use_retained_static_depth() const;
+	void update_retained_queues();
+	void begin_retained_queue(RetainedQueue &retained, const Renderer &renderer, bool changed);
+	void push_retained_queue(RetainedQueue &retained, const RetainedVisibilityList &visible, bool depth,
+	                         unsigned index, unsigned count);
+	void push_retained_motion_vectors(RenderQueue &queue, unsigned index, unsigned count);
+	void rebuild_retained_queues();
+	void enqueue_rebuild_retained_queues(TaskComposer &composer);
+
 	void build_render_pass_inner(Vulkan::CommandBuffer &cmd) const;
 	void setup_debug_probes();
 	void render_debug_probes(const Renderer &renderer, Vulkan::CommandBuffer &cmd, RenderQueue &queue,
@@ -99,6 +136,14 @@ protected:
 	AbstractRenderableHandle debug_probe_mesh;
 	const ComponentGroupVector<VolumetricDiffuseLightComponent> *volumetric_diffuse_lights = nullptr;
 
+	enum { OcclusionWidth = 256, OcclusionHeight = 144 };
+	OcclusionBuffer occlusion_buffer;
+	OccluderList visible_occluders;
+	bool use_occlusion_culling() const;
+	void setup_occluders();
+	void enqueue_occlusion_rasterization(TaskComposer &composer);
+	void enqueue_occlusion_culling(TaskComposer &composer);
+
 	void prepare_setup_queues();
 	void resolve_full_motion_vectors(Vulkan::CommandBuffer &cmd, const RenderContext &context) const;
 };
@@ -48,6 +48,7 @@ void SimpleRenderer::render_scene(const Camera &camera, Scene &scene, Vulkan::Co
 	scene.update_all_transforms();
 	render_context.set_camera(camera);
 	render_context.set_lighting_parameters(&lighting);
+	scene.update_lod_selection(render_context.get_visibility_frustum());
 
 	visible.clear();
 	scene.gather_unbounded_renderables(visible);
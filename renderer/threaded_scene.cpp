@@ -22,121 +22,154 @@
 
 #include "threaded_scene.hpp"
 #include "render_context.hpp"
+#include "parallel_for.hpp"
 #include <algorithm>
+#include <memory>
 
 namespace Granite
 {
 namespace Threaded
 {
-void scene_gather_opaque_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
-                                     VisibilityList *lists, unsigned num_tasks)
+static constexpr size_t TransformGrainSize = 64;
+// A few parts per task, so parts which end up with more visible work than others can be balanced out.
+static constexpr unsigned GatherPartsPerTask = 4;
+
+// Splits a whole-scene gather by spatial index subtree.
+// The spatial indices are only up to date once the composer gets this far, so the partition is built
+// by partition_func(partition, num_parts) in its own pipeline stage, then gather_func(partition, part, slot)
+// gathers the parts in parallel.
+template <typename PartitionFunc, typename GatherFunc>
+static TaskGroup &gather_partitioned(TaskComposer &composer, unsigned num_tasks, const char *desc,
+                                     PartitionFunc &&partition_func, GatherFunc &&gather_func)
 {
-	auto &group = composer.begin_pipeline_stage();
-	group.set_desc("gather-opaque-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
+	auto partition = std::make_shared<SceneQueryPartition>();
+	unsigned num_parts = num_tasks * GatherPartsPerTask;
+
 	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks]() {
-			scene.gather_visible_opaque_renderables_subset(frustum, lists[i], i, num_tasks);
+		auto &group = composer.begin_pipeline_stage();
+		group.set_desc(desc);
+		group.enqueue_task([partition, num_parts, partition_func]() {
+			partition_func(*partition, num_parts);
 		});
 	}
+
+	auto &group = parallel_for_slots(composer, 0, num_parts, 1, num_tasks,
+	                                 [partition, gather_func](size_t begin, size_t end, unsigned slot) {
+		                                 for (size_t part = begin; part < end; part++)
+			                                 gather_func(*partition, unsigned(part), slot);
+	                                 });
+	group.set_desc(desc);
+	return group;
+}
+
+void scene_gather_opaque_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
+                                     VisibilityList *lists, unsigned num_tasks)
+{
+	gather_partitioned(composer, num_tasks, "gather-opaque-renderables",
+	                   [&frustum, &scene](SceneQueryPartition &partition, unsigned num_parts) {
+		                   scene.partition_opaque_renderables(frustum, num_parts, partition);
+	                   },
+	                   [&frustum, lists, &scene](const SceneQueryPartition &partition, unsigned part, unsigned slot) {
+		                   scene.gather_visible_opaque_renderables_part(frustum, lists[slot], partition, part);
+	                   });
 }
 
 void scene_gather_motion_vector_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
                                             VisibilityList *lists, unsigned num_tasks)
 {
-	auto &group = composer.begin_pipeline_stage();
-	group.set_desc("gather-motion-vector-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks]() {
-			scene.gather_visible_motion_vector_renderables_subset(frustum, lists[i], i, num_tasks);
-		});
-	}
+	gather_partitioned(composer, num_tasks, "gather-motion-vector-renderables",
+	                   [&frustum, &scene](SceneQueryPartition &partition, unsigned num_parts) {
+		                   scene.partition_opaque_renderables(frustum, num_parts, partition);
+	                   },
+	                   [&frustum, lists, &scene](const SceneQueryPartition &partition, unsigned part, unsigned slot) {
+		                   scene.gather_visible_motion_vector_renderables_part(frustum, lists[slot], partition, part);
+	                   });
 }
 
 void scene_gather_transparent_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
                                           VisibilityList *lists, unsigned num_tasks)
 {
-	auto &group = composer.begin_pipeline_stage();
-	group.set_desc("gather-transparent-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks]() {
-			scene.gather_visible_transparent_renderables_subset(frustum, lists[i], i, num_tasks);
-		});
-	}
+	gather_partitioned(composer, num_tasks, "gather-transparent-renderables",
+	                   [&frustum, &scene](SceneQueryPartition &partition, unsigned num_parts) {
+		                   scene.partition_transparent_renderables(frustum, num_parts, partition);
+	                   },
+	                   [&frustum, lists, &scene](const SceneQueryPartition &partition, unsigned part, unsigned slot) {
+		                   scene.gather_visible_transparent_renderables_part(frustum, lists[slot], partition, part);
+	                   });
+}
+
+// This way of combining hashes is order independent and serves as a good way of hashing the overall scene.
+static void hash_appended_transforms(const VisibilityList &list, size_t offset, Util::Hash &hash)
+{
+	for (size_t i = offset, n = list.size(); i < n; i++)
+		hash ^= list[i].transform_hash;
 }
 
 void scene_gather_static_shadow_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
                                             VisibilityList *lists, Util::Hash *transform_hashes, unsigned num_tasks)
 {
-	auto &group = composer.begin_pipeline_stage();
-	group.set_desc("gather-static-shadow-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks, transform_hashes]() {
-			if (transform_hashes)
-				transform_hashes[i] = 0;
-
-			scene.gather_visible_static_shadow_renderables_subset(frustum, lists[i], i, num_tasks);
-
-			// This way of combining hashes is order independent and serves as a good way of hashing the overall scene.
-			if (transform_hashes)
-				for (auto &v : lists[i])
-					transform_hashes[i] ^= v.transform_hash;
-		});
-	}
+	// Which slots end up being used depends on scheduling, so clear them all up front.
+	if (transform_hashes)
+		std::fill(transform_hashes, transform_hashes + num_tasks, Util::Hash(0));
+
+	gather_partitioned(composer, num_tasks, "gather-static-shadow-renderables",
+	                   [&frustum, &scene](SceneQueryPartition &partition, unsigned num_parts) {
+		                   scene.partition_static_shadow_renderables(frustum, num_parts, partition);
+	                   },
+	                   [&frustum, lists, &scene, transform_hashes](const SceneQueryPartition &partition,
+	                                                                unsigned part, unsigned slot) {
+		                   size_t offset = lists[slot].size();
+		                   scene.gather_visible_static_shadow_renderables_part(frustum, lists[slot], partition, part);
+		                   if (transform_hashes)
+			                   hash_appended_transforms(lists[slot], offset, transform_hashes[slot]);
+	                   });
 }
 
 void scene_gather_dynamic_shadow_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
                                              VisibilityList *lists, Util::Hash *transform_hashes, unsigned num_tasks)
 {
-	auto &group = composer.begin_pipeline_stage();
-	group.set_desc("gather-dynamic-shadow-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks, transform_hashes]() {
-			if (transform_hashes)
-				transform_hashes[i] = 0;
-
-			scene.gather_visible_dynamic_shadow_renderables_subset(frustum, lists[i], i, num_tasks);
-
-			// This way of combining hashes is order independent and serves as a good way of hashing the overall scene.
-			if (transform_hashes)
-				for (auto &v : lists[i])
-					transform_hashes[i] ^= v.transform_hash;
-		});
-	}
+	if (transform_hashes)
+		std::fill(transform_hashes, transform_hashes + num_tasks, Util::Hash(0));
+
+	gather_partitioned(composer, num_tasks, "gather-dynamic-shadow-renderables",
+	                   [&frustum, &scene](SceneQueryPartition &partition, unsigned num_parts) {
+		                   scene.partition_dynamic_shadow_renderables(frustum, num_parts, partition);
+	                   },
+	                   [&frustum, lists, &scene, transform_hashes](const SceneQueryPartition &partition,
+	                                                                unsigned part, unsigned slot) {
+		                   size_t offset = lists[slot].size();
+		                   scene.gather_visible_dynamic_shadow_renderables_part(frustum, lists[slot], partition, part);
+		                   if (part == 0)
+			                   scene.gather_render_pass_shadow_renderables(lists[slot]);
+		                   if (transform_hashes)
+			                   hash_appended_transforms(lists[slot], offset, transform_hashes[slot]);
+	                   });
 }
 
 void scene_gather_positional_light_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
                                                VisibilityList *lists, unsigned num_tasks)
 {
-	auto &group = composer.begin_pipeline_stage();
-	group.set_desc("gather-positional-light-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks]() {
-			scene.gather_visible_positional_lights_subset(frustum, lists[i], i, num_tasks);
-		});
-	}
+	gather_partitioned(composer, num_tasks, "gather-positional-light-renderables",
+	                   [&frustum, &scene](SceneQueryPartition &partition, unsigned num_parts) {
+		                   scene.partition_positional_lights(frustum, num_parts, partition);
+	                   },
+	                   [&frustum, lists, &scene](const SceneQueryPartition &partition, unsigned part, unsigned slot) {
+		                   scene.gather_visible_positional_lights_part(frustum, lists[slot], partition, part);
+	                   });
 }
 
 void scene_gather_positional_light_renderables_sorted(const Scene &scene, TaskComposer &composer,
                                                       const RenderContext &context,
                                                       PositionalLightList *lists, unsigned num_tasks)
 {
-	{
-		auto &group = composer.begin_pipeline_stage();
-		group.set_desc("gather-positional-light-renderables");
-		for (unsigned i = 0; i < num_tasks; i++)
-		{
-			group.enqueue_task([&context, lists, &scene, i, num_tasks]() {
-				scene.gather_visible_positional_lights_subset(context.get_visibility_frustum(),
-				                                              lists[i], i, num_tasks);
-			});
-		}
-	}
+	gather_partitioned(composer, num_tasks, "gather-positional-light-renderables",
+	                   [&context, &scene](SceneQueryPartition &partition, unsigned num_parts) {
+		                   scene.partition_positional_lights(context.get_visibility_frustum(), num_parts, partition);
+	                   },
+	                   [&context, lists, &scene](const SceneQueryPartition &partition, unsigned part, unsigned slot) {
+		                   scene.gather_visible_positional_lights_part(context.get_visibility_frustum(),
+		                                                               lists[slot], partition, part);
+	                   });
 
 	{
 		auto &group = composer.begin_pipeline_stage();
@@ -189,37 +222,30 @@ void compose_parallel_push_renderables(TaskComposer &composer, const RenderConte
 					queues[i].push_motion_vector_renderables(context, visibility[i].data(), visibility[i].size());
 					break;
 				}
+				queues[i].sort_indices();
 			});
 		}
 	}
 
-	{
-		auto &group = composer.begin_pipeline_stage();
-		group.set_desc("parallel-push-renderables-sort");
-		group.enqueue_task([=]() {
-			for (unsigned i = 1; i < count; i++)
-				queues[0].combine_render_info(queues[i]);
-			queues[0].sort();
-		});
-	}
+	queues[0].merge(composer, queues, count, count);
 }
 
 void scene_update_cached_transforms(Scene &scene, TaskComposer &composer, unsigned num_tasks)
 {
-	auto &group = composer.begin_pipeline_stage();
+	auto &group = parallel_for_slots(composer, 0, scene.get_cached_transforms_count(), TransformGrainSize, num_tasks,
+	                                 [&scene](size_t begin, size_t end, unsigned) {
+		                                 scene.update_cached_transforms_range(begin, end);
+	                                 });
 	group.set_desc("parallel-update-cached-transforms");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&scene, num_tasks, i]() {
-			scene.update_cached_transforms_subset(i, num_tasks);
-		});
-	}
 
 	auto &listener_group = composer.begin_pipeline_stage();
 	listener_group.set_desc("parallel-update-transform-listeners");
 	listener_group.enqueue_task([&scene]() {
 		scene.update_transform_listener_components();
 	});
+	listener_group.enqueue_task([&scene]() {
+		scene.update_spatial_indices();
+	});
 }
 }
 }
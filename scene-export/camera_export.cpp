@@ -71,4 +71,34 @@ std::string export_cameras_to_json(const std::vector<RecordedCamera> &recorded_c
 	doc.Accept(writer);
 	return buffer.GetString();
 }
+
+bool import_cameras_from_json(const std::string &json, std::vector<RecordedCamera> &cameras)
+{
+	Document doc;
+	doc.Parse(json);
+	if (doc.HasParseError() || !doc.HasMember("cameras"))
+		return false;
+
+	auto &cams = doc["cameras"];
+	for (auto itr = cams.Begin(); itr != cams.End(); ++itr)
+	{
+		auto &c = *itr;
+		RecordedCamera cam;
+		cam.fovy = c["fovy"].GetFloat();
+		cam.aspect = c["aspect"].GetFloat();
+		cam.znear = c["znear"].GetFloat();
+		cam.zfar = c["zfar"].GetFloat();
+
+		for (int i = 0; i < 3; i++)
+		{
+			cam.direction[i] = c["direction"][i].GetFloat();
+			cam.position[i] = c["position"][i].GetFloat();
+			cam.up[i] = c["up"][i].GetFloat();
+		}
+
+		cameras.push_back(cam);
+	}
+
+	return true;
+}
 }
\ No newline at end of file
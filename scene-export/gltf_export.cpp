@@ -29,6 +29,7 @@
 #include "hashmap.hpp"
 #include "thread_group.hpp"
 #include <unordered_set>
+#include <algorithm>
 #include "texture_utils.hpp"
 #include "texture_format.hpp"
 #include "stb_image_write.h"
@@ -1655,14 +1656,25 @@ bool export_scene_to_glb(const SceneInformation &scene, const std::string &path,
 	asset.AddMember("version", "2.0", allocator);
 	doc.AddMember("asset", asset, allocator);
 
+	bool has_lods = std::any_of(scene.nodes.begin(), scene.nodes.end(), [](const Node &node) {
+		return !node.lod_nodes.empty();
+	});
+
 	if (!scene.lights.empty())
 	{
 		Value req(kArrayType);
 		req.PushBack("KHR_lights_punctual", allocator);
 		doc.AddMember("extensionsRequired", req, allocator);
+	}
 
+	if (!scene.lights.empty() || has_lods)
+	{
 		Value used(kArrayType);
-		used.PushBack("KHR_lights_punctual", allocator);
+		if (!scene.lights.empty())
+			used.PushBack("KHR_lights_punctual", allocator);
+		// Not required, readers which ignore it just render the most detailed level.
+		if (has_lods)
+			used.PushBack("MSFT_lod", allocator);
 		doc.AddMember("extensionsUsed", used, allocator);
 	}
 
@@ -1706,20 +1718,43 @@ bool export_scene_to_glb(const SceneInformation &scene, const std::string &path,
 			}
 		}
 
+		Value ext(kObjectType);
+
 		// TODO: Reverse mapping to avoid searching every time.
 		for (auto &light : scene.lights)
 		{
 			if (light.attached_to_node && light.node_index == uint32_t(&node - scene.nodes.data()))
 			{
-				Value ext(kObjectType);
 				Value cmn(kObjectType);
 				cmn.AddMember("light", uint32_t(&light - scene.lights.data()), allocator);
 				ext.AddMember("KHR_lights_punctual", cmn, allocator);
-				n.AddMember("extensions", ext, allocator);
 				break;
 			}
 		}
 
+		if (!node.lod_nodes.empty())
+		{
+			Value lod(kObjectType);
+			Value ids(kArrayType);
+			for (auto &id : node.lod_nodes)
+				ids.PushBack(id, allocator);
+			lod.AddMember("ids", ids, allocator);
+			ext.AddMember("MSFT_lod", lod, allocator);
+
+			if (!node.lod_screen_sizes.empty())
+			{
+				Value extras(kObjectType);
+				Value coverage(kArrayType);
+				for (auto &size : node.lod_screen_sizes)
+					coverage.PushBack(lod_screen_size_to_coverage(size), allocator);
+				extras.AddMember("MSFT_screencoverage", coverage, allocator);
+				n.AddMember("extras", extras, allocator);
+			}
+		}
+
+		if (ext.MemberCount() != 0)
+			n.AddMember("extensions", ext, allocator);
+
 		if (node.transform.rotation.w != 1.0f ||
 		    node.transform.rotation.x != 0.0f ||
 		    node.transform.rotation.y != 0.0f ||
@@ -0,0 +1,165 @@
+#include "aabb_tree.hpp"
+#include "frustum.hpp"
+#include "transforms.hpp"
+#include "muglm/muglm_impl.hpp"
+#include "muglm/matrix_helper.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+
+using namespace Granite;
+
+// Synthetic scene: boxes scattered in a cube, viewed by a handful of cameras which roughly
+// match a main view, shadow cascades and positional light views.
+static constexpr float WorldSize = 2000.0f;
+static constexpr unsigned NumFrames = 16;
+static constexpr unsigned DynamicStride = 20;
+static constexpr unsigned NumParts = 16;
+
+struct Random
+{
+	uint32_t state = 1;
+	float next()
+	{
+		state = state * 1664525u + 1013904223u;
+		return float(state >> 8) * (1.0f / float(1u << 24));
+	}
+};
+
+static AABB random_box(Random &rnd)
+{
+	vec3 center = vec3(rnd.next(), rnd.next(), rnd.next()) * WorldSize - vec3(0.5f * WorldSize);
+	vec3 half = vec3(0.25f) + vec3(rnd.next(), rnd.next(), rnd.next()) * 2.0f;
+	return AABB(center - half, center + half);
+}
+
+static std::vector<Frustum> build_views(Random &rnd)
+{
+	std::vector<Frustum> views;
+	const float ranges[] = { 500.0f, 50.0f, 150.0f, 400.0f, 1000.0f, 20.0f, 20.0f };
+	for (float range : ranges)
+	{
+		vec3 pos = vec3(rnd.next(), rnd.next(), rnd.next()) * WorldSize - vec3(0.5f * WorldSize);
+		vec3 dir = normalize(vec3(rnd.next(), rnd.next(), rnd.next()) - vec3(0.5f));
+		mat4 view = mat4_cast(look_at_arbitrary_up(dir)) * translate(-pos);
+		mat4 proj = projection(0.5f * pi<float>(), 16.0f / 9.0f, 0.1f, range);
+		Frustum frustum;
+		frustum.build_planes(inverse(proj * view));
+		views.push_back(frustum);
+	}
+	return views;
+}
+
+static double now_ms(int64_t start)
+{
+	return double(Util::get_current_time_nsecs() - start) * 1e-6;
+}
+
+static bool run_bench(unsigned count)
+{
+	Random rnd;
+	std::vector<AABB> boxes(count);
+	for (auto &box : boxes)
+		box = random_box(rnd);
+
+	auto start = Util::get_current_time_nsecs();
+	AABBTree tree;
+	std::vector<uint32_t> leaves(count);
+	for (unsigned i = 0; i < count; i++)
+		leaves[i] = tree.insert(boxes[i], i);
+	tree.optimize();
+	double build_ms = now_ms(start);
+
+	double linear_ms = 0.0, tree_ms = 0.0, split_ms = 0.0, update_ms = 0.0;
+	size_t visible = 0, reinserted = 0, num_roots = 0;
+	std::vector<uint32_t> linear_list, tree_list;
+	std::vector<AABBTree::QueryRoot> roots;
+
+	// A few percent of the objects are dynamic and keep moving in a straight line.
+	std::vector<vec3> velocities(count);
+	for (unsigned i = 0; i < count; i += DynamicStride)
+		velocities[i] = (vec3(rnd.next(), rnd.next(), rnd.next()) - vec3(0.5f)) * 0.2f;
+
+	for (unsigned frame = 0; frame < NumFrames; frame++)
+	{
+		start = Util::get_current_time_nsecs();
+		for (unsigned i = 0; i < count; i += DynamicStride)
+		{
+			boxes[i] = AABB(boxes[i].get_minimum() + velocities[i], boxes[i].get_maximum() + velocities[i]);
+			reinserted += tree.update(leaves[i], boxes[i]) ? 1 : 0;
+		}
+		tree.optimize();
+		update_ms += now_ms(start);
+
+		for (auto &frustum : build_views(rnd))
+		{
+			auto *planes = frustum.get_planes();
+
+			linear_list.clear();
+			start = Util::get_current_time_nsecs();
+			for (unsigned i = 0; i < count; i++)
+				if (SIMD::frustum_cull(boxes[i], planes))
+					linear_list.push_back(i);
+			linear_ms += now_ms(start);
+
+			tree_list.clear();
+			start = Util::get_current_time_nsecs();
+			tree.query(planes, [&](uint32_t index, bool fully_inside) {
+				if (fully_inside || SIMD::frustum_cull(boxes[index], planes))
+					tree_list.push_back(index);
+			});
+			tree_ms += now_ms(start);
+
+			std::sort(tree_list.begin(), tree_list.end());
+			if (linear_list != tree_list)
+			{
+				LOGE("Visible set mismatch, linear %zu, tree %zu.\n", linear_list.size(), tree_list.size());
+				return false;
+			}
+
+			// The same query split into parts, as the threaded scene gathers do it.
+			tree_list.clear();
+			start = Util::get_current_time_nsecs();
+			tree.partition_query(planes, 4 * NumParts, roots);
+			for (unsigned part = 0; part < NumParts; part++)
+			{
+				size_t begin = part * roots.size() / NumParts;
+				size_t end = (part + 1) * roots.size() / NumParts;
+				tree.query_roots(planes, roots.data() + begin, end - begin, [&](uint32_t index, bool fully_inside) {
+					if (fully_inside || SIMD::frustum_cull(boxes[index], planes))
+						tree_list.push_back(index);
+				});
+			}
+			split_ms += now_ms(start);
+			num_roots += roots.size();
+
+			std::sort(tree_list.begin(), tree_list.end());
+			if (linear_list != tree_list)
+			{
+				LOGE("Visible set mismatch, linear %zu, split tree %zu.\n", linear_list.size(), tree_list.size());
+				return false;
+			}
+			visible += linear_list.size();
+		}
+	}
+
+	unsigned num_queries = NumFrames * 7;
+	LOGI("%8u objects: build %7.2f ms (height %u), update %6.3f ms/frame (%zu reinserts), "
+	     "linear %7.3f ms/view, tree %7.3f ms/view, split tree %7.3f ms/view (%zu roots), %zu visible/view.\n",
+	     count, build_ms, tree.get_height(), update_ms / NumFrames, reinserted,
+	     linear_ms / num_queries, tree_ms / num_queries, split_ms / num_queries, num_roots / num_queries,
+	     visible / num_queries);
+	return true;
+}
+
+int main()
+{
+	const unsigned counts[] = { 10000, 100000, 1000000 };
+	for (unsigned count : counts)
+		if (!run_bench(count))
+			return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
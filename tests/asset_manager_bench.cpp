@@ -0,0 +1,116 @@
+#include "asset_manager.hpp"
+#include "filesystem.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+
+using namespace Granite;
+
+static constexpr unsigned NumAssets = 100000;
+static constexpr unsigned NumFrames = 500;
+static constexpr unsigned UsedPerFrame = 2000;
+static constexpr unsigned PrioChangesPerFrame = 50;
+static constexpr uint64_t AssetCost = 64 * 1024;
+
+struct Random
+{
+	uint32_t state = 1;
+	uint32_t next()
+	{
+		state = state * 1664525u + 1013904223u;
+		return state ^ (state >> 16);
+	}
+};
+
+// Completes every instantiation right away, so the benchmark only measures the residency bookkeeping.
+struct MockInstantiator final : AssetInstantiatorInterface
+{
+	uint64_t estimate_cost_asset(AssetID, File &) override
+	{
+		return AssetCost;
+	}
+
+	void instantiate_asset(AssetManager &manager, TaskGroup *, AssetID id, File &) override
+	{
+		instantiations++;
+		manager.update_cost(id, AssetCost);
+	}
+
+	void release_asset(AssetID) override
+	{
+		releases++;
+	}
+
+	void set_id_bounds(uint32_t) override
+	{
+	}
+
+	void latch_handles() override
+	{
+	}
+
+	uint64_t instantiations = 0;
+	uint64_t releases = 0;
+};
+
+// The asset manager logs every release, which would dominate the measurement.
+struct SilentLogger final : Util::LoggingInterface
+{
+	bool log(const char *, const char *, va_list) override
+	{
+		return true;
+	}
+};
+
+int main()
+{
+	AssetManager manager;
+	MockInstantiator instantiator;
+	manager.set_asset_instantiator_interface(&instantiator);
+
+	static const uint8_t data[16] = {};
+	std::vector<AssetID> ids;
+	ids.reserve(NumAssets);
+	for (unsigned i = 0; i < NumAssets; i++)
+		ids.push_back(manager.register_asset(Util::make_handle<ConstantMemoryFile>(data, sizeof(data)), AssetClass::ImageColor, 0));
+
+	// Room for a tenth of the assets, and a working set which drifts over time.
+	manager.set_asset_budget(AssetCost * NumAssets / 10);
+	manager.set_asset_budget_per_iteration(AssetCost * 256);
+
+	Random rnd;
+	uint64_t total_ns = 0;
+	uint64_t max_ns = 0;
+
+	for (unsigned frame = 0; frame < NumFrames; frame++)
+	{
+		unsigned window_base = (frame * 97) % NumAssets;
+		for (unsigned i = 0; i < UsedPerFrame; i++)
+			manager.mark_used_asset(ids[(window_base + rnd.next() % (NumAssets / 8)) % NumAssets]);
+		for (unsigned i = 0; i < PrioChangesPerFrame; i++)
+			manager.set_asset_residency_priority(ids[(window_base + rnd.next() % (NumAssets / 8)) % NumAssets], 1 + int(rnd.next() % 3));
+		for (unsigned i = 0; i < PrioChangesPerFrame; i++)
+			manager.set_asset_residency_priority(ids[rnd.next() % NumAssets], 0);
+
+		SilentLogger logger;
+		Util::set_thread_logging_interface(&logger);
+		auto start = Util::get_current_time_nsecs();
+		manager.iterate(nullptr);
+		auto ns = uint64_t(Util::get_current_time_nsecs() - start);
+		Util::set_thread_logging_interface(nullptr);
+		total_ns += ns;
+		max_ns = std::max(max_ns, ns);
+	}
+
+	LOGI("%u assets, %u frames: %.3f us / iterate on average, %.3f us max.\n",
+	     NumAssets, NumFrames, 1e-3 * double(total_ns) / NumFrames, 1e-3 * double(max_ns));
+	LOGI("%llu instantiations, %llu releases, %llu KiB resident.\n",
+	     static_cast<unsigned long long>(instantiator.instantiations),
+	     static_cast<unsigned long long>(instantiator.releases),
+	     static_cast<unsigned long long>(manager.get_current_total_consumed() / 1024));
+
+	manager.set_asset_instantiator_interface(nullptr);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+#include "asset_manager.hpp"
+#include "filesystem.hpp"
+#include "logging.hpp"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+
+using namespace Granite;
+
+static constexpr unsigned NumAssets = 4096;
+static constexpr unsigned NumThreads = 8;
+static constexpr unsigned MarksPerThread = 1u << 20;
+static constexpr unsigned CostUpdatesPerThread = 1u << 18;
+static constexpr uint64_t AssetCost = 3;
+
+struct MockInstantiator final : AssetInstantiatorInterface
+{
+	uint64_t estimate_cost_asset(AssetID, File &) override
+	{
+		return AssetCost;
+	}
+
+	void instantiate_asset(AssetManager &manager, TaskGroup *, AssetID id, File &) override
+	{
+		manager.update_cost(id, AssetCost);
+	}
+
+	void release_asset(AssetID id) override
+	{
+		released.push_back(id.id);
+	}
+
+	void set_id_bounds(uint32_t) override
+	{
+	}
+
+	void latch_handles() override
+	{
+	}
+
+	std::vector<uint32_t> released;
+};
+
+struct SilentLogger final : Util::LoggingInterface
+{
+	bool log(const char *, const char *, va_list) override
+	{
+		return true;
+	}
+};
+
+static bool make_all_resident(AssetManager &manager, std::vector<AssetID> &ids)
+{
+	static const uint8_t data[16] = {};
+	for (unsigned i = 0; i < NumAssets; i++)
+		ids.push_back(manager.register_asset(Util::make_handle<ConstantMemoryFile>(data, sizeof(data)), AssetClass::ImageColor, 1));
+
+	manager.set_asset_budget(AssetCost * NumAssets);
+	manager.set_asset_budget_per_iteration(AssetCost * NumAssets);
+	// First iteration instantiates, second one picks up the costs.
+	manager.iterate(nullptr);
+	manager.iterate(nullptr);
+
+	if (manager.get_current_total_consumed() != AssetCost * NumAssets)
+	{
+		LOGE("Expected every asset to be resident.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool test_marks()
+{
+	AssetManager manager;
+	MockInstantiator instantiator;
+	manager.set_asset_instantiator_interface(&instantiator);
+
+	std::vector<AssetID> ids;
+	if (!make_all_resident(manager, ids))
+		return false;
+
+	// Every thread marks all even IDs, many times over, in a different order.
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < NumThreads; t++)
+	{
+		threads.emplace_back([&, t]() {
+			uint32_t state = t + 1;
+			for (unsigned i = 0; i < MarksPerThread; i++)
+			{
+				state = state * 1664525u + 1013904223u;
+				manager.mark_used_asset(ids[((state >> 8) % (NumAssets / 2)) * 2]);
+			}
+			for (unsigned i = 0; i < NumAssets; i += 2)
+				manager.mark_used_asset(ids[i]);
+		});
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	// A quarter below the budget, unprioritized assets are released, least recently used first,
+	// until exactly the marked half remains.
+	for (auto &id : ids)
+		manager.set_asset_residency_priority(id, 0);
+	manager.set_asset_budget(AssetCost * NumAssets * 2 / 3);
+
+	SilentLogger logger;
+	Util::set_thread_logging_interface(&logger);
+	manager.iterate(nullptr);
+	Util::set_thread_logging_interface(nullptr);
+
+	if (instantiator.released.size() != NumAssets / 2)
+	{
+		LOGE("Released %u assets, expected %u.\n", unsigned(instantiator.released.size()), NumAssets / 2);
+		return false;
+	}
+
+	for (auto id : instantiator.released)
+	{
+		if ((id & 1) == 0)
+		{
+			LOGE("Released marked asset %u.\n", id);
+			return false;
+		}
+	}
+
+	instantiator.released.clear();
+	manager.set_asset_instantiator_interface(nullptr);
+	LOGI("%u marks from %u threads OK.\n", NumThreads * MarksPerThread, NumThreads);
+	return true;
+}
+
+static bool test_cost_updates()
+{
+	AssetManager manager;
+	MockInstantiator instantiator;
+	manager.set_asset_instantiator_interface(&instantiator);
+
+	std::vector<AssetID> ids;
+	if (!make_all_resident(manager, ids))
+		return false;
+
+	// Cost updates are always thread safe, so keep iterating while they come in.
+	// Every thread owns a slice of the assets, and ends by reporting a cost of id + 1 for each of them.
+	std::atomic_uint done_threads;
+	done_threads.store(0, std::memory_order_relaxed);
+
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < NumThreads; t++)
+	{
+		threads.emplace_back([&, t]() {
+			unsigned per_thread = NumAssets / NumThreads;
+			for (unsigned i = 0; i < CostUpdatesPerThread; i++)
+				manager.update_cost(ids[t * per_thread + i % per_thread], 1 + i % 7);
+			for (unsigned i = 0; i < per_thread; i++)
+				manager.update_cost(ids[t * per_thread + i], t * per_thread + i + 1);
+			done_threads.fetch_add(1, std::memory_order_release);
+		});
+	}
+
+	SilentLogger logger;
+	Util::set_thread_logging_interface(&logger);
+	manager.set_asset_budget(uint64_t(1) << 40);
+	unsigned iterations = 0;
+	while (done_threads.load(std::memory_order_acquire) != NumThreads)
+	{
+		manager.iterate(nullptr);
+		iterations++;
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+	manager.iterate(nullptr);
+	Util::set_thread_logging_interface(nullptr);
+
+	uint64_t expected = uint64_t(NumAssets) * (NumAssets + 1) / 2;
+	if (manager.get_current_total_consumed() != expected)
+	{
+		LOGE("Total cost is %llu, expected %llu.\n",
+		     static_cast<unsigned long long>(manager.get_current_total_consumed()),
+		     static_cast<unsigned long long>(expected));
+		return false;
+	}
+
+	if (!instantiator.released.empty())
+	{
+		LOGE("Assets were released while in budget.\n");
+		return false;
+	}
+
+	manager.set_asset_instantiator_interface(nullptr);
+	LOGI("%u cost updates from %u threads over %u iterations OK.\n",
+	     NumThreads * CostUpdatesPerThread, NumThreads, iterations);
+	return true;
+}
+
+int main()
+{
+	if (!test_marks())
+		return EXIT_FAILURE;
+	if (!test_cost_updates())
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
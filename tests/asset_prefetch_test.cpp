@@ -0,0 +1,214 @@
+#include "scene.hpp"
+#include "render_components.hpp"
+#include "abstract_renderable.hpp"
+#include "asset_manager.hpp"
+#include "camera_export.hpp"
+#include "filesystem.hpp"
+#include "os_filesystem.hpp"
+#include "transforms.hpp"
+#include "muglm/muglm_impl.hpp"
+#include "muglm/matrix_helper.hpp"
+#include "logging.hpp"
+#include <vector>
+#include <memory>
+#include <stdlib.h>
+
+using namespace Granite;
+
+struct TexturedBox : AbstractRenderable
+{
+	void get_render_info(const RenderContext &, const RenderInfoComponent *, RenderQueue &) const override
+	{
+	}
+
+	bool has_static_aabb() const override
+	{
+		return true;
+	}
+
+	const AABB *get_static_aabb() const override
+	{
+		return &aabb;
+	}
+
+	Util::ArrayView<const AssetID> get_asset_dependencies() const override
+	{
+		return { &texture, 1 };
+	}
+
+	AABB aabb = AABB(vec3(-0.5f), vec3(0.5f));
+	AssetID texture;
+};
+
+// Every activation completes right away, so an asset is either resident or not.
+struct MockInstantiator final : AssetInstantiatorInterface
+{
+	uint64_t estimate_cost_asset(AssetID, File &) override
+	{
+		return 1;
+	}
+
+	void instantiate_asset(AssetManager &manager, TaskGroup *, AssetID id, File &) override
+	{
+		resident[id.id] = true;
+		manager.update_cost(id, 1);
+	}
+
+	void release_asset(AssetID id) override
+	{
+		resident[id.id] = false;
+	}
+
+	void set_id_bounds(uint32_t bound) override
+	{
+		resident.resize(bound);
+	}
+
+	void latch_handles() override
+	{
+	}
+
+	std::vector<bool> resident;
+};
+
+struct SilentLogger final : Util::LoggingInterface
+{
+	bool log(const char *, const char *, va_list) override
+	{
+		return true;
+	}
+};
+
+static constexpr unsigned NumObjects = 256;
+static constexpr unsigned PrefetchFrames = 16;
+static constexpr float ViewDistance = 16.0f;
+
+// Plays back the recorded cameras at a constant speed, interpolating between consecutive ones.
+static std::vector<RecordedCamera> play_back_cameras(const std::vector<RecordedCamera> &recorded, float speed)
+{
+	std::vector<RecordedCamera> path;
+	float t = 0.0f;
+	for (size_t i = 0; i + 1 < recorded.size(); i++)
+	{
+		auto &a = recorded[i];
+		auto &b = recorded[i + 1];
+		float len = distance(a.position, b.position);
+
+		for (; t < len; t += speed)
+		{
+			float l = t / len;
+			RecordedCamera camera = a;
+			camera.position = mix(a.position, b.position, l);
+			camera.direction = normalize(mix(a.direction, b.direction, l));
+			camera.up = normalize(mix(a.up, b.up, l));
+			path.push_back(camera);
+		}
+
+		t -= len;
+	}
+	return path;
+}
+
+// Returns how many boxes came into view before their texture was activated.
+static unsigned count_late_activations(const std::vector<RecordedCamera> &path, bool prefetch)
+{
+	Scene scene;
+	AssetManager manager;
+	MockInstantiator instantiator;
+	static const uint8_t data[16] = {};
+
+	// Boxes at the end of the corridor get the lowest IDs, so ID order does not happen to match the path.
+	std::vector<Util::IntrusivePtr<TexturedBox>> boxes(NumObjects);
+	for (unsigned i = NumObjects; i; i--)
+	{
+		auto &box = boxes[i - 1];
+		box = Util::make_handle<TexturedBox>();
+		box->texture = manager.register_asset(Util::make_handle<ConstantMemoryFile>(data, sizeof(data)), AssetClass::ImageColor);
+	}
+
+	for (unsigned i = 0; i < NumObjects; i++)
+	{
+		auto node = scene.create_node();
+		node->get_transform().translation = vec3(0.0f, 0.0f, -2.0f - float(i));
+		node->invalidate_cached_transform();
+		scene.create_renderable(boxes[i], node.get());
+	}
+	scene.update_all_transforms();
+
+	// Everything fits in the budget, but only two textures can be activated per frame.
+	manager.set_asset_instantiator_interface(&instantiator);
+	manager.set_asset_budget(NumObjects);
+	manager.set_asset_budget_per_iteration(2);
+
+	std::vector<bool> seen(NumObjects);
+	unsigned late = 0;
+	VisibilityList visible;
+
+	SilentLogger logger;
+	Util::set_thread_logging_interface(&logger);
+
+	for (size_t frame = 0; frame < path.size(); frame++)
+	{
+		auto &camera = path[frame];
+		mat4 view = mat4_cast(look_at(camera.direction, camera.up)) * translate(-camera.position);
+		mat4 view_projection = projection(camera.fovy, camera.aspect, camera.znear, camera.zfar) * view;
+
+		if (prefetch)
+		{
+			vec3 velocity = frame ? camera.position - path[frame - 1].position : vec3(0.0f);
+			scene.hint_future_asset_use(manager, view_projection, velocity, PrefetchFrames);
+		}
+
+		Frustum frustum;
+		frustum.build_planes(inverse(view_projection));
+		visible.clear();
+		scene.gather_visible_opaque_renderables(frustum, visible);
+
+		for (auto &info : visible)
+		{
+			for (auto &id : info.renderable->get_asset_dependencies())
+			{
+				if (!seen[id.id] && !instantiator.resident[id.id])
+					late++;
+				seen[id.id] = true;
+				manager.mark_used_asset(id);
+			}
+		}
+
+		manager.iterate(nullptr);
+	}
+
+	Util::set_thread_logging_interface(nullptr);
+	manager.set_asset_instantiator_interface(nullptr);
+	return late;
+}
+
+int main()
+{
+	// Camera keyframes down the corridor, in the cameras.json format the scene viewer exports.
+	Filesystem fs;
+	fs.register_protocol("assets", std::make_unique<OSFilesystem>(ASSET_DIRECTORY));
+	std::string json;
+	std::vector<RecordedCamera> recorded;
+	if (!fs.read_file_to_string("assets://cameras/corridor.json", json) ||
+	    !import_cameras_from_json(json, recorded))
+	{
+		LOGE("Failed to load recorded cameras.\n");
+		return EXIT_FAILURE;
+	}
+
+	// One box per frame.
+	auto path = play_back_cameras(recorded, 1.0f);
+	unsigned late = count_late_activations(path, false);
+	unsigned late_prefetch = count_late_activations(path, true);
+	LOGI("%u late activations, %u with prefetching.\n", late, late_prefetch);
+
+	// When prefetching, only boxes seen while the first frame's backlog is still being activated may be late.
+	if (late_prefetch * 4 > late || late_prefetch > 2 * unsigned(ViewDistance))
+	{
+		LOGE("Prefetching did not avoid late activations.\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
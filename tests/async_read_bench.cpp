@@ -0,0 +1,190 @@
+#include "filesystem.hpp"
+#include "os_filesystem.hpp"
+#include "async_reader.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <vector>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace Granite;
+
+static constexpr unsigned NumSmallFiles = 4000;
+static constexpr size_t SmallFileSize = 4 * 1024;
+static constexpr unsigned NumLargeFiles = 8;
+static constexpr size_t LargeFileSize = 8 * 1024 * 1024;
+
+struct TestFile
+{
+	std::string path;
+	size_t size;
+};
+
+static uint64_t checksum(const void *data, size_t size)
+{
+	auto *words = static_cast<const uint64_t *>(data);
+	uint64_t sum = 0;
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+		sum = sum * 31 + words[i];
+	return sum;
+}
+
+static bool write_files(OSFilesystem &fs, std::vector<TestFile> &files)
+{
+	uint32_t state = 1;
+	for (unsigned i = 0; i < NumSmallFiles + NumLargeFiles; i++)
+	{
+		TestFile test_file;
+		test_file.path = i < NumSmallFiles ? ("small-" + std::to_string(i)) : ("large-" + std::to_string(i - NumSmallFiles));
+		test_file.size = i < NumSmallFiles ? SmallFileSize : LargeFileSize;
+
+		auto file = fs.open(test_file.path, FileMode::WriteOnly);
+		if (!file)
+			return false;
+		auto mapping = file->map_write(test_file.size);
+		if (!mapping)
+			return false;
+
+		auto *words = mapping->mutable_data<uint32_t>();
+		for (size_t j = 0; j < test_file.size / sizeof(uint32_t); j++)
+		{
+			state = state * 1664525u + 1013904223u;
+			words[j] = state;
+		}
+
+		files.push_back(std::move(test_file));
+	}
+
+	return true;
+}
+
+static void drop_page_cache(OSFilesystem &fs, const std::vector<TestFile> &files)
+{
+#ifdef __linux__
+	for (auto &file : files)
+	{
+		int fd = ::open(fs.get_filesystem_path(file.path).c_str(), O_RDONLY);
+		if (fd < 0)
+			continue;
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		::close(fd);
+	}
+#else
+	(void)fs;
+	(void)files;
+#endif
+}
+
+static uint64_t read_mmap(OSFilesystem &fs, const std::vector<TestFile> &files)
+{
+	uint64_t sum = 0;
+	for (auto &test_file : files)
+	{
+		auto file = fs.open(test_file.path, FileMode::ReadOnly);
+		auto mapping = file ? file->map() : FileMappingHandle{};
+		if (!mapping)
+			return 0;
+		sum += checksum(mapping->data(), mapping->get_size());
+	}
+	return sum;
+}
+
+static uint64_t read_async(OSFilesystem &fs, const std::vector<TestFile> &files)
+{
+	// Submit everything up front like AssetManager::iterate() does, then consume in order.
+	std::vector<Util::IntrusivePtr<PrefetchedFile>> prefetched;
+	prefetched.reserve(files.size());
+	for (auto &test_file : files)
+	{
+		auto file = fs.open(test_file.path, FileMode::ReadOnly);
+		if (!file)
+			return 0;
+		prefetched.push_back(PrefetchedFile::read(*file));
+	}
+
+	uint64_t sum = 0;
+	for (auto &file : prefetched)
+	{
+		auto mapping = file->map();
+		if (!mapping)
+			return 0;
+		sum += checksum(mapping->data(), mapping->get_size());
+	}
+	return sum;
+}
+
+static bool run(OSFilesystem &fs, const std::vector<TestFile> &files, size_t begin, size_t end, const char *tag)
+{
+	std::vector<TestFile> subset(files.begin() + begin, files.begin() + end);
+	size_t total_size = 0;
+	for (auto &file : subset)
+		total_size += file.size;
+	double mib = double(total_size) / (1024.0 * 1024.0);
+
+	uint64_t reference = 0;
+	for (bool cold : { true, false })
+	{
+		for (bool async : { false, true })
+		{
+			if (cold)
+				drop_page_cache(fs, subset);
+			else
+				(async ? read_async : read_mmap)(fs, subset);
+
+			auto start = Util::get_current_time_nsecs();
+			uint64_t sum = (async ? read_async : read_mmap)(fs, subset);
+			double seconds = 1e-9 * double(Util::get_current_time_nsecs() - start);
+
+			if (!async && cold)
+				reference = sum;
+			if (sum == 0 || sum != reference)
+			{
+				LOGE("Checksum mismatch for %s.\n", tag);
+				return false;
+			}
+
+			LOGI("%s, %s, %s: %8.3f ms, %8.1f MiB/s.\n", tag, cold ? "cold" : "warm", async ? "read_async" : "mmap",
+			     seconds * 1e3, mib / seconds);
+		}
+	}
+
+	return true;
+}
+
+int main()
+{
+	char dir[] = "/tmp/granite-async-read-XXXXXX";
+	if (!mkdtemp(dir))
+	{
+		LOGE("Failed to create temporary directory.\n");
+		return EXIT_FAILURE;
+	}
+
+	bool ret;
+	{
+		OSFilesystem fs(dir);
+		LOGI("Backend: %s.\n", AsyncReader::get().get_backend() == AsyncReader::Backend::IOUring ? "io_uring" : "thread pool");
+
+		std::vector<TestFile> files;
+		ret = write_files(fs, files);
+		if (!ret)
+			LOGE("Failed to write test files.\n");
+
+		if (ret)
+		{
+			ret = run(fs, files, 0, NumSmallFiles, "small files") &&
+			      run(fs, files, NumSmallFiles, files.size(), "large files");
+		}
+
+		for (auto &file : files)
+			fs.remove(file.path);
+	}
+
+	rmdir(dir);
+	return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,301 @@
+#include "blob_archive.hpp"
+#include "filesystem.hpp"
+#include "os_filesystem.hpp"
+#include "lz4_block.hpp"
+#include "logging.hpp"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+using namespace Granite;
+
+struct Random
+{
+	uint32_t state = 1;
+	uint32_t next()
+	{
+		state = state * 1664525u + 1013904223u;
+		return state ^ (state >> 16);
+	}
+};
+
+struct TestFile
+{
+	std::string path;
+	std::vector<uint8_t> data;
+};
+
+static std::vector<uint8_t> make_data(Random &rnd, size_t size, unsigned symbols)
+{
+	// Few symbols in short runs compress well, many symbols do not compress at all.
+	std::vector<uint8_t> data(size);
+	for (size_t i = 0; i < size;)
+	{
+		size_t run = std::min<size_t>(size - i, 1 + rnd.next() % 8);
+		uint8_t v = uint8_t(rnd.next() % symbols);
+		memset(data.data() + i, v, run);
+		i += run;
+	}
+
+	if (symbols == 256)
+		for (auto &v : data)
+			v = uint8_t(rnd.next());
+
+	return data;
+}
+
+static bool test_lz4()
+{
+	Random rnd;
+	for (size_t size : { 0, 1, 5, 12, 13, 64, 1000, 65536 })
+	{
+		for (unsigned symbols : { 1u, 4u, 256u })
+		{
+			auto data = make_data(rnd, size, symbols);
+			std::vector<uint8_t> compressed(Util::lz4_compress_bound(size));
+			size_t compressed_size = Util::lz4_compress(compressed.data(), compressed.size(), data.data(), size);
+			if (compressed_size == 0)
+			{
+				LOGE("Failed to compress %zu bytes.\n", size);
+				return false;
+			}
+
+			std::vector<uint8_t> decompressed(size);
+			if (!Util::lz4_decompress(decompressed.data(), size, compressed.data(), compressed_size) ||
+			    decompressed != data)
+			{
+				LOGE("Round trip failed for %zu bytes.\n", size);
+				return false;
+			}
+
+			if (size && Util::lz4_decompress(decompressed.data(), size, compressed.data(), compressed_size - 1))
+			{
+				LOGE("Truncated input was accepted.\n");
+				return false;
+			}
+		}
+	}
+
+	LOGI("LZ4 OK.\n");
+	return true;
+}
+
+static bool test_v1()
+{
+	// Layout as written by tools/blobify.py.
+	const char payload[] = "abcdefgh";
+	std::vector<uint8_t> blob;
+	const auto append = [&](const void *data, size_t size) {
+		blob.insert(blob.end(), static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + size);
+	};
+
+	append("BLOBBY01", 8);
+	for (auto &entry : { std::make_pair("dir/a", 0ull), std::make_pair("b", 4ull) })
+	{
+		append("ENTR", 4);
+		uint8_t len = uint8_t(strlen(entry.first));
+		append(&len, 1);
+		append(entry.first, len);
+		uint64_t offset = entry.second;
+		uint64_t size = 4;
+		append(&offset, sizeof(offset));
+		append(&size, sizeof(size));
+	}
+	append("DATA", 4);
+	append(payload, 8);
+
+	BlobFilesystem fs(Util::make_handle<ConstantMemoryFile>(blob.data(), blob.size()));
+	auto file = fs.open("b", FileMode::ReadOnly);
+	auto mapping = file ? file->map() : FileMappingHandle{};
+	if (!mapping || mapping->get_size() != 4 || memcmp(mapping->data(), "efgh", 4) != 0)
+	{
+		LOGE("Failed to read BLOBBY01 file.\n");
+		return false;
+	}
+
+	if (fs.list("dir").size() != 1)
+	{
+		LOGE("Failed to list BLOBBY01 directory.\n");
+		return false;
+	}
+
+	LOGI("BLOBBY01 OK.\n");
+	return true;
+}
+
+static bool verify_file(BlobFilesystem &fs, const TestFile &test_file, Random &rnd)
+{
+	FileStat s = {};
+	if (!fs.stat(test_file.path, s) || s.type != PathType::File || s.size != test_file.data.size())
+	{
+		LOGE("Failed to stat %s.\n", test_file.path.c_str());
+		return false;
+	}
+
+	auto file = fs.open(test_file.path, FileMode::ReadOnly);
+	if (!file || file->get_size() != test_file.data.size())
+	{
+		LOGE("Failed to open %s.\n", test_file.path.c_str());
+		return false;
+	}
+
+	auto mapping = file->map();
+	if (!mapping || (!test_file.data.empty() && memcmp(mapping->data(), test_file.data.data(), test_file.data.size()) != 0))
+	{
+		LOGE("Contents of %s do not match.\n", test_file.path.c_str());
+		return false;
+	}
+
+	// Background reads go through read_async() instead.
+	auto prefetched = PrefetchedFile::read(*file);
+	if (!prefetched->wait() || prefetched->get_size() != test_file.data.size() ||
+	    (!test_file.data.empty() && memcmp(prefetched->map()->data(), test_file.data.data(), test_file.data.size()) != 0))
+	{
+		LOGE("Contents of %s do not match when read asynchronously.\n", test_file.path.c_str());
+		return false;
+	}
+
+	// Random access, including ranges crossing chunk boundaries.
+	for (unsigned i = 0; i < 64 && !test_file.data.empty(); i++)
+	{
+		size_t offset = rnd.next() % test_file.data.size();
+		size_t range = std::min<size_t>(test_file.data.size() - offset, rnd.next() % (3 * 4096));
+		auto sub = file->map_subset(offset, range);
+		if (!sub || memcmp(sub->data(), test_file.data.data() + offset, range) != 0)
+		{
+			LOGE("Range [%zu, %zu) of %s does not match.\n", offset, offset + range, test_file.path.c_str());
+			return false;
+		}
+
+		auto prefetched_sub = PrefetchedFile::read(*Util::make_handle<FileSlice>(file, offset, range));
+		if (!prefetched_sub->wait() || prefetched_sub->get_size() != range ||
+		    memcmp(prefetched_sub->map()->data(), test_file.data.data() + offset, range) != 0)
+		{
+			LOGE("Range [%zu, %zu) of %s does not match when read asynchronously.\n",
+			     offset, offset + range, test_file.path.c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool test_v2()
+{
+	Random rnd;
+	std::vector<TestFile> files = {
+		{ "a.txt", { 'h', 'e', 'l', 'l', 'o' } },
+		{ "textures/compressible.bin", make_data(rnd, 1024 * 1024 + 123, 4) },
+		{ "textures/random.bin", make_data(rnd, 300 * 1024, 256) },
+		{ "textures/deep/empty.bin", {} },
+		{ "meshes/mesh.bin", make_data(rnd, 200 * 1024, 16) },
+	};
+
+	char path[] = "/tmp/granite-blob-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return false;
+	close(fd);
+
+	BlobArchive::Packer packer;
+	packer.set_compression(BlobArchive::Compression::LZ4);
+	packer.set_chunk_size(4096);
+	size_t total_size = 0;
+	for (auto &file : files)
+	{
+		packer.add_file(file.path, Util::make_handle<ConstantMemoryFile>(file.data.data(), file.data.size()));
+		total_size += file.data.size();
+	}
+
+	if (packer.add_file("a.txt", Util::make_handle<ConstantMemoryFile>(nullptr, 0)) && packer.write(path))
+	{
+		LOGE("Duplicate path was accepted.\n");
+		return false;
+	}
+
+	BlobArchive::Packer duplicate_free;
+	duplicate_free.set_compression(BlobArchive::Compression::LZ4);
+	duplicate_free.set_chunk_size(4096);
+	for (auto &file : files)
+		duplicate_free.add_file(file.path, Util::make_handle<ConstantMemoryFile>(file.data.data(), file.data.size()));
+
+	bool ret = duplicate_free.write(path);
+	if (!ret)
+		LOGE("Failed to write archive.\n");
+
+	OSFilesystem os_fs("/");
+	auto archive = ret ? os_fs.open(path, FileMode::ReadOnly) : FileHandle{};
+	if (ret && (!archive || archive->get_size() >= total_size))
+	{
+		LOGE("Archive was not compressed.\n");
+		ret = false;
+	}
+
+	if (ret)
+	{
+		BlobFilesystem fs(archive);
+		for (auto &file : files)
+			if (ret)
+				ret = verify_file(fs, file, rnd);
+
+		auto root = fs.list("");
+		auto textures = fs.list("textures");
+		if (ret && (root.size() != 3 || textures.size() != 3 || fs.list("textures/deep").size() != 1))
+		{
+			LOGE("Unexpected directory listing.\n");
+			ret = false;
+		}
+
+		for (auto &entry : textures)
+		{
+			if (ret && entry.path == "textures/deep" && entry.type != PathType::Directory)
+			{
+				LOGE("Expected a directory.\n");
+				ret = false;
+			}
+		}
+
+		if (ret && (fs.open("textures", FileMode::ReadOnly) || fs.open("missing.bin", FileMode::ReadOnly) || fs.open("a.txt", FileMode::WriteOnly)))
+		{
+			LOGE("Opened something which is not a readable file.\n");
+			ret = false;
+		}
+
+		auto compressible = fs.open("textures/compressible.bin", FileMode::ReadOnly);
+		if (ret && (!compressible || !compressible->has_async_read()))
+		{
+			LOGE("Compressed file does not read in the background.\n");
+			ret = false;
+		}
+
+		// Incompressible files are stored as-is, aligned for direct upload.
+		auto random = fs.open("textures/random.bin", FileMode::ReadOnly);
+		auto mapping = random ? random->map() : FileMappingHandle{};
+		if (ret && (!mapping || (reinterpret_cast<uintptr_t>(mapping->data()) & (BlobArchive::DefaultAlignment - 1)) != 0))
+		{
+			LOGE("Uncompressed file is not aligned.\n");
+			ret = false;
+		}
+
+		if (ret)
+			LOGI("BLOBBY02 OK, %zu bytes stored in %llu.\n", total_size, static_cast<unsigned long long>(archive->get_size()));
+	}
+
+	unlink(path);
+	return ret;
+}
+
+int main()
+{
+	if (!test_lz4())
+		return EXIT_FAILURE;
+	if (!test_v1())
+		return EXIT_FAILURE;
+	if (!test_v2())
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
@@ -21,9 +21,13 @@
  */
 
 #include "cooperative_task.hpp"
+#include "thread_group.hpp"
 #include "logging.hpp"
+#include <atomic>
+#include <stdlib.h>
 
 using namespace Util;
+using namespace Granite;
 
 struct PrinterTask : CooperativeTaskRunnable
 {
@@ -37,6 +41,138 @@ struct PrinterTask : CooperativeTaskRunnable
 	}
 };
 
+static constexpr unsigned NestingDepth = 10;
+
+// Every level waits on two children from inside a task.
+// With a single worker, this can only make progress if waits suspend the task.
+static void spawn_nested(ThreadGroup &group, std::atomic_uint &leaves, unsigned depth)
+{
+	if (depth == NestingDepth)
+	{
+		leaves.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	auto children = group.create_task();
+	for (unsigned i = 0; i < 2; i++)
+	{
+		children->enqueue_task([&group, &leaves, depth]() {
+			spawn_nested(group, leaves, depth + 1);
+		});
+	}
+	children->wait();
+}
+
+static bool run_nested_wait_test(ThreadGroupScheduler scheduler, unsigned num_threads)
+{
+	ThreadGroup group;
+	group.set_fiber_waits(true);
+	// With a FIFO queue, every level is started before any leaf completes, and a blocking wait would deadlock.
+	group.set_fiber_wait_limit(1u << NestingDepth);
+	group.start(num_threads, 0, {}, scheduler);
+
+	std::atomic_uint leaves;
+	leaves.store(0);
+
+	auto root = group.create_task([&]() {
+		spawn_nested(group, leaves, 0);
+	});
+	root->wait();
+
+	if (leaves.load() != 1u << NestingDepth)
+	{
+		LOGE("Expected %u leaves, got %u.\n", 1u << NestingDepth, leaves.load());
+		return false;
+	}
+
+	return true;
+}
+
+static void spawn_chain(ThreadGroup &group, std::atomic_uint &links, unsigned depth)
+{
+	links.fetch_add(1, std::memory_order_relaxed);
+	if (!depth)
+		return;
+
+	auto child = group.create_task([&group, &links, depth]() {
+		spawn_chain(group, links, depth - 1);
+	});
+	child->wait();
+}
+
+// With one fiber per worker, every wait inside a task has to fall back to blocking its worker.
+static bool run_wait_limit_test(ThreadGroupScheduler scheduler)
+{
+	constexpr unsigned NumThreads = 4;
+	ThreadGroup group;
+	group.set_fiber_waits(true);
+	group.set_fiber_wait_limit(1);
+	group.start(NumThreads, 0, {}, scheduler);
+
+	std::atomic_uint links;
+	links.store(0);
+
+	// Each waiting link blocks one worker, so one is always left to run the next link.
+	auto root = group.create_task([&]() {
+		spawn_chain(group, links, NumThreads - 1);
+	});
+	root->wait();
+
+	if (links.load() != NumThreads)
+	{
+		LOGE("Expected %u links, got %u.\n", NumThreads, links.load());
+		return false;
+	}
+
+	return true;
+}
+
+// A task waits on a signal which is only incremented by tasks queued after it.
+static bool run_signal_wait_test(ThreadGroupScheduler scheduler, unsigned num_threads)
+{
+	ThreadGroup group;
+	group.set_fiber_waits(true);
+	group.start(num_threads, 0, {}, scheduler);
+
+	constexpr unsigned NumWaiters = 8;
+	constexpr unsigned NumSignals = 16;
+	TaskSignal signal;
+	std::atomic_uint woken;
+	woken.store(0);
+
+	auto waiters = group.create_task();
+	for (unsigned i = 0; i < NumWaiters; i++)
+	{
+		waiters->enqueue_task([&signal, &woken, i]() {
+			signal.wait_until_at_least(NumSignals - i);
+			woken.fetch_add(1, std::memory_order_relaxed);
+		});
+	}
+	waiters->flush();
+
+	auto signallers = group.create_task();
+	for (unsigned i = 0; i < NumSignals; i++)
+	{
+		signallers->enqueue_task([&signal]() {
+			signal.signal_increment();
+		});
+	}
+	signallers->flush();
+
+	waiters->wait();
+	signallers->wait();
+	group.wait_idle();
+
+	if (woken.load() != NumWaiters || signal.get_count() != NumSignals)
+	{
+		LOGE("Expected %u woken waiters and %u signals, got %u and %u.\n",
+		     NumWaiters, NumSignals, woken.load(), unsigned(signal.get_count()));
+		return false;
+	}
+
+	return true;
+}
+
 int main()
 {
 	CooperativeTask task(std::make_unique<PrinterTask>());
@@ -45,5 +181,26 @@ int main()
 		LOGI(":D\n");
 		task.resume(0.0);
 	}
-}
 
+	for (auto scheduler : { ThreadGroupScheduler::SharedQueue, ThreadGroupScheduler::WorkStealing })
+	{
+		for (unsigned num_threads : { 1u, 2u, 4u })
+		{
+			if (!run_nested_wait_test(scheduler, num_threads) ||
+			    !run_signal_wait_test(scheduler, num_threads))
+			{
+				LOGE("Fiber wait test failed with %u threads.\n", num_threads);
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (!run_wait_limit_test(scheduler))
+		{
+			LOGE("Fiber wait limit test failed.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	LOGI("Fiber wait tests passed.\n");
+	return EXIT_SUCCESS;
+}
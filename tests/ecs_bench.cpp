@@ -0,0 +1,226 @@
+#include "ecs.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <utility>
+
+using namespace Granite;
+
+// Roughly shaped like RenderInfoComponent and CachedSpatialTransformTimestampComponent.
+struct BenchTransformComponent : ComponentBase
+{
+	GRANITE_COMPONENT_TYPE_DECL(BenchTransformComponent)
+	float world_transform[16];
+	float aabb[8];
+};
+
+struct BenchTimestampComponent : ComponentBase
+{
+	GRANITE_COMPONENT_TYPE_DECL(BenchTimestampComponent)
+	uint64_t last_timestamp = 0;
+};
+
+struct BenchTagComponent : ComponentBase
+{
+	GRANITE_COMPONENT_TYPE_DECL(BenchTagComponent)
+	uint32_t tag = 0;
+};
+
+static constexpr unsigned NumEntities = 200000;
+static constexpr unsigned NumIterations = 20;
+
+static const char *storage_name(EntityStorage storage)
+{
+	return storage == EntityStorage::Archetypes ? "archetypes" : "component pools";
+}
+
+static double elapsed_ns(int64_t start, unsigned count)
+{
+	return double(Util::get_current_time_nsecs() - start) / double(count);
+}
+
+static void run_bench(EntityStorage storage)
+{
+	EntityPool pool(storage);
+	std::vector<Entity *> entities;
+	entities.reserve(NumEntities);
+
+	auto start = Util::get_current_time_nsecs();
+	for (unsigned i = 0; i < NumEntities; i++)
+	{
+		auto *e = pool.create_entity();
+		auto *transform = e->allocate_component<BenchTransformComponent>();
+		transform->world_transform[0] = float(i);
+		e->allocate_component<BenchTimestampComponent>();
+		entities.push_back(e);
+	}
+	double create_ns = elapsed_ns(start, NumEntities);
+
+	// Both layouts see the same interleaving of structural changes.
+	// Churn half of the entities in random order, so pooled components are no longer laid out in iteration order,
+	// as they would be after a while in a live scene.
+	uint32_t rng = 1;
+	for (unsigned i = NumEntities - 1; i; i--)
+	{
+		rng = rng * 1664525u + 1013904223u;
+		std::swap(entities[i], entities[(rng >> 8) % (i + 1)]);
+	}
+
+	for (unsigned i = 0; i < NumEntities / 2; i++)
+		pool.delete_entity(entities[i]);
+
+	for (unsigned i = 0; i < NumEntities / 2; i++)
+	{
+		auto *e = pool.create_entity();
+		auto *transform = e->allocate_component<BenchTransformComponent>();
+		transform->world_transform[0] = float(i);
+		e->allocate_component<BenchTimestampComponent>();
+		entities[i] = e;
+	}
+
+	for (unsigned i = 0; i < NumEntities; i += 3)
+		entities[i]->allocate_component<BenchTagComponent>();
+
+	auto *group = pool.get_component_group_holder<BenchTransformComponent, BenchTimestampComponent>();
+	uint64_t checksum = 0;
+
+	start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < NumIterations; iter++)
+	{
+		for (auto &e : group->get_groups())
+		{
+			auto *transform = get_component<BenchTransformComponent>(e);
+			auto *timestamp = get_component<BenchTimestampComponent>(e);
+			timestamp->last_timestamp += uint64_t(transform->world_transform[0]);
+		}
+	}
+	double iterate_ns = elapsed_ns(start, NumIterations * NumEntities);
+
+	start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < NumIterations; iter++)
+	{
+		group->for_each_chunk([](const EntityChunk<BenchTransformComponent, BenchTimestampComponent> &chunk) {
+			auto *transforms = chunk.get<BenchTransformComponent>();
+			auto *timestamps = chunk.get<BenchTimestampComponent>();
+			for (size_t i = 0; i < chunk.count; i++)
+				timestamps[i].last_timestamp += uint64_t(transforms[i].world_transform[0]);
+		});
+	}
+	double chunk_ns = elapsed_ns(start, NumIterations * NumEntities);
+
+	for (auto &e : group->get_groups())
+		checksum += get_component<BenchTimestampComponent>(e)->last_timestamp;
+
+	// Random access by entity, in creation order.
+	start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < NumIterations; iter++)
+		for (auto *e : entities)
+			checksum += e->get_component<BenchTimestampComponent>()->last_timestamp & 1;
+	double lookup_ns = elapsed_ns(start, NumIterations * NumEntities);
+
+	start = Util::get_current_time_nsecs();
+	for (unsigned i = 0; i < NumEntities; i++)
+		entities[i]->free_component<BenchTimestampComponent>();
+	double remove_ns = elapsed_ns(start, NumEntities);
+
+	start = Util::get_current_time_nsecs();
+	for (auto *e : entities)
+		pool.delete_entity(e);
+	double delete_ns = elapsed_ns(start, NumEntities);
+
+	LOGI("%16s: create %6.1f ns, iterate %5.2f ns, chunk iterate %5.2f ns, lookup %5.2f ns, remove %6.1f ns, delete %6.1f ns (checksum %llu).\n",
+	     storage_name(storage), create_ns, iterate_ns, chunk_ns, lookup_ns, remove_ns, delete_ns,
+	     static_cast<unsigned long long>(checksum));
+}
+
+static constexpr unsigned NumSpawned = 50000;
+
+static void register_spawn_groups(EntityPool &pool)
+{
+	// A handful of overlapping groups, like a scene has for its various passes.
+	pool.get_component_group<BenchTransformComponent>();
+	pool.get_component_group<BenchTimestampComponent>();
+	pool.get_component_group<BenchTagComponent>();
+	pool.get_component_group<BenchTransformComponent, BenchTimestampComponent>();
+	pool.get_component_group<BenchTransformComponent, BenchTagComponent>();
+	pool.get_component_group<BenchTimestampComponent, BenchTagComponent>();
+	pool.get_component_group<BenchTransformComponent, BenchTimestampComponent, BenchTagComponent>();
+}
+
+static void run_spawn_bench(EntityStorage storage)
+{
+	double spawn_ns, despawn_ns, batch_spawn_ns, batch_despawn_ns;
+	size_t count_immediate, count_batched;
+
+	{
+		EntityPool pool(storage);
+		register_spawn_groups(pool);
+		std::vector<Entity *> entities;
+		entities.reserve(NumSpawned);
+
+		auto start = Util::get_current_time_nsecs();
+		for (unsigned i = 0; i < NumSpawned; i++)
+		{
+			auto *e = pool.create_entity();
+			e->allocate_component<BenchTransformComponent>();
+			e->allocate_component<BenchTimestampComponent>();
+			e->allocate_component<BenchTagComponent>();
+			entities.push_back(e);
+		}
+		spawn_ns = elapsed_ns(start, NumSpawned);
+		count_immediate = pool.get_component_group<BenchTransformComponent, BenchTimestampComponent, BenchTagComponent>().size();
+
+		start = Util::get_current_time_nsecs();
+		for (auto *e : entities)
+			pool.delete_entity(e);
+		despawn_ns = elapsed_ns(start, NumSpawned);
+	}
+
+	{
+		EntityPool pool(storage);
+		register_spawn_groups(pool);
+		EntityCommandBuffer buffer;
+
+		auto start = Util::get_current_time_nsecs();
+		for (unsigned i = 0; i < NumSpawned; i++)
+		{
+			auto e = buffer.create_entity();
+			buffer.allocate_component<BenchTransformComponent>(e);
+			buffer.allocate_component<BenchTimestampComponent>(e);
+			buffer.allocate_component<BenchTagComponent>(e);
+		}
+		pool.commit(buffer);
+		batch_spawn_ns = elapsed_ns(start, NumSpawned);
+		count_batched = pool.get_component_group<BenchTransformComponent, BenchTimestampComponent, BenchTagComponent>().size();
+
+		start = Util::get_current_time_nsecs();
+		for (auto *e : buffer.get_created_entities())
+			buffer.delete_entity(e->get_id());
+		pool.commit(buffer);
+		batch_despawn_ns = elapsed_ns(start, NumSpawned);
+	}
+
+	LOGI("%16s: spawn %6.1f ns, despawn %6.1f ns, batched spawn %6.1f ns, batched despawn %6.1f ns (%zu / %zu).\n",
+	     storage_name(storage), spawn_ns, despawn_ns, batch_spawn_ns, batch_despawn_ns,
+	     count_immediate, count_batched);
+}
+
+int main()
+{
+	LOGI("%u entities, times per entity.\n", NumEntities);
+	for (unsigned i = 0; i < 2; i++)
+	{
+		run_bench(EntityStorage::ComponentPools);
+		run_bench(EntityStorage::Archetypes);
+	}
+
+	LOGI("%u entities with 3 components and 7 groups, times per entity.\n", NumSpawned);
+	for (unsigned i = 0; i < 2; i++)
+	{
+		run_spawn_bench(EntityStorage::ComponentPools);
+		run_spawn_bench(EntityStorage::Archetypes);
+	}
+	return EXIT_SUCCESS;
+}
@@ -1,5 +1,12 @@
 #include "ecs.hpp"
+#include "system_scheduler.hpp"
+#include "thread_group.hpp"
 #include "logging.hpp"
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <thread>
 
 using namespace Granite;
 
@@ -33,9 +40,9 @@ struct CComponent : ComponentBase
 	int v;
 };
 
-int main()
+static void run_basic_test(EntityStorage storage)
 {
-	EntityPool pool;
+	EntityPool pool(storage);
 	auto a = pool.create_entity();
 	a->allocate_component<AComponent>(10);
 	a->allocate_component<BComponent>(20);
@@ -52,4 +59,511 @@ int main()
 		LOGI("BA: %d, %d\n", get<0>(e)->v, get<1>(e)->v);
 	for (auto &e : group_bc)
 		LOGI("BC: %d\n", get<0>(e)->v);
-}
\ No newline at end of file
+}
+
+struct GroupSums
+{
+	size_t count_ab;
+	size_t count_bc;
+	int64_t sum_ab;
+	int64_t sum_bc;
+};
+
+static void summarize_groups(EntityPool &pool, GroupSums &sums)
+{
+	sums = {};
+	for (auto &e : pool.get_component_group<AComponent, BComponent>())
+	{
+		sums.count_ab++;
+		sums.sum_ab += get_component<AComponent>(e)->v + get_component<BComponent>(e)->v;
+	}
+
+	for (auto &e : pool.get_component_group<BComponent, CComponent>())
+	{
+		sums.count_bc++;
+		sums.sum_bc += get_component<BComponent>(e)->v + get_component<CComponent>(e)->v;
+	}
+}
+
+static bool operator==(const GroupSums &a, const GroupSums &b)
+{
+	return a.count_ab == b.count_ab && a.sum_ab == b.sum_ab &&
+	       a.count_bc == b.count_bc && a.sum_bc == b.sum_bc;
+}
+
+// Applies the same pseudo-random sequence of structural changes to a pool,
+// and summarizes what the groups see through both per-entity and per-chunk iteration.
+static bool run_random_ops(EntityStorage storage, GroupSums &sums)
+{
+	EntityPool pool(storage);
+	std::vector<Entity *> live;
+	uint32_t rng = 1;
+	const auto next = [&]() -> uint32_t {
+		rng = rng * 1664525u + 1013904223u;
+		return rng >> 8;
+	};
+
+	for (unsigned i = 0; i < 20000; i++)
+	{
+		unsigned op = next() % 8;
+		if (op < 3 || live.empty())
+		{
+			auto *e = pool.create_entity();
+			e->allocate_component<AComponent>(int(i));
+			if (next() & 1)
+				e->allocate_component<BComponent>(int(i * 2));
+			live.push_back(e);
+		}
+		else
+		{
+			auto index = next() % live.size();
+			auto *e = live[index];
+			switch (op)
+			{
+			case 3:
+				e->allocate_component<CComponent>(int(i * 3));
+				break;
+			case 4:
+				e->free_component<AComponent>();
+				break;
+			case 5:
+				e->allocate_component<BComponent>(int(i * 5));
+				break;
+			case 6:
+				e->free_component<BComponent>();
+				break;
+			default:
+				pool.delete_entity(e);
+				live[index] = live.back();
+				live.pop_back();
+				break;
+			}
+		}
+
+		// Touch a group mid-way so lazily built caches get exercised.
+		if (i == 10000)
+			pool.get_component_group<AComponent, BComponent>();
+	}
+
+	summarize_groups(pool, sums);
+
+	size_t chunk_count = 0;
+	int64_t chunk_sum = 0;
+	pool.get_component_group_holder<AComponent, BComponent>()->for_each_chunk(
+			[&](const EntityChunk<AComponent, BComponent> &chunk) {
+				auto *a = chunk.get<AComponent>();
+				auto *b = chunk.get<BComponent>();
+				for (size_t i = 0; i < chunk.count; i++)
+				{
+					if (chunk.entities[i]->get_component<AComponent>() != &a[i])
+						chunk_count = SIZE_MAX / 2;
+					chunk_sum += a[i].v + b[i].v;
+				}
+				chunk_count += chunk.count;
+			});
+
+	if (chunk_count != sums.count_ab || chunk_sum != sums.sum_ab)
+	{
+		LOGE("Chunk iteration does not match group.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool run_handle_test(EntityStorage storage)
+{
+	EntityPool pool(storage);
+	auto *a = pool.create_entity();
+	a->allocate_component<AComponent>(1);
+	EntityID id = a->get_id();
+
+	if (pool.get_entity(id) != a)
+	{
+		LOGE("Handle does not resolve to its entity.\n");
+		return false;
+	}
+
+	uint32_t slot = a->get_slot();
+	pool.delete_entity(a);
+
+	// The slot is reused right away, but the old handle must not resolve to the new entity.
+	auto *b = pool.create_entity();
+	if (b->get_slot() != slot || pool.get_entity(id) || pool.get_entity(b->get_id()) != b)
+	{
+		LOGE("Stale handle was not detected.\n");
+		return false;
+	}
+
+	if (b->get_component<AComponent>() || b->has_component<AComponent>() ||
+	    b->has_component(ComponentIDMapping::get_id<AComponent>()))
+	{
+		LOGE("Reused slot inherited a component.\n");
+		return false;
+	}
+
+	b->allocate_component<BComponent>(2);
+	if (!b->get_component<BComponent>() || b->get_component<BComponent>()->v != 2)
+	{
+		LOGE("Lookup through slot failed.\n");
+		return false;
+	}
+
+	return true;
+}
+
+struct CountingListener : EntityGroupListener
+{
+	void on_entity_added(Entity &) override
+	{
+		count++;
+	}
+
+	void on_entity_removed(const Entity &) override
+	{
+		count--;
+	}
+
+	void on_reset() override
+	{
+		count = 0;
+	}
+
+	int count = 0;
+};
+
+static bool run_listener_test()
+{
+	EntityPool pool;
+	auto *group = pool.get_component_group_holder<AComponent, BComponent>();
+	CountingListener listener;
+
+	std::vector<Entity *> entities;
+	for (int i = 0; i < 10; i++)
+	{
+		auto *e = pool.create_entity();
+		e->allocate_component<AComponent>(i);
+		e->allocate_component<BComponent>(i);
+		entities.push_back(e);
+	}
+
+	// Existing members are replayed.
+	group->set_listener(&listener);
+	if (listener.count != 10)
+	{
+		LOGE("Listener missed existing members.\n");
+		return false;
+	}
+
+	entities[0]->free_component<BComponent>();
+	entities[0]->free_component<AComponent>();
+	pool.delete_entity(entities[1]);
+	entities[2]->allocate_component<CComponent>(2);
+	if (listener.count != 8 || static_cast<size_t>(listener.count) != group->get_groups().size())
+	{
+		LOGE("Listener does not track group membership.\n");
+		return false;
+	}
+
+	pool.reset_groups();
+	if (listener.count != 0)
+	{
+		LOGE("Listener was not reset.\n");
+		return false;
+	}
+
+	group->set_listener(nullptr);
+	return true;
+}
+
+static bool run_scheduler_test(EntityStorage storage, ThreadGroup &group)
+{
+	constexpr unsigned NumEntities = 5000;
+	EntityPool pool(storage);
+	std::vector<Entity *> entities;
+	for (unsigned i = 0; i < NumEntities; i++)
+	{
+		auto *e = pool.create_entity();
+		e->allocate_component<AComponent>(int(i));
+		e->allocate_component<BComponent>(0);
+		e->allocate_component<CComponent>(int(i));
+		entities.push_back(e);
+	}
+
+	std::atomic<unsigned> changed_visits;
+	std::atomic<int64_t> c_sum;
+
+	SystemScheduler scheduler(pool, group);
+	scheduler.add_system<Write<AComponent>>("increment-a", [](const QueryChunk<Write<AComponent>> &chunk) {
+		auto *a = chunk.write<AComponent>();
+		for (size_t i = 0; i < chunk.count; i++)
+			a[i].v++;
+	});
+	scheduler.add_system<Read<AComponent>, Write<BComponent>>("copy-a-to-b",
+			[](const QueryChunk<Read<AComponent>, Write<BComponent>> &chunk) {
+				auto *a = chunk.read<AComponent>();
+				auto *b = chunk.write<BComponent>();
+				for (size_t i = 0; i < chunk.count; i++)
+					b[i].v = a[i].v * 2;
+			});
+	{
+		// Passed as an lvalue which goes out of scope before run(), so the scheduler has to keep a copy.
+		auto sum_c = [&](const QueryChunk<Read<CComponent>> &chunk) {
+			int64_t sum = 0;
+			for (size_t i = 0; i < chunk.count; i++)
+				sum += chunk.read<CComponent>()[i].v;
+			c_sum.fetch_add(sum, std::memory_order_relaxed);
+		};
+		scheduler.add_system<Read<CComponent>>("sum-c", sum_c);
+	}
+	scheduler.add_system<Read<CComponent>>("changed-c", [&](const QueryChunk<Read<CComponent>> &chunk) {
+		changed_visits.fetch_add(unsigned(chunk.count), std::memory_order_relaxed);
+	}, true);
+
+	const int64_t expected_c_sum = int64_t(NumEntities) * (NumEntities - 1) / 2;
+	const bool tracks_changes = storage == EntityStorage::Archetypes;
+
+	for (unsigned iter = 0; iter < 3; iter++)
+	{
+		if (iter == 2)
+			pool.mark_component_changed<CComponent>(*entities[NumEntities / 2]);
+
+		changed_visits = 0;
+		c_sum = 0;
+		scheduler.run();
+
+		for (unsigned i = 0; i < NumEntities; i++)
+		{
+			int expected_a = int(i + iter + 1);
+			if (entities[i]->get_component<AComponent>()->v != expected_a ||
+			    entities[i]->get_component<BComponent>()->v != expected_a * 2)
+			{
+				LOGE("System ordering was not respected.\n");
+				return false;
+			}
+		}
+
+		if (c_sum != expected_c_sum)
+		{
+			LOGE("Read-only system did not see every entity.\n");
+			return false;
+		}
+
+		unsigned visits = changed_visits;
+		bool ok;
+		if (iter == 0 || !tracks_changes)
+			ok = visits == NumEntities;
+		else if (iter == 1)
+			ok = visits == 0;
+		else
+			ok = visits != 0 && visits < NumEntities;
+
+		if (!ok)
+		{
+			LOGE("Change filter visited %u entities in run %u.\n", visits, iter);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Records the same operations into command buffers on worker threads, and checks that groups
+// end up the same as when applying them directly.
+static bool run_command_buffer_test(EntityStorage storage, ThreadGroup &group)
+{
+	constexpr unsigned NumEntities = 4000;
+	constexpr unsigned NumBuffers = 4;
+	EntityPool immediate(storage), deferred(storage);
+
+	// Groups exist up front, so commits have to update them.
+	immediate.get_component_group<AComponent, BComponent>();
+	immediate.get_component_group<BComponent, CComponent>();
+	deferred.get_component_group<AComponent, BComponent>();
+	deferred.get_component_group<BComponent, CComponent>();
+
+	std::vector<Entity *> immediate_entities;
+	for (unsigned i = 0; i < NumEntities; i++)
+	{
+		auto *e = immediate.create_entity();
+		e->allocate_component<AComponent>(int(i));
+		if (i % 3)
+			e->allocate_component<BComponent>(int(i * 2));
+		if (i % 5 == 0)
+			e->allocate_component<CComponent>(int(i * 3));
+		immediate_entities.push_back(e);
+	}
+
+	EntityCommandBuffer buffers[NumBuffers];
+	auto task = group.create_task();
+	for (unsigned b = 0; b < NumBuffers; b++)
+	{
+		task->enqueue_task([&buffers, b]() {
+			auto &buffer = buffers[b];
+			for (unsigned i = b; i < NumEntities; i += NumBuffers)
+			{
+				auto e = buffer.create_entity();
+				if (i % 5 == 0)
+					buffer.allocate_component<CComponent>(e, int(i * 3));
+				buffer.allocate_component<AComponent>(e, int(i));
+				if (i % 3)
+					buffer.allocate_component<BComponent>(e, int(i * 2));
+			}
+		});
+	}
+	task->wait();
+
+	EntityCommandBuffer *buffer_list[NumBuffers];
+	for (unsigned b = 0; b < NumBuffers; b++)
+		buffer_list[b] = &buffers[b];
+	deferred.commit(buffer_list, NumBuffers);
+
+	std::vector<Entity *> deferred_entities;
+	for (unsigned i = 0; i < NumEntities; i++)
+	{
+		auto *e = buffers[i % NumBuffers].get_created_entities()[i / NumBuffers];
+		if (e->get_component<AComponent>()->v != int(i))
+		{
+			LOGE("Created entity does not match its record.\n");
+			return false;
+		}
+		deferred_entities.push_back(e);
+	}
+
+	GroupSums immediate_sums, deferred_sums;
+	summarize_groups(immediate, immediate_sums);
+	summarize_groups(deferred, deferred_sums);
+	if (!(immediate_sums == deferred_sums))
+	{
+		LOGE("Committed creation does not match immediate creation.\n");
+		return false;
+	}
+
+	// Components recorded for entities deleted in the same batch are dropped.
+	EntityCommandBuffer buffer;
+	for (unsigned i = 0; i < NumEntities; i++)
+	{
+		if (i % 7 == 0)
+			buffer.allocate_component<CComponent>(deferred_entities[i]->get_id(), int(i * 7));
+		if (i % 2 == 0)
+			buffer.delete_entity(deferred_entities[i]->get_id());
+		else if (i % 7 == 0)
+			immediate_entities[i]->allocate_component<CComponent>(int(i * 7));
+	}
+
+	for (unsigned i = 0; i < NumEntities; i += 2)
+		immediate.delete_entity(immediate_entities[i]);
+
+	auto *new_e = immediate.create_entity();
+	new_e->allocate_component<BComponent>(-1);
+	new_e->allocate_component<CComponent>(-2);
+	auto pending = buffer.create_entity();
+	buffer.allocate_component<BComponent>(pending, -1);
+	buffer.allocate_component<CComponent>(pending, -2);
+
+	deferred.commit(buffer);
+
+	summarize_groups(immediate, immediate_sums);
+	summarize_groups(deferred, deferred_sums);
+	if (!(immediate_sums == deferred_sums) || !buffer.get_created_entity(pending))
+	{
+		LOGE("Committed deletion does not match immediate deletion.\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Many threads read the same group right after structural changes, so they race to rebuild it.
+static bool run_concurrent_gather_test(EntityStorage storage)
+{
+	constexpr unsigned NumRounds = 32;
+	constexpr unsigned NumThreads = 8;
+	constexpr unsigned EntitiesPerRound = 500;
+	EntityPool pool(storage);
+	auto &group_ab = *pool.get_component_group_holder<AComponent, BComponent>();
+
+	for (unsigned round = 0; round < NumRounds; round++)
+	{
+		// Structural changes happen up front, then every thread finds the archetype cache stale at once.
+		for (unsigned i = 0; i < EntitiesPerRound; i++)
+		{
+			auto *e = pool.create_entity();
+			e->allocate_component<AComponent>(int(i));
+			e->allocate_component<BComponent>(int(round));
+		}
+
+		const size_t expected = size_t(round + 1) * EntitiesPerRound;
+		std::atomic<unsigned> mismatches;
+		mismatches.store(0, std::memory_order_relaxed);
+
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < NumThreads; t++)
+		{
+			threads.emplace_back([&]() {
+				auto &groups = group_ab.get_groups();
+				auto &entities = group_ab.get_entities();
+				int64_t sum = 0;
+				for (auto &g : groups)
+					sum += get<1>(g)->v;
+				if (groups.size() != expected || entities.size() != expected ||
+				    sum != int64_t(EntitiesPerRound) * round * (round + 1) / 2)
+				{
+					mismatches.fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+		}
+
+		for (auto &thread : threads)
+			thread.join();
+
+		if (mismatches.load(std::memory_order_relaxed))
+		{
+			LOGE("Concurrent gathers saw a partial group in round %u.\n", round);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main()
+{
+	run_basic_test(EntityStorage::ComponentPools);
+	run_basic_test(EntityStorage::Archetypes);
+
+	GroupSums pools, archetypes;
+	if (!run_random_ops(EntityStorage::ComponentPools, pools) ||
+	    !run_random_ops(EntityStorage::Archetypes, archetypes))
+		return EXIT_FAILURE;
+
+	if (!run_handle_test(EntityStorage::ComponentPools) || !run_handle_test(EntityStorage::Archetypes))
+		return EXIT_FAILURE;
+
+	if (!run_listener_test())
+		return EXIT_FAILURE;
+
+	ThreadGroup group;
+	group.start(4, 0, {});
+	if (!run_scheduler_test(EntityStorage::ComponentPools, group) ||
+	    !run_scheduler_test(EntityStorage::Archetypes, group))
+		return EXIT_FAILURE;
+
+	if (!run_command_buffer_test(EntityStorage::ComponentPools, group) ||
+	    !run_command_buffer_test(EntityStorage::Archetypes, group))
+		return EXIT_FAILURE;
+
+	if (pools.count_ab != archetypes.count_ab || pools.sum_ab != archetypes.sum_ab ||
+	    pools.count_bc != archetypes.count_bc || pools.sum_bc != archetypes.sum_bc)
+	{
+		LOGE("Archetype storage does not match component pools.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!run_concurrent_gather_test(EntityStorage::ComponentPools) ||
+	    !run_concurrent_gather_test(EntityStorage::Archetypes))
+		return EXIT_FAILURE;
+
+	LOGI("AB: %zu entities, BC: %zu entities.\n", pools.count_ab, pools.count_bc);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,317 @@
+#include "scene.hpp"
+#include "scene_formats.hpp"
+#include "render_components.hpp"
+#include "abstract_renderable.hpp"
+#include "transforms.hpp"
+#include "muglm/muglm_impl.hpp"
+#include "muglm/matrix_helper.hpp"
+#include "logging.hpp"
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+
+using namespace Granite;
+
+struct BoxRenderable : AbstractRenderable
+{
+	void get_render_info(const RenderContext &, const RenderInfoComponent *, RenderQueue &) const override
+	{
+	}
+
+	bool has_static_aabb() const override
+	{
+		return true;
+	}
+
+	const AABB *get_static_aabb() const override
+	{
+		return &aabb;
+	}
+
+	AABB aabb = AABB(vec3(-0.5f), vec3(0.5f));
+};
+
+static constexpr unsigned NumObjects = 200;
+static const float MinScreenSizes[] = { 0.2f, 0.05f, 0.0f };
+
+struct LODScene
+{
+	Scene scene;
+	std::vector<NodeHandle> nodes;
+	std::vector<Entity *> entities;
+
+	LODScene()
+	{
+		// Objects along -Z, from right in front of the camera to far away.
+		for (unsigned i = 0; i < NumObjects; i++)
+		{
+			auto node = scene.create_node();
+			node->get_transform().translation = vec3(0.0f, 0.0f, -2.0f - 0.5f * float(i));
+			node->invalidate_cached_transform();
+			nodes.push_back(node);
+
+			std::vector<LODComponent::Level> levels;
+			for (auto size : MinScreenSizes)
+				levels.push_back({ Util::make_handle<BoxRenderable>(), size });
+
+			auto *entity = scene.create_renderable(levels.front().renderable, node.get());
+			entity->allocate_component<LODComponent>()->levels = std::move(levels);
+			entities.push_back(entity);
+		}
+
+		scene.update_all_transforms();
+	}
+};
+
+static Frustum build_frustum(float z)
+{
+	mat4 proj = projection(0.5f * pi<float>(), 16.0f / 9.0f, 0.1f, 1000.0f);
+	mat4 view = translate(vec3(0.0f, 0.0f, -z));
+	Frustum frustum;
+	frustum.build_planes(inverse(proj * view));
+	return frustum;
+}
+
+static bool verify_selection(const LODScene &lods, const Frustum &frustum)
+{
+	for (auto *entity : lods.entities)
+	{
+		auto *lod = entity->get_component<LODComponent>();
+		auto *transform = entity->get_component<RenderInfoComponent>();
+		unsigned level = lod->current_level;
+
+		if (entity->get_component<RenderableComponent>()->renderable != lod->levels[level].renderable)
+		{
+			LOGE("Renderable does not match the selected level.\n");
+			return false;
+		}
+
+		float size = frustum.estimate_screen_size(transform->get_aabb());
+		bool too_fine = level + 1 < lod->levels.size() &&
+		                size < lod->levels[level].min_screen_size * (1.0f - lod->hysteresis);
+		bool too_coarse = level > 0 &&
+		                  size >= lod->levels[level - 1].min_screen_size * (1.0f + lod->hysteresis);
+
+		if (too_coarse || too_fine)
+		{
+			LOGE("Level %u selected for screen size %.4f.\n", level, size);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool verify_retained(const LODScene &lods, const RetainedVisibilityList &retained)
+{
+	for (auto &info : retained.get_list())
+	{
+		bool found = false;
+		for (auto *entity : lods.entities)
+		{
+			if (info.transform == entity->get_component<RenderInfoComponent>())
+			{
+				if (info.renderable != entity->get_component<RenderableComponent>()->renderable.get())
+				{
+					LOGE("Retained list has a stale level.\n");
+					return false;
+				}
+				found = true;
+				break;
+			}
+		}
+
+		if (!found)
+		{
+			LOGE("Retained list has an unknown entry.\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static unsigned count_levels(const LODScene &lods, unsigned level)
+{
+	unsigned count = 0;
+	for (auto *entity : lods.entities)
+		if (entity->get_component<LODComponent>()->current_level == level)
+			count++;
+	return count;
+}
+
+static bool test_selection()
+{
+	LODScene lods;
+	RetainedVisibilityList retained;
+
+	auto frustum = build_frustum(0.0f);
+	lods.scene.update_lod_selection(frustum);
+	if (!verify_selection(lods, frustum))
+		return false;
+
+	for (unsigned level = 0; level < 3; level++)
+	{
+		if (count_levels(lods, level) == 0)
+		{
+			LOGE("No object selected level %u.\n", level);
+			return false;
+		}
+	}
+
+	lods.scene.gather_retained_opaque_renderables(frustum, retained);
+	if (!verify_retained(lods, retained))
+		return false;
+
+	// Moving away coarsens, and the retained list must pick it up although no transform changed.
+	frustum = build_frustum(10.0f);
+	lods.scene.update_lod_selection(frustum);
+	if (!verify_selection(lods, frustum))
+		return false;
+	if (!lods.scene.gather_retained_opaque_renderables(frustum, retained))
+	{
+		LOGE("Retained list did not report a change.\n");
+		return false;
+	}
+	if (!verify_retained(lods, retained))
+		return false;
+
+	// Once both ends of a small back and forth camera movement have been visited, nothing may switch anymore.
+	lods.scene.update_lod_selection(build_frustum(9.98f));
+	lods.scene.update_lod_selection(build_frustum(10.02f));
+
+	unsigned levels[NumObjects];
+	for (unsigned i = 0; i < NumObjects; i++)
+		levels[i] = lods.entities[i]->get_component<LODComponent>()->current_level;
+
+	for (unsigned iter = 0; iter < 16; iter++)
+	{
+		lods.scene.update_lod_selection(build_frustum((iter & 1) ? 10.02f : 9.98f));
+		for (unsigned i = 0; i < NumObjects; i++)
+		{
+			if (lods.entities[i]->get_component<LODComponent>()->current_level != levels[i])
+			{
+				LOGE("Object %u flickered between levels.\n", i);
+				return false;
+			}
+		}
+	}
+
+	// Objects behind the camera keep their level.
+	frustum = build_frustum(-200.0f);
+	lods.scene.update_lod_selection(frustum);
+	for (unsigned i = 0; i < NumObjects; i++)
+	{
+		if (lods.entities[i]->get_component<LODComponent>()->current_level != levels[i])
+		{
+			LOGE("Invisible object switched level.\n");
+			return false;
+		}
+	}
+
+	LOGI("LOD selection OK.\n");
+	return true;
+}
+
+static bool test_simplify()
+{
+	// Tessellated unit sphere.
+	constexpr unsigned Rings = 64;
+	constexpr unsigned Segments = 128;
+	std::vector<vec3> positions;
+	std::vector<uint32_t> indices;
+
+	for (unsigned r = 0; r <= Rings; r++)
+	{
+		float theta = pi<float>() * float(r) / float(Rings);
+		for (unsigned s = 0; s <= Segments; s++)
+		{
+			float phi = 2.0f * pi<float>() * float(s) / float(Segments);
+			positions.emplace_back(muglm::sin(theta) * muglm::cos(phi), muglm::cos(theta), muglm::sin(theta) * muglm::sin(phi));
+		}
+	}
+
+	for (unsigned r = 0; r < Rings; r++)
+	{
+		for (unsigned s = 0; s < Segments; s++)
+		{
+			uint32_t i0 = r * (Segments + 1) + s;
+			uint32_t i1 = i0 + Segments + 1;
+			uint32_t quad[] = { i0, i1, i0 + 1, i0 + 1, i1, i1 + 1 };
+			indices.insert(indices.end(), std::begin(quad), std::end(quad));
+		}
+	}
+
+	SceneFormats::Mesh mesh;
+	mesh.positions.resize(positions.size() * sizeof(vec3));
+	memcpy(mesh.positions.data(), positions.data(), mesh.positions.size());
+	mesh.position_stride = sizeof(vec3);
+	mesh.attribute_layout[Util::ecast(MeshAttribute::Position)].format = VK_FORMAT_R32G32B32_SFLOAT;
+	mesh.indices.resize(indices.size() * sizeof(uint32_t));
+	memcpy(mesh.indices.data(), indices.data(), mesh.indices.size());
+	mesh.index_type = VK_INDEX_TYPE_UINT32;
+	mesh.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	mesh.count = uint32_t(indices.size());
+	mesh.static_aabb = AABB(vec3(-1.0f), vec3(1.0f));
+
+	SceneFormats::Mesh lod;
+	float error = 0.0f;
+	if (!SceneFormats::mesh_simplify(lod, mesh, 0.25f, 0.1f, error))
+	{
+		LOGE("Simplification failed.\n");
+		return false;
+	}
+
+	if (lod.count >= mesh.count / 2 || lod.count % 3 != 0)
+	{
+		LOGE("Simplified to %u indices from %u.\n", lod.count, mesh.count);
+		return false;
+	}
+
+	if (error <= 0.0f || error > 0.2f)
+	{
+		LOGE("Unexpected simplification error %.5f.\n", error);
+		return false;
+	}
+
+	// Unreferenced vertices are dropped, and everything stays on the sphere.
+	size_t vertex_count = lod.positions.size() / lod.position_stride;
+	if (vertex_count >= positions.size() / 2)
+	{
+		LOGE("Unreferenced vertices were kept.\n");
+		return false;
+	}
+
+	for (size_t i = 0; i < vertex_count; i++)
+	{
+		vec3 p;
+		memcpy(p.data, lod.positions.data() + i * lod.position_stride, sizeof(vec3));
+		if (muglm::abs(length(p) - 1.0f) > 1e-4f)
+		{
+			LOGE("Vertex moved off the surface.\n");
+			return false;
+		}
+	}
+
+	for (float size : { 0.01f, 0.1f, 0.5f, 1.0f })
+	{
+		float coverage = SceneFormats::lod_screen_size_to_coverage(size);
+		if (muglm::abs(SceneFormats::lod_coverage_to_screen_size(coverage) - size) > 1e-5f)
+		{
+			LOGE("Screen coverage does not round-trip.\n");
+			return false;
+		}
+	}
+
+	LOGI("Simplified %u triangles to %u, error %.5f.\n", mesh.count / 3, lod.count / 3, error);
+	return true;
+}
+
+int main()
+{
+	if (!test_selection())
+		return EXIT_FAILURE;
+	if (!test_simplify())
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+#include "metrics.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace Util;
+
+static bool test_buckets()
+{
+	unsigned last_bucket = 0;
+	for (uint64_t v = 0; v < 100000; v++)
+	{
+		unsigned bucket = MetricHistogram::get_bucket(v);
+		if (bucket < last_bucket || v > MetricHistogram::get_bucket_upper_bound(bucket) ||
+		    (bucket && v <= MetricHistogram::get_bucket_upper_bound(bucket - 1)))
+		{
+			LOGE("Value %llu landed in wrong bucket %u.\n", static_cast<unsigned long long>(v), bucket);
+			return false;
+		}
+		last_bucket = bucket;
+	}
+
+	if (MetricHistogram::get_bucket(UINT64_MAX) != MetricHistogram::NumBuckets - 1 ||
+	    MetricHistogram::get_bucket_upper_bound(MetricHistogram::NumBuckets - 1) != UINT64_MAX)
+	{
+		LOGE("Largest bucket is wrong.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static constexpr unsigned NumThreads = 8;
+static constexpr unsigned NumIterations = 1000000;
+
+int main()
+{
+	if (!test_buckets())
+		return EXIT_FAILURE;
+
+	auto &registry = MetricsRegistry::get();
+	auto *counter = registry.counter("test.counter");
+	auto *gauge = registry.gauge("test.gauge");
+	auto *histogram = registry.histogram("test.histogram");
+
+	if (registry.counter("test.counter") != counter || registry.gauge("test.counter"))
+	{
+		LOGE("Lookup by name failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	MetricsSampler sampler;
+	std::vector<MetricSample> samples;
+	sampler.sample(samples);
+
+	auto start = get_current_time_nsecs();
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < NumThreads; i++)
+	{
+		threads.emplace_back([=]() {
+			for (unsigned j = 0; j < NumIterations; j++)
+			{
+				counter->add();
+				gauge->add(1);
+				histogram->record(j % 1000);
+			}
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+	double ns = double(get_current_time_nsecs() - start) / double(NumThreads * NumIterations);
+
+	sampler.sample(samples);
+	auto *c = MetricsSampler::find(samples, "test.counter");
+	auto *g = MetricsSampler::find(samples, "test.gauge");
+	auto *h = MetricsSampler::find(samples, "test.histogram");
+	if (!c || !g || !h)
+	{
+		LOGE("Missing samples.\n");
+		return EXIT_FAILURE;
+	}
+
+	const double expected = double(NumThreads) * NumIterations;
+	if (c->value != expected || g->value != expected || h->count != NumThreads * NumIterations)
+	{
+		LOGE("Lost updates.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Values are uniform in [0, 1000), the buckets have at most 12.5% error.
+	if (h->p50 < 500 || h->p50 > 562 || h->p99 < 990 || h->p99 > 1023 || h->max < 999 || h->max > 1023 ||
+	    h->value < 499.0 || h->value > 500.0)
+	{
+		LOGE("Unexpected percentiles, p50 %llu, p99 %llu, max %llu, mean %f.\n",
+		     static_cast<unsigned long long>(h->p50), static_cast<unsigned long long>(h->p99),
+		     static_cast<unsigned long long>(h->max), h->value);
+		return EXIT_FAILURE;
+	}
+
+	// Histograms only report the interval since the previous sample.
+	histogram->record(10);
+	sampler.sample(samples);
+	h = MetricsSampler::find(samples, "test.histogram");
+	if (h->count != 1 || h->p50 != 10 || h->value != 10.0)
+	{
+		LOGE("Histogram interval is wrong.\n");
+		return EXIT_FAILURE;
+	}
+
+	{
+		MetricsDumpFile dump("metrics-test.csv", 10);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+
+	FILE *file = fopen("metrics-test.csv", "r");
+	char line[1024];
+	unsigned lines = 0;
+	while (file && fgets(line, sizeof(line), file))
+		lines++;
+	if (file)
+		fclose(file);
+	remove("metrics-test.csv");
+
+	// Header plus one row per metric for every dump.
+	if (lines < 4 || (lines - 1) % 3 != 0)
+	{
+		LOGE("Unexpected metrics dump, %u lines.\n", lines);
+		return EXIT_FAILURE;
+	}
+
+	LOGI("%.1f ns per counter + gauge + histogram update with %u threads.\n", ns, NumThreads);
+	return EXIT_SUCCESS;
+}
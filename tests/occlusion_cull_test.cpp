@@ -0,0 +1,288 @@
+#include "scene.hpp"
+#include "occlusion_buffer.hpp"
+#include "render_components.hpp"
+#include "abstract_renderable.hpp"
+#include "transforms.hpp"
+#include "thread_group.hpp"
+#include "task_composer.hpp"
+#include "muglm/muglm_impl.hpp"
+#include "muglm/matrix_helper.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+
+using namespace Granite;
+
+struct BoxRenderable : AbstractRenderable
+{
+	void get_render_info(const RenderContext &, const RenderInfoComponent *, RenderQueue &) const override
+	{
+	}
+
+	bool has_static_aabb() const override
+	{
+		return true;
+	}
+
+	const AABB *get_static_aabb() const override
+	{
+		return &aabb;
+	}
+
+	AABB aabb = AABB(vec3(-0.5f), vec3(0.5f));
+};
+
+// Unit cube matching BoxRenderable, as occluder geometry.
+static void build_cube_occluder(OccluderComponent &occluder)
+{
+	for (unsigned i = 0; i < 8; i++)
+		occluder.positions.push_back(vec3(i & 1 ? 0.5f : -0.5f, i & 2 ? 0.5f : -0.5f, i & 4 ? 0.5f : -0.5f));
+
+	static const uint32_t indices[] = {
+		0, 1, 3, 0, 3, 2, 4, 6, 7, 4, 7, 5,
+		0, 4, 5, 0, 5, 1, 2, 3, 7, 2, 7, 6,
+		0, 2, 6, 0, 6, 4, 1, 5, 7, 1, 7, 3,
+	};
+	occluder.indices.insert(occluder.indices.end(), std::begin(indices), std::end(indices));
+}
+
+struct ReferenceScene
+{
+	Scene scene;
+	AbstractRenderableHandle box = Util::make_handle<BoxRenderable>();
+	std::vector<NodeHandle> nodes;
+	std::vector<AABB> walls;
+
+	Entity *add_box(const vec3 &center, const vec3 &size)
+	{
+		auto node = scene.create_node();
+		node->get_transform().translation = center;
+		node->get_transform().scale = size;
+		node->invalidate_cached_transform();
+		nodes.push_back(node);
+		return scene.create_renderable(box, node.get());
+	}
+
+	void add_wall(const vec3 &lo, const vec3 &hi)
+	{
+		auto *entity = add_box(0.5f * (lo + hi), hi - lo);
+		build_cube_occluder(*entity->allocate_component<OccluderComponent>());
+		walls.emplace_back(lo, hi);
+	}
+};
+
+// Interior made of rooms along -Z, separated by walls with a doorway, and a pillar in every room.
+// Small props are scattered everywhere, most of them are hidden behind walls.
+static void build_interior(ReferenceScene &ref)
+{
+	for (int room = 0; room < 4; room++)
+	{
+		float z = -10.0f - 12.0f * float(room);
+		float door = float(room % 3) * 2.0f - 2.0f;
+		ref.add_wall(vec3(-20.0f, -4.0f, z - 0.25f), vec3(door - 1.0f, 4.0f, z + 0.25f));
+		ref.add_wall(vec3(door + 1.0f, -4.0f, z - 0.25f), vec3(20.0f, 4.0f, z + 0.25f));
+		ref.add_wall(vec3(door - 1.0f, 2.0f, z - 0.25f), vec3(door + 1.0f, 4.0f, z + 0.25f));
+		ref.add_wall(vec3(3.0f, -4.0f, z + 4.0f), vec3(4.0f, 4.0f, z + 5.0f));
+	}
+
+	uint32_t state = 1;
+	const auto next = [&]() -> float {
+		state = state * 1664525u + 1013904223u;
+		return float(state >> 8) * (1.0f / float(1u << 24));
+	};
+
+	for (unsigned i = 0; i < 4000; i++)
+	{
+		vec3 center(40.0f * next() - 20.0f, 7.0f * next() - 3.5f, -2.0f - 54.0f * next());
+		ref.add_box(center, vec3(0.2f + 0.4f * next()));
+	}
+}
+
+static bool ray_aabb(const vec3 &origin, const vec3 &inv_dir, const AABB &aabb, float &t)
+{
+	vec3 t0 = (aabb.get_minimum() - origin) * inv_dir;
+	vec3 t1 = (aabb.get_maximum() - origin) * inv_dir;
+	vec3 t_lo = min(t0, t1);
+	vec3 t_hi = max(t0, t1);
+	float t_enter = muglm::max(muglm::max(t_lo.x, t_lo.y), muglm::max(t_lo.z, 0.0f));
+	float t_exit = muglm::min(muglm::min(t_hi.x, t_hi.y), t_hi.z);
+	t = t_enter;
+	return t_enter <= t_exit;
+}
+
+// Ray casts the AABB's screen footprint at a much higher resolution than the occlusion buffer.
+static bool reference_visible(const AABB &aabb, const std::vector<AABB> &walls,
+                              const mat4 &view_projection, const mat4 &inv_view_projection, const vec3 &camera_pos)
+{
+	constexpr float width = 1280.0f;
+	constexpr float height = 720.0f;
+
+	vec2 lo(width, height), hi(0.0f);
+	for (unsigned i = 0; i < 8; i++)
+	{
+		vec4 clip = view_projection * vec4(aabb.get_corner(i), 1.0f);
+		if (clip.w <= 0.0f)
+			return true;
+		vec2 screen = (clip.xy() / vec2(clip.w) * 0.5f + 0.5f) * vec2(width, height);
+		lo = min(lo, screen);
+		hi = max(hi, screen);
+	}
+
+	int x0 = int(muglm::max(lo.x, 0.0f)), x1 = int(muglm::min(hi.x, width - 1.0f));
+	int y0 = int(muglm::max(lo.y, 0.0f)), y1 = int(muglm::min(hi.y, height - 1.0f));
+
+	for (int y = y0; y <= y1; y++)
+	{
+		for (int x = x0; x <= x1; x++)
+		{
+			vec4 clip((float(x) + 0.5f) / width * 2.0f - 1.0f, (float(y) + 0.5f) / height * 2.0f - 1.0f, 1.0f, 1.0f);
+			vec4 far_point = inv_view_projection * clip;
+			vec3 dir = normalize(far_point.xyz() / vec3(far_point.w) - camera_pos);
+			vec3 inv_dir = vec3(1.0f) / dir;
+
+			float t;
+			if (!ray_aabb(camera_pos, inv_dir, aabb, t))
+				continue;
+
+			bool hidden = false;
+			for (auto &wall : walls)
+			{
+				float wall_t;
+				if (ray_aabb(camera_pos, inv_dir, wall, wall_t) && wall_t < t)
+				{
+					hidden = true;
+					break;
+				}
+			}
+
+			if (!hidden)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+int main()
+{
+	ReferenceScene ref;
+	build_interior(ref);
+	ref.scene.update_all_transforms();
+
+	vec3 camera_pos(0.5f, 0.3f, 0.0f);
+	mat4 view = mat4_cast(angleAxis(0.1f, vec3(0.0f, 1.0f, 0.0f))) * translate(-camera_pos);
+	mat4 view_projection = projection(0.5f * pi<float>(), 16.0f / 9.0f, 0.1f, 100.0f) * view;
+	mat4 inv_view_projection = inverse(view_projection);
+	Frustum frustum;
+	frustum.build_planes(inv_view_projection);
+
+	VisibilityList visible;
+	ref.scene.gather_visible_opaque_renderables(frustum, visible);
+	OccluderList occluders;
+	ref.scene.gather_visible_occluders(frustum, occluders);
+	if (occluders.empty())
+	{
+		LOGE("No occluders are visible.\n");
+		return EXIT_FAILURE;
+	}
+
+	OcclusionBuffer buffer;
+	buffer.init(256, 144);
+	buffer.begin(view_projection);
+	buffer.add_occluders(occluders);
+
+	auto start = Util::get_current_time_nsecs();
+	buffer.rasterize();
+	auto st_time = Util::get_current_time_nsecs() - start;
+
+	std::vector<float> reference_depth;
+	for (unsigned y = 0; y < buffer.get_height(); y++)
+		for (unsigned x = 0; x < buffer.get_width(); x++)
+			reference_depth.push_back(buffer.get_depth(x, y));
+
+	// Rasterizing bands of tiles on worker threads must give the exact same buffer.
+	ThreadGroup group;
+	group.start(4, 0, {});
+	constexpr unsigned NumBands = 4;
+	start = Util::get_current_time_nsecs();
+	{
+		TaskComposer composer(group);
+		auto &stage = composer.begin_pipeline_stage();
+		for (unsigned i = 0; i < NumBands; i++)
+			stage.enqueue_task([&buffer, i]() { buffer.rasterize_band(i, NumBands); });
+		composer.get_outgoing_task()->wait();
+	}
+	auto mt_time = Util::get_current_time_nsecs() - start;
+
+	size_t covered = 0;
+	for (unsigned y = 0, i = 0; y < buffer.get_height(); y++)
+	{
+		for (unsigned x = 0; x < buffer.get_width(); x++, i++)
+		{
+			if (buffer.get_depth(x, y) != reference_depth[i])
+			{
+				LOGE("Threaded rasterization mismatch at (%u, %u).\n", x, y);
+				return EXIT_FAILURE;
+			}
+			if (reference_depth[i] < 1.0f)
+				covered++;
+		}
+	}
+
+	size_t frustum_visible = visible.size();
+	VisibilityList culled = visible;
+	start = Util::get_current_time_nsecs();
+	buffer.cull(culled);
+	auto cull_time = Util::get_current_time_nsecs() - start;
+
+	// Nothing which is visible in a high resolution ray cast may be culled,
+	// and the buffer should find a good share of what is really hidden.
+	size_t truly_hidden = 0;
+	size_t culled_index = 0;
+	for (auto &info : visible)
+	{
+		bool kept = culled_index < culled.size() && culled[culled_index].transform == info.transform;
+		if (kept)
+			culled_index++;
+
+		bool ref_visible = reference_visible(info.transform->get_aabb(), ref.walls,
+		                                     view_projection, inv_view_projection, camera_pos);
+		if (!ref_visible)
+			truly_hidden++;
+
+		if (ref_visible && !kept)
+		{
+			LOGE("Visible renderable was occlusion culled.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	auto stats = buffer.get_statistics();
+	LOGI("Occluders: %zu entities, %u triangles, %.1f %% of the buffer covered.\n",
+	     occluders.size(), stats.occluder_triangles,
+	     100.0 * double(covered) / double(buffer.get_width() * buffer.get_height()));
+	LOGI("Rasterization: %.3f ms single threaded, %.3f ms in %u bands.\n",
+	     1e-6 * double(st_time), 1e-6 * double(mt_time), NumBands);
+	LOGI("Frustum visible %zu, occlusion culled %u (%.1f %%) in %.3f ms, really hidden %zu (%.1f %% found).\n",
+	     frustum_visible, stats.occluded, 100.0 * double(stats.occluded) / double(stats.tested),
+	     1e-6 * double(cull_time), truly_hidden,
+	     truly_hidden ? 100.0 * double(stats.occluded) / double(truly_hidden) : 100.0);
+
+	if (stats.tested != frustum_visible || stats.occluded != frustum_visible - culled.size())
+	{
+		LOGE("Statistics mismatch.\n");
+		return EXIT_FAILURE;
+	}
+
+	// The reference scene is built so that most of it is hidden.
+	if (stats.occluded * 2 < truly_hidden)
+	{
+		LOGE("Occlusion culling is too conservative.\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
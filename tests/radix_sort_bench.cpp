@@ -0,0 +1,186 @@
+#include "radix_sorter.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+// Keys shaped like RenderInfo::get_sprite_sort_key() produces them.
+struct Random
+{
+	uint32_t state = 1;
+	uint32_t next()
+	{
+		state = state * 1664525u + 1013904223u;
+		return state ^ (state >> 16);
+	}
+
+	float next_float(float lo, float hi)
+	{
+		return lo + (hi - lo) * float(next() >> 8) * (1.0f / float(1u << 24));
+	}
+};
+
+static uint32_t float_bits(float v)
+{
+	uint32_t u;
+	memcpy(&u, &v, sizeof(u));
+	return u;
+}
+
+static uint64_t opaque_key(Random &rnd, const uint32_t *pipelines, unsigned num_pipelines, unsigned num_draws)
+{
+	uint32_t pipeline_hash = pipelines[rnd.next() % num_pipelines] & 0xffff0000u;
+	pipeline_hash |= (rnd.next() % num_draws) * 2654435761u & 0xffffu;
+	uint32_t depth_key = float_bits(rnd.next_float(0.5f, 500.0f)) >> 2;
+	return (uint64_t(pipeline_hash) << 30) | depth_key;
+}
+
+static uint64_t transparent_key(Random &rnd, const uint32_t *pipelines, unsigned num_pipelines)
+{
+	uint32_t pipeline_hash = pipelines[rnd.next() % num_pipelines] & 0xffff0000u;
+	pipeline_hash |= rnd.next() & 0xffffu;
+	uint32_t depth_key = float_bits(rnd.next_float(0.5f, 500.0f)) ^ 0xffffffffu;
+	return (uint64_t(depth_key) << 32) | pipeline_hash;
+}
+
+enum class Distribution
+{
+	Opaque,
+	Depth,
+	Transparent,
+	Background,
+	Random
+};
+
+static const char *distribution_name(Distribution dist)
+{
+	switch (dist)
+	{
+	case Distribution::Opaque:
+		return "opaque";
+	case Distribution::Depth:
+		return "depth";
+	case Distribution::Transparent:
+		return "transparent";
+	case Distribution::Background:
+		return "background";
+	default:
+		return "random";
+	}
+}
+
+static void generate_keys(std::vector<uint64_t> &keys, size_t count, Distribution dist)
+{
+	Random rnd;
+	uint32_t pipelines[64];
+	for (auto &p : pipelines)
+		p = rnd.next();
+
+	keys.resize(count);
+	for (auto &key : keys)
+	{
+		switch (dist)
+		{
+		case Distribution::Opaque:
+			key = opaque_key(rnd, pipelines, 48, std::max<unsigned>(1, unsigned(count / 16)));
+			break;
+		case Distribution::Depth:
+			key = opaque_key(rnd, pipelines, 4, 64);
+			break;
+		case Distribution::Transparent:
+			key = transparent_key(rnd, pipelines, 8);
+			break;
+		case Distribution::Background:
+			// Like get_background_sort_key(), the upper half never changes.
+			key = (UINT64_MAX << 32) | (pipelines[rnd.next() % 16] & 0xffff0000u) | (rnd.next() & 0xffffu);
+			break;
+		default:
+			key = (uint64_t(rnd.next()) << 32) | rnd.next();
+			break;
+		}
+	}
+}
+
+static constexpr unsigned NumIterations = 10;
+
+template <typename Sorter>
+static bool run_sorter(const char *tag, const std::vector<uint64_t> &keys, const std::vector<uint32_t> &reference,
+                       double &ms)
+{
+	Sorter sorter;
+	int64_t total = 0;
+
+	for (unsigned iter = 0; iter < NumIterations; iter++)
+	{
+		sorter.resize(keys.size());
+		memcpy(sorter.code_data(), keys.data(), keys.size() * sizeof(uint64_t));
+
+		auto start = Util::get_current_time_nsecs();
+		sorter.sort();
+		total += Util::get_current_time_nsecs() - start;
+	}
+
+	ms = 1e-6 * double(total) / NumIterations;
+
+	const uint32_t *indices = sorter.indices_data();
+	const uint64_t *codes = sorter.sorted_code_data();
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		if (indices[i] != reference[i] || codes[i] != keys[reference[i]])
+		{
+			LOGE("%s: mismatch at %zu.\n", tag, i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+using Sorter8 = Util::RadixSorter<uint64_t, 8, 8, 8, 8, 8, 8, 8, 8>;
+using Sorter11 = Util::RadixSorter<uint64_t, 11, 11, 11, 11, 10, 10>;
+
+static bool run_bench(size_t count, Distribution dist)
+{
+	std::vector<uint64_t> keys;
+	generate_keys(keys, count, dist);
+
+	std::vector<uint32_t> reference(count);
+	for (size_t i = 0; i < count; i++)
+		reference[i] = uint32_t(i);
+
+	auto start = Util::get_current_time_nsecs();
+	std::stable_sort(reference.begin(), reference.end(), [&](uint32_t a, uint32_t b) {
+		return keys[a] < keys[b];
+	});
+	double std_ms = 1e-6 * double(Util::get_current_time_nsecs() - start);
+
+	double ms8, ms11;
+	if (!run_sorter<Sorter8>("8-bit", keys, reference, ms8) ||
+	    !run_sorter<Sorter11>("11-bit", keys, reference, ms11))
+	{
+		return false;
+	}
+
+	LOGI("%8zu %-11s: stable_sort %8.3f ms, 8-bit %7.3f ms, 11-bit %7.3f ms.\n",
+	     count, distribution_name(dist), std_ms, ms8, ms11);
+	return true;
+}
+
+int main()
+{
+	const size_t counts[] = { 10000, 100000, 500000, 2000000 };
+	const Distribution dists[] = {
+		Distribution::Opaque, Distribution::Depth, Distribution::Transparent,
+		Distribution::Background, Distribution::Random,
+	};
+
+	for (auto count : counts)
+		for (auto dist : dists)
+			if (!run_bench(count, dist))
+				return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
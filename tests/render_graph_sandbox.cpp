@@ -24,6 +24,7 @@
 #include "render_graph.hpp"
 #include "os_filesystem.hpp"
 #include "task_composer.hpp"
+#include "timer.hpp"
 #include <string.h>
 
 using namespace Granite;
@@ -38,7 +39,6 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
 
 	void on_swapchain_created(const SwapchainParameterEvent &e)
 	{
-		graph.reset();
 		graph.set_device(&e.get_device());
 
 		ResourceDimensions dim;
@@ -46,6 +46,57 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
 		dim.height = e.get_height();
 		dim.format = e.get_format();
 		dim.transform = e.get_prerotate();
+
+		if (!benchmarked_bake)
+		{
+			benchmark_bake(dim);
+			benchmarked_bake = true;
+		}
+
+		add_passes(dim);
+		auto start = Util::get_current_time_nsecs();
+		graph.bake();
+		LOGI("Baked render graph in %.3f us.\n", 1e-3 * double(Util::get_current_time_nsecs() - start));
+		graph.log();
+	}
+
+	double time_bake(const ResourceDimensions &dim, bool resize)
+	{
+		constexpr unsigned Iterations = 32;
+		int64_t total = 0;
+
+		for (unsigned iter = 0; iter < Iterations; iter++)
+		{
+			auto bake_dim = dim;
+			if (resize)
+			{
+				bake_dim.width += iter + 1;
+				bake_dim.height += iter + 1;
+			}
+
+			add_passes(bake_dim);
+			auto start = Util::get_current_time_nsecs();
+			graph.bake();
+			total += Util::get_current_time_nsecs() - start;
+		}
+
+		return 1e-3 * double(total) / Iterations;
+	}
+
+	void benchmark_bake(const ResourceDimensions &dim)
+	{
+		graph.enable_bake_cache(false);
+		double full = time_bake(dim, false);
+		graph.enable_bake_cache(true);
+		double cached = time_bake(dim, false);
+		double resized = time_bake(dim, true);
+
+		LOGI("Render graph bake: full %.3f us, cached %.3f us, resized %.3f us.\n", full, cached, resized);
+	}
+
+	void add_passes(const ResourceDimensions &dim)
+	{
+		graph.reset();
 		graph.set_backbuffer_dimensions(dim);
 
 		AttachmentInfo back;
@@ -128,8 +179,6 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
 		});
 
 		graph.set_backbuffer_source("back");
-		graph.bake();
-		graph.log();
 	}
 
 	void on_swapchain_destroyed(const SwapchainParameterEvent &)
@@ -147,6 +196,7 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
 	}
 
 	RenderGraph graph;
+	bool benchmarked_bake = false;
 };
 
 namespace Granite
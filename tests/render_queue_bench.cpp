@@ -0,0 +1,151 @@
+#include "render_queue.hpp"
+#include "thread_group.hpp"
+#include "task_composer.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <thread>
+#include <stdlib.h>
+#include <stdint.h>
+
+using namespace Granite;
+
+// CPU-only, nothing is dispatched. Compares combine_render_info() + sort() with sort_indices() + merge().
+struct BenchRenderInfo
+{
+	uint32_t draw;
+};
+
+static void bench_render(Vulkan::CommandBuffer &, const RenderQueueData *, unsigned)
+{
+}
+
+static constexpr unsigned NumQueues = 8;
+static constexpr unsigned NumIterations = 10;
+
+static void push_items(RenderQueue *queues, size_t count)
+{
+	uint32_t state = 1;
+	const auto next = [&]() {
+		state = state * 1664525u + 1013904223u;
+		return state ^ (state >> 16);
+	};
+
+	unsigned num_draws = std::max<unsigned>(1, unsigned(count / 16));
+	for (unsigned i = 0; i < NumQueues; i++)
+	{
+		auto &queue = queues[i];
+		queue.reset();
+
+		// Like compose_parallel_push_renderables(), every queue pushes a contiguous chunk of the visible list.
+		for (size_t j = (count * i) / NumQueues; j < (count * (i + 1)) / NumQueues; j++)
+		{
+			uint32_t draw = next() % num_draws;
+			Util::Hash pipeline_hash = (next() % 48) * 0x9e3779b9u;
+			float z = 0.5f + float(next() >> 8) * (500.0f / float(1u << 24));
+			uint64_t key = RenderInfo::get_sprite_sort_key(Queue::Opaque, pipeline_hash, draw * 2654435761u, z);
+
+			auto *info = queue.push<BenchRenderInfo>(Queue::Opaque, draw + 1, key, bench_render,
+			                                         reinterpret_cast<void *>(uintptr_t(j + 1)));
+			if (info)
+				info->draw = draw;
+		}
+	}
+}
+
+static void combine_and_sort(RenderQueue *queues, ThreadGroup *)
+{
+	for (unsigned i = 1; i < NumQueues; i++)
+		queues[0].combine_render_info(queues[i]);
+	queues[0].sort();
+}
+
+static void sort_and_merge(RenderQueue *queues, ThreadGroup *group)
+{
+	if (group)
+	{
+		TaskComposer composer(*group);
+		auto &stage = composer.begin_pipeline_stage();
+		for (unsigned i = 0; i < NumQueues; i++)
+			stage.enqueue_task([queues, i]() { queues[i].sort_indices(); });
+		queues[0].merge(composer, queues, NumQueues, NumQueues);
+		composer.get_outgoing_task()->wait();
+	}
+	else
+	{
+		for (unsigned i = 0; i < NumQueues; i++)
+			queues[i].sort_indices();
+		queues[0].merge(queues, NumQueues);
+	}
+}
+
+static double run_mode(RenderQueue *queues, size_t count, ThreadGroup *group,
+                       void (*func)(RenderQueue *, ThreadGroup *))
+{
+	int64_t total = 0;
+	for (unsigned iter = 0; iter < NumIterations; iter++)
+	{
+		push_items(queues, count);
+		auto start = Util::get_current_time_nsecs();
+		func(queues, group);
+		total += Util::get_current_time_nsecs() - start;
+	}
+	return 1e-6 * double(total) / NumIterations;
+}
+
+static bool compare(const RenderQueue &a, const RenderQueue &b)
+{
+	size_t count = a.get_dispatch_size(Queue::Opaque);
+	if (count != b.get_dispatch_size(Queue::Opaque))
+	{
+		LOGE("Dispatch size mismatch.\n");
+		return false;
+	}
+
+	auto *data_a = a.get_queue_data(Queue::Opaque).sorted_data();
+	auto *data_b = b.get_queue_data(Queue::Opaque).sorted_data();
+	for (size_t i = 0; i < count; i++)
+	{
+		if (data_a[i].sorting_key != data_b[i].sorting_key || data_a[i].instance_data != data_b[i].instance_data ||
+		    static_cast<const BenchRenderInfo *>(data_a[i].render_info)->draw !=
+		    static_cast<const BenchRenderInfo *>(data_b[i].render_info)->draw)
+		{
+			LOGE("Mismatch at %zu.\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main()
+{
+	unsigned num_threads = std::max(1u, std::min(NumQueues, std::thread::hardware_concurrency()));
+	ThreadGroup group;
+	group.start(num_threads, 0, {});
+
+	// Both instances are kept around so block allocations are warm after the first iteration.
+	RenderQueue combined[NumQueues];
+	RenderQueue merged[NumQueues];
+
+	LOGI("%u queues, %u worker threads.\n", NumQueues, num_threads);
+	const size_t counts[] = { 1000, 10000, 100000, 500000 };
+	for (auto count : counts)
+	{
+		double combine_ms = run_mode(combined, count, nullptr, combine_and_sort);
+		double merge_ms = run_mode(merged, count, nullptr, sort_and_merge);
+		if (!compare(combined[0], merged[0]))
+			return EXIT_FAILURE;
+
+		double merge_mt_ms = run_mode(merged, count, &group, sort_and_merge);
+		if (!compare(combined[0], merged[0]))
+			return EXIT_FAILURE;
+
+		// Bulk RenderQueueData copies after pushing: combining and gathering, versus only the merge itself.
+		double mb = double(count * sizeof(RenderQueueData)) / (1024.0 * 1024.0);
+		LOGI("%7zu draws: combine + sort %7.3f ms (%6.2f MB copied), sort + merge %7.3f ms (MT %7.3f ms, %6.2f MB copied).\n",
+		     count, combine_ms, 2.0 * mb, merge_ms, merge_mt_ms, mb);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -4,8 +4,13 @@
 #include "logging.hpp"
 #include "transforms.hpp"
 #include "frustum.hpp"
+#include "transform_batch.hpp"
+#include "aabb_batch.hpp"
+#include "timer.hpp"
 #include <assert.h>
+#include <float.h>
 #include <string.h>
+#include <vector>
 
 using namespace Granite;
 
@@ -98,11 +103,255 @@ static void test_quat()
 	}
 }
 
+static void test_transform_batch()
+{
+	uint32_t state = 1;
+	const auto next_u32 = [&]() -> uint32_t {
+		state = state * 1664525u + 1013904223u;
+		return state >> 8;
+	};
+	const auto next = [&]() -> float {
+		return float(next_u32()) * (2.0f / float(1u << 24)) - 1.0f;
+	};
+
+	// A few levels of nodes, every node parented to a random node of the previous level.
+	// Level sizes are not lane multiples, so tails are covered as well.
+	const unsigned level_sizes[] = { 7, 61, 200, 333 };
+	std::vector<uint32_t> parents;
+	std::vector<uint32_t> level_offsets;
+	uint32_t prev_offset = 0, prev_count = 0;
+	for (auto size : level_sizes)
+	{
+		level_offsets.push_back(uint32_t(parents.size()));
+		for (unsigned i = 0; i < size; i++)
+			parents.push_back(prev_count ? prev_offset + next_u32() % prev_count : TransformBatch::NoParent);
+		prev_offset = level_offsets.back();
+		prev_count = size;
+	}
+	level_offsets.push_back(uint32_t(parents.size()));
+
+	size_t count = parents.size();
+	std::vector<vec3> scales(count), translations(count);
+	std::vector<quat> rotations(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		// Negative and zero components to also cover signed zeros.
+		scales[i] = i % 5 == 0 ? vec3(-1.0f, 2.0f, 0.0f) : vec3(next(), next(), next()) * 4.0f;
+		translations[i] = vec3(next(), next(), next()) * 100.0f;
+		rotations[i] = i % 7 == 0 ? quat(1.0f, 0.0f, 0.0f, 0.0f) :
+		               normalize(quat(next(), next(), next(), next()));
+	}
+
+	std::vector<mat4> reference(count), prev(count), batched(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		mat4 parent = parents[i] == TransformBatch::NoParent ? mat4(1.0f) : reference[parents[i]];
+		compute_model_transform(reference[i], scales[i], rotations[i], translations[i], parent);
+		batched[i] = mat4(float(i));
+	}
+
+	for (size_t level = 0; level + 1 < level_offsets.size(); level++)
+	{
+		TransformBatch batch;
+		for (uint32_t i = level_offsets[level]; i < level_offsets[level + 1]; i++)
+		{
+			batch.push(scales[i], rotations[i], translations[i], parents[i], i);
+			if (batch.full() || i + 1 == level_offsets[level + 1])
+			{
+				batch.compose(batched.data(), prev.data());
+				batch.clear();
+			}
+		}
+	}
+
+	// Exact float equality. With fast math the compiler is free to pick the sign of zero results,
+	// so bit patterns of zeros may differ between the two paths.
+	// If FMA is enabled, contraction is up to the compiler as well, so allow for an ULP or so there.
+	const auto equal = [](const mat4 &a, const mat4 &b) -> bool {
+#ifdef __FMA__
+		float magnitude = 1.0f;
+		for (unsigned c = 0; c < 4; c++)
+			for (unsigned r = 0; r < 4; r++)
+				magnitude = muglm::max(magnitude, muglm::abs(a[c][r]));
+#endif
+
+		for (unsigned c = 0; c < 4; c++)
+		{
+			for (unsigned r = 0; r < 4; r++)
+			{
+#ifdef __FMA__
+				if (muglm::abs(a[c][r] - b[c][r]) > 1e-5f * magnitude)
+					return false;
+#else
+				if (a[c][r] != b[c][r])
+					return false;
+#endif
+			}
+		}
+		return true;
+	};
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!equal(reference[i], batched[i]) || prev[i][0].x != float(i))
+		{
+			LOGE("Transform batch mismatch at %zu!\n", i);
+			exit(1);
+		}
+	}
+}
+
+static std::vector<AABB> build_aabb_field(unsigned count)
+{
+	uint32_t state = 7;
+	const auto next = [&]() -> float {
+		state = state * 1664525u + 1013904223u;
+		return float(state >> 8) * (2.0f / float(1u << 24)) - 1.0f;
+	};
+
+	// Boxes all around the camera, some of them straddling planes, some of them behind the near plane.
+	std::vector<AABB> aabbs;
+	aabbs.reserve(count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		vec3 center = vec3(next(), next(), next()) * 10.0f;
+		vec3 extent = (vec3(next(), next(), next()) + 1.1f) * 0.5f;
+		aabbs.emplace_back(center - extent, center + extent);
+	}
+	return aabbs;
+}
+
+static Frustum build_test_frustum()
+{
+	mat4 view = mat4_cast(angleAxis(0.5f, normalize(vec3(0.3f, 1.0f, 0.2f)))) * translate(vec3(-1.0f, -2.0f, -3.0f));
+	Frustum frustum;
+	frustum.build_planes(inverse(projection(0.8f, 1.5f, 0.1f, 20.0f) * view));
+	return frustum;
+}
+
+static void test_aabb_batch()
+{
+	Frustum frustum = build_test_frustum();
+
+	// Not a lane multiple, so tails are covered too.
+	auto aabbs = build_aabb_field(1003);
+	AABBBatch batch;
+	uint32_t visible[AABBBatch::MaxCount];
+	float sizes[AABBBatch::MaxCount];
+	unsigned total_visible = 0;
+
+	for (size_t base = 0; base < aabbs.size(); base += AABBBatch::MaxCount)
+	{
+		size_t count = std::min<size_t>(aabbs.size() - base, AABBBatch::MaxCount);
+		batch.clear();
+		for (size_t i = 0; i < count; i++)
+			batch.push(aabbs[base + i]);
+
+		unsigned num_visible = batch.cull(frustum, visible, sizes);
+		unsigned visible_index = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			auto &aabb = aabbs[base + i];
+			bool expected = SIMD::frustum_cull(aabb, frustum.get_planes());
+			bool got = visible_index < num_visible && visible[visible_index] == i;
+			if (expected != got)
+			{
+				LOGE("AABB batch cull mismatch at %zu!\n", base + i);
+				exit(1);
+			}
+
+			if (!got)
+				continue;
+
+			float reference = frustum.estimate_screen_size(aabb);
+			float size = sizes[visible_index++];
+			if (reference == FLT_MAX ? size != FLT_MAX : muglm::abs(size - reference) > 1e-4f * reference)
+			{
+				LOGE("AABB batch screen size mismatch at %zu, %f != %f!\n", base + i, size, reference);
+				exit(1);
+			}
+		}
+
+		if (visible_index != num_visible)
+		{
+			LOGE("AABB batch reported too many visible boxes!\n");
+			exit(1);
+		}
+		total_visible += num_visible;
+	}
+
+	if (total_visible == 0 || total_visible == aabbs.size())
+	{
+		LOGE("AABB batch test is degenerate!\n");
+		exit(1);
+	}
+
+	// A box right in front of the camera must cover more of the screen than a box of the same size further away.
+	Frustum centered;
+	centered.build_planes(inverse(projection(0.8f, 1.0f, 0.1f, 100.0f)));
+	float near_size = centered.estimate_screen_size(AABB(vec3(-1.0f, -1.0f, -6.0f), vec3(1.0f, 1.0f, -4.0f)));
+	float far_size = centered.estimate_screen_size(AABB(vec3(-1.0f, -1.0f, -51.0f), vec3(1.0f, 1.0f, -49.0f)));
+	if (!(near_size > far_size && far_size > 0.0f))
+	{
+		LOGE("Screen size estimate is not monotonic, %f <= %f!\n", near_size, far_size);
+		exit(1);
+	}
+}
+
+static void bench_aabb_batch()
+{
+	Frustum frustum = build_test_frustum();
+
+	// Small enough to stay in cache, so this measures the culling itself.
+	auto aabbs = build_aabb_field(4096);
+	std::vector<AABBBatch> batches(aabbs.size() / AABBBatch::MaxCount);
+	for (size_t i = 0; i < aabbs.size(); i++)
+		batches[i / AABBBatch::MaxCount].push(aabbs[i]);
+
+	constexpr unsigned iterations = 1000;
+	unsigned single_visible = 0;
+	unsigned batched_visible = 0;
+	unsigned sized_visible = 0;
+	uint32_t visible[AABBBatch::MaxCount];
+	float sizes[AABBBatch::MaxCount];
+
+	auto start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < iterations; iter++)
+		for (auto &aabb : aabbs)
+			single_visible += unsigned(SIMD::frustum_cull(aabb, frustum.get_planes()));
+	auto single_time = Util::get_current_time_nsecs() - start;
+
+	start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < iterations; iter++)
+		for (auto &batch : batches)
+			batched_visible += batch.cull(frustum, visible, nullptr);
+	auto batched_time = Util::get_current_time_nsecs() - start;
+
+	start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < iterations; iter++)
+		for (auto &batch : batches)
+			sized_visible += batch.cull(frustum, visible, sizes);
+	auto sized_time = Util::get_current_time_nsecs() - start;
+
+	if (single_visible != batched_visible || single_visible != sized_visible)
+	{
+		LOGE("AABB batch bench mismatch!\n");
+		exit(1);
+	}
+
+	double boxes = double(aabbs.size()) * iterations;
+	LOGI("Frustum cull: single %.3f ns/box, batched %.3f ns/box, batched with screen sizes %.3f ns/box.\n",
+	     double(single_time) / boxes, double(batched_time) / boxes, double(sized_time) / boxes);
+}
+
 int main()
 {
 	test_matrix_multiply();
 	test_frustum_cull();
 	test_aabb_transform();
 	test_quat();
+	test_transform_batch();
+	test_aabb_batch();
+	bench_aabb_batch();
 	LOGI(":D\n");
 }
\ No newline at end of file
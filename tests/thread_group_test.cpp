@@ -21,14 +21,24 @@
  */
 
 #include "thread_group.hpp"
+#include "parallel_for.hpp"
 #include "logging.hpp"
+#include "timer.hpp"
+#include <atomic>
+#include <vector>
+#include <stdlib.h>
 
 using namespace Granite;
 
-int main()
+static const char *scheduler_name(ThreadGroupScheduler scheduler)
+{
+	return scheduler == ThreadGroupScheduler::WorkStealing ? "work-stealing" : "shared";
+}
+
+static void run_dependency_test(ThreadGroupScheduler scheduler)
 {
 	ThreadGroup group;
-	group.start(4, 0, {});
+	group.start(4, 0, {}, scheduler);
 
 	auto task1 = group.create_task([]() {
 		LOGI("Ohai!\n");
@@ -54,3 +64,295 @@ int main()
 
 	group.wait_idle();
 }
+
+static bool run_priority_test(ThreadGroupScheduler scheduler)
+{
+	ThreadGroup group;
+	group.start(1, 0, {}, scheduler);
+	group.set_task_latency_tracking(true);
+
+	// Park the only worker so everything below is queued up before anything runs.
+	std::mutex lock;
+	std::condition_variable cond;
+	bool released = false;
+	auto blocker = group.create_task([&]() {
+		std::unique_lock<std::mutex> holder{lock};
+		cond.wait(holder, [&]() { return released; });
+	});
+	blocker->set_desc("blocker");
+	blocker->flush();
+
+	constexpr unsigned NumTasks = 64;
+	std::vector<TaskPriority> order;
+	order.reserve(3 * NumTasks);
+
+	TaskGroupHandle groups[NumTaskPriorities];
+	const TaskPriority submit_order[] = { TaskPriority::Bulk, TaskPriority::LatencySensitive, TaskPriority::FrameCritical };
+	for (auto prio : submit_order)
+	{
+		auto &task = groups[unsigned(prio)];
+		task = group.create_task();
+		task->set_task_priority(prio);
+		for (unsigned i = 0; i < NumTasks; i++)
+			task->enqueue_task([&order, prio]() { order.push_back(prio); });
+		task->flush();
+	}
+
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		released = true;
+		cond.notify_one();
+	}
+	group.wait_idle();
+
+	for (size_t i = 1; i < order.size(); i++)
+	{
+		if (unsigned(order[i]) < unsigned(order[i - 1]))
+		{
+			LOGE("Task of priority %u ran after a task of priority %u.\n",
+			     unsigned(order[i]), unsigned(order[i - 1]));
+			return false;
+		}
+	}
+
+	auto stats = group.get_task_latency_statistics(TaskPriority::Bulk, false);
+	LOGI("  %14s, bulk latency: p50 %.0f us, p99 %.0f us over %llu tasks.\n",
+	     scheduler_name(scheduler), stats.p50_us, stats.p99_us,
+	     static_cast<unsigned long long>(stats.count));
+
+	return order.size() == 3 * NumTasks && stats.count == NumTasks;
+}
+
+static bool run_parallel_for_test(ThreadGroupScheduler scheduler)
+{
+	ThreadGroup group;
+	group.start(4, 0, {}, scheduler);
+
+	constexpr size_t Count = 100000;
+	constexpr unsigned NumSlots = 4;
+	std::vector<std::atomic_uint> visits(Count);
+	for (auto &v : visits)
+		v.store(0, std::memory_order_relaxed);
+
+	std::atomic_uint slot_owners[NumSlots];
+	for (auto &owner : slot_owners)
+		owner.store(0, std::memory_order_relaxed);
+
+	std::atomic_bool slot_conflict;
+	slot_conflict.store(false);
+
+	uint64_t sum = 0;
+
+	TaskComposer composer(group);
+	parallel_for_slots(composer, 0, Count, 256, NumSlots, [&](size_t begin, size_t end, unsigned slot) {
+		if (slot >= NumSlots || slot_owners[slot].fetch_add(1, std::memory_order_relaxed) != 0)
+			slot_conflict = true;
+
+		// Skew the cost so later elements are more expensive.
+		volatile unsigned dummy = 0;
+		for (size_t i = begin; i < end; i++)
+		{
+			for (size_t j = 0; j < i / 4096; j++)
+				dummy = dummy + 1;
+			visits[i].fetch_add(1, std::memory_order_relaxed);
+		}
+
+		if (slot < NumSlots)
+			slot_owners[slot].fetch_sub(1, std::memory_order_relaxed);
+	}).set_desc("parallel-for-test");
+
+	parallel_reduce(composer, 0, Count, 1024, uint64_t(0), &sum,
+	                [](size_t begin, size_t end, uint64_t &accum) {
+		                for (size_t i = begin; i < end; i++)
+			                accum += i;
+	                },
+	                [](uint64_t &accum, uint64_t value) {
+		                accum += value;
+	                });
+
+	uint64_t observed_sum = 0;
+	auto &check = composer.begin_pipeline_stage();
+	check.enqueue_task([&]() {
+		observed_sum = sum;
+	});
+
+	composer.get_outgoing_task()->wait();
+
+	for (size_t i = 0; i < Count; i++)
+	{
+		if (visits[i].load() != 1)
+		{
+			LOGE("Element %zu was visited %u times.\n", i, visits[i].load());
+			return false;
+		}
+	}
+
+	if (slot_conflict)
+	{
+		LOGE("Slot was used by more than one task at a time.\n");
+		return false;
+	}
+
+	uint64_t expected_sum = uint64_t(Count) * (Count - 1) / 2;
+	if (observed_sum != expected_sum)
+	{
+		LOGE("Expected reduction to be %llu, got %llu.\n",
+		     static_cast<unsigned long long>(expected_sum),
+		     static_cast<unsigned long long>(observed_sum));
+		return false;
+	}
+
+	return true;
+}
+
+// Mimics a frame worth of culling and render queue pushes:
+// a handful of pipeline stages, each fanning out into many tiny tasks,
+// some of which spawn follow-up work from within the workers.
+static constexpr unsigned NumStages = 4;
+static constexpr unsigned TasksPerStage = 2048;
+static constexpr unsigned NestedTasks = 4;
+static constexpr unsigned NumFrames = 64;
+
+static bool run_contention_benchmark(ThreadGroupScheduler scheduler, unsigned num_threads)
+{
+	ThreadGroup group;
+	group.start(num_threads, 0, {}, scheduler);
+
+	std::atomic_uint counter;
+	counter.store(0);
+
+	auto start_time = Util::get_current_time_nsecs();
+
+	for (unsigned frame = 0; frame < NumFrames; frame++)
+	{
+		TaskGroupHandle prev;
+		for (unsigned stage = 0; stage < NumStages; stage++)
+		{
+			auto task = group.create_task();
+			for (unsigned i = 0; i < TasksPerStage; i++)
+			{
+				task->enqueue_task([&group, &counter, i]() {
+					counter.fetch_add(1, std::memory_order_relaxed);
+					if ((i & 63) == 0)
+					{
+						auto nested = group.create_task();
+						for (unsigned j = 0; j < NestedTasks; j++)
+						{
+							nested->enqueue_task([&counter]() {
+								counter.fetch_add(1, std::memory_order_relaxed);
+							});
+						}
+					}
+				});
+			}
+
+			if (prev)
+			{
+				group.add_dependency(*task, *prev);
+				prev->flush();
+			}
+			prev = std::move(task);
+		}
+		prev->wait();
+		group.wait_idle();
+	}
+
+	auto end_time = Util::get_current_time_nsecs();
+	unsigned expected = NumFrames * NumStages * (TasksPerStage + (TasksPerStage / 64) * NestedTasks);
+	unsigned observed = counter.load();
+
+	double total_ms = 1e-6 * double(end_time - start_time);
+	LOGI("  %14s, %2u threads: %8.3f ms / frame, %7.1f ns / task.\n",
+	     scheduler_name(scheduler), num_threads,
+	     total_ms / NumFrames, 1e6 * total_ms / double(expected));
+
+	if (observed != expected)
+	{
+		LOGE("Expected %u tasks to run, but %u did.\n", expected, observed);
+		return false;
+	}
+
+	return true;
+}
+
+static constexpr unsigned NumEmptyGroups = 20000;
+
+// Measures the fixed cost of create / flush / run / wait for task groups which do no work,
+// and of fence signals waited on from the submitting thread.
+static bool run_empty_task_benchmark(ThreadGroupScheduler scheduler, unsigned num_threads)
+{
+	ThreadGroup group;
+	group.start(num_threads, 0, {}, scheduler);
+
+	auto start_time = Util::get_current_time_nsecs();
+	for (unsigned i = 0; i < NumEmptyGroups; i++)
+	{
+		auto task = group.create_task([]() {});
+		task->flush();
+		task->wait();
+	}
+	auto wait_time = Util::get_current_time_nsecs();
+
+	TaskSignal signal;
+	for (unsigned i = 0; i < NumEmptyGroups; i++)
+	{
+		auto task = group.create_task([]() {});
+		task->set_fence_counter_signal(&signal);
+		task.reset();
+		signal.wait_until_at_least(i + 1);
+	}
+	auto signal_time = Util::get_current_time_nsecs();
+
+	group.wait_idle();
+
+	LOGI("  %14s, %2u threads: %7.1f ns / empty group wait, %7.1f ns / signal wait.\n",
+	     scheduler_name(scheduler), num_threads,
+	     double(wait_time - start_time) / NumEmptyGroups,
+	     double(signal_time - wait_time) / NumEmptyGroups);
+
+	if (signal.get_count() != NumEmptyGroups)
+	{
+		LOGE("Expected signal count %u, got %u.\n", NumEmptyGroups, unsigned(signal.get_count()));
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	run_dependency_test(ThreadGroupScheduler::SharedQueue);
+	run_dependency_test(ThreadGroupScheduler::WorkStealing);
+
+	if (!run_priority_test(ThreadGroupScheduler::SharedQueue) ||
+	    !run_priority_test(ThreadGroupScheduler::WorkStealing))
+		return EXIT_FAILURE;
+
+	if (!run_parallel_for_test(ThreadGroupScheduler::SharedQueue) ||
+	    !run_parallel_for_test(ThreadGroupScheduler::WorkStealing))
+		return EXIT_FAILURE;
+
+	unsigned max_threads = argc >= 2 ? unsigned(strtoul(argv[1], nullptr, 0)) : std::thread::hardware_concurrency();
+	if (max_threads == 0)
+		max_threads = 1;
+
+	LOGI("Contention benchmark, %u stages x %u tasks per frame.\n", NumStages, TasksPerStage);
+	for (unsigned num_threads = 1; num_threads <= max_threads; num_threads++)
+	{
+		if (!run_contention_benchmark(ThreadGroupScheduler::SharedQueue, num_threads))
+			return EXIT_FAILURE;
+		if (!run_contention_benchmark(ThreadGroupScheduler::WorkStealing, num_threads))
+			return EXIT_FAILURE;
+	}
+
+	LOGI("Empty task overhead, %u groups.\n", NumEmptyGroups);
+	for (unsigned num_threads = 1; num_threads <= max_threads; num_threads++)
+	{
+		if (!run_empty_task_benchmark(ThreadGroupScheduler::SharedQueue, num_threads))
+			return EXIT_FAILURE;
+		if (!run_empty_task_benchmark(ThreadGroupScheduler::WorkStealing, num_threads))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
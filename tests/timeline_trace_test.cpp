@@ -0,0 +1,137 @@
+#include "timeline_trace_file.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Util;
+
+static constexpr unsigned NumThreads = 8;
+static constexpr unsigned NumEvents = 100000;
+static constexpr unsigned NumDescs = 64;
+
+using EventCounts = std::map<std::string, unsigned>;
+
+static double write_trace(const char *path)
+{
+	// Every thread submits more events than fit in its ring, so the writer has to keep up or overflow.
+	TimelineTraceFile file(path);
+	std::vector<std::thread> threads;
+	auto start = get_current_time_nsecs();
+
+	for (unsigned i = 0; i < NumThreads; i++)
+	{
+		threads.emplace_back([&file, i]() {
+			char tid[32];
+			snprintf(tid, sizeof(tid), "thread-%u", i);
+			TimelineTraceFile::set_tid(tid);
+
+			char descs[NumDescs][32];
+			for (unsigned j = 0; j < NumDescs; j++)
+				snprintf(descs[j], sizeof(descs[j]), "event-%u", j);
+
+			for (unsigned j = 0; j < NumEvents; j++)
+				TimelineTraceFile::ScopedEvent e(&file, descs[j % NumDescs]);
+
+			const char *names[] = { "a", "b" };
+			const double values[] = { double(i), 1.0 };
+			file.submit_counters("counters", get_current_time_nsecs(), names, values, 2);
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	// Wall clock time, the writer thread competes with the producers.
+	return double(get_current_time_nsecs() - start) / double(NumThreads * NumEvents);
+}
+
+static bool count_events(const char *path, EventCounts &counts)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return false;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), file))
+	{
+		char name[256], ph[8], tid[64];
+		if (sscanf(line, "{ \"name\": \"%255[^\"]\", \"ph\": \"%7[^\"]\", \"tid\": \"%63[^\"]\"", name, ph, tid) == 3)
+			counts[std::string(name) + "/" + ph + "/" + tid]++;
+		else if (sscanf(line, "{ \"name\": \"%255[^\"]\", \"ph\": \"%7[^\"]\"", name, ph) == 2)
+			counts[std::string(name) + "/" + ph]++;
+	}
+
+	fclose(file);
+	return true;
+}
+
+static bool check_counts(const char *tag, const EventCounts &counts)
+{
+	for (unsigned i = 0; i < NumThreads; i++)
+	{
+		for (unsigned j = 0; j < NumDescs; j++)
+		{
+			char key[64];
+			snprintf(key, sizeof(key), "event-%u/B/thread-%u", j, i);
+			auto itr = counts.find(key);
+			unsigned expected = NumEvents / NumDescs + (j < NumEvents % NumDescs ? 1 : 0);
+			if (itr == counts.end() || itr->second != expected)
+			{
+				LOGE("%s: Expected %u events for %s.\n", tag, expected, key);
+				return false;
+			}
+		}
+	}
+
+	auto itr = counts.find("counters/C");
+	if (itr == counts.end() || itr->second != NumThreads)
+	{
+		LOGE("%s: Missing counter events.\n", tag);
+		return false;
+	}
+
+	return true;
+}
+
+int main()
+{
+	const char *binary_path = "timeline-trace-test.bin";
+	const char *converted_path = "timeline-trace-test-converted.json";
+	const char *json_path = "timeline-trace-test.json";
+
+	double binary_ns = write_trace(binary_path);
+	double json_ns = write_trace(json_path);
+
+	if (!TimelineTraceFile::convert_to_json(binary_path, converted_path))
+		return EXIT_FAILURE;
+
+	EventCounts json_counts, converted_counts;
+	if (!count_events(json_path, json_counts) || !count_events(converted_path, converted_counts))
+	{
+		LOGE("Failed to read back traces.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!check_counts("JSON", json_counts) || !check_counts("Binary", converted_counts))
+		return EXIT_FAILURE;
+
+	if (json_counts != converted_counts)
+	{
+		LOGE("Converted binary trace does not match JSON trace.\n");
+		return EXIT_FAILURE;
+	}
+
+	LOGI("%u threads, %.1f ns per scoped event (binary), %.1f ns per scoped event (JSON), wall clock time over all events.\n",
+	     NumThreads, binary_ns, json_ns);
+
+	remove(binary_path);
+	remove(converted_path);
+	remove(json_path);
+	return EXIT_SUCCESS;
+}
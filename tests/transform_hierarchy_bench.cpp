@@ -0,0 +1,243 @@
+#include "scene.hpp"
+#include "transform_batch.hpp"
+#include "transforms.hpp"
+#include "thread_group.hpp"
+#include "task_composer.hpp"
+#include "muglm/muglm_impl.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+
+using namespace Granite;
+
+// 300 roots, each with three levels of 10 children below it. 333300 nodes in total.
+static constexpr unsigned NumRoots = 300;
+static constexpr unsigned FanOut = 10;
+static constexpr unsigned Depth = 3;
+static constexpr unsigned NumIterations = 10;
+
+struct Random
+{
+	uint32_t state = 1;
+	float next()
+	{
+		state = state * 1664525u + 1013904223u;
+		return float(state >> 8) * (2.0f / float(1u << 24)) - 1.0f;
+	}
+
+	Transform next_transform()
+	{
+		Transform t;
+		t.scale = vec3(1.0f) + 0.2f * vec3(next(), next(), next());
+		t.translation = 10.0f * vec3(next(), next(), next());
+		t.rotation = normalize(quat(next(), next(), next(), next()));
+		return t;
+	}
+};
+
+// The same hierarchy flattened into level order, without any Scene or Node overhead.
+struct FlatHierarchy
+{
+	std::vector<Transform> locals;
+	std::vector<uint32_t> parents;
+	std::vector<uint32_t> level_offsets;
+	std::vector<mat4> world;
+	std::vector<mat4> prev_world;
+};
+
+static void build_flat(FlatHierarchy &flat, Random &rnd)
+{
+	uint32_t prev_offset = 0;
+	uint32_t prev_count = 0;
+	for (unsigned level = 0; level <= Depth; level++)
+	{
+		flat.level_offsets.push_back(uint32_t(flat.parents.size()));
+		if (level == 0)
+		{
+			for (unsigned i = 0; i < NumRoots; i++)
+				flat.parents.push_back(TransformBatch::NoParent);
+		}
+		else
+		{
+			for (uint32_t p = 0; p < prev_count; p++)
+				for (unsigned i = 0; i < FanOut; i++)
+					flat.parents.push_back(prev_offset + p);
+		}
+
+		prev_offset = flat.level_offsets.back();
+		prev_count = uint32_t(flat.parents.size()) - prev_offset;
+	}
+	flat.level_offsets.push_back(uint32_t(flat.parents.size()));
+
+	flat.locals.resize(flat.parents.size());
+	for (auto &t : flat.locals)
+		t = rnd.next_transform();
+	flat.world.resize(flat.parents.size());
+	flat.prev_world.resize(flat.parents.size());
+}
+
+static void update_flat_per_node(FlatHierarchy &flat)
+{
+	static const mat4 identity(1.0f);
+	for (size_t i = 0, n = flat.parents.size(); i < n; i++)
+	{
+		auto &t = flat.locals[i];
+		uint32_t parent = flat.parents[i];
+		flat.prev_world[i] = flat.world[i];
+		compute_model_transform(flat.world[i], t.scale, t.rotation, t.translation,
+		                        parent == TransformBatch::NoParent ? identity : flat.world[parent]);
+	}
+}
+
+static void update_flat_batched(FlatHierarchy &flat)
+{
+	TransformBatch batch;
+	for (size_t level = 0; level + 1 < flat.level_offsets.size(); level++)
+	{
+		for (uint32_t i = flat.level_offsets[level]; i < flat.level_offsets[level + 1]; i++)
+		{
+			auto &t = flat.locals[i];
+			batch.push(t.scale, t.rotation, t.translation, flat.parents[i], i);
+			if (batch.full())
+			{
+				batch.compose(flat.world.data(), flat.prev_world.data());
+				batch.clear();
+			}
+		}
+
+		batch.compose(flat.world.data(), flat.prev_world.data());
+		batch.clear();
+	}
+}
+
+static double time_flat(FlatHierarchy &flat, void (*func)(FlatHierarchy &))
+{
+	int64_t total = 0;
+	for (unsigned iter = 0; iter < NumIterations; iter++)
+	{
+		auto start = Util::get_current_time_nsecs();
+		func(flat);
+		total += Util::get_current_time_nsecs() - start;
+	}
+	return 1e-6 * double(total) / NumIterations;
+}
+
+static void add_children(Scene &scene, Node &node, unsigned depth, Random &rnd, size_t &count)
+{
+	if (depth == 0)
+		return;
+
+	for (unsigned i = 0; i < FanOut; i++)
+	{
+		auto child = scene.create_node();
+		child->get_transform() = rnd.next_transform();
+		add_children(scene, *child, depth - 1, rnd, count);
+		node.add_child(child);
+		count++;
+	}
+}
+
+static double time_scene(Scene &scene, std::vector<NodeHandle> &roots, ThreadGroup *group)
+{
+	int64_t total = 0;
+	for (unsigned iter = 0; iter < NumIterations; iter++)
+	{
+		// Moving every root dirties the entire hierarchy.
+		for (auto &root : roots)
+		{
+			root->get_transform().translation.y += 0.01f;
+			root->invalidate_cached_transform();
+		}
+
+		auto start = Util::get_current_time_nsecs();
+		if (group)
+		{
+			TaskComposer composer(*group);
+			scene.update_transform_tree(composer);
+			composer.get_outgoing_task()->wait();
+		}
+		else
+			scene.update_transform_tree();
+		total += Util::get_current_time_nsecs() - start;
+	}
+	return 1e-6 * double(total) / NumIterations;
+}
+
+static bool verify_scene(const std::vector<NodeHandle> &roots)
+{
+	static const mat4 identity(1.0f);
+	std::vector<Node *> stack;
+	for (auto &root : roots)
+		stack.push_back(root.get());
+
+	while (!stack.empty())
+	{
+		auto *node = stack.back();
+		stack.pop_back();
+
+		auto *parent = node->get_parent();
+		auto &t = node->get_transform();
+		mat4 reference;
+		compute_model_transform(reference, t.scale, t.rotation, t.translation,
+		                        parent ? parent->get_cached_transform() : identity);
+
+		auto &cached = node->get_cached_transform();
+		for (unsigned c = 0; c < 4; c++)
+		{
+			for (unsigned r = 0; r < 4; r++)
+			{
+				if (muglm::abs(reference[c][r] - cached[c][r]) > 1e-4f * (muglm::abs(reference[c][r]) + 1.0f))
+				{
+					LOGE("Scene transform mismatch.\n");
+					return false;
+				}
+			}
+		}
+
+		for (auto &child : node->get_children())
+			stack.push_back(child.get());
+	}
+
+	return true;
+}
+
+int main()
+{
+	Random rnd;
+
+	FlatHierarchy flat;
+	build_flat(flat, rnd);
+	double per_node_ms = time_flat(flat, update_flat_per_node);
+	double batched_ms = time_flat(flat, update_flat_batched);
+	LOGI("Flat, %zu nodes: per node %7.3f ms, batched %7.3f ms.\n", flat.parents.size(), per_node_ms, batched_ms);
+
+	Scene scene;
+	std::vector<NodeHandle> roots;
+	size_t count = 0;
+	for (unsigned i = 0; i < NumRoots; i++)
+	{
+		auto root = scene.create_node();
+		root->get_transform() = rnd.next_transform();
+		add_children(scene, *root, Depth, rnd, count);
+		roots.push_back(root);
+		count++;
+	}
+
+	unsigned num_threads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+	ThreadGroup group;
+	group.start(num_threads, 0, {});
+
+	double st_ms = time_scene(scene, roots, nullptr);
+	if (!verify_scene(roots))
+		return EXIT_FAILURE;
+	double mt_ms = time_scene(scene, roots, &group);
+	if (!verify_scene(roots))
+		return EXIT_FAILURE;
+
+	LOGI("Scene, %zu nodes: update_transform_tree() %7.3f ms, %u threads %7.3f ms.\n", count, st_ms, num_threads, mt_ms);
+	return EXIT_SUCCESS;
+}
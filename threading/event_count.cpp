@@ -0,0 +1,112 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "event_count.hpp"
+#include <limits.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Granite
+{
+#ifdef __linux__
+namespace Internal
+{
+void futex_wait(const void *addr, uint32_t expected_value)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected_value, nullptr, nullptr, 0);
+}
+
+void futex_wake(const void *addr, unsigned count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count > unsigned(INT_MAX) ? INT_MAX : int(count), nullptr, nullptr, 0);
+}
+}
+
+static_assert(sizeof(std::atomic_uint32_t) == sizeof(uint32_t), "Unexpected atomic size.");
+#endif
+
+EventCount::EventCount()
+{
+	epoch.store(0, std::memory_order_relaxed);
+	waiters.store(0, std::memory_order_relaxed);
+}
+
+uint32_t EventCount::prepare_wait()
+{
+	waiters.fetch_add(1, std::memory_order_seq_cst);
+	// Pairs with the fence in notify(). Either the waiter observes the new state when it re-checks,
+	// or the notifier observes the waiter.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return epoch.load(std::memory_order_acquire);
+}
+
+void EventCount::cancel_wait()
+{
+	waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void EventCount::commit_wait(uint32_t key)
+{
+#ifdef __linux__
+	while (epoch.load(std::memory_order_acquire) == key)
+		Internal::futex_wait(&epoch, key);
+#else
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		cond.wait(holder, [&]() {
+			return epoch.load(std::memory_order_acquire) != key;
+		});
+	}
+#endif
+	waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void EventCount::wake(unsigned count)
+{
+#ifdef __linux__
+	epoch.fetch_add(1, std::memory_order_release);
+	Internal::futex_wake(&epoch, count);
+#else
+	std::lock_guard<std::mutex> holder{lock};
+	epoch.fetch_add(1, std::memory_order_release);
+	if (count == 1)
+		cond.notify_one();
+	else
+		cond.notify_all();
+#endif
+}
+
+void EventCount::notify(unsigned count)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (count && waiters.load(std::memory_order_relaxed) != 0)
+		wake(count);
+}
+
+void EventCount::notify_all()
+{
+	notify(UINT_MAX);
+}
+}
@@ -0,0 +1,71 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#ifndef __linux__
+#include <condition_variable>
+#include <mutex>
+#endif
+
+namespace Granite
+{
+#ifdef __linux__
+namespace Internal
+{
+// Thin wrappers around the futex syscall on a 32-bit word.
+void futex_wait(const void *addr, uint32_t expected_value);
+void futex_wake(const void *addr, unsigned count);
+}
+#endif
+
+// Lets threads sleep until some lock-free state changes without taking a lock on the notify side.
+// Waiters call prepare_wait(), re-check their condition, then either cancel_wait() or commit_wait().
+// Notifiers update their state first, then call notify().
+// Uses futex directly on Linux, and falls back to a condition variable elsewhere.
+class EventCount
+{
+public:
+	EventCount();
+	EventCount(const EventCount &) = delete;
+	void operator=(const EventCount &) = delete;
+
+	uint32_t prepare_wait();
+	void cancel_wait();
+	void commit_wait(uint32_t key);
+
+	// Wakes up to count waiters. Cheap if nobody is waiting.
+	void notify(unsigned count);
+	void notify_all();
+
+private:
+	std::atomic_uint32_t epoch;
+	std::atomic_uint32_t waiters;
+#ifndef __linux__
+	std::condition_variable cond;
+	std::mutex lock;
+#endif
+	void wake(unsigned count);
+};
+}
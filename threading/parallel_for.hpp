@@ -0,0 +1,227 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "task_composer.hpp"
+#include "bitops.hpp"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Data-parallel loops on top of TaskComposer.
+// The range starts out as a single task. While a task works through its range,
+// it splits off the upper half into a new task whenever there are idle workers,
+// so skewed per-element costs balance out without having to guess a task count up front.
+
+namespace Granite
+{
+namespace Internal
+{
+template <typename Func>
+struct ParallelForState : Util::IntrusivePtrEnabled<ParallelForState<Func>,
+                                                     std::default_delete<ParallelForState<Func>>,
+                                                     Util::MultiThreadCounter>
+{
+	template <typename F>
+	ParallelForState(ThreadGroup &group_, TaskDepsHandle stage_deps_, TaskGroupHandle deferred_,
+	                 size_t grain_, unsigned num_slots, F &&func_)
+		: group(group_), stage_deps(std::move(stage_deps_)), deferred(std::move(deferred_)),
+		  grain(std::max<size_t>(grain_, 1)), func(std::forward<F>(func_))
+	{
+		free_slots.store(num_slots >= 64 ? ~uint64_t(0) : ((uint64_t(1) << num_slots) - 1),
+		                 std::memory_order_relaxed);
+	}
+
+	ThreadGroup &group;
+	// Holds desc and task class of the pipeline stage, which child tasks inherit.
+	TaskDepsHandle stage_deps;
+	// Keeps the next pipeline stage from starting until all child tasks are done.
+	TaskGroupHandle deferred;
+	size_t grain;
+	Func func;
+
+	// A slot is owned by exactly one task at a time,
+	// which lets the loop body write to per-slot outputs without synchronization.
+	std::atomic<uint64_t> free_slots;
+
+	bool try_acquire_slot(unsigned &slot)
+	{
+		uint64_t mask = free_slots.load(std::memory_order_relaxed);
+		while (mask)
+		{
+			unsigned index = trailing_zeroes64(mask);
+			if (free_slots.compare_exchange_weak(mask, mask & ~(uint64_t(1) << index),
+			                                     std::memory_order_acquire, std::memory_order_relaxed))
+			{
+				slot = index;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void release_slot(unsigned slot)
+	{
+		free_slots.fetch_or(uint64_t(1) << slot, std::memory_order_release);
+	}
+};
+
+template <typename Func>
+void parallel_for_range(Util::IntrusivePtr<ParallelForState<Func>> &state,
+                        size_t begin, size_t end, unsigned slot);
+
+template <typename Func>
+void parallel_for_spawn(Util::IntrusivePtr<ParallelForState<Func>> &state,
+                               size_t begin, size_t end, unsigned slot)
+{
+	auto &group = state->group;
+	auto task = group.create_task([state, begin, end, slot]() mutable {
+		parallel_for_range(state, begin, end, slot);
+	});
+	task->set_desc(state->stage_deps->desc);
+	task->set_task_class(state->stage_deps->task_class);
+	group.add_dependency(*state->deferred, *task);
+	group.submit(task);
+}
+
+template <typename Func>
+void parallel_for_range(Util::IntrusivePtr<ParallelForState<Func>> &state,
+                        size_t begin, size_t end, unsigned slot)
+{
+	auto &group = state->group;
+	size_t grain = state->grain;
+	auto task_class = state->stage_deps->task_class;
+
+	while (begin < end)
+	{
+		// Always complete at least one grain between splits so a single idle worker
+		// which has not picked up the previous split yet does not make us split all the way down.
+		unsigned child_slot;
+		if (end - begin >= 2 * grain && group.has_idle_threads(task_class) && state->try_acquire_slot(child_slot))
+		{
+			size_t mid = begin + (end - begin) / 2;
+			parallel_for_spawn(state, mid, end, child_slot);
+			end = mid;
+		}
+
+		size_t chunk_end = std::min(end, begin + grain);
+		state->func(begin, chunk_end, slot);
+		begin = chunk_end;
+	}
+
+	state->release_slot(slot);
+}
+}
+
+// Begins a new pipeline stage in composer which calls func(begin, end, slot)
+// over consecutive sub-ranges of [begin, end), at most grain elements at a time.
+// slot is in [0, num_slots) and at most one task uses a given slot at any time,
+// so func can append to per-slot outputs without locking. It also caps parallelism at num_slots.
+// num_slots must be in [1, 64]. Anything func refers to must remain valid until the stage completes.
+// Returns the stage's task group so a description or task class can be set.
+template <typename Func>
+TaskGroup &parallel_for_slots(TaskComposer &composer, size_t begin, size_t end, size_t grain,
+                              unsigned num_slots, Func &&func)
+{
+	using FuncType = typename std::decay<Func>::type;
+	auto &group = composer.begin_pipeline_stage();
+	if (begin >= end)
+		return group;
+
+	Util::IntrusivePtr<Internal::ParallelForState<FuncType>> state(
+			new Internal::ParallelForState<FuncType>(composer.get_thread_group(), group.deps,
+			                                         composer.get_deferred_enqueue_handle(),
+			                                         grain, num_slots, std::forward<Func>(func)));
+
+	unsigned slot = 0;
+	state->try_acquire_slot(slot);
+	group.enqueue_task([state, begin, end, slot]() mutable {
+		Internal::parallel_for_range(state, begin, end, slot);
+	});
+	return group;
+}
+
+// Same as parallel_for_slots(), but func(begin, end) does not care about output slots.
+template <typename Func>
+TaskGroup &parallel_for(TaskComposer &composer, size_t begin, size_t end, size_t grain, Func &&func)
+{
+	unsigned num_slots = std::min(composer.get_thread_group().get_num_threads() + 1, 64u);
+	return parallel_for_slots(composer, begin, end, grain, num_slots,
+	                          [func = std::forward<Func>(func)](size_t range_begin, size_t range_end, unsigned) mutable {
+		                          func(range_begin, range_end);
+	                          });
+}
+
+// Begins a new pipeline stage which reduces [begin, end) into *result.
+// map_func(begin, end, T &accum) folds a sub-range into accum, which starts out as identity.
+// reduce_func(T &accum, const T &value) combines two partial results.
+// Sub-ranges are distributed dynamically, so reduce_func must be associative and commutative.
+// *result is assigned before the next pipeline stage in composer begins.
+template <typename T, typename MapFunc, typename ReduceFunc>
+TaskGroup &parallel_reduce(TaskComposer &composer, size_t begin, size_t end, size_t grain,
+                           const T &identity, T *result, MapFunc &&map_func, ReduceFunc &&reduce_func)
+{
+	struct Reducer
+	{
+		Reducer(unsigned num_slots_, const T &identity_, T *result_, MapFunc &&map_func_, ReduceFunc &&reduce_func_)
+			: partials(num_slots_, identity_), identity(identity_), result(result_),
+			  map_func(std::forward<MapFunc>(map_func_)), reduce_func(std::forward<ReduceFunc>(reduce_func_))
+		{
+		}
+
+		// Runs when the last task referencing the loop is done, before the next stage may begin.
+		~Reducer()
+		{
+			*result = identity;
+			for (auto &partial : partials)
+				reduce_func(*result, partial);
+		}
+
+		std::vector<T> partials;
+		T identity;
+		T *result;
+		typename std::decay<MapFunc>::type map_func;
+		typename std::decay<ReduceFunc>::type reduce_func;
+	};
+
+	unsigned num_slots = std::min(composer.get_thread_group().get_num_threads() + 1, 64u);
+
+	if (begin >= end)
+	{
+		*result = identity;
+		return composer.begin_pipeline_stage();
+	}
+
+	auto reducer = std::make_shared<Reducer>(num_slots, identity, result,
+	                                         std::forward<MapFunc>(map_func),
+	                                         std::forward<ReduceFunc>(reduce_func));
+
+	return parallel_for_slots(composer, begin, end, grain, num_slots,
+	                          [reducer](size_t range_begin, size_t range_end, unsigned slot) {
+		                          reducer->map_func(range_begin, range_end, reducer->partials[slot]);
+	                          });
+}
+}
@@ -31,11 +31,248 @@
 #include "timeline_trace_file.hpp"
 #include "thread_name.hpp"
 #include "environment.hpp"
+#include "timer.hpp"
+#include "bitops.hpp"
+#include "cooperative_task.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits.h>
 
 namespace Granite
 {
+// Identifies the work-stealing worker (if any) running on the current thread,
+// so tasks made ready by a worker can go straight to its local deque.
+static thread_local ThreadGroup *current_worker_group;
+static thread_local TaskClass current_worker_class;
+static thread_local std::unique_ptr<WorkStealingDeque<Internal::Task *>> *current_worker_deques;
+
 namespace Internal
 {
+struct FiberWorker;
+
+// Runs tasks on its own stack, so a task can be suspended in the middle of a wait.
+class TaskFiber : public Util::CooperativeTaskRunnable
+{
+public:
+	TaskFiber(FiberWorker &worker_, unsigned index_)
+		: worker(worker_), index(index_)
+	{
+	}
+
+	void run() noexcept override;
+
+	void suspend()
+	{
+		yield();
+	}
+
+	bool can_resume() const;
+
+	FiberWorker &worker;
+	unsigned index;
+	Task *task = nullptr;
+
+	// What the fiber waits for while suspended.
+	TaskDeps *wait_deps = nullptr;
+	TaskSignal *wait_signal = nullptr;
+	uint64_t wait_count = 0;
+};
+
+struct FiberWorker
+{
+	FiberWorker(ThreadGroup &group_, TaskClass task_class);
+
+	struct Fiber
+	{
+		std::unique_ptr<Util::CooperativeTask> context;
+		TaskFiber *runnable;
+	};
+
+	ThreadGroup &group;
+	ThreadGroup::TaskClassContext &ctx;
+	std::vector<Fiber> fibers;
+	std::vector<unsigned> free_fibers;
+	std::vector<unsigned> suspended_fibers;
+	TaskFiber *current = nullptr;
+
+	void run_task(Task *task);
+	void execute(Task *task);
+	void resume(unsigned index);
+	bool resume_ready_fibers();
+	bool has_ready_fibers() const;
+
+	static bool suspend_current(TaskDeps *deps, TaskSignal *signal, uint64_t count);
+	static void wake_suspended(ThreadGroup &group);
+	static void wake_signal_waiters();
+};
+}
+
+static thread_local Internal::FiberWorker *current_fiber_worker;
+static constexpr size_t FiberStackSize = 256 * 1024;
+
+// A TaskSignal does not know which thread group its waiters run on,
+// so while any fiber waits on a signal, every thread group running fibers is woken up on increment.
+static std::atomic_uint fiber_signal_waiters;
+static std::mutex fiber_groups_lock;
+static std::vector<ThreadGroup *> fiber_groups;
+
+namespace Internal
+{
+void TaskFiber::run() noexcept
+{
+	for (;;)
+	{
+		worker.run_task(task);
+		task = nullptr;
+		yield();
+	}
+}
+
+bool TaskFiber::can_resume() const
+{
+	if (wait_deps)
+		return wait_deps->done.load(std::memory_order_seq_cst);
+	else
+		return wait_signal->get_count() >= wait_count;
+}
+
+FiberWorker::FiberWorker(ThreadGroup &group_, TaskClass task_class)
+	: group(group_), ctx(task_class == TaskClass::Foreground ? group_.fg : group_.bg)
+{
+}
+
+void FiberWorker::run_task(Task *task)
+{
+	group.run_task(task);
+}
+
+void FiberWorker::execute(Task *task)
+{
+	unsigned index;
+	if (free_fibers.empty())
+	{
+		// suspend_current() never lets the last fiber the limit allows suspend.
+		assert(fibers.size() < group.max_fibers_per_worker);
+		index = unsigned(fibers.size());
+		auto runnable = std::make_unique<TaskFiber>(*this, index);
+		auto *ptr = runnable.get();
+		fibers.push_back({ std::make_unique<Util::CooperativeTask>(std::move(runnable), FiberStackSize), ptr });
+	}
+	else
+	{
+		index = free_fibers.back();
+		free_fibers.pop_back();
+	}
+
+	fibers[index].runnable->task = task;
+	resume(index);
+}
+
+void FiberWorker::resume(unsigned index)
+{
+	auto &fiber = fibers[index];
+	current = fiber.runnable;
+	fiber.context->resume(0.0);
+	current = nullptr;
+
+	// If the task is still set, it suspended itself again.
+	if (!fiber.runnable->task)
+		free_fibers.push_back(index);
+}
+
+bool FiberWorker::resume_ready_fibers()
+{
+	bool did_work = false;
+	size_t i = 0;
+	while (i < suspended_fibers.size())
+	{
+		unsigned index = suspended_fibers[i];
+		auto &runnable = *fibers[index].runnable;
+		if (!runnable.can_resume())
+		{
+			i++;
+			continue;
+		}
+
+		suspended_fibers[i] = suspended_fibers.back();
+		suspended_fibers.pop_back();
+		ctx.suspended_fibers.fetch_sub(1, std::memory_order_relaxed);
+		if (runnable.wait_signal)
+			fiber_signal_waiters.fetch_sub(1, std::memory_order_relaxed);
+		runnable.wait_deps = nullptr;
+		runnable.wait_signal = nullptr;
+
+		resume(index);
+		did_work = true;
+	}
+
+	return did_work;
+}
+
+bool FiberWorker::has_ready_fibers() const
+{
+	for (auto index : suspended_fibers)
+		if (fibers[index].runnable->can_resume())
+			return true;
+	return false;
+}
+
+bool FiberWorker::suspend_current(TaskDeps *deps, TaskSignal *signal, uint64_t count)
+{
+	auto *worker = current_fiber_worker;
+	if (!worker || !worker->current)
+		return false;
+
+	// The worker needs a fiber to run other tasks on while this one is suspended.
+	// At the limit, the caller blocks instead, so stack memory stays bounded however deep waits nest.
+	if (worker->free_fibers.empty() && worker->fibers.size() >= worker->group.max_fibers_per_worker)
+		return false;
+
+	auto *fiber = worker->current;
+	fiber->wait_deps = deps;
+	fiber->wait_signal = signal;
+	fiber->wait_count = count;
+
+	// Announce the suspension before the worker re-checks the condition,
+	// pairs with the checks in wake_suspended() and wake_signal_waiters().
+	worker->ctx.suspended_fibers.fetch_add(1, std::memory_order_seq_cst);
+	if (signal)
+		fiber_signal_waiters.fetch_add(1, std::memory_order_seq_cst);
+
+	worker->suspended_fibers.push_back(fiber->index);
+	fiber->suspend();
+	return true;
+}
+
+void FiberWorker::wake_suspended(ThreadGroup &group)
+{
+	if (!group.fiber_waits)
+		return;
+
+	for (auto *ctx : { &group.fg, &group.bg })
+	{
+		if (ctx->suspended_fibers.load(std::memory_order_seq_cst) == 0)
+			continue;
+
+		// Workers check for resumable fibers under the lock before sleeping.
+		{
+			std::lock_guard<std::mutex> holder{ctx->cond_lock};
+		}
+		ctx->cond.notify_all();
+		ctx->event.notify_all();
+	}
+}
+
+void FiberWorker::wake_signal_waiters()
+{
+	if (fiber_signal_waiters.load(std::memory_order_seq_cst) == 0)
+		return;
+
+	std::lock_guard<std::mutex> holder{fiber_groups_lock};
+	for (auto *group : fiber_groups)
+		wake_suspended(*group);
+}
+
 void TaskDeps::notify_dependees()
 {
 	if (signal)
@@ -45,11 +282,9 @@ void TaskDeps::notify_dependees()
 		dep->dependency_satisfied();
 	pending.clear();
 
-	{
-		std::lock_guard<std::mutex> holder{cond_lock};
-		done = true;
-		cond.notify_all();
-	}
+	done.store(true, std::memory_order_seq_cst);
+	done_event.notify_all();
+	FiberWorker::wake_suspended(*group);
 }
 
 void TaskDeps::task_completed()
@@ -97,10 +332,21 @@ void TaskGroup::wait()
 	if (!flushed)
 		flush();
 
-	std::unique_lock<std::mutex> holder{deps->cond_lock};
-	deps->cond.wait(holder, [this]() {
-		return deps->done;
-	});
+	// Inside a fiber, let the worker run something else until we're done.
+	if (!deps->done.load(std::memory_order_acquire) &&
+	    Internal::FiberWorker::suspend_current(deps.get(), nullptr, 0))
+	{
+		return;
+	}
+
+	while (!deps->done.load(std::memory_order_acquire))
+	{
+		auto key = deps->done_event.prepare_wait();
+		if (deps->done.load(std::memory_order_acquire))
+			deps->done_event.cancel_wait();
+		else
+			deps->done_event.commit_wait(key);
+	}
 }
 
 bool TaskGroup::poll()
@@ -159,25 +405,89 @@ Util::TimelineTraceFile *ThreadGroup::get_timeline_trace_file()
 void ThreadGroup::start(unsigned num_threads_foreground,
                         unsigned num_threads_background,
                         const std::function<void ()> &on_thread_begin)
+{
+	auto sched = ThreadGroupScheduler::SharedQueue;
+	std::string sched_name;
+	if (Util::get_environment("GRANITE_THREAD_GROUP_SCHEDULER", sched_name))
+	{
+		if (sched_name == "work-stealing")
+			sched = ThreadGroupScheduler::WorkStealing;
+		else if (sched_name != "shared")
+			LOGW("Unknown thread group scheduler \"%s\", using shared queue.\n", sched_name.c_str());
+	}
+
+	if (Util::get_environment_bool("GRANITE_THREAD_GROUP_FIBERS", false))
+		set_fiber_waits(true);
+
+	start(num_threads_foreground, num_threads_background, on_thread_begin, sched);
+}
+
+void ThreadGroup::set_fiber_waits(bool enable)
+{
+	if (active)
+		throw std::logic_error("Cannot change fiber waits on a thread group which has already started.");
+	fiber_waits = enable;
+}
+
+void ThreadGroup::set_fiber_wait_limit(unsigned max_fibers_per_worker_)
+{
+	if (active)
+		throw std::logic_error("Cannot change fiber wait limit on a thread group which has already started.");
+	if (!max_fibers_per_worker_)
+		throw std::logic_error("Need at least one fiber per worker.");
+	max_fibers_per_worker = max_fibers_per_worker_;
+}
+
+void ThreadGroup::start(unsigned num_threads_foreground,
+                        unsigned num_threads_background,
+                        const std::function<void ()> &on_thread_begin,
+                        ThreadGroupScheduler scheduler_)
 {
 	if (active)
 		throw std::logic_error("Cannot start a thread group which has already started.");
 
-	dead = false;
+	dead.store(false, std::memory_order_relaxed);
 	active = true;
+	scheduler = scheduler_;
 
 	fg.thread_group.resize(num_threads_foreground);
 	bg.thread_group.resize(num_threads_background);
 
+	if (fiber_waits)
+	{
+		std::lock_guard<std::mutex> holder{fiber_groups_lock};
+		fiber_groups.push_back(this);
+	}
+
+	if (scheduler == ThreadGroupScheduler::WorkStealing)
+	{
+		for (auto *ctx : { &fg, &bg })
+		{
+			ctx->local_tasks.resize(ctx->thread_group.size() * NumTaskPriorities);
+			for (auto &local : ctx->local_tasks)
+				local = std::make_unique<WorkStealingDeque<Internal::Task *>>();
+		}
+	}
+
 #ifndef GRANITE_SHIPPING
 	std::string path;
 	if (Util::get_environment("GRANITE_TIMELINE_TRACE", path))
 	{
-		LOGI("Enabling JSON timeline tracing to %s.\n", path.c_str());
+		LOGI("Enabling timeline tracing to %s.\n", path.c_str());
 		timeline_trace_file = std::make_unique<Util::TimelineTraceFile>(path);
+		set_task_latency_tracking(true);
 	}
 #endif
 
+	std::string metrics_path;
+	if (Util::get_environment("GRANITE_METRICS_DUMP", metrics_path))
+	{
+		LOGI("Dumping metrics to %s.\n", metrics_path.c_str());
+		unsigned interval_ms = Util::get_environment_uint("GRANITE_METRICS_DUMP_INTERVAL_MS", 1000);
+		metrics_dump_file = std::make_unique<Util::MetricsDumpFile>(metrics_path, interval_ms);
+		set_task_latency_tracking(true);
+	}
+
 	refresh_global_timeline_trace_file();
 	set_main_thread_name();
 
@@ -189,21 +499,29 @@ void ThreadGroup::start(unsigned num_threads_foreground,
 			set_worker_thread_name_and_prio(self_index - 1, TaskClass::Foreground);
 			if (on_thread_begin)
 				on_thread_begin();
-			thread_looper(self_index, TaskClass::Foreground);
+			if (scheduler == ThreadGroupScheduler::WorkStealing)
+				thread_looper_work_stealing(self_index, self_index - 1, TaskClass::Foreground);
+			else
+				thread_looper(self_index, TaskClass::Foreground);
 		});
 		self_index++;
 	}
 
+	unsigned local_index = 0;
 	for (auto &t : bg.thread_group)
 	{
-		t = std::make_unique<std::thread>([this, on_thread_begin, self_index]() {
+		t = std::make_unique<std::thread>([this, on_thread_begin, self_index, local_index]() {
 			refresh_global_timeline_trace_file();
 			set_worker_thread_name_and_prio(self_index - 1, TaskClass::Background);
 			if (on_thread_begin)
 				on_thread_begin();
-			thread_looper(self_index, TaskClass::Background);
+			if (scheduler == ThreadGroupScheduler::WorkStealing)
+				thread_looper_work_stealing(self_index, local_index, TaskClass::Background);
+			else
+				thread_looper(self_index, TaskClass::Background);
 		});
 		self_index++;
+		local_index++;
 	}
 }
 
@@ -224,8 +542,45 @@ void ThreadGroup::add_dependency(TaskGroup &dependee, TaskGroup &dependency)
 	dependee.deps->dependency_count.fetch_add(1, std::memory_order_relaxed);
 }
 
+void ThreadGroup::move_to_ready_tasks_work_stealing(TaskClassContext &ctx, TaskClass task_class,
+                                                    const Util::SmallVector<Internal::Task *> &list)
+{
+	auto priority = unsigned(list.front()->deps->priority);
+
+	if (current_worker_group == this && current_worker_class == task_class)
+	{
+		// Keep the work on this worker, idle workers will steal if we cannot keep up.
+		for (auto *t : list)
+			current_worker_deques[priority]->push(t);
+	}
+	else
+	{
+		std::lock_guard<std::mutex> holder{ctx.cond_lock};
+		for (auto *t : list)
+			ctx.ready_tasks[priority].push(t);
+		ctx.injected_count[priority].fetch_add(unsigned(list.size()), std::memory_order_release);
+	}
+
+	ctx.event.notify(unsigned(list.size()));
+}
+
 void ThreadGroup::move_to_ready_tasks(const Util::SmallVector<Internal::Task *> &list)
 {
+	// All tasks in the list belong to the same TaskDeps, and thus share task class and priority.
+	if (!list.empty() && latency_tracking.load(std::memory_order_relaxed))
+		list.front()->deps->ready_ns = Util::get_current_time_nsecs();
+
+	if (scheduler == ThreadGroupScheduler::WorkStealing)
+	{
+		if (list.empty())
+			return;
+
+		auto task_class = list.front()->deps->task_class;
+		total_tasks.fetch_add(list.size(), std::memory_order_relaxed);
+		move_to_ready_tasks_work_stealing(task_class == TaskClass::Foreground ? fg : bg, task_class, list);
+		return;
+	}
+
 	unsigned fg_task_count = 0;
 	unsigned bg_task_count = 0;
 	for (auto *t : list)
@@ -243,7 +598,13 @@ void ThreadGroup::move_to_ready_tasks(const Util::SmallVector<Internal::Task *>
 		std::lock_guard<std::mutex> holder{fg.cond_lock};
 
 		for (auto &t : list)
-			fg.ready_tasks.push(t);
+		{
+			if (t->deps->task_class == TaskClass::Foreground)
+			{
+				fg.ready_tasks[unsigned(t->deps->priority)].push(t);
+				fg.ready_count++;
+			}
+		}
 
 		if (fg_task_count >= fg.thread_group.size())
 			fg.cond.notify_all();
@@ -259,7 +620,13 @@ void ThreadGroup::move_to_ready_tasks(const Util::SmallVector<Internal::Task *>
 		std::lock_guard<std::mutex> holder{bg.cond_lock};
 
 		for (auto &t : list)
-			bg.ready_tasks.push(t);
+		{
+			if (t->deps->task_class == TaskClass::Background)
+			{
+				bg.ready_tasks[unsigned(t->deps->priority)].push(t);
+				bg.ready_count++;
+			}
+		}
 
 		if (bg_task_count >= bg.thread_group.size())
 			bg.cond.notify_all();
@@ -291,15 +658,81 @@ void ThreadGroup::free_task_deps(Internal::TaskDeps *deps)
 	task_deps_pool.free(deps);
 }
 
+#ifdef __linux__
+static constexpr unsigned SignalWaiterShift = 48;
+static constexpr uint64_t SignalWaiter = uint64_t(1) << SignalWaiterShift;
+static constexpr uint64_t SignalCountMask = SignalWaiter - 1;
+
+static const void *signal_futex_word(const std::atomic<uint64_t> &counter)
+{
+	static_assert(sizeof(counter) == sizeof(uint64_t), "Unexpected atomic size.");
+	auto *words = reinterpret_cast<const uint32_t *>(&counter);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	return words + 1;
+#else
+	return words;
+#endif
+}
+
+TaskSignal::TaskSignal()
+{
+	counter.store(0, std::memory_order_relaxed);
+}
+
 void TaskSignal::signal_increment()
 {
-	std::lock_guard<std::mutex> holder{lock};
-	counter++;
-	cond.notify_all();
+	auto old_value = counter.fetch_add(1, std::memory_order_seq_cst);
+	// A waiter may return and destroy the signal as soon as the increment is visible,
+	// so only the address is used from here on.
+	if (old_value >= SignalWaiter)
+		Internal::futex_wake(signal_futex_word(counter), UINT_MAX);
+	Internal::FiberWorker::wake_signal_waiters();
 }
 
 void TaskSignal::wait_until_at_least(uint64_t count)
 {
+	if (get_count() < count && Internal::FiberWorker::suspend_current(nullptr, this, count))
+		return;
+
+	auto value = counter.load(std::memory_order_acquire);
+	while ((value & SignalCountMask) < count)
+	{
+		if (!counter.compare_exchange_weak(value, value + SignalWaiter,
+		                                   std::memory_order_acq_rel, std::memory_order_acquire))
+		{
+			continue;
+		}
+
+		// Returns immediately if the count changed after we registered.
+		Internal::futex_wait(signal_futex_word(counter), uint32_t(value));
+		value = counter.fetch_sub(SignalWaiter, std::memory_order_acq_rel) - SignalWaiter;
+	}
+}
+
+uint64_t TaskSignal::get_count()
+{
+	return counter.load(std::memory_order_seq_cst) & SignalCountMask;
+}
+#else
+TaskSignal::TaskSignal()
+{
+}
+
+void TaskSignal::signal_increment()
+{
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		counter++;
+		cond.notify_all();
+	}
+	Internal::FiberWorker::wake_signal_waiters();
+}
+
+void TaskSignal::wait_until_at_least(uint64_t count)
+{
+	if (get_count() < count && Internal::FiberWorker::suspend_current(nullptr, this, count))
+		return;
+
 	std::unique_lock<std::mutex> holder{lock};
 	cond.wait(holder, [&]() -> bool {
 		return counter >= count;
@@ -311,6 +744,7 @@ uint64_t TaskSignal::get_count()
 	std::lock_guard<std::mutex> holder{lock};
 	return counter;
 }
+#endif
 
 TaskGroupHandle ThreadGroup::create_task()
 {
@@ -340,6 +774,11 @@ void TaskGroup::set_task_class(TaskClass task_class)
 	deps->task_class = task_class;
 }
 
+void TaskGroup::set_task_priority(TaskPriority priority)
+{
+	deps->priority = priority;
+}
+
 void ThreadGroup::wait_idle()
 {
 	std::unique_lock<std::mutex> holder{wait_cond_lock};
@@ -353,54 +792,350 @@ bool ThreadGroup::is_idle()
 	return total_tasks.load(std::memory_order_acquire) == completed_tasks.load(std::memory_order_acquire);
 }
 
-void ThreadGroup::thread_looper(unsigned index, TaskClass task_class)
+bool ThreadGroup::has_idle_threads(TaskClass task_class) const
 {
-	Util::register_thread_index(index);
 	auto &ctx = task_class == TaskClass::Foreground ? fg : bg;
+	return ctx.idle_count.load(std::memory_order_relaxed) != 0;
+}
 
-	for (;;)
+void ThreadGroup::set_task_latency_tracking(bool enable)
+{
+	latency_tracking.store(enable, std::memory_order_relaxed);
+}
+
+void ThreadGroup::record_task_latency(const Internal::TaskDeps &deps)
+{
+	auto now_ns = Util::get_current_time_nsecs();
+	auto latency_us = uint64_t(std::max<int64_t>(now_ns - deps.ready_ns, 0)) / 1000;
+	unsigned bucket = latency_us ? std::min<unsigned>(64 - leading_zeroes64(latency_us), NumLatencyBuckets - 1) : 0;
+	latency_buckets[unsigned(deps.priority)][bucket].fetch_add(1, std::memory_order_relaxed);
+	task_latency_metric->record(latency_us);
+
+	if (timeline_trace_file)
 	{
-		Internal::Task *task = nullptr;
+		report_latency_buckets[unsigned(deps.priority)][bucket].fetch_add(1, std::memory_order_relaxed);
+		constexpr int64_t ReportIntervalNs = 100 * 1000 * 1000;
+		auto last_ns = last_latency_report_ns.load(std::memory_order_relaxed);
+		if (now_ns - last_ns >= ReportIntervalNs &&
+		    last_latency_report_ns.compare_exchange_strong(last_ns, now_ns, std::memory_order_relaxed))
+		{
+			report_task_latency_statistics(now_ns);
+		}
+	}
+}
+
+TaskLatencyStatistics ThreadGroup::get_task_latency_statistics(TaskPriority priority, bool reset)
+{
+	return compute_latency_statistics(latency_buckets[unsigned(priority)], reset);
+}
+
+TaskLatencyStatistics ThreadGroup::compute_latency_statistics(std::atomic<uint64_t> *latency, bool reset)
+{
+	uint64_t buckets[NumLatencyBuckets];
+	uint64_t count = 0;
+	for (unsigned i = 0; i < NumLatencyBuckets; i++)
+	{
+		auto &bucket = latency[i];
+		buckets[i] = reset ? bucket.exchange(0, std::memory_order_relaxed) : bucket.load(std::memory_order_relaxed);
+		count += buckets[i];
+	}
 
+	TaskLatencyStatistics stats = {};
+	stats.count = count;
+	if (!count)
+		return stats;
+
+	// Report the upper bound of the bucket the percentile lands in.
+	const auto percentile = [&](double p) -> double {
+		auto threshold = uint64_t(std::ceil(p * double(count)));
+		uint64_t accum = 0;
+		for (unsigned i = 0; i < NumLatencyBuckets; i++)
 		{
-			std::unique_lock<std::mutex> holder{ctx.cond_lock};
-			ctx.cond.wait(holder, [&]() {
-				return dead || !ctx.ready_tasks.empty();
-			});
+			accum += buckets[i];
+			if (accum >= threshold)
+				return double(uint64_t(1) << i);
+		}
+		return double(uint64_t(1) << (NumLatencyBuckets - 1));
+	};
+
+	stats.p50_us = percentile(0.50);
+	stats.p90_us = percentile(0.90);
+	stats.p99_us = percentile(0.99);
+	stats.max_us = percentile(1.0);
+	return stats;
+}
 
-			if (dead && ctx.ready_tasks.empty())
-				break;
+void ThreadGroup::report_task_latency_statistics(int64_t now_ns)
+{
+	static const char *track_names[NumTaskPriorities] = {
+		"task-latency-frame-critical",
+		"task-latency-latency-sensitive",
+		"task-latency-bulk",
+	};
+	static const char *counter_names[] = { "p50_us", "p90_us", "p99_us", "max_us" };
+
+	for (unsigned i = 0; i < NumTaskPriorities; i++)
+	{
+		auto stats = compute_latency_statistics(report_latency_buckets[i], true);
+		if (!stats.count)
+			continue;
+
+		const double values[] = { stats.p50_us, stats.p90_us, stats.p99_us, stats.max_us };
+		timeline_trace_file->submit_counters(track_names[i], now_ns, counter_names, values, 4);
+	}
+}
+
+void ThreadGroup::run_task(Internal::Task *task)
+{
+	if (task->deps->ready_ns && latency_tracking.load(std::memory_order_relaxed))
+		record_task_latency(*task->deps);
+
+	if (task->callable)
+	{
+		GRANITE_SCOPED_TIMELINE_EVENT_FILE(timeline_trace_file.get(), task->deps->desc);
+		task->callable.call();
+	}
+
+	task->deps->task_completed();
+	task_pool.free(task);
+	tasks_executed_metric->add();
 
-			task = ctx.ready_tasks.front();
-			ctx.ready_tasks.pop();
+	{
+		auto completed = completed_tasks.fetch_add(1, std::memory_order_relaxed) + 1;
+		//LOGI("Task completed (%u / %u)!\n", completed, total_tasks.load(memory_order_relaxed));
+
+		if (completed == total_tasks.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> holder{wait_cond_lock};
+			wait_cond.notify_all();
+		}
+	}
+}
+
+void ThreadGroup::execute_task(Internal::Task *task)
+{
+	if (current_fiber_worker)
+		current_fiber_worker->execute(task);
+	else
+		run_task(task);
+}
+
+Internal::Task *ThreadGroup::pop_ready_task_locked(TaskClassContext &ctx)
+{
+	for (auto &queue : ctx.ready_tasks)
+	{
+		if (!queue.empty())
+		{
+			auto *task = queue.front();
+			queue.pop();
+			ctx.ready_count--;
+			return task;
 		}
+	}
+
+	return nullptr;
+}
+
+bool ThreadGroup::try_pop_injected_task(TaskClassContext &ctx, unsigned priority, Internal::Task *&task)
+{
+	auto &count = ctx.injected_count[priority];
+	if (count.load(std::memory_order_acquire) == 0)
+		return false;
+
+	std::lock_guard<std::mutex> holder{ctx.cond_lock};
+	auto &queue = ctx.ready_tasks[priority];
+	if (queue.empty())
+		return false;
+
+	task = queue.front();
+	queue.pop();
+	count.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool ThreadGroup::try_steal_task(TaskClassContext &ctx, unsigned local_index, unsigned priority,
+                                 uint32_t &rng, Internal::Task *&task)
+{
+	auto num_workers = unsigned(ctx.local_tasks.size() / NumTaskPriorities);
+	if (num_workers <= 1)
+		return false;
+
+	// xorshift32, only used to spread out victims.
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
 
-		if (task->callable)
+	unsigned start_index = rng % num_workers;
+	for (unsigned i = 0; i < num_workers; i++)
+	{
+		unsigned victim = (start_index + i) % num_workers;
+		if (victim == local_index)
+			continue;
+
+		// A failed steal may just mean we lost a race, keep trying until the victim looks empty.
+		auto &deque = *ctx.local_tasks[victim * NumTaskPriorities + priority];
+		while (!deque.empty_hint())
+			if (deque.steal(task))
+				return true;
+	}
+
+	return false;
+}
+
+bool ThreadGroup::try_get_task_work_stealing(TaskClassContext &ctx, unsigned local_index,
+                                             uint32_t &rng, Internal::Task *&task)
+{
+	auto *local = &ctx.local_tasks[local_index * NumTaskPriorities];
+
+	// Drain tiers strictly in order.
+	for (unsigned priority = 0; priority < NumTaskPriorities; priority++)
+	{
+		if (local[priority]->pop(task) ||
+		    try_pop_injected_task(ctx, priority, task) ||
+		    try_steal_task(ctx, local_index, priority, rng, task))
 		{
-			GRANITE_SCOPED_TIMELINE_EVENT_FILE(timeline_trace_file.get(), task->deps->desc);
-			task->callable.call();
+			return true;
 		}
+	}
 
-		task->deps->task_completed();
-		task_pool.free(task);
+	return false;
+}
 
+void ThreadGroup::thread_looper_work_stealing(unsigned index, unsigned local_index, TaskClass task_class)
+{
+	Util::register_thread_index(index);
+	auto &ctx = task_class == TaskClass::Foreground ? fg : bg;
+
+	current_worker_group = this;
+	current_worker_class = task_class;
+	current_worker_deques = &ctx.local_tasks[local_index * NumTaskPriorities];
+
+	uint32_t rng = 0x9e3779b9u * (index + 1);
+
+	std::unique_ptr<Internal::FiberWorker> fiber_worker;
+	if (fiber_waits)
+	{
+		fiber_worker = std::make_unique<Internal::FiberWorker>(*this, task_class);
+		current_fiber_worker = fiber_worker.get();
+	}
+
+	for (;;)
+	{
+		// Tasks which were suspended come before starting new ones.
+		if (fiber_worker && fiber_worker->resume_ready_fibers())
+			continue;
+
+		Internal::Task *task = nullptr;
+
+		if (!try_get_task_work_stealing(ctx, local_index, rng, task))
 		{
-			auto completed = completed_tasks.fetch_add(1, std::memory_order_relaxed) + 1;
-			//LOGI("Task completed (%u / %u)!\n", completed, total_tasks.load(memory_order_relaxed));
+			// Nothing to do. Re-check after announcing that we are about to sleep
+			// so we cannot miss a notification from move_to_ready_tasks().
+			auto key = ctx.event.prepare_wait();
+			if (try_get_task_work_stealing(ctx, local_index, rng, task))
+			{
+				ctx.event.cancel_wait();
+			}
+			else if (fiber_worker && fiber_worker->has_ready_fibers())
+			{
+				ctx.event.cancel_wait();
+				continue;
+			}
+			else if (dead.load(std::memory_order_acquire))
+			{
+				ctx.event.cancel_wait();
+				break;
+			}
+			else
+			{
+				ctx.idle_count.fetch_add(1, std::memory_order_relaxed);
+				ctx.event.commit_wait(key);
+				ctx.idle_count.fetch_sub(1, std::memory_order_relaxed);
+				continue;
+			}
+		}
+
+		execute_task(task);
+	}
+
+	current_worker_group = nullptr;
+	current_worker_deques = nullptr;
+	current_fiber_worker = nullptr;
+}
+
+void ThreadGroup::thread_looper(unsigned index, TaskClass task_class)
+{
+	Util::register_thread_index(index);
+	auto &ctx = task_class == TaskClass::Foreground ? fg : bg;
+
+	std::unique_ptr<Internal::FiberWorker> fiber_worker;
+	if (fiber_waits)
+	{
+		fiber_worker = std::make_unique<Internal::FiberWorker>(*this, task_class);
+		current_fiber_worker = fiber_worker.get();
+	}
+
+	const auto has_work = [&]() -> bool {
+		return ctx.ready_count != 0 || (fiber_worker && fiber_worker->has_ready_fibers());
+	};
+
+	for (;;)
+	{
+		// Tasks which were suspended come before starting new ones.
+		if (fiber_worker && fiber_worker->resume_ready_fibers())
+			continue;
 
-			if (completed == total_tasks.load(std::memory_order_relaxed))
+		Internal::Task *task = nullptr;
+
+		{
+			std::unique_lock<std::mutex> holder{ctx.cond_lock};
+			if (!dead && !has_work())
 			{
-				std::lock_guard<std::mutex> holder{wait_cond_lock};
-				wait_cond.notify_all();
+				ctx.idle_count.fetch_add(1, std::memory_order_relaxed);
+				ctx.cond.wait(holder, [&]() {
+					return dead || has_work();
+				});
+				ctx.idle_count.fetch_sub(1, std::memory_order_relaxed);
 			}
+
+			if (dead && ctx.ready_count == 0)
+				break;
+
+			task = pop_ready_task_locked(ctx);
 		}
+
+		if (task)
+			execute_task(task);
 	}
+
+	current_fiber_worker = nullptr;
 }
 
 ThreadGroup::ThreadGroup()
 {
 	total_tasks.store(0);
 	completed_tasks.store(0);
+	dead.store(false);
+	for (auto *ctx : { &fg, &bg })
+	{
+		for (auto &count : ctx->injected_count)
+			count.store(0);
+		ctx->idle_count.store(0);
+		ctx->suspended_fibers.store(0);
+	}
+
+	latency_tracking.store(false);
+	last_latency_report_ns.store(0);
+
+	auto &metrics = Util::MetricsRegistry::get();
+	tasks_executed_metric = metrics.counter("thread-group.tasks-executed");
+	task_latency_metric = metrics.histogram("thread-group.task-latency-us");
+	for (auto &buckets : latency_buckets)
+		for (auto &bucket : buckets)
+			bucket.store(0);
+	for (auto &buckets : report_latency_buckets)
+		for (auto &bucket : buckets)
+			bucket.store(0);
 }
 
 ThreadGroup::~ThreadGroup()
@@ -418,11 +1153,14 @@ void ThreadGroup::stop()
 	{
 		std::lock_guard<std::mutex> holder_fg{fg.cond_lock};
 		std::lock_guard<std::mutex> holder_bg{bg.cond_lock};
-		dead = true;
+		dead.store(true, std::memory_order_release);
 		fg.cond.notify_all();
 		bg.cond.notify_all();
 	}
 
+	fg.event.notify_all();
+	bg.event.notify_all();
+
 	for (auto &t : fg.thread_group)
 	{
 		if (t && t->joinable())
@@ -441,7 +1179,18 @@ void ThreadGroup::stop()
 		}
 	}
 
+	fg.local_tasks.clear();
+	bg.local_tasks.clear();
+
+	if (fiber_waits)
+	{
+		std::lock_guard<std::mutex> holder{fiber_groups_lock};
+		auto itr = std::find(fiber_groups.begin(), fiber_groups.end(), this);
+		if (itr != fiber_groups.end())
+			fiber_groups.erase(itr);
+	}
+
 	active = false;
-	dead = false;
+	dead.store(false, std::memory_order_relaxed);
 }
 }
\ No newline at end of file
@@ -33,23 +33,39 @@
 #include "variant.hpp"
 #include "intrusive.hpp"
 #include "timeline_trace_file.hpp"
+#include "metrics.hpp"
 #include "global_managers.hpp"
 #include "small_vector.hpp"
 #include "small_callable.hpp"
+#include "event_count.hpp"
+#include "work_stealing_deque.hpp"
 
 namespace Granite
 {
 class ThreadGroup;
 
+// Signalling is a single atomic increment unless somebody is blocked in wait_until_at_least().
 struct TaskSignal
 {
-	std::condition_variable cond;
-	std::mutex lock;
-	uint64_t counter = 0;
+	TaskSignal();
+	TaskSignal(const TaskSignal &) = delete;
+	void operator=(const TaskSignal &) = delete;
 
 	void signal_increment();
 	void wait_until_at_least(uint64_t count);
 	uint64_t get_count();
+
+private:
+#ifdef __linux__
+	// The upper bits count sleeping waiters, so signal_increment() can tell from a single
+	// fetch_add whether a wakeup is needed, and never touches the signal after that.
+	// Waiters sleep on the 32 least significant bits.
+	std::atomic<uint64_t> counter;
+#else
+	std::condition_variable cond;
+	std::mutex lock;
+	uint64_t counter = 0;
+#endif
 };
 
 enum class TaskClass : uint8_t
@@ -58,11 +74,44 @@ enum class TaskClass : uint8_t
 	Background
 };
 
+// Within a task class, ready tasks of a higher tier always run first.
+// A running task is never interrupted, but workers re-check tiers between every task,
+// so bulk work yields to more urgent work at task boundaries.
+enum class TaskPriority : uint8_t
+{
+	// Work the current frame is waiting on.
+	FrameCritical = 0,
+	// Work somebody will wait on soon, e.g. a blocking asset request.
+	LatencySensitive = 1,
+	// Throughput work, e.g. asset streaming and texture compression.
+	Bulk = 2
+};
+static constexpr unsigned NumTaskPriorities = 3;
+
+struct TaskLatencyStatistics
+{
+	uint64_t count;
+	double p50_us;
+	double p90_us;
+	double p99_us;
+	double max_us;
+};
+
+enum class ThreadGroupScheduler : uint8_t
+{
+	// One locked FIFO queue per task class.
+	SharedQueue,
+	// Per-worker Chase-Lev deques with LIFO local pop and randomized stealing.
+	// Tasks made ready from outside the workers go through the shared queue.
+	WorkStealing
+};
+
 struct TaskGroup;
 namespace Internal
 {
 struct TaskDeps;
 struct Task;
+struct FiberWorker;
 
 struct TaskDepsDeleter
 {
@@ -82,6 +131,7 @@ struct TaskDeps : Util::IntrusivePtrEnabled<TaskDeps, TaskDepsDeleter, Util::Mul
 		count.store(0, std::memory_order_relaxed);
 		// One implicit dependency is the flush() happening.
 		dependency_count.store(1, std::memory_order_relaxed);
+		done.store(false, std::memory_order_relaxed);
 		desc[0] = '\0';
 	}
 
@@ -97,10 +147,13 @@ struct TaskDeps : Util::IntrusivePtrEnabled<TaskDeps, TaskDepsDeleter, Util::Mul
 	void dependency_satisfied();
 	void notify_dependees();
 
-	std::condition_variable cond;
-	std::mutex cond_lock;
-	bool done = false;
+	// Waiters in TaskGroup::wait() sleep on this until done is set.
+	EventCount done_event;
+	std::atomic_bool done;
 	TaskClass task_class = TaskClass::Foreground;
+	TaskPriority priority = TaskPriority::FrameCritical;
+	// When pending tasks were made ready, only recorded when latency tracking is enabled.
+	int64_t ready_ns = 0;
 
 	char desc[64];
 };
@@ -142,6 +195,7 @@ struct TaskGroup : Util::IntrusivePtrEnabled<TaskGroup, Internal::TaskGroupDelet
 
 	void set_desc(const char *desc);
 	void set_task_class(TaskClass task_class);
+	void set_task_priority(TaskPriority priority);
 
 	unsigned id = 0;
 	bool flushed = false;
@@ -161,6 +215,32 @@ public:
 	           unsigned num_threads_background,
 	           const std::function<void ()> &on_thread_begin) override;
 
+	void start(unsigned num_threads_foreground,
+	           unsigned num_threads_background,
+	           const std::function<void ()> &on_thread_begin,
+	           ThreadGroupScheduler scheduler);
+
+	ThreadGroupScheduler get_scheduler() const
+	{
+		return scheduler;
+	}
+
+	// When enabled, workers run tasks on fibers. TaskGroup::wait() and TaskSignal::wait_until_at_least()
+	// called from inside a task then suspend that task, and the worker keeps running other ready tasks
+	// until the dependency completes. A suspended task always resumes on the worker which suspended it.
+	// Must be set before start().
+	void set_fiber_waits(bool enable);
+
+	// Each fiber owns a 256 KiB stack, and every suspended wait keeps one alive.
+	// Once a worker has this many fibers, waits on it block like they do without fiber waits.
+	// Must be set before start().
+	void set_fiber_wait_limit(unsigned max_fibers_per_worker);
+
+	bool get_fiber_waits() const
+	{
+		return fiber_waits;
+	}
+
 	unsigned get_num_threads() const
 	{
 		return unsigned(fg.thread_group.size() + bg.thread_group.size());
@@ -185,6 +265,16 @@ public:
 	void wait_idle();
 	bool is_idle();
 
+	// Racy hint, used to decide if it's worth splitting work into more tasks.
+	bool has_idle_threads(TaskClass task_class) const;
+
+	// Records how long tasks wait between becoming ready and starting to execute, per priority tier.
+	// Enabled automatically when timeline tracing or metrics dumping is enabled,
+	// in which case the statistics are also emitted periodically as counter events.
+	// The periodic events keep their own buckets, so they do not reset what is returned here.
+	void set_task_latency_tracking(bool enable);
+	TaskLatencyStatistics get_task_latency_statistics(TaskPriority priority, bool reset);
+
 	Util::TimelineTraceFile *get_timeline_trace_file();
 	void refresh_global_timeline_trace_file();
 
@@ -195,18 +285,46 @@ private:
 	Util::ThreadSafeObjectPool<TaskGroup> task_group_pool;
 	Util::ThreadSafeObjectPool<Internal::TaskDeps> task_deps_pool;
 
-	struct
+	struct TaskClassContext
 	{
 		std::vector<std::unique_ptr<std::thread>> thread_group;
-		std::queue<Internal::Task *> ready_tasks;
+		std::queue<Internal::Task *> ready_tasks[NumTaskPriorities];
+		unsigned ready_count = 0;
 		std::mutex cond_lock;
 		std::condition_variable cond;
+		std::atomic_uint idle_count;
+
+		// Only used by the work-stealing scheduler.
+		// ready_tasks is then the injection queue for tasks made ready outside the workers.
+		// Each worker owns NumTaskPriorities consecutive deques.
+		std::vector<std::unique_ptr<WorkStealingDeque<Internal::Task *>>> local_tasks;
+		std::atomic_uint injected_count[NumTaskPriorities];
+		EventCount event;
+
+		// Fibers suspended on workers of this class, only used with fiber waits.
+		std::atomic_uint suspended_fibers;
 	} fg, bg;
 
+	friend struct Internal::FiberWorker;
+
 	void thread_looper(unsigned self_index, TaskClass task_class);
+	void thread_looper_work_stealing(unsigned self_index, unsigned local_index, TaskClass task_class);
+	void run_task(Internal::Task *task);
+	void execute_task(Internal::Task *task);
+	void move_to_ready_tasks_work_stealing(TaskClassContext &ctx, TaskClass task_class,
+	                                       const Util::SmallVector<Internal::Task *> &list);
+	static bool try_pop_injected_task(TaskClassContext &ctx, unsigned priority, Internal::Task *&task);
+	static bool try_steal_task(TaskClassContext &ctx, unsigned local_index, unsigned priority,
+	                           uint32_t &rng, Internal::Task *&task);
+	static bool try_get_task_work_stealing(TaskClassContext &ctx, unsigned local_index,
+	                                       uint32_t &rng, Internal::Task *&task);
+	static Internal::Task *pop_ready_task_locked(TaskClassContext &ctx);
 
 	bool active = false;
-	bool dead = false;
+	std::atomic_bool dead;
+	ThreadGroupScheduler scheduler = ThreadGroupScheduler::SharedQueue;
+	bool fiber_waits = false;
+	unsigned max_fibers_per_worker = 64;
 
 	std::condition_variable wait_cond;
 	std::mutex wait_cond_lock;
@@ -215,6 +333,20 @@ private:
 
 	std::unique_ptr<Util::TimelineTraceFile> timeline_trace_file;
 	void set_thread_context() override;
+
+	std::unique_ptr<Util::MetricsDumpFile> metrics_dump_file;
+	Util::MetricCounter *tasks_executed_metric;
+	Util::MetricHistogram *task_latency_metric;
+
+	// log2 buckets of microseconds.
+	enum { NumLatencyBuckets = 32 };
+	std::atomic_bool latency_tracking;
+	std::atomic<uint64_t> latency_buckets[NumTaskPriorities][NumLatencyBuckets];
+	std::atomic<uint64_t> report_latency_buckets[NumTaskPriorities][NumLatencyBuckets];
+	std::atomic<int64_t> last_latency_report_ns;
+	void record_task_latency(const Internal::TaskDeps &deps);
+	void report_task_latency_statistics(int64_t now_ns);
+	static TaskLatencyStatistics compute_latency_statistics(std::atomic<uint64_t> *buckets, bool reset);
 };
 
 template <typename Func>
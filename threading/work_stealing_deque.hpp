@@ -0,0 +1,167 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <assert.h>
+#include <type_traits>
+
+namespace Granite
+{
+// Chase-Lev work-stealing deque.
+// The owning thread pushes and pops at the bottom (LIFO),
+// any other thread may steal from the top (FIFO).
+// Based on "Correct and Efficient Work-Stealing for Weak Memory Models" (Lê et al. 2013).
+template <typename T>
+class WorkStealingDeque
+{
+public:
+	static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable.");
+
+	explicit WorkStealingDeque(uint32_t log2_capacity = 10)
+	{
+		top.store(0, std::memory_order_relaxed);
+		bottom.store(0, std::memory_order_relaxed);
+		auto *initial = new Array(log2_capacity);
+		arrays.emplace_back(initial);
+		array.store(initial, std::memory_order_relaxed);
+	}
+
+	WorkStealingDeque(const WorkStealingDeque &) = delete;
+	void operator=(const WorkStealingDeque &) = delete;
+
+	// Owner thread only.
+	void push(T value)
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_acquire);
+		auto *a = array.load(std::memory_order_relaxed);
+
+		if (b - t > int64_t(a->mask))
+			a = grow(a, b, t);
+
+		a->store(b, value);
+		bottom.store(b + 1, std::memory_order_release);
+	}
+
+	// Owner thread only.
+	bool pop(T &value)
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		auto *a = array.load(std::memory_order_relaxed);
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+
+		if (t > b)
+		{
+			// Empty.
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+
+		value = a->load(b);
+		if (t == b)
+		{
+			// Last element, race against stealers.
+			bool won = top.compare_exchange_strong(t, t + 1,
+			                                       std::memory_order_seq_cst,
+			                                       std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return won;
+		}
+
+		return true;
+	}
+
+	// Any thread.
+	bool steal(T &value)
+	{
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_acquire);
+
+		if (t >= b)
+			return false;
+
+		auto *a = array.load(std::memory_order_acquire);
+		value = a->load(t);
+		return top.compare_exchange_strong(t, t + 1,
+		                                   std::memory_order_seq_cst,
+		                                   std::memory_order_relaxed);
+	}
+
+	// Racy, only useful as a hint.
+	bool empty_hint() const
+	{
+		return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Array
+	{
+		explicit Array(uint32_t log2_capacity)
+			: mask((uint64_t(1) << log2_capacity) - 1),
+			  data(new std::atomic<T>[size_t(mask + 1)])
+		{
+		}
+
+		uint64_t mask;
+		std::unique_ptr<std::atomic<T>[]> data;
+
+		void store(int64_t index, T value)
+		{
+			data[size_t(uint64_t(index) & mask)].store(value, std::memory_order_relaxed);
+		}
+
+		T load(int64_t index) const
+		{
+			return data[size_t(uint64_t(index) & mask)].load(std::memory_order_relaxed);
+		}
+	};
+
+	alignas(64) std::atomic<int64_t> top;
+	alignas(64) std::atomic<int64_t> bottom;
+	std::atomic<Array *> array;
+
+	// Retired arrays may still be read by in-flight stealers, so keep them alive until destruction.
+	std::vector<std::unique_ptr<Array>> arrays;
+
+	Array *grow(Array *old, int64_t b, int64_t t)
+	{
+		uint32_t log2_capacity = 1;
+		while ((uint64_t(1) << log2_capacity) <= old->mask + 1)
+			log2_capacity++;
+
+		auto *a = new Array(log2_capacity);
+		arrays.emplace_back(a);
+		for (int64_t i = t; i < b; i++)
+			a->store(i, old->load(i));
+		array.store(a, std::memory_order_release);
+		return a;
+	}
+};
+}
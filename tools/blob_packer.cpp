@@ -0,0 +1,123 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "blob_archive.hpp"
+#include "os_filesystem.hpp"
+#include "path_utils.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+#include <memory>
+#include <string.h>
+#include <stdlib.h>
+
+using namespace Granite;
+using namespace Util;
+
+static void print_help()
+{
+	LOGI("Usage: blob-packer\n"
+	     "\t--output <path>\n"
+	     "\t--input <path> <blob-path> (Files or directories, can be repeated)\n"
+	     "\t[--compress] (LZ4 compress files which benefit from it)\n"
+	     "\t[--alignment <bytes>] (Alignment of uncompressed files, default 256)\n"
+	     "\t[--chunk-size <bytes>] (Granularity of random access into compressed files, default 64 KiB)\n");
+}
+
+struct Input
+{
+	std::string path;
+	std::string blob_path;
+};
+
+static bool add_input(BlobArchive::Packer &packer, const Input &input)
+{
+	std::unique_ptr<OSFilesystem> fs;
+	FileStat s = {};
+
+	// Relative paths resolve against the working directory.
+	auto split = Path::split(input.path);
+	fs = std::make_unique<OSFilesystem>(split.first.empty() ? "." : split.first);
+	if (!fs->stat(split.second, s))
+	{
+		LOGE("%s does not exist.\n", input.path.c_str());
+		return false;
+	}
+
+	if (s.type == PathType::File)
+		return packer.add_file(input.blob_path, fs->open(split.second, FileMode::ReadOnly));
+
+	fs = std::make_unique<OSFilesystem>(input.path);
+	for (auto &entry : fs->walk(""))
+	{
+		if (entry.type != PathType::File)
+			continue;
+
+		if (!packer.add_file(Path::join(input.blob_path, entry.path), fs->open(entry.path, FileMode::ReadOnly)))
+		{
+			LOGE("Failed to add %s.\n", entry.path.c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	std::string output;
+	std::vector<Input> inputs;
+	BlobArchive::Packer packer;
+
+	CLICallbacks cbs;
+	cbs.add("--output", [&](CLIParser &parser) { output = parser.next_string(); });
+	cbs.add("--input", [&](CLIParser &parser) {
+		Input input;
+		input.path = parser.next_string();
+		input.blob_path = parser.next_string();
+		inputs.push_back(std::move(input));
+	});
+	cbs.add("--compress", [&](CLIParser &) { packer.set_compression(BlobArchive::Compression::LZ4); });
+	cbs.add("--alignment", [&](CLIParser &parser) { packer.set_alignment(parser.next_uint()); });
+	cbs.add("--chunk-size", [&](CLIParser &parser) { packer.set_chunk_size(parser.next_uint()); });
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.error_handler = [] { print_help(); };
+	CLIParser cli_parser(std::move(cbs), argc - 1, argv + 1);
+	if (!cli_parser.parse())
+		return EXIT_FAILURE;
+	else if (cli_parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (output.empty() || inputs.empty())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	for (auto &input : inputs)
+		if (!add_input(packer, input))
+			return EXIT_FAILURE;
+
+	if (!packer.write(output))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -27,6 +27,8 @@
 #include "cli_parser.hpp"
 #include "rapidjson_wrapper.hpp"
 #include "global_managers_init.hpp"
+#include <float.h>
+#include <map>
 
 using namespace Granite;
 using namespace Util;
@@ -46,6 +48,71 @@ static SceneFormats::TextureCompressionFamily string_to_compression(const std::s
 	}
 }
 
+// Appends a node per level with a coarser copy of every primitive in primitives, each level having roughly
+// ratio times the triangles of the one before. A level takes over once its simplification error
+// projects to less than a pixel at 1080p, measured against the bounding sphere of the base level.
+static void build_lod_chain(std::vector<SceneFormats::Node> &nodes, std::vector<SceneFormats::Mesh> &meshes,
+                            SceneFormats::Node &lod_chain, const std::vector<uint32_t> &primitives,
+                            unsigned num_levels, float ratio)
+{
+	constexpr float PixelSize = 2.0f / 1080.0f;
+	constexpr float MaxRelativeError = 0.1f;
+
+	AABB aabb(vec3(FLT_MAX), vec3(-FLT_MAX));
+	size_t prev_triangles = 0;
+	for (auto prim : primitives)
+	{
+		aabb.expand(meshes[prim].static_aabb);
+		prev_triangles += meshes[prim].count / 3;
+	}
+	float radius = aabb.get_radius();
+
+	auto level_primitives = primitives;
+	float target_ratio = 1.0f;
+
+	for (unsigned level = 0; level < num_levels; level++)
+	{
+		target_ratio *= ratio;
+
+		SceneFormats::Node lod_node;
+		size_t triangles = 0;
+		float max_error = 0.0f;
+		bool progress = false;
+
+		for (size_t i = 0; i < primitives.size(); i++)
+		{
+			SceneFormats::Mesh lod;
+			float error;
+			// Primitives which cannot be simplified further are kept as-is, the levels must match primitive for primitive.
+			if (SceneFormats::mesh_simplify(lod, meshes[primitives[i]], target_ratio, MaxRelativeError, error) &&
+			    lod.count < meshes[level_primitives[i]].count)
+			{
+				level_primitives[i] = uint32_t(meshes.size());
+				meshes.push_back(std::move(lod));
+				max_error = muglm::max(max_error, error);
+				progress = true;
+			}
+			triangles += meshes[level_primitives[i]].count / 3;
+		}
+
+		if (!progress || triangles * 10 > prev_triangles * 9)
+			break;
+
+		float screen_size = max_error > 0.0f ? radius * PixelSize / max_error : FLT_MAX;
+		if (!lod_chain.lod_screen_sizes.empty())
+			screen_size = muglm::min(screen_size, lod_chain.lod_screen_sizes.back());
+
+		lod_node.meshes = level_primitives;
+		lod_chain.lod_screen_sizes.push_back(screen_size);
+		lod_chain.lod_nodes.push_back(uint32_t(nodes.size()));
+		nodes.push_back(std::move(lod_node));
+		prev_triangles = triangles;
+	}
+
+	if (!lod_chain.lod_nodes.empty())
+		lod_chain.lod_screen_sizes.push_back(0.0f);
+}
+
 static void print_help()
 {
 	LOGI("Usage: [--output <out.glb>] [--texcomp <type>]\n");
@@ -66,6 +133,7 @@ static void print_help()
 	LOGI("[--quantize-attributes]\n");
 	LOGI("[--flip-tangent-w]\n");
 	LOGI("[--renormalize-normals]\n");
+	LOGI("[--lod-levels <count>] [--lod-ratio <triangle ratio per level>]\n");
 	LOGI("[--gltf]\n");
 }
 
@@ -88,6 +156,8 @@ int main(int argc, char *argv[])
 	bool animate_cameras = false;
 	bool flip_tangent_w = false;
 	bool renormalize_normals = false;
+	unsigned lod_levels = 0;
+	float lod_ratio = 0.5f;
 	float animate_cameras_speed = 1.0f;
 	float animate_cameras_sharpness = 0.0f;
 
@@ -109,6 +179,8 @@ int main(int argc, char *argv[])
 	cbs.add("--animate-cameras-sharpness", [&](CLIParser &parser) { animate_cameras_sharpness = float(parser.next_double()); });
 	cbs.add("--flip-tangent-w", [&](CLIParser &) { flip_tangent_w = true; });
 	cbs.add("--renormalize-normals", [&](CLIParser &) { renormalize_normals = true; });
+	cbs.add("--lod-levels", [&](CLIParser &parser) { lod_levels = parser.next_uint(); });
+	cbs.add("--lod-ratio", [&](CLIParser &parser) { lod_ratio = float(parser.next_double()); });
 	cbs.add("--gltf", [&](CLIParser &) { options.gltf = true; });
 
 	cbs.add("--fog-color", [&](CLIParser &parser) {
@@ -183,7 +255,7 @@ int main(int argc, char *argv[])
 	}
 
 	std::vector<SceneFormats::Mesh> meshes;
-	if (renormalize_normals || flip_tangent_w)
+	if (renormalize_normals || flip_tangent_w || lod_levels)
 	{
 		meshes = parser.get_meshes();
 		for (auto &mesh : meshes)
@@ -200,6 +272,39 @@ int main(int argc, char *argv[])
 		info.meshes = meshes;
 	}
 
+	if (lod_levels)
+	{
+		if (lod_ratio <= 0.0f || lod_ratio >= 1.0f)
+		{
+			LOGE("LOD ratio must be in (0, 1).\n");
+			return 1;
+		}
+
+		// Instances of the same primitives share one chain.
+		std::map<std::vector<uint32_t>, SceneFormats::Node> chains;
+		size_t num_nodes = nodes.size();
+		for (size_t i = 0; i < num_nodes; i++)
+		{
+			if (nodes[i].meshes.empty() || nodes[i].has_skin || !nodes[i].lod_nodes.empty())
+				continue;
+
+			auto itr = chains.find(nodes[i].meshes);
+			if (itr == chains.end())
+			{
+				SceneFormats::Node chain;
+				auto primitives = nodes[i].meshes;
+				build_lod_chain(nodes, meshes, chain, primitives, lod_levels, lod_ratio);
+				itr = chains.emplace(std::move(primitives), std::move(chain)).first;
+			}
+
+			nodes[i].lod_nodes = itr->second.lod_nodes;
+			nodes[i].lod_screen_sizes = itr->second.lod_screen_sizes;
+		}
+
+		LOGI("Generated %zu LOD nodes.\n", nodes.size() - num_nodes);
+		info.meshes = meshes;
+	}
+
 	std::vector<SceneFormats::CameraInfo> cameras;
 	std::vector<SceneFormats::Animation> animations;
 	if (!extra_cameras.empty())
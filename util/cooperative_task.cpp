@@ -29,7 +29,7 @@
 
 namespace Util
 {
-static thread_local stack<cothread_t> swap_stack;
+static thread_local std::stack<cothread_t> swap_stack;
 
 static void yield_cothread()
 {
@@ -55,10 +55,10 @@ static void co_trampoline(void *arg)
 	std::terminate();
 }
 
-CooperativeTask::CooperativeTask(std::unique_ptr<CooperativeTaskRunnable> task_)
+CooperativeTask::CooperativeTask(std::unique_ptr<CooperativeTaskRunnable> task_, size_t stack_size)
 	: task(std::move(task_))
 {
-	cothread = co_create(0x10000, co_trampoline, task.get());
+	cothread = co_create(unsigned(stack_size), co_trampoline, task.get());
 	if (!cothread)
 		throw std::bad_alloc();
 }
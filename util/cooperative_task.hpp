@@ -23,6 +23,7 @@
 #pragma once
 
 #include <memory>
+#include <stddef.h>
 
 namespace Util
 {
@@ -52,7 +53,7 @@ private:
 class CooperativeTask
 {
 public:
-	explicit CooperativeTask(std::unique_ptr<CooperativeTaskRunnable> task_);
+	explicit CooperativeTask(std::unique_ptr<CooperativeTaskRunnable> task_, size_t stack_size = 0x10000);
 	~CooperativeTask();
 
 	CooperativeTask(const CooperativeTask &) = delete;
@@ -0,0 +1,213 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "lz4_block.hpp"
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace Util
+{
+static constexpr size_t MinMatch = 4;
+// The last match must start at least this far from the end of the block.
+static constexpr size_t MatchStartLimit = 12;
+// The block must end with at least this many literals.
+static constexpr size_t LastLiterals = 5;
+static constexpr size_t MaxOffset = 0xffff;
+static constexpr unsigned HashBits = 14;
+
+static inline uint32_t read_u32(const uint8_t *ptr)
+{
+	uint32_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash_sequence(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HashBits);
+}
+
+static uint8_t *write_length(uint8_t *op, size_t len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = uint8_t(len);
+	return op;
+}
+
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *literals, size_t literal_count)
+{
+	if (literal_count >= 15)
+		op = write_length(op, literal_count - 15);
+	if (literal_count)
+		memcpy(op, literals, literal_count);
+	return op + literal_count;
+}
+
+size_t lz4_compress_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+size_t lz4_compress(void *dst, size_t dst_size, const void *src, size_t src_size)
+{
+	if (dst_size < lz4_compress_bound(src_size) || uint64_t(src_size) > UINT32_MAX)
+		return 0;
+
+	auto *base = static_cast<const uint8_t *>(src);
+	auto *end = base + src_size;
+	auto *ip = base;
+	auto *anchor = base;
+	auto *op = static_cast<uint8_t *>(dst);
+
+	if (src_size > MatchStartLimit)
+	{
+		std::vector<uint32_t> table(1u << HashBits);
+		auto *match_start_limit = end - MatchStartLimit;
+		auto *match_end_limit = end - LastLiterals;
+
+		while (ip <= match_start_limit)
+		{
+			uint32_t sequence = read_u32(ip);
+			uint32_t &slot = table[hash_sequence(sequence)];
+			auto *ref = base + slot;
+			slot = uint32_t(ip - base);
+
+			if (ref >= ip || size_t(ip - ref) > MaxOffset || read_u32(ref) != sequence)
+			{
+				ip++;
+				continue;
+			}
+
+			while (ip > anchor && ref > base && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+
+			auto *match_end = ip + MinMatch;
+			auto *ref_end = ref + MinMatch;
+			while (match_end < match_end_limit && *match_end == *ref_end)
+			{
+				match_end++;
+				ref_end++;
+			}
+
+			size_t literal_count = size_t(ip - anchor);
+			size_t match_length = size_t(match_end - ip) - MinMatch;
+			size_t offset = size_t(ip - ref);
+
+			auto *token = op++;
+			*token = uint8_t((literal_count < 15 ? literal_count : 15) << 4);
+			*token |= uint8_t(match_length < 15 ? match_length : 15);
+			op = write_sequence(op, anchor, literal_count);
+			*op++ = uint8_t(offset & 0xff);
+			*op++ = uint8_t(offset >> 8);
+			if (match_length >= 15)
+				op = write_length(op, match_length - 15);
+
+			ip = anchor = match_end;
+			if (ip <= match_start_limit)
+				table[hash_sequence(read_u32(ip - 2))] = uint32_t(ip - 2 - base);
+		}
+	}
+
+	size_t literal_count = size_t(end - anchor);
+	*op++ = uint8_t((literal_count < 15 ? literal_count : 15) << 4);
+	op = write_sequence(op, anchor, literal_count);
+	return size_t(op - static_cast<uint8_t *>(dst));
+}
+
+static bool read_length(const uint8_t *&ip, const uint8_t *ip_end, size_t &len)
+{
+	uint8_t v;
+	do
+	{
+		if (ip >= ip_end)
+			return false;
+		v = *ip++;
+		len += v;
+	} while (v == 255);
+	return true;
+}
+
+bool lz4_decompress(void *dst, size_t dst_size, const void *src, size_t src_size)
+{
+	auto *ip = static_cast<const uint8_t *>(src);
+	auto *ip_end = ip + src_size;
+	auto *op_begin = static_cast<uint8_t *>(dst);
+	auto *op = op_begin;
+	auto *op_end = op + dst_size;
+
+	for (;;)
+	{
+		if (ip >= ip_end)
+			return false;
+		uint8_t token = *ip++;
+
+		size_t literal_count = token >> 4;
+		if (literal_count == 15 && !read_length(ip, ip_end, literal_count))
+			return false;
+		if (size_t(ip_end - ip) < literal_count || size_t(op_end - op) < literal_count)
+			return false;
+		if (literal_count)
+			memcpy(op, ip, literal_count);
+		op += literal_count;
+		ip += literal_count;
+
+		// The last sequence only has literals.
+		if (ip == ip_end)
+			return op == op_end;
+
+		if (ip_end - ip < 2)
+			return false;
+		size_t offset = size_t(ip[0]) | (size_t(ip[1]) << 8);
+		ip += 2;
+		if (offset == 0 || offset > size_t(op - op_begin))
+			return false;
+
+		size_t match_length = token & 15;
+		if (match_length == 15 && !read_length(ip, ip_end, match_length))
+			return false;
+		match_length += MinMatch;
+		if (size_t(op_end - op) < match_length)
+			return false;
+
+		const uint8_t *ref = op - offset;
+		if (offset >= match_length)
+		{
+			memcpy(op, ref, match_length);
+			op += match_length;
+		}
+		else
+		{
+			// Overlapping copies repeat the last offset bytes.
+			for (size_t i = 0; i < match_length; i++)
+				*op++ = *ref++;
+		}
+	}
+}
+}
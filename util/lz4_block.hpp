@@ -0,0 +1,41 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+namespace Util
+{
+// Codec for the LZ4 block format (without the LZ4 frame format around it).
+// Intended for small, independently decodable chunks.
+
+// Worst case compressed size for size bytes of input.
+size_t lz4_compress_bound(size_t size);
+
+// Returns the compressed size. dst_size must be at least lz4_compress_bound(src_size).
+// src_size must fit in 32 bits.
+size_t lz4_compress(void *dst, size_t dst_size, const void *src, size_t src_size);
+
+// Decompresses exactly dst_size bytes. Returns false if the input is malformed or does not decode to dst_size bytes.
+bool lz4_decompress(void *dst, size_t dst_size, const void *src, size_t src_size);
+}
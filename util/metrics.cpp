@@ -0,0 +1,369 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "metrics.hpp"
+#include "bitops.hpp"
+#include "logging.hpp"
+#include "thread_name.hpp"
+#include "timer.hpp"
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+namespace Util
+{
+namespace Internal
+{
+unsigned get_metrics_shard()
+{
+	// Threads get shards round-robin, so threads created around the same time do not collide.
+	static std::atomic<unsigned> next_shard;
+	static thread_local unsigned shard = next_shard.fetch_add(1, std::memory_order_relaxed);
+	return shard;
+}
+}
+
+uint64_t MetricCounter::get() const
+{
+	uint64_t total = 0;
+	for (auto &shard : shards)
+		total += shard.value.load(std::memory_order_relaxed);
+	return total;
+}
+
+MetricHistogram::MetricHistogram()
+	: shards(new Shard[NumShards])
+{
+	for (unsigned i = 0; i < NumShards; i++)
+	{
+		for (auto &bucket : shards[i].buckets)
+			bucket.store(0, std::memory_order_relaxed);
+		shards[i].sum.store(0, std::memory_order_relaxed);
+	}
+}
+
+unsigned MetricHistogram::get_bucket(uint64_t value)
+{
+	if (value < SubBuckets)
+		return unsigned(value);
+
+	unsigned exponent = 63 - leading_zeroes64(value);
+	unsigned sub_bucket = unsigned(value >> (exponent - SubBucketBits)) & (SubBuckets - 1);
+	return (exponent - SubBucketBits + 1) * SubBuckets + sub_bucket;
+}
+
+uint64_t MetricHistogram::get_bucket_upper_bound(unsigned bucket)
+{
+	if (bucket < SubBuckets)
+		return bucket;
+
+	unsigned shift = bucket / SubBuckets - 1;
+	uint64_t lower = uint64_t(SubBuckets + bucket % SubBuckets) << shift;
+	return lower + ((uint64_t(1) << shift) - 1);
+}
+
+void MetricHistogram::record(uint64_t value)
+{
+	auto &shard = shards[Internal::get_metrics_shard() % NumShards];
+	shard.buckets[get_bucket(value)].fetch_add(1, std::memory_order_relaxed);
+	shard.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t MetricHistogram::get_bucket_count(unsigned bucket) const
+{
+	uint64_t count = 0;
+	for (unsigned i = 0; i < NumShards; i++)
+		count += shards[i].buckets[bucket].load(std::memory_order_relaxed);
+	return count;
+}
+
+uint64_t MetricHistogram::get_sum() const
+{
+	uint64_t sum = 0;
+	for (unsigned i = 0; i < NumShards; i++)
+		sum += shards[i].sum.load(std::memory_order_relaxed);
+	return sum;
+}
+
+MetricsRegistry &MetricsRegistry::get()
+{
+	// Intentionally leaked, metrics may be updated from threads which outlive static destruction.
+	static auto *registry = new MetricsRegistry;
+	return *registry;
+}
+
+MetricsRegistry::Entry *MetricsRegistry::find_or_create(const char *name, MetricType type)
+{
+	std::lock_guard<std::mutex> holder{lock};
+	auto itr = entry_indices.find(name);
+	if (itr != entry_indices.end())
+	{
+		auto *entry = entries[itr->second].get();
+		if (entry->type != type)
+		{
+			LOGE("Metric %s was already registered with a different type.\n", name);
+			return nullptr;
+		}
+		return entry;
+	}
+
+	auto *entry = new Entry;
+	entries.emplace_back(entry);
+	entry_indices[name] = entries.size() - 1;
+	entry->name = name;
+	entry->type = type;
+
+	switch (type)
+	{
+	case MetricType::Counter:
+		entry->counter.reset(new MetricCounter);
+		break;
+	case MetricType::Gauge:
+		entry->gauge.reset(new MetricGauge);
+		break;
+	case MetricType::Histogram:
+		entry->histogram.reset(new MetricHistogram);
+		break;
+	}
+
+	return entry;
+}
+
+MetricCounter *MetricsRegistry::counter(const char *name)
+{
+	auto *entry = find_or_create(name, MetricType::Counter);
+	return entry ? entry->counter.get() : nullptr;
+}
+
+MetricGauge *MetricsRegistry::gauge(const char *name)
+{
+	auto *entry = find_or_create(name, MetricType::Gauge);
+	return entry ? entry->gauge.get() : nullptr;
+}
+
+MetricHistogram *MetricsRegistry::histogram(const char *name)
+{
+	auto *entry = find_or_create(name, MetricType::Histogram);
+	return entry ? entry->histogram.get() : nullptr;
+}
+
+void MetricsSampler::sample(std::vector<MetricSample> &samples)
+{
+	auto &registry = MetricsRegistry::get();
+	auto now_ns = get_current_time_nsecs();
+	double interval = last_ns ? 1e-9 * double(now_ns - last_ns) : 0.0;
+	last_ns = now_ns;
+
+	std::vector<MetricsRegistry::Entry *> entries;
+	{
+		// Entries are never removed, so they can be read without the lock.
+		std::lock_guard<std::mutex> holder{registry.lock};
+		entries.reserve(registry.entries.size());
+		for (auto &entry : registry.entries)
+			entries.push_back(entry.get());
+	}
+
+	samples.clear();
+	samples.reserve(entries.size());
+	previous.resize(entries.size());
+	uint64_t buckets[MetricHistogram::NumBuckets];
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		auto *entry = entries[i];
+		auto &prev = previous[i];
+		MetricSample sample = {};
+		sample.name = entry->name.c_str();
+		sample.type = entry->type;
+
+		switch (entry->type)
+		{
+		case MetricType::Counter:
+		{
+			uint64_t value = entry->counter->get();
+			sample.value = double(value);
+			sample.rate = interval > 0.0 ? double(value - prev.value) / interval : 0.0;
+			prev.value = value;
+			break;
+		}
+
+		case MetricType::Gauge:
+			sample.value = double(entry->gauge->get());
+			break;
+
+		case MetricType::Histogram:
+		{
+			auto &histogram = *entry->histogram;
+			prev.buckets.resize(MetricHistogram::NumBuckets);
+
+			uint64_t total = 0;
+			for (unsigned j = 0; j < MetricHistogram::NumBuckets; j++)
+			{
+				uint64_t bucket = histogram.get_bucket_count(j);
+				buckets[j] = bucket - prev.buckets[j];
+				prev.buckets[j] = bucket;
+				total += buckets[j];
+			}
+
+			uint64_t sum = histogram.get_sum();
+			sample.count = total;
+			sample.value = total ? double(sum - prev.sum) / double(total) : 0.0;
+			prev.sum = sum;
+
+			const auto percentile = [&](uint64_t num, uint64_t denom) -> uint64_t {
+				uint64_t threshold = (total * num + denom - 1) / denom;
+				uint64_t accum = 0;
+				for (unsigned j = 0; j < MetricHistogram::NumBuckets; j++)
+				{
+					accum += buckets[j];
+					if (accum >= threshold && accum)
+						return MetricHistogram::get_bucket_upper_bound(j);
+				}
+				return 0;
+			};
+
+			if (total)
+			{
+				sample.p50 = percentile(50, 100);
+				sample.p90 = percentile(90, 100);
+				sample.p99 = percentile(99, 100);
+				sample.max = percentile(1, 1);
+			}
+			break;
+		}
+		}
+
+		samples.push_back(sample);
+	}
+}
+
+const MetricSample *MetricsSampler::find(const std::vector<MetricSample> &samples, const char *name)
+{
+	for (auto &sample : samples)
+		if (strcmp(sample.name, name) == 0)
+			return &sample;
+	return nullptr;
+}
+
+static const char *metric_type_name(MetricType type)
+{
+	switch (type)
+	{
+	case MetricType::Counter:
+		return "counter";
+	case MetricType::Gauge:
+		return "gauge";
+	default:
+		return "histogram";
+	}
+}
+
+MetricsDumpFile::MetricsDumpFile(const std::string &path, unsigned interval_ms)
+{
+	thr = std::thread(&MetricsDumpFile::looper, this, path, interval_ms);
+}
+
+MetricsDumpFile::~MetricsDumpFile()
+{
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		shutdown = true;
+	}
+	cond.notify_one();
+
+	if (thr.joinable())
+		thr.join();
+}
+
+void MetricsDumpFile::looper(std::string path, unsigned interval_ms)
+{
+	set_current_thread_name("metrics-dump");
+
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file)
+	{
+		LOGE("Failed to open file: %s.\n", path.c_str());
+		return;
+	}
+
+	bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+	if (csv)
+		fputs("time_s,name,type,value,rate,count,p50,p90,p99,max\n", file);
+
+	MetricsSampler sampler;
+	std::vector<MetricSample> samples;
+	sampler.sample(samples);
+	auto base_ns = get_current_time_nsecs();
+	bool done = false;
+
+	while (!done)
+	{
+		{
+			std::unique_lock<std::mutex> holder{lock};
+			cond.wait_for(holder, std::chrono::milliseconds(interval_ms), [this]() {
+				return shutdown;
+			});
+			done = shutdown;
+		}
+
+		sampler.sample(samples);
+		double time_s = 1e-9 * double(get_current_time_nsecs() - base_ns);
+
+		if (csv)
+		{
+			for (auto &s : samples)
+			{
+				fprintf(file, "%.3f,%s,%s,%f,%f,%llu,%llu,%llu,%llu,%llu\n",
+				        time_s, s.name, metric_type_name(s.type), s.value, s.rate,
+				        static_cast<unsigned long long>(s.count),
+				        static_cast<unsigned long long>(s.p50), static_cast<unsigned long long>(s.p90),
+				        static_cast<unsigned long long>(s.p99), static_cast<unsigned long long>(s.max));
+			}
+		}
+		else
+		{
+			fprintf(file, "{ \"time_s\": %.3f, \"metrics\": {", time_s);
+			for (size_t i = 0; i < samples.size(); i++)
+			{
+				auto &s = samples[i];
+				fprintf(file, "%s \"%s\": { \"type\": \"%s\", \"value\": %f", i ? "," : "", s.name,
+				        metric_type_name(s.type), s.value);
+				if (s.type == MetricType::Counter)
+					fprintf(file, ", \"rate\": %f", s.rate);
+				else if (s.type == MetricType::Histogram)
+				{
+					fprintf(file, ", \"count\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu",
+					        static_cast<unsigned long long>(s.count),
+					        static_cast<unsigned long long>(s.p50), static_cast<unsigned long long>(s.p90),
+					        static_cast<unsigned long long>(s.p99), static_cast<unsigned long long>(s.max));
+				}
+				fputs(" }", file);
+			}
+			fputs(" } }\n", file);
+		}
+
+		fflush(file);
+	}
+
+	fclose(file);
+}
+}
@@ -0,0 +1,203 @@
+/* Copyright (c) 2017-2023 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "aligned_alloc.hpp"
+
+namespace Util
+{
+// Metrics are cheap enough to leave enabled everywhere. They are registered once by name through MetricsRegistry,
+// and the returned pointers stay valid for the lifetime of the process, so hot paths should cache them.
+// Updates only touch a per-thread shard with relaxed atomics.
+namespace Internal
+{
+unsigned get_metrics_shard();
+}
+
+class MetricCounter : public AlignedAllocation<MetricCounter>
+{
+public:
+	void add(uint64_t count = 1)
+	{
+		shards[Internal::get_metrics_shard() % NumShards].value.fetch_add(count, std::memory_order_relaxed);
+	}
+
+	uint64_t get() const;
+
+private:
+	enum { NumShards = 16 };
+	struct alignas(64) Shard
+	{
+		std::atomic<uint64_t> value{0};
+	};
+	Shard shards[NumShards];
+};
+
+// A value which can go up and down, like queue sizes or bytes in use.
+class MetricGauge
+{
+public:
+	void set(int64_t value_)
+	{
+		value.store(value_, std::memory_order_relaxed);
+	}
+
+	void add(int64_t delta)
+	{
+		value.fetch_add(delta, std::memory_order_relaxed);
+	}
+
+	int64_t get() const
+	{
+		return value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<int64_t> value{0};
+};
+
+// Log-linear buckets in the spirit of HDR histograms. Every power of two is split into 8 sub-buckets,
+// so any recorded value is reported with at most 12.5% error.
+class MetricHistogram
+{
+public:
+	enum { SubBucketBits = 3, SubBuckets = 1 << SubBucketBits, NumBuckets = (64 - SubBucketBits + 1) * SubBuckets };
+
+	void record(uint64_t value);
+
+	uint64_t get_bucket_count(unsigned bucket) const;
+	static unsigned get_bucket(uint64_t value);
+	// Largest value which lands in the bucket.
+	static uint64_t get_bucket_upper_bound(unsigned bucket);
+
+private:
+	enum { NumShards = 4 };
+	struct alignas(64) Shard : AlignedAllocation<Shard>
+	{
+		std::atomic<uint64_t> buckets[NumBuckets];
+		std::atomic<uint64_t> sum;
+	};
+	std::unique_ptr<Shard[]> shards;
+
+	friend class MetricsRegistry;
+	friend class MetricsSampler;
+	MetricHistogram();
+	uint64_t get_sum() const;
+};
+
+enum class MetricType
+{
+	Counter,
+	Gauge,
+	Histogram
+};
+
+struct MetricSample
+{
+	const char *name;
+	MetricType type;
+
+	// Counter: running total. Gauge: current value. Histogram: mean of the values recorded in the interval.
+	double value;
+	// Counter: increments per second over the interval.
+	double rate;
+
+	// Histogram only, covering the values recorded in the interval.
+	// Percentiles are the upper bound of the bucket they land in.
+	uint64_t count;
+	uint64_t p50, p90, p99, max;
+};
+
+class MetricsRegistry
+{
+public:
+	static MetricsRegistry &get();
+
+	MetricCounter *counter(const char *name);
+	MetricGauge *gauge(const char *name);
+	MetricHistogram *histogram(const char *name);
+
+private:
+	MetricsRegistry() = default;
+	friend class MetricsSampler;
+
+	struct Entry
+	{
+		std::string name;
+		MetricType type;
+		std::unique_ptr<MetricCounter> counter;
+		std::unique_ptr<MetricGauge> gauge;
+		std::unique_ptr<MetricHistogram> histogram;
+	};
+
+	std::mutex lock;
+	// Entries are only ever appended, so indices are stable.
+	std::vector<std::unique_ptr<Entry>> entries;
+	std::unordered_map<std::string, size_t> entry_indices;
+
+	Entry *find_or_create(const char *name, MetricType type);
+};
+
+// Turns the cumulative metrics into numbers for the interval since the previous call to sample().
+// Each consumer, like a dump file or an overlay, owns its own sampler.
+class MetricsSampler
+{
+public:
+	void sample(std::vector<MetricSample> &samples);
+	static const MetricSample *find(const std::vector<MetricSample> &samples, const char *name);
+
+private:
+	struct Previous
+	{
+		uint64_t value = 0;
+		uint64_t sum = 0;
+		std::vector<uint64_t> buckets;
+	};
+	std::vector<Previous> previous;
+	int64_t last_ns = 0;
+};
+
+// Periodically writes every metric to a file, as CSV if the path ends with .csv, otherwise as one JSON object per line.
+class MetricsDumpFile
+{
+public:
+	MetricsDumpFile(const std::string &path, unsigned interval_ms);
+	~MetricsDumpFile();
+
+private:
+	void looper(std::string path, unsigned interval_ms);
+	std::thread thr;
+	std::mutex lock;
+	std::condition_variable cond;
+	bool shutdown = false;
+};
+}
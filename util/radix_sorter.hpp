@@ -24,63 +24,73 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include "dynamic_array.hpp"
 #include <memory>
+#include <utility>
 
 namespace Util
 {
-template <int offset, int bits, typename ValueT, typename IndexT>
-static inline void radix_sort_pass(ValueT * __restrict outputs, const ValueT * __restrict inputs,
-                                   IndexT * __restrict output_indices,
-                                   const IndexT * __restrict input_indices,
-                                   IndexT * __restrict scratch_indices,
-                                   size_t count)
+template <int... pattern>
+constexpr uint32_t radix_total_buckets()
 {
-	constexpr int num_values = 1 << bits;
-	IndexT per_value_counts[num_values] = {};
-	for (size_t i = 0; i < count; i++)
-	{
-		ValueT c = (inputs[i] >> offset) & ((ValueT(1) << bits) - ValueT(1));
-		scratch_indices[i] = per_value_counts[c]++;
-	}
-
-	IndexT per_value_counts_prefix[num_values];
-	IndexT prefix_sum = 0;
-	for (int i = 0; i < num_values; i++)
-	{
-		per_value_counts_prefix[i] = prefix_sum;
-		prefix_sum += per_value_counts[i];
-	}
+	const int bits[] = { pattern... };
+	uint32_t total = 0;
+	for (int b : bits)
+		total += 1u << b;
+	return total;
+}
 
-	for (size_t i = 0; i < count; i++)
-	{
-		ValueT inp = inputs[i];
-		ValueT c = (inp >> offset) & ((ValueT(1) << bits) - ValueT(1));
-		IndexT effective_index = scratch_indices[i] + per_value_counts_prefix[c];
-		IndexT input_index = input_indices ? input_indices[i] : i;
+template <int... pattern>
+constexpr unsigned radix_total_bits()
+{
+	const int bits[] = { pattern... };
+	unsigned total = 0;
+	for (int b : bits)
+		total += unsigned(b);
+	return total;
+}
 
-		output_indices[effective_index] = input_index;
-		outputs[effective_index] = inp;
-	}
+template <int... pattern>
+constexpr unsigned radix_max_digit_bits()
+{
+	const int bits[] = { pattern... };
+	unsigned max_bits = 0;
+	for (int b : bits)
+		max_bits = unsigned(b) > max_bits ? unsigned(b) : max_bits;
+	return max_bits;
 }
 
+// LSD radix sort of CodeT keys which also produces the permutation, one pass per digit in pattern,
+// least significant digit first. Histograms for every digit are gathered up front in one read,
+// so passes for digits which are the same for every key are skipped.
+// A larger digit size trades bigger histograms for fewer passes, e.g. <uint64_t, 11, 11, 11, 11, 10, 10>.
 template <typename CodeT, int... pattern>
 class RadixSorter
 {
 public:
-	static_assert(sizeof...(pattern) % 2 == 0, "Need even number of radix passes.");
 	static_assert(sizeof...(pattern) > 0, "Need at least one radix pass.");
+	enum { NumDigits = sizeof...(pattern) };
 
 	void resize(size_t count)
 	{
 		codes.reserve(count * 2);
-		indices.reserve(count * 3);
+		indices.reserve(count * 2);
 		N = count;
+		sorted_codes = codes.data();
+		sorted_indices = indices.data();
 	}
 
 	void sort()
 	{
-		sort_inner_first<pattern...>();
+		histograms.reserve(TotalBuckets);
+		auto *hist = histograms.data();
+		memset(hist, 0, TotalBuckets * sizeof(uint32_t));
+		const CodeT *input = codes.data();
+		for (size_t i = 0; i < N; i++)
+			accumulate<0, 0, pattern...>(hist, input[i]);
+
+		sort_digits(hist);
 	}
 
 	size_t size() const
@@ -88,6 +98,7 @@ public:
 		return N;
 	}
 
+	// Keys are written here before sorting.
 	CodeT *code_data()
 	{
 		return codes.data();
@@ -98,52 +109,125 @@ public:
 		return codes.data();
 	}
 
+	// Sorted keys, valid after sorting.
+	const CodeT *sorted_code_data() const
+	{
+		return sorted_codes;
+	}
+
+	// Sorted position to input index, valid after sorting.
 	const uint32_t *indices_data() const
 	{
-		return indices.data();
+		return sorted_indices;
 	}
 
 private:
 	DynamicArray<CodeT> codes;
 	DynamicArray<uint32_t> indices;
+	DynamicArray<uint32_t> histograms;
+	const CodeT *sorted_codes = nullptr;
+	const uint32_t *sorted_indices = nullptr;
 	size_t N = 0;
 
-	template <int offset>
-	void sort_inner(CodeT *, CodeT *, uint32_t *, uint32_t *, uint32_t *)
+	static constexpr unsigned digit_bits(unsigned digit)
 	{
+		const int bits[] = { pattern... };
+		return unsigned(bits[digit]);
 	}
 
-	template <int offset, int count, int... counts>
-	void sort_inner(CodeT *output_values, CodeT *input_values,
-	                uint32_t *output_indices, uint32_t *input_indices,
-	                uint32_t *scratch_indices)
+	static constexpr unsigned digit_shift(unsigned digit)
 	{
-		radix_sort_pass<offset, count>(output_values, input_values,
-		                               output_indices, input_indices,
-		                               scratch_indices, N);
+		unsigned shift = 0;
+		for (unsigned i = 0; i < digit; i++)
+			shift += digit_bits(i);
+		return shift;
+	}
 
-		sort_inner<offset + count, counts...>(input_values, output_values,
-		                                      input_indices, output_indices,
-		                                      scratch_indices);
+	static constexpr uint32_t digit_bucket_base(unsigned digit)
+	{
+		uint32_t base = 0;
+		for (unsigned i = 0; i < digit; i++)
+			base += 1u << digit_bits(i);
+		return base;
 	}
 
-	template <int count, int... counts>
-	void sort_inner_first()
+	enum : uint32_t { TotalBuckets = radix_total_buckets<pattern...>(), MaxDigitBits = radix_max_digit_bits<pattern...>() };
+	static_assert(MaxDigitBits <= 16, "Radix digits must be 16 bits or less.");
+	static_assert(radix_total_bits<pattern...>() <= sizeof(CodeT) * 8, "Radix digits do not fit in CodeT.");
+
+	static uint32_t digit_value(CodeT code, unsigned digit)
 	{
-		auto *output_values = codes.data();
-		auto *input_values = codes.data() + N;
+		return uint32_t((code >> digit_shift(digit)) & ((CodeT(1) << digit_bits(digit)) - CodeT(1)));
+	}
 
-		auto *output_indices = indices.data();
-		auto *input_indices = indices.data() + 1 * N;
-		auto *scratch_indices = indices.data() + 2 * N;
+	template <unsigned shift, uint32_t bucket_base>
+	static inline void accumulate(uint32_t *, CodeT)
+	{
+	}
 
-		radix_sort_pass<0, count>(input_values, output_values,
-		                          input_indices, static_cast<const uint32_t *>(nullptr),
-		                          scratch_indices, N);
+	template <unsigned shift, uint32_t bucket_base, int bits, int... rest>
+	static inline void accumulate(uint32_t *hist, CodeT code)
+	{
+		hist[bucket_base + uint32_t((code >> shift) & ((CodeT(1) << bits) - CodeT(1)))]++;
+		accumulate<shift + bits, bucket_base + (1u << bits), rest...>(hist, code);
+	}
+
+	// Stable scatter by digit. offsets holds the first output position of every digit value,
+	// and is advanced as keys are written. Without input indices, key i has index i.
+	static void scatter(CodeT * __restrict output_codes, uint32_t * __restrict output_indices,
+	                    const CodeT * __restrict input_codes, const uint32_t * __restrict input_indices,
+	                    size_t count, unsigned digit, uint32_t * __restrict offsets)
+	{
+		unsigned shift = digit_shift(digit);
+		CodeT mask = (CodeT(1) << digit_bits(digit)) - CodeT(1);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			CodeT code = input_codes[i];
+			uint32_t dst = offsets[uint32_t((code >> shift) & mask)]++;
+			output_codes[dst] = code;
+			output_indices[dst] = input_indices ? input_indices[i] : uint32_t(i);
+		}
+	}
 
-		sort_inner<count, counts...>(output_values, input_values,
-		                             output_indices, input_indices,
-		                             scratch_indices);
+	// Sorts by every digit, ping-ponging between the two halves of the buffers.
+	// hist holds the digit counts. Keys start out in the first half and the result stays wherever the last pass put it.
+	void sort_digits(const uint32_t *hist)
+	{
+		CodeT *src_codes = codes.data();
+		CodeT *dst_codes = codes.data() + N;
+		uint32_t *src_indices = indices.data();
+		uint32_t *dst_indices = indices.data() + N;
+		bool has_indices = false;
+
+		uint32_t offsets[1u << MaxDigitBits];
+
+		for (unsigned digit = 0; digit < NumDigits; digit++)
+		{
+			const uint32_t *digit_hist = hist + digit_bucket_base(digit);
+			if (N == 0 || digit_hist[digit_value(src_codes[0], digit)] == N)
+				continue;
+
+			uint32_t offset = 0;
+			for (uint32_t i = 0, n = 1u << digit_bits(digit); i < n; i++)
+			{
+				offsets[i] = offset;
+				offset += digit_hist[i];
+			}
+
+			scatter(dst_codes, dst_indices, src_codes, has_indices ? src_indices : nullptr, N, digit, offsets);
+
+			std::swap(src_codes, dst_codes);
+			std::swap(src_indices, dst_indices);
+			has_indices = true;
+		}
+
+		if (!has_indices)
+			for (size_t i = 0; i < N; i++)
+				src_indices[i] = uint32_t(i);
+
+		sorted_codes = src_codes;
+		sorted_indices = src_indices;
 	}
 };
-}
\ No newline at end of file
+}
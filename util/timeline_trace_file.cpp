@@ -26,6 +26,8 @@
 #include "timer.hpp"
 #include <string.h>
 #include <stdio.h>
+#include <algorithm>
+#include <chrono>
 
 namespace Util
 {
@@ -57,32 +59,173 @@ void TimelineTraceFile::Event::set_tid(const char *tid_)
 	snprintf(tid, sizeof(tid), "%s", tid_);
 }
 
-TimelineTraceFile::Event *TimelineTraceFile::begin_event(const char *desc, uint32_t pid)
+static std::atomic<uint64_t> next_file_id{1};
+
+// Header is magic, version, reserved, base timestamp in ns. Followed by records starting with a RecordType byte.
+// All values are in native byte order, timestamps are in ns relative to the base timestamp.
+static const char BinaryMagic[8] = { 'G', 'R', 'N', 'T', 'R', 'A', 'C', 'E' };
+static constexpr uint32_t BinaryVersion = 1;
+
+enum class RecordType : uint8_t
 {
-	auto *e = event_pool.allocate();
-	e->pid = pid;
-	e->set_tid(trace_tid);
-	e->set_desc(desc);
-	e->start_ns = get_current_time_nsecs();
-	return e;
+	// u16 length, characters. Strings are numbered in the order they appear.
+	String = 0,
+	// u32 desc, u32 tid, u32 pid, i64 start, i64 end.
+	Span = 1,
+	// u32 desc, u32 pid, i64 timestamp, u8 count, count * (u32 name, f64 value).
+	Counters = 2
+};
+
+static void write_json_span(FILE *file, const char *desc, const char *tid, uint32_t pid, int64_t start_ns, int64_t end_ns)
+{
+	auto start_us = double(start_ns) * 1e-3;
+	auto end_us = double(end_ns) * 1e-3;
+	if (start_us > end_us)
+		return;
+
+	fprintf(file, "{ \"name\": \"%s\", \"ph\": \"B\", \"tid\": \"%s\", \"pid\": \"%u\", \"ts\": %f },\n",
+	        desc, tid, pid, start_us);
+	fprintf(file, "{ \"name\": \"%s\", \"ph\": \"E\", \"tid\": \"%s\", \"pid\": \"%u\", \"ts\": %f },\n",
+	        desc, tid, pid, end_us);
+}
+
+static void write_json_counters(FILE *file, const char *desc, uint32_t pid, int64_t ts_ns,
+                                const char * const *names, const double *values, unsigned count)
+{
+	fprintf(file, "{ \"name\": \"%s\", \"ph\": \"C\", \"pid\": \"%u\", \"ts\": %f, \"args\": {",
+	        desc, pid, double(ts_ns) * 1e-3);
+	for (unsigned i = 0; i < count; i++)
+		fprintf(file, "%s\"%s\": %f", i ? ", " : " ", names[i], values[i]);
+	fputs(" } },\n", file);
+}
+
+template <typename T>
+static void append_value(std::vector<uint8_t> &binary, const T &value)
+{
+	size_t offset = binary.size();
+	binary.resize(offset + sizeof(T));
+	memcpy(binary.data() + offset, &value, sizeof(T));
+}
+
+TimelineTraceFile::ThreadBuffer *TimelineTraceFile::get_thread_buffer()
+{
+	// File IDs are never reused, so a stale cache entry for a destroyed trace file can never match.
+	static thread_local uint64_t cached_file_id;
+	static thread_local ThreadBuffer *cached_buffer;
+	if (cached_file_id == file_id)
+		return cached_buffer;
+
+	auto id = std::this_thread::get_id();
+	std::lock_guard<std::mutex> holder{lock};
+	ThreadBuffer *buffer = nullptr;
+	for (auto &b : thread_buffers)
+	{
+		if (b->thread_id == id)
+		{
+			buffer = b.get();
+			break;
+		}
+	}
+
+	if (!buffer)
+	{
+		thread_buffers.emplace_back(new ThreadBuffer);
+		buffer = thread_buffers.back().get();
+		buffer->thread_id = id;
+		buffer->ring.reset(new Event *[RingSize]);
+	}
+
+	cached_file_id = file_id;
+	cached_buffer = buffer;
+	return buffer;
 }
 
 TimelineTraceFile::Event *TimelineTraceFile::allocate_event()
 {
-	auto *e = event_pool.allocate();
+	auto *buffer = get_thread_buffer();
+	if (!buffer->free_events)
+		buffer->free_events = buffer->returned_events.exchange(nullptr, std::memory_order_acquire);
+
+	if (!buffer->free_events)
+	{
+		auto *chunk = new Event[EventChunkSize];
+		buffer->chunks.emplace_back(chunk);
+		for (unsigned i = 0; i < EventChunkSize; i++)
+		{
+			chunk[i].owner = buffer;
+			chunk[i].next_free = i + 1 < EventChunkSize ? &chunk[i + 1] : nullptr;
+		}
+		buffer->free_events = chunk;
+	}
+
+	auto *e = buffer->free_events;
+	buffer->free_events = e->next_free;
+
 	e->desc[0] = '\0';
 	e->tid[0] = '\0';
 	e->pid = 0;
 	e->start_ns = 0;
 	e->end_ns = 0;
+	e->type = EventType::Span;
+	e->num_counters = 0;
+	return e;
+}
+
+void TimelineTraceFile::recycle_event(Event *e)
+{
+	auto &returned = e->owner->returned_events;
+	Event *head = returned.load(std::memory_order_relaxed);
+	do
+	{
+		e->next_free = head;
+	} while (!returned.compare_exchange_weak(head, e, std::memory_order_release, std::memory_order_relaxed));
+}
+
+TimelineTraceFile::Event *TimelineTraceFile::begin_event(const char *desc, uint32_t pid)
+{
+	auto *e = allocate_event();
+	e->pid = pid;
+	e->set_tid(trace_tid);
+	e->set_desc(desc);
+	e->start_ns = get_current_time_nsecs();
 	return e;
 }
 
+void TimelineTraceFile::submit_counters(const char *desc, uint64_t timestamp_ns,
+                                        const char * const *names, const double *values, unsigned count)
+{
+	auto *e = allocate_event();
+	e->set_desc(desc);
+	e->set_tid(trace_tid);
+	e->type = EventType::Counter;
+	e->start_ns = timestamp_ns;
+	e->end_ns = timestamp_ns;
+	e->num_counters = std::min<unsigned>(count, MaxCounters);
+	for (unsigned i = 0; i < e->num_counters; i++)
+	{
+		e->counter_names[i] = names[i];
+		e->counter_values[i] = values[i];
+	}
+	submit_event(e);
+}
+
 void TimelineTraceFile::submit_event(Event *e)
 {
-	std::lock_guard<std::mutex> holder{lock};
-	queued_events.push(e);
-	cond.notify_one();
+	auto *buffer = get_thread_buffer();
+	uint32_t write_index = buffer->write_index.load(std::memory_order_relaxed);
+	uint32_t read_index = buffer->read_index.load(std::memory_order_acquire);
+
+	if (write_index - read_index < RingSize)
+	{
+		buffer->ring[write_index & (RingSize - 1)] = e;
+		buffer->write_index.store(write_index + 1, std::memory_order_release);
+	}
+	else
+	{
+		// The writer thread fell behind, don't lose the event.
+		std::lock_guard<std::mutex> holder{lock};
+		overflow_events.push_back(e);
+	}
 }
 
 void TimelineTraceFile::end_event(Event *e)
@@ -92,50 +235,157 @@ void TimelineTraceFile::end_event(Event *e)
 }
 
 TimelineTraceFile::TimelineTraceFile(const std::string &path)
+	: file_id(next_file_id.fetch_add(1, std::memory_order_relaxed))
 {
 	thr = std::thread(&TimelineTraceFile::looper, this, path);
 }
 
+uint32_t TimelineTraceFile::intern_string(const char *str, std::vector<uint8_t> &binary)
+{
+	auto itr = string_ids.find(str);
+	if (itr != string_ids.end())
+		return itr->second;
+
+	auto id = uint32_t(string_ids.size());
+	string_ids.insert({ str, id });
+
+	auto len = uint16_t(std::min<size_t>(strlen(str), UINT16_MAX));
+	append_value(binary, RecordType::String);
+	append_value(binary, len);
+	binary.insert(binary.end(), str, str + len);
+	return id;
+}
+
+void TimelineTraceFile::write_event(const Event &e, FILE *file, std::vector<uint8_t> &binary)
+{
+	if (!file)
+		return;
+
+	auto start_ns = int64_t(e.start_ns - base_ts);
+	auto end_ns = int64_t(e.end_ns - base_ts);
+
+	if (!binary_output)
+	{
+		if (e.type == EventType::Counter)
+			write_json_counters(file, e.desc, e.pid, start_ns, e.counter_names, e.counter_values, e.num_counters);
+		else
+			write_json_span(file, e.desc, e.tid, e.pid, start_ns, end_ns);
+		return;
+	}
+
+	// Strings must be defined before the record which refers to them.
+	uint32_t desc = intern_string(e.desc, binary);
+	if (e.type == EventType::Counter)
+	{
+		uint32_t names[MaxCounters];
+		for (unsigned i = 0; i < e.num_counters; i++)
+			names[i] = intern_string(e.counter_names[i], binary);
+
+		append_value(binary, RecordType::Counters);
+		append_value(binary, desc);
+		append_value(binary, e.pid);
+		append_value(binary, start_ns);
+		append_value(binary, uint8_t(e.num_counters));
+		for (unsigned i = 0; i < e.num_counters; i++)
+		{
+			append_value(binary, names[i]);
+			append_value(binary, e.counter_values[i]);
+		}
+	}
+	else
+	{
+		uint32_t tid = intern_string(e.tid, binary);
+		append_value(binary, RecordType::Span);
+		append_value(binary, desc);
+		append_value(binary, tid);
+		append_value(binary, e.pid);
+		append_value(binary, start_ns);
+		append_value(binary, end_ns);
+	}
+
+	if (binary.size() >= 64 * 1024)
+	{
+		fwrite(binary.data(), 1, binary.size(), file);
+		binary.clear();
+	}
+}
+
+void TimelineTraceFile::drain(ThreadBuffer &buffer, FILE *file, std::vector<uint8_t> &binary)
+{
+	uint32_t read_index = buffer.read_index.load(std::memory_order_relaxed);
+	uint32_t write_index = buffer.write_index.load(std::memory_order_acquire);
+
+	for (; read_index != write_index; read_index++)
+	{
+		auto *e = buffer.ring[read_index & (RingSize - 1)];
+		write_event(*e, file, binary);
+		recycle_event(e);
+	}
+
+	buffer.read_index.store(read_index, std::memory_order_release);
+}
+
 void TimelineTraceFile::looper(std::string path)
 {
-	set_current_thread_name("json-trace-io");
+	set_current_thread_name("timeline-trace-io");
 
-	FILE *file = fopen(path.c_str(), "w");
+	binary_output = path.size() < 5 || path.compare(path.size() - 5, 5, ".json") != 0;
+	FILE *file = fopen(path.c_str(), binary_output ? "wb" : "w");
 	if (!file)
 		LOGE("Failed to open file: %s.\n", path.c_str());
 
+	base_ts = get_current_time_nsecs();
+
 	if (file)
-		fputs("[\n", file);
+	{
+		if (binary_output)
+		{
+			fwrite(BinaryMagic, 1, sizeof(BinaryMagic), file);
+			uint32_t header[2] = { BinaryVersion, 0 };
+			fwrite(header, sizeof(uint32_t), 2, file);
+			fwrite(&base_ts, sizeof(base_ts), 1, file);
+		}
+		else
+			fputs("[\n", file);
+	}
 
-	uint64_t base_ts = get_current_time_nsecs();
+	// Producers never wake us up, events are picked up in batches.
+	constexpr auto DrainInterval = std::chrono::milliseconds(10);
+	std::vector<ThreadBuffer *> buffers;
+	std::vector<Event *> overflow;
+	std::vector<uint8_t> binary;
+	bool done = false;
 
-	for (;;)
+	while (!done)
 	{
-		Event *e;
 		{
 			std::unique_lock<std::mutex> holder{lock};
-			cond.wait(holder, [this]() {
-				return !queued_events.empty();
+			cond.wait_for(holder, DrainInterval, [this]() {
+				return shutdown;
 			});
-			e = queued_events.front();
-			queued_events.pop();
-		}
 
-		if (!e)
-			break;
+			done = shutdown;
+			buffers.clear();
+			for (auto &buffer : thread_buffers)
+				buffers.push_back(buffer.get());
+			std::swap(overflow, overflow_events);
+		}
 
-		auto start_us = int64_t(e->start_ns - base_ts) * 1e-3;
-		auto end_us = int64_t(e->end_ns - base_ts) * 1e-3;
+		for (auto *buffer : buffers)
+			drain(*buffer, file, binary);
 
-		if (file && start_us <= end_us)
+		for (auto *e : overflow)
 		{
-			fprintf(file, "{ \"name\": \"%s\", \"ph\": \"B\", \"tid\": \"%s\", \"pid\": \"%u\", \"ts\": %f },\n",
-			        e->desc, e->tid, e->pid, start_us);
-			fprintf(file, "{ \"name\": \"%s\", \"ph\": \"E\", \"tid\": \"%s\", \"pid\": \"%u\", \"ts\": %f },\n",
-			        e->desc, e->tid, e->pid, end_us);
+			write_event(*e, file, binary);
+			recycle_event(e);
 		}
+		overflow.clear();
 
-		event_pool.free(e);
+		if (file && !binary.empty())
+		{
+			fwrite(binary.data(), 1, binary.size(), file);
+			binary.clear();
+		}
 	}
 
 	// Intentionally truncate the JSON so that we can emit "," after the last element.
@@ -145,11 +395,122 @@ void TimelineTraceFile::looper(std::string path)
 
 TimelineTraceFile::~TimelineTraceFile()
 {
-	submit_event(nullptr);
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		shutdown = true;
+	}
+	cond.notify_one();
+
 	if (thr.joinable())
 		thr.join();
 }
 
+bool TimelineTraceFile::convert_to_json(const std::string &binary_path, const std::string &json_path)
+{
+	FILE *in = fopen(binary_path.c_str(), "rb");
+	if (!in)
+	{
+		LOGE("Failed to open file: %s.\n", binary_path.c_str());
+		return false;
+	}
+
+	char magic[sizeof(BinaryMagic)];
+	uint32_t header[2];
+	uint64_t base;
+	if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, BinaryMagic, sizeof(magic)) != 0 ||
+	    fread(header, sizeof(uint32_t), 2, in) != 2 || header[0] != BinaryVersion ||
+	    fread(&base, sizeof(base), 1, in) != 1)
+	{
+		LOGE("%s is not a binary timeline trace.\n", binary_path.c_str());
+		fclose(in);
+		return false;
+	}
+
+	FILE *out = fopen(json_path.c_str(), "w");
+	if (!out)
+	{
+		LOGE("Failed to open file: %s.\n", json_path.c_str());
+		fclose(in);
+		return false;
+	}
+
+	fputs("[\n", out);
+
+	std::vector<std::string> strings;
+	const auto read = [in](void *data, size_t size) {
+		return fread(data, 1, size, in) == size;
+	};
+	const auto read_string = [&](const char *&str) {
+		uint32_t id;
+		if (!read(&id, sizeof(id)) || id >= strings.size())
+			return false;
+		str = strings[id].c_str();
+		return true;
+	};
+
+	bool ok = true;
+	RecordType type;
+	while (ok && read(&type, sizeof(type)))
+	{
+		switch (type)
+		{
+		case RecordType::String:
+		{
+			uint16_t len;
+			std::string str;
+			ok = read(&len, sizeof(len));
+			if (ok)
+			{
+				str.resize(len);
+				ok = read(&str[0], len);
+			}
+			strings.push_back(std::move(str));
+			break;
+		}
+
+		case RecordType::Span:
+		{
+			const char *desc, *tid;
+			uint32_t pid;
+			int64_t start_ns, end_ns;
+			ok = read_string(desc) && read_string(tid) && read(&pid, sizeof(pid)) &&
+			     read(&start_ns, sizeof(start_ns)) && read(&end_ns, sizeof(end_ns));
+			if (ok)
+				write_json_span(out, desc, tid, pid, start_ns, end_ns);
+			break;
+		}
+
+		case RecordType::Counters:
+		{
+			const char *desc;
+			uint32_t pid;
+			int64_t ts_ns;
+			uint8_t count;
+			const char *names[MaxCounters];
+			double values[MaxCounters];
+			ok = read_string(desc) && read(&pid, sizeof(pid)) && read(&ts_ns, sizeof(ts_ns)) &&
+			     read(&count, sizeof(count)) && count <= MaxCounters;
+			for (unsigned i = 0; ok && i < count; i++)
+				ok = read_string(names[i]) && read(&values[i], sizeof(values[i]));
+			if (ok)
+				write_json_counters(out, desc, pid, ts_ns, names, values, count);
+			break;
+		}
+
+		default:
+			ok = false;
+			break;
+		}
+	}
+
+	if (!ok)
+		LOGE("%s is truncated or corrupt, converted what could be read.\n", binary_path.c_str());
+
+	fclose(in);
+	fclose(out);
+	return ok;
+}
+
 TimelineTraceFile::ScopedEvent::ScopedEvent(TimelineTraceFile *file_, const char *tag, uint32_t pid)
 	: file(file_)
 {
@@ -27,21 +27,39 @@
 #include <condition_variable>
 #include <mutex>
 #include <memory>
-#include <queue>
-#include "object_pool.hpp"
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <stdio.h>
 
 namespace Util
 {
+// Events are handed to a writer thread through per-thread ring buffers, so submitting never takes a lock
+// unless a ring is full. Paths ending in .json are written as Chrome JSON, anything else in a compact
+// binary format with interned strings, which convert_to_json() turns into the same JSON.
 class TimelineTraceFile
 {
+	struct ThreadBuffer;
+
 public:
 	explicit TimelineTraceFile(const std::string &path);
 	~TimelineTraceFile();
 
+	static bool convert_to_json(const std::string &binary_path, const std::string &json_path);
+
 	static void set_tid(const char *tid);
 	static TimelineTraceFile *get_per_thread();
 	static void set_per_thread(TimelineTraceFile *file);
 
+	enum class EventType : uint8_t
+	{
+		Span,
+		Counter
+	};
+
+	enum { MaxCounters = 4 };
+
 	struct Event
 	{
 		char desc[256];
@@ -49,6 +67,16 @@ public:
 		uint32_t pid;
 		uint64_t start_ns, end_ns;
 
+		EventType type;
+		// Only used for counter events. Names must be string literals or otherwise outlive the trace file.
+		unsigned num_counters;
+		const char *counter_names[MaxCounters];
+		double counter_values[MaxCounters];
+
+		// The thread buffer the event is recycled to.
+		ThreadBuffer *owner;
+		Event *next_free;
+
 		void set_desc(const char *desc);
 		void set_tid(const char *tid);
 	};
@@ -58,6 +86,10 @@ public:
 	Event *allocate_event();
 	void submit_event(Event *e);
 
+	// Emits a counter track sample, e.g. for latency percentiles.
+	void submit_counters(const char *desc, uint64_t timestamp_ns,
+	                     const char * const *names, const double *values, unsigned count);
+
 	struct ScopedEvent
 	{
 		ScopedEvent(TimelineTraceFile *file, const char *tag, uint32_t pid = 0);
@@ -72,13 +104,45 @@ public:
 	};
 
 private:
+	enum { RingSize = 8 * 1024, EventChunkSize = 256 };
+
+	// Single producer (the owning thread), single consumer (the writer thread).
+	struct ThreadBuffer
+	{
+		std::thread::id thread_id;
+		std::unique_ptr<Event *[]> ring;
+		std::atomic<uint32_t> write_index{0};
+		std::atomic<uint32_t> read_index{0};
+
+		// Only touched by the owning thread.
+		Event *free_events = nullptr;
+		std::vector<std::unique_ptr<Event[]>> chunks;
+
+		// Events recycled by the writer thread, taken back in one go by the owning thread.
+		std::atomic<Event *> returned_events{nullptr};
+	};
+
 	void looper(std::string path);
+	ThreadBuffer *get_thread_buffer();
+	void drain(ThreadBuffer &buffer, FILE *file, std::vector<uint8_t> &binary);
+	void write_event(const Event &e, FILE *file, std::vector<uint8_t> &binary);
+	static void recycle_event(Event *e);
+
 	std::thread thr;
 	std::mutex lock;
 	std::condition_variable cond;
+	bool shutdown = false;
+	uint64_t file_id;
+
+	// Guarded by lock.
+	std::vector<std::unique_ptr<ThreadBuffer>> thread_buffers;
+	std::vector<Event *> overflow_events;
 
-	ThreadSafeObjectPool<Event> event_pool;
-	std::queue<Event *> queued_events;
+	// Only touched by the writer thread.
+	bool binary_output = false;
+	uint64_t base_ts = 0;
+	std::unordered_map<std::string, uint32_t> string_ids;
+	uint32_t intern_string(const char *str, std::vector<uint8_t> &binary);
 };
 
 #ifndef GRANITE_SHIPPING
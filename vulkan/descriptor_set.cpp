@@ -38,6 +38,11 @@ DescriptorSetAllocator::DescriptorSetAllocator(Hash hash, Device *device_, const
 {
 	bindless = layout.array_size[0] == DescriptorSetLayout::UNSIZED_ARRAY;
 
+	auto &metrics = MetricsRegistry::get();
+	set_hit_metric = metrics.counter("vulkan.descriptor-set.hit");
+	set_miss_metric = metrics.counter("vulkan.descriptor-set.miss");
+	pool_create_metric = metrics.counter("vulkan.descriptor-pool.create");
+
 	if (!bindless)
 	{
 		unsigned count = device_->num_thread_indices;
@@ -265,8 +270,12 @@ std::pair<VkDescriptorSet, bool> DescriptorSetAllocator::find(unsigned thread_in
 
 	auto *node = state.set_nodes.request(hash);
 	if (node)
+	{
+		set_hit_metric->add();
 		return { node->set, true };
+	}
 
+	set_miss_metric->add();
 	node = state.set_nodes.request_vacant(hash);
 	if (node)
 		return { node->set, false };
@@ -298,6 +307,7 @@ std::pair<VkDescriptorSet, bool> DescriptorSetAllocator::find(unsigned thread_in
 	if (table.vkAllocateDescriptorSets(device->get_device(), &alloc, sets) != VK_SUCCESS)
 		LOGE("Failed to allocate descriptor sets.\n");
 	state.pools.push_back(pool);
+	pool_create_metric->add();
 
 	for (auto set : sets)
 		state.set_nodes.make_vacant(set);
@@ -29,6 +29,7 @@
 #include "sampler.hpp"
 #include "limits.hpp"
 #include "dynamic_array.hpp"
+#include "metrics.hpp"
 #include <utility>
 #include <vector>
 #include "cookie.hpp"
@@ -163,6 +164,10 @@ private:
 	std::vector<std::unique_ptr<PerThread>> per_thread;
 	std::vector<VkDescriptorPoolSize> pool_size;
 	bool bindless = false;
+
+	Util::MetricCounter *set_hit_metric;
+	Util::MetricCounter *set_miss_metric;
+	Util::MetricCounter *pool_create_metric;
 };
 
 class BindlessAllocator
@@ -657,6 +657,9 @@ void ResourceManager::latch_handles()
 	views.resize(assets.size());
 	draws.resize(assets.size());
 
+	if (!updates.empty())
+		latch_version++;
+
 	for (auto &update : updates)
 	{
 		if (update.id >= views.size())
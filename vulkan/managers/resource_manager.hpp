@@ -126,6 +126,13 @@ public:
 		return mesh_encoding;
 	}
 
+	// Changes whenever latching replaces views or draws,
+	// so anything holding on to resolved handles across frames can tell they went stale.
+	inline uint64_t get_latch_version() const
+	{
+		return latch_version;
+	}
+
 	const Buffer *get_index_buffer() const;
 	const Buffer *get_position_buffer() const;
 	const Buffer *get_attribute_buffer() const;
@@ -169,6 +176,7 @@ private:
 	std::vector<const ImageView *> views;
 	std::vector<DrawCall> draws;
 	std::vector<Granite::AssetID> updates;
+	uint64_t latch_version = 0;
 
 	ImageHandle fallback_color;
 	ImageHandle fallback_normal;
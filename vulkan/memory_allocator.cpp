@@ -320,6 +320,12 @@ void DeviceAllocator::init(Device *device_)
 	const auto &props = device->get_gpu_properties();
 	atom_alignment = props.limits.nonCoherentAtomSize;
 
+	auto &metrics = Util::MetricsRegistry::get();
+	allocate_memory_metric = metrics.counter("vulkan.memory.allocate-calls");
+	recycled_block_metric = metrics.counter("vulkan.memory.recycled-blocks");
+	allocated_bytes_metric = metrics.gauge("vulkan.memory.allocated-bytes");
+	recycled_bytes_metric = metrics.gauge("vulkan.memory.recycled-bytes");
+
 	heaps.clear();
 	allocators.clear();
 
@@ -448,6 +454,26 @@ DeviceAllocator::~DeviceAllocator()
 {
 	for (auto &heap : heaps)
 		heap.garbage_collect(device);
+	if (allocated_bytes_metric)
+		update_memory_metrics();
+}
+
+void DeviceAllocator::update_memory_metrics()
+{
+	// Recycled blocks are allocated, but unused. This is the closest thing we have to fragmentation at this level.
+	int64_t allocated_bytes = 0;
+	int64_t recycled_bytes = 0;
+	for (auto &heap : heaps)
+	{
+		allocated_bytes += int64_t(heap.size);
+		for (auto &block : heap.blocks)
+			recycled_bytes += block.size;
+	}
+
+	allocated_bytes_metric->add(allocated_bytes - reported_allocated_bytes);
+	recycled_bytes_metric->add(recycled_bytes - reported_recycled_bytes);
+	reported_allocated_bytes = allocated_bytes;
+	reported_recycled_bytes = recycled_bytes;
 }
 
 void DeviceAllocator::internal_free(uint32_t size, uint32_t memory_type, AllocationMode mode, VkDeviceMemory memory, bool is_mapped)
@@ -462,6 +488,7 @@ void DeviceAllocator::internal_free(uint32_t size, uint32_t memory_type, Allocat
 	heap.blocks.push_back({ memory, size, memory_type, mode });
 	if (memory_heap_is_budget_critical[mem_props.memoryTypes[memory_type].heapIndex])
 		heap.garbage_collect(device);
+	update_memory_metrics();
 }
 
 void DeviceAllocator::internal_free_no_recycle(uint32_t size, uint32_t memory_type, VkDeviceMemory memory)
@@ -469,12 +496,14 @@ void DeviceAllocator::internal_free_no_recycle(uint32_t size, uint32_t memory_ty
 	auto &heap = heaps[mem_props.memoryTypes[memory_type].heapIndex];
 	table->vkFreeMemory(device->get_device(), memory, nullptr);
 	heap.size -= size;
+	update_memory_metrics();
 }
 
 void DeviceAllocator::garbage_collect()
 {
 	for (auto &heap : heaps)
 		heap.garbage_collect(device);
+	update_memory_metrics();
 }
 
 void *DeviceAllocator::map_memory(const DeviceAllocation &alloc, MemoryAccessFlags flags,
@@ -577,6 +606,17 @@ bool DeviceAllocator::internal_allocate(
 	uint32_t size, uint32_t memory_type, AllocationMode mode,
 	VkDeviceMemory *memory, uint8_t **host_memory,
 	VkObjectType object_type, uint64_t dedicated_object, ExternalHandle *external)
+{
+	bool ret = allocate_device_memory(size, memory_type, mode, memory, host_memory,
+	                                  object_type, dedicated_object, external);
+	update_memory_metrics();
+	return ret;
+}
+
+bool DeviceAllocator::allocate_device_memory(
+	uint32_t size, uint32_t memory_type, AllocationMode mode,
+	VkDeviceMemory *memory, uint8_t **host_memory,
+	VkObjectType object_type, uint64_t dedicated_object, ExternalHandle *external)
 {
 	uint32_t heap_index = mem_props.memoryTypes[memory_type].heapIndex;
 	auto &heap = heaps[heap_index];
@@ -603,6 +643,7 @@ bool DeviceAllocator::internal_allocate(
 				return false;
 		}
 		heap.blocks.erase(itr);
+		recycled_block_metric->add();
 		return true;
 	}
 
@@ -731,6 +772,7 @@ bool DeviceAllocator::internal_allocate(
 		GRANITE_SCOPED_TIMELINE_EVENT_FILE(device->get_system_handles().timeline_trace_file, "vkAllocateMemory");
 		res = table->vkAllocateMemory(device->get_device(), &info, nullptr, &device_memory);
 	}
+	allocate_memory_metric->add();
 
 	// If we're importing, make sure we consume the native handle.
 	if (external && bool(*external) &&
@@ -774,6 +816,7 @@ bool DeviceAllocator::internal_allocate(
 				                                   "vkAllocateMemory");
 				res = table->vkAllocateMemory(device->get_device(), &info, nullptr, &device_memory);
 			}
+			allocate_memory_metric->add();
 			++block_itr;
 		}
 
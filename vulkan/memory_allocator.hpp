@@ -31,6 +31,7 @@
 #include "enum_cast.hpp"
 #include "vulkan_common.hpp"
 #include "arena_allocator.hpp"
+#include "metrics.hpp"
 #include <assert.h>
 #include <memory>
 #include <stddef.h>
@@ -296,5 +297,18 @@ private:
 	std::vector<Heap> heaps;
 	bool memory_heap_is_budget_critical[VK_MAX_MEMORY_HEAPS] = {};
 	void get_memory_budget_nolock(HeapBudget *heaps);
+
+	bool allocate_device_memory(uint32_t size, uint32_t memory_type, AllocationMode mode,
+	                            VkDeviceMemory *memory, uint8_t **host_memory,
+	                            VkObjectType object_type, uint64_t dedicated_object, ExternalHandle *external);
+
+	// Gauges are shared between devices, so only deltas against what this allocator reported last are applied.
+	Util::MetricCounter *allocate_memory_metric = nullptr;
+	Util::MetricCounter *recycled_block_metric = nullptr;
+	Util::MetricGauge *allocated_bytes_metric = nullptr;
+	Util::MetricGauge *recycled_bytes_metric = nullptr;
+	int64_t reported_allocated_bytes = 0;
+	int64_t reported_recycled_bytes = 0;
+	void update_memory_metrics();
 };
 }